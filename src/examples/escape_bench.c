@@ -0,0 +1,120 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "zb_escape.h"
+
+/*
+ * escape_bench.c
+ *
+ * Measures zb_escape and zb_unescape with every implementation this CPU supports,
+ * on payloads that need no escaping, random payloads (1 in 64 bytes escaped), and
+ * the worst case where every byte needs escaping. Each result is checked against
+ * the scalar implementation, and unescaping must give back the original payload.
+ *
+ * Usage: escape_bench [size [megabytes]]
+ *
+ * size is the payload size in bytes (default 72, MAX_PACKET_SIZE). megabytes is
+ * how much payload to process per measurement (default 256).
+ */
+
+static const int impls[] = {ZB_ESCAPE_SCALAR, ZB_ESCAPE_SSE2, ZB_ESCAPE_AVX2, ZB_ESCAPE_NEON};
+static const char *kinds[] = {"none", "random", "all"};
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *buf, int size, int kind) {
+	static const unsigned char special[] = {0x7E, 0x7D, 0x11, 0x13};
+	int i;
+
+	for (i = 0; i < size; i++) {
+		switch (kind) {
+			case 0:
+				buf[i] = 0x20 + rand() % 0x5d;
+				break;
+			case 1:
+				buf[i] = rand() % 64 == 0 ? special[rand() % 4] : 0x20 + rand() % 0x5d;
+				break;
+			default:
+				buf[i] = special[rand() % 4];
+				break;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned char *in, *escaped, *reference, *out;
+	int size = 72, megabytes = 256, rounds, kind, i, j, n, ref_n, used;
+	double t_escape, t_unescape;
+	int failed = 0;
+
+	if (argc > 1) {
+		size = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		megabytes = atoi(argv[2]);
+	}
+	if (size < 1) {
+		printf("Usage: %s [size [megabytes]]\n", argv[0]);
+		return 1;
+	}
+	rounds = (long long) megabytes * 1000000 / size;
+
+	in = malloc(size);
+	escaped = malloc(2 * size);
+	reference = malloc(2 * size);
+	out = malloc(size + ZB_UNESCAPE_SLACK);
+
+	printf("%d byte payloads, %d MB each\n", size, megabytes);
+	printf("%-8s %-8s %12s %12s %10s\n", "impl", "payload", "escape MB/s", "unescape MB/s", "expansion");
+
+	for (kind = 0; kind < 3; kind++) {
+		fill(in, size, kind);
+		zb_escape_select(ZB_ESCAPE_SCALAR);
+		ref_n = zb_escape(reference, in, size);
+
+		for (i = 0; i < (int) (sizeof(impls) / sizeof(impls[0])); i++) {
+			if (zb_escape_select(impls[i]) < 0) {
+				continue;
+			}
+
+			n = zb_escape(escaped, in, size);
+			if (n != ref_n || memcmp(escaped, reference, n) != 0) {
+				printf("%s: escaped %s payload differs from scalar\n", zb_escape_name(), kinds[kind]);
+				failed = 1;
+			}
+			if (zb_unescape(out, size, escaped, n, &used) != size || used != n || memcmp(out, in, size) != 0) {
+				printf("%s: unescaped %s payload differs from the original\n", zb_escape_name(), kinds[kind]);
+				failed = 1;
+			}
+
+			t_escape = now();
+			for (j = 0; j < rounds; j++) {
+				n = zb_escape(escaped, in, size);
+			}
+			t_escape = now() - t_escape;
+			n = zb_escape(escaped, in, size);
+
+			t_unescape = now();
+			for (j = 0; j < rounds; j++) {
+				zb_unescape(out, size, escaped, n, &used);
+			}
+			t_unescape = now() - t_unescape;
+
+			printf("%-8s %-8s %12.0f %12.0f %10.2f\n", zb_escape_name(), kinds[kind],
+					(double) rounds * size / t_escape / 1e6, (double) rounds * size / t_unescape / 1e6,
+					(double) n / size);
+		}
+	}
+
+	free(in);
+	free(escaped);
+	free(reference);
+	free(out);
+	return failed;
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "zb_transport.h"
+#include "zb_packets.h"
+#include "zb_loopback.h"
+#include "zb_fragment.h"
+#include "zb_samples.h"
+
+/*
+ * frag_bench.c
+ *
+ * Measures the throughput of fragmented messages (zb_fragment.h) between a sensor and the
+ * master, connected through a simulated XBee network (zb_loopback.h). The sensor sends
+ * measurement histories as the example sensor does, each filled with batches of readings
+ * up to a random length; the master checks every message byte by byte, and decodes it.
+ *
+ * To see the cost of resending, both ends may drop a share of the packets they receive,
+ * fragments as well as acknowledgements.
+ *
+ * Usage: frag_bench [baud [loss % [messages]]]
+ *
+ * baud 0 moves data as fast as the kernel allows; the default is 9600, the XBee's.
+ */
+
+#define SENSOR_ID 2
+
+/* one end: its transport, parser and endpoint */
+struct node {
+	zb_transport_t *t;
+	zb_addr_cache_t cache;
+	zb_parser_t parser;
+	zb_frag_t frag;
+	char id;
+};
+
+static struct node master, sensor;
+static int loss;
+static volatile int running = 1;
+
+/* the packet layer's device id is global, so the two ends take turns */
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char message[ZB_FRAG_MESSAGE_MAX];
+static int message_len;
+static volatile int received, failed, malformed;
+static volatile int sent_status = 1;	/* 1 while the sender has not heard */
+static long readings;
+
+/* fills message with batches of a random walk, up to about len bytes. */
+static void make_history(int len) {
+	struct zb_sample_writer batch;
+	uint16_t value = rand() % 4096;
+	int n;
+
+	message_len = 0;
+	while (1) {
+		zb_samples_begin(&batch, rand(), 50);
+		while (zb_samples_add(&batch, value) == 0) {
+			value = (value + rand() % 65 - 32) & 0xfff;
+		}
+		n = zb_samples_history_add(message, message_len, len, &batch);
+		if (n < 0) {
+			break;
+		}
+		message_len = n;
+	}
+}
+
+static void on_message(void *arg, char from, const unsigned char *data, int len) {
+	uint16_t values[ZB_SAMPLES_MAX];
+	const unsigned char *batch;
+	uint16_t interval;
+	uint32_t time;
+	int pos = 0, size, n;
+
+	(void) arg;
+	if (from != SENSOR_ID || len != message_len || memcmp(data, message, len) != 0) {
+		malformed++;
+		return;
+	}
+	while ((size = zb_samples_history_next(data, len, &pos, &batch)) > 0) {
+		n = zb_samples_decode(batch, size, &time, &interval, values, ZB_SAMPLES_MAX);
+		if (n < 0) {
+			break;
+		}
+		readings += n;
+	}
+	if (size != 0) {
+		malformed++;
+	}
+	received++;
+}
+
+static void on_sent(void *arg, int status) {
+	(void) arg;
+	if (status != 0) {
+		failed++;
+	}
+	sent_status = status;
+}
+
+static void on_packet(void *arg, const struct zb_packet *packet) {
+	struct node *n = arg;
+
+	if (loss && rand() % 100 < loss) {
+		return;
+	}
+	zb_frag_handle(&n->frag, packet->op, packet->from, (const unsigned char *) packet->data, packet->len);
+}
+
+/* reads, resends and acknowledges for one end. */
+static void *thread_node(void *arg) {
+	struct node *n = arg;
+	unsigned char buf[256];
+	int len, due;
+
+	while (running) {
+		pthread_mutex_lock(&stack_lock);
+		zb_set_device_id(n->id);
+		due = zb_frag_poll(&n->frag, zb_transport_millis());
+		pthread_mutex_unlock(&stack_lock);
+
+		len = zb_read_timeout(n->t, buf, sizeof(buf), due < 0 || due > 20 ? 20 : due);
+
+		pthread_mutex_lock(&stack_lock);
+		zb_set_device_id(n->id);
+		zb_parse_buffer(&n->parser, buf, len, on_packet, n);
+		pthread_mutex_unlock(&stack_lock);
+	}
+	return NULL;
+}
+
+static void node_init(struct node *n, zb_loopback_t *net, const struct zb_transport_config *cfg,
+		char id, int rto_ms) {
+	n->t = zb_loopback_open(net, cfg);
+	n->id = id;
+	zb_addr_cache_init(&n->cache);
+	zb_parser_init(&n->parser);
+	zb_parser_set_address_cache(&n->parser, &n->cache);
+	zb_frag_init(&n->frag, n->t, &n->cache, id, on_message, NULL);
+	n->frag.rto_ms = rto_ms;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long baud = 9600, start, elapsed;
+	struct zb_transport_config cfg;
+	pthread_t master_thread, sensor_thread;
+	zb_loopback_t *net;
+	long bytes = 0;
+	int messages = 20, i;
+
+	if (argc > 1) {
+		baud = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		loss = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		messages = atoi(argv[3]);
+	}
+	if (loss < 0 || loss >= 100 || messages < 1) {
+		printf("Usage: %s [baud [loss %% [messages]]]\n", argv[0]);
+		return 1;
+	}
+
+	net = zb_loopback_create(ZB_LOOPBACK_SOCKETPAIR, baud);
+	if (net == NULL) {
+		return 1;
+	}
+	zb_transport_config_init(&cfg);
+	if (baud) {
+		cfg.baud = baud;
+	}
+	/* the first node opened is the coordinator. a full window of fragments takes about
+	 * 650 ms at 9600 baud, so wait longer than that before resending. */
+	node_init(&master, net, &cfg, 0, baud ? 2000 : 200);
+	node_init(&sensor, net, &cfg, SENSOR_ID, baud ? 2000 : 200);
+	if (master.t == NULL || sensor.t == NULL) {
+		return 1;
+	}
+	zb_set_broadcast_mode(0);
+
+	pthread_create(&master_thread, NULL, thread_node, &master);
+	pthread_create(&sensor_thread, NULL, thread_node, &sensor);
+
+	printf("%d messages of up to %d bytes at ", messages, ZB_FRAG_MESSAGE_MAX);
+	if (baud) {
+		printf("%lu baud", baud);
+	} else {
+		printf("full speed");
+	}
+	printf(", %d%% of packets lost\n", loss);
+
+	start = zb_transport_millis();
+	for (i = 0; i < messages; i++) {
+		/* the first message is as long as they get */
+		make_history(i == 0 ? ZB_FRAG_MESSAGE_MAX : rand() % ZB_FRAG_MESSAGE_MAX + 1);
+
+		pthread_mutex_lock(&stack_lock);
+		zb_set_device_id(SENSOR_ID);
+		sent_status = 1;
+		zb_frag_send(&sensor.frag, 0, message, message_len, on_sent, NULL);
+		pthread_mutex_unlock(&stack_lock);
+
+		/* the sender hears of the last acknowledgement after the master has the message */
+		while (sent_status == 1) {
+			usleep(1000);
+		}
+		if (sent_status != 0) {
+			printf("message %d failed\n", i);
+			break;
+		}
+		bytes += message_len;
+	}
+	elapsed = zb_transport_millis() - start;
+
+	running = 0;
+	pthread_join(master_thread, NULL);
+	pthread_join(sensor_thread, NULL);
+
+	printf("%d of %d messages, %ld bytes and %ld readings in %.2f s: %.0f B/s\n", received, messages,
+			bytes, readings, elapsed / 1e3, bytes / (elapsed / 1e3));
+	printf("fragments sent %lu, resent %lu, dropped for want of a slot %lu\n",
+			sensor.frag.fragments_sent, sensor.frag.fragments_resent, master.frag.fragments_dropped);
+
+	zb_transport_close(master.t);
+	zb_transport_close(sensor.t);
+	zb_loopback_destroy(net);
+	return received == messages && failed == 0 && malformed == 0 ? 0 : 1;
+}
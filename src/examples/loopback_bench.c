@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "zb_transport.h"
+#include "zb_packets.h"
+#include "zb_loopback.h"
+
+/*
+ * loopback_bench.c
+ *
+ * Measures throughput and latency of the stack without radios. A master and a number
+ * of sensors are connected through a simulated XBee network (zb_loopback.h) in one
+ * process. Every sensor sends measurement responses to the coordinator as fast as its
+ * transport accepts them, each carrying the time it was sent; the master parses them
+ * and reports the frame rate and the send-to-parse latency.
+ *
+ * Usage: loopback_bench [sensors [frames [baud [pty|socket [capture]]]]]
+ *
+ * baud 0 (the default) moves data as fast as the kernel allows.
+ * With a capture file, the master's traffic is recorded, e.g. for replay_bench.
+ */
+
+static zb_transport_t *radio;
+static int frames_per_sensor = 1000;
+
+/* sensors flush after this many frames, so that zb_send never finds the queue full */
+#define TX_QUEUE_SIZE 256
+#define TX_BATCH (TX_QUEUE_SIZE / 2)
+
+static volatile int received;
+static unsigned long long latency_sum, latency_max, last_received_ns;
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* time a measurement response from the moment it was sent. */
+static void on_packet(void *arg, const struct zb_packet *packet) {
+	char text[MAX_PACKET_SIZE + 1];
+	unsigned long long sent, latency;
+
+	(void) arg;
+	if (packet->op != OP_MEASURE_RESPONSE) {
+		return;
+	}
+	memcpy(text, packet->data, packet->len);
+	text[packet->len] = '\0';
+	sent = strtoull(text, NULL, 10);
+
+	latency = now_ns() - sent;
+	latency_sum += latency;
+	if (latency > latency_max) {
+		latency_max = latency;
+	}
+	last_received_ns = now_ns();
+	received++;
+}
+
+/* parse everything arriving at the coordinator. */
+static void *thread_master(void *arg) {
+	unsigned char buf[256];
+	zb_parser_t parser;
+	int n;
+
+	(void) arg;
+	zb_parser_init(&parser);
+	while (1) {
+		n = zb_read(radio, buf, sizeof(buf));
+		zb_parse_buffer(&parser, buf, n, on_packet, NULL);
+	}
+
+	return NULL;
+}
+
+/* send timestamped measurement responses. the payload is text, so it never needs escaping. */
+static void *thread_sensor(void *arg) {
+	zb_transport_t *sensor = arg;
+	char data[24];
+	int i, len;
+
+	for (i = 0; i < frames_per_sensor; i++) {
+		len = snprintf(data, sizeof(data), "%llu", now_ns());
+		zb_send_packet(sensor, OP_MEASURE_RESPONSE, (unsigned char *) data, len);
+		if (i % TX_BATCH == TX_BATCH - 1) {
+			zb_transport_flush(sensor);
+		}
+	}
+	zb_transport_flush(sensor);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int sensors = 4, expected, last, i;
+	unsigned long baud = 0;
+	int kind = ZB_LOOPBACK_SOCKETPAIR;
+	struct zb_transport_config cfg;
+	zb_transport_t *sensor[ZB_LOOPBACK_MAX_NODES];
+	pthread_t master_thread, sensor_thread[ZB_LOOPBACK_MAX_NODES];
+	unsigned long long start, elapsed;
+	zb_loopback_t *net;
+
+	if (argc > 1) {
+		sensors = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		frames_per_sensor = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		baud = strtoul(argv[3], NULL, 10);
+	}
+	if (argc > 4 && strcmp(argv[4], "pty") == 0) {
+		kind = ZB_LOOPBACK_PTY;
+	}
+	if (sensors < 1 || sensors >= ZB_LOOPBACK_MAX_NODES) {
+		printf("between 1 and %d sensors are supported\n", ZB_LOOPBACK_MAX_NODES - 1);
+		return 1;
+	}
+
+	net = zb_loopback_create(kind, baud);
+	if (net == NULL) {
+		return 1;
+	}
+
+	zb_transport_config_init(&cfg);
+	if (baud) {
+		cfg.baud = baud;
+	}
+	cfg.tx_queue_size = TX_QUEUE_SIZE;
+
+	/* the first node opened is the coordinator */
+	if (argc > 5) {
+		cfg.capture_path = argv[5];
+	}
+	radio = zb_loopback_open(net, &cfg);
+	if (radio == NULL) {
+		return 1;
+	}
+	cfg.capture_path = NULL;
+	for (i = 0; i < sensors; i++) {
+		sensor[i] = zb_loopback_open(net, &cfg);
+		if (sensor[i] == NULL) {
+			return 1;
+		}
+	}
+
+	pthread_create(&master_thread, NULL, thread_master, NULL);
+	zb_packets_init(radio);
+	zb_set_broadcast_mode(0);
+
+	start = now_ns();
+	for (i = 0; i < sensors; i++) {
+		pthread_create(&sensor_thread[i], NULL, thread_sensor, sensor[i]);
+	}
+	for (i = 0; i < sensors; i++) {
+		pthread_join(sensor_thread[i], NULL);
+	}
+
+	/* wait for the last frames to arrive, or for the count to stop changing */
+	expected = sensors * frames_per_sensor;
+	do {
+		last = received;
+		usleep(100000);
+	} while (received < expected && received != last);
+	elapsed = received ? last_received_ns - start : now_ns() - start;
+
+	printf("%d of %d frames in %.3f s: %.0f frames/s, latency mean %.1f us, max %.1f us\n",
+			received, expected, elapsed / 1e9, received / (elapsed / 1e9),
+			received ? latency_sum / 1e3 / received : 0.0, latency_max / 1e3);
+
+	return received == expected ? 0 : 1;
+}
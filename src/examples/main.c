@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include "zb_packets.h"
 #include "zb_transport.h"
+#include "zb_samples.h"
+#include "zb_schedule.h"
+#include "zb_fragment.h"
 
 /* You can monitor the converted value by adding the variable "ADC3ConvertedValue"
  * to the debugger watch window
@@ -9,14 +12,36 @@
 #define ADC3_DR_ADDRESS     ((uint32_t)0x4001224C)
 __IO uint16_t ADCConvertedValue = 0;
 
+/* readings are taken this often, and sent in batches when measurements are requested,
+ * in the reply slot the request gives this device. batches that fill up before that are
+ * kept, and sent along as one fragmented message. */
+#define SAMPLE_INTERVAL_MS 50
+#define DEVICE_ID 2
+#define DEVICE_NI "SENSOR2"		/* the master finds us by this name in node discovery */
+
 static void ADC_Config(void);
 static void USART_Config(void);
 static void respond();
-static char hexToChar(char h);
+static void sample();
+static void reply();
+
+static zb_transport_t *radio;
+static struct zb_sample_writer batch;
+static zb_frag_t messages;
+static unsigned char history[2][ZB_FRAG_MESSAGE_MAX];	/* one filling while the other is sent */
+static int history_len;
+static int filling;
+static int history_sending;
+static unsigned long next_sample;
+static unsigned long reply_at;		/* start of our slot, if replying */
+static int replying;
 
 int main(void)
 {
-	unsigned char c;
+	int c, due;
+	long wait;
+	unsigned long now;
+	struct zb_transport_config cfg;
 	
 	/* set up ADC3 for continuous DMA mode */
 	ADC_Config();
@@ -25,16 +50,41 @@ int main(void)
 	ADC_SoftwareStartConv(ADC3);
 
 	/* Setup packet layer / transport layer UART */
-	zb_packets_init();
+	zb_transport_config_init(&cfg);
+	radio = zb_transport_open(&cfg);
+	zb_packets_init(radio);
 
 	zb_set_broadcast_mode(0);
-	zb_set_device_id(2);
+	zb_set_device_id(DEVICE_ID);
+	zb_send_command_with_argument(radio, "NI", DEVICE_NI, sizeof(DEVICE_NI) - 1);
 
-	zb_send_packet(OP_PONG, "", 0);
+	zb_send_packet(radio, OP_PONG, "", 0);
+	zb_frag_init(&messages, radio, NULL, DEVICE_ID, NULL, NULL);
+
+	next_sample = zb_transport_millis();
+	zb_samples_begin(&batch, next_sample, SAMPLE_INTERVAL_MS);
 	
 	while (1)
 	{
-		c = zb_getc();
+		/* take the readings that are due and reply if our slot has come, then wait for the
+		 * radio until the next of those */
+		now = zb_transport_millis();
+		while ((wait = (long) (next_sample - now)) <= 0) {
+			sample();
+		}
+		if (replying && (long) (reply_at - now) <= 0) {
+			reply();
+		} else if (replying && (long) (reply_at - now) < wait) {
+			wait = reply_at - now;
+		}
+		due = zb_frag_poll(&messages, now);
+		if (due >= 0 && due < wait) {
+			wait = due;
+		}
+		c = zb_getc_timeout(radio, wait);
+		if (c < 0) {
+			continue;
+		}
 		
 		switch (zb_parse(c)) {
 			case ZB_VALID_PACKET:
@@ -50,21 +100,88 @@ int main(void)
 }
 
 
+static void on_history_sent(void *arg, int status) {
+	(void) arg;
+	(void) status;
+	history_sending = 0;
+}
+
+/* starts sending the kept batches to the master, and fills the other buffer meanwhile.
+ * returns 0, or -1 if the last history is still being sent. */
+static int send_history() {
+	if (history_sending) {
+		return -1;
+	}
+	history_sending = 1;
+	if (zb_frag_send(&messages, 0, history[filling], history_len, on_history_sent, NULL) != 0) {
+		history_sending = 0;
+		return -1;
+	}
+	filling = !filling;
+	history_len = 0;
+	return 0;
+}
+
+/* keeps the current batch for the next reply, and starts a new one. when the history is
+ * full it goes out at once, or the batch does as a packet of its own if it cannot. */
+static void keep_batch() {
+	int len = zb_samples_history_add(history[filling], history_len, ZB_FRAG_MESSAGE_MAX, &batch);
+
+	if (len < 0 && send_history() == 0) {
+		len = zb_samples_history_add(history[filling], history_len, ZB_FRAG_MESSAGE_MAX, &batch);
+	}
+	if (len < 0) {
+		zb_send_packet(radio, OP_MEASURE_BATCH, batch.buf, batch.len);
+	} else {
+		history_len = len;
+	}
+	zb_samples_begin(&batch, next_sample, SAMPLE_INTERVAL_MS);
+}
+
+/* takes a reading. a full batch is kept until the next request */
+static void sample() {
+	if (zb_samples_add(&batch, ADCConvertedValue) != 0) {
+		keep_batch();
+		zb_samples_add(&batch, ADCConvertedValue);
+	}
+	next_sample += SAMPLE_INTERVAL_MS;
+}
+
+/* sends the readings taken so far, at least the current one: with the kept batches as one
+ * message, or as one packet if there are none or the last message is still going */
+static void reply() {
+	if (batch.count == 0) {
+		zb_samples_add(&batch, ADCConvertedValue);
+	}
+	if (history_len == 0 || history_sending) {
+		zb_send_packet(radio, OP_MEASURE_BATCH, batch.buf, batch.len);
+		zb_samples_begin(&batch, next_sample, SAMPLE_INTERVAL_MS);
+	} else {
+		keep_batch();
+		send_history();
+	}
+	replying = 0;
+}
+
 static void respond() {
-	unsigned char buf[4];
-	uint16_t val;
+	long delay;
+
+	/* acknowledgements of the history */
+	if (zb_frag_handle(&messages, zb_packet_op, zb_packet_from, (unsigned char *) zb_packet_data, zb_packet_len)) {
+		return;
+	}
 
 	switch (zb_packet_op) {
 		case OP_PING:
-			zb_send_packet(OP_PONG, NULL, 0);
+			zb_send_packet(radio, OP_PONG, NULL, 0);
 			break;
 		case OP_MEASURE_REQUEST:
-			val = ADCConvertedValue;
-			buf[3] = hexToChar(val & 0x0f);
-			buf[2] = hexToChar(val >> 4  & 0x0f);
-			buf[1] = hexToChar(val >> 8  & 0x0f);
-			buf[0] = hexToChar(val >> 12 & 0x0f);
-			zb_send_packet(OP_MEASURE_RESPONSE, buf, 4);
+			/* wait for our slot. a request without one is answered at once */
+			delay = zb_schedule_delay((unsigned char *) zb_packet_data, zb_packet_len, DEVICE_ID, NULL);
+			if (delay >= 0) {
+				reply_at = zb_transport_millis() + delay;
+				replying = 1;
+			}
 			break;
 		default:
 			break;
@@ -144,11 +261,3 @@ void ADC_Config(void)
   ADC_Cmd(ADC3, ENABLE);
 }
 
-static char hexToChar(char h) {
-	static const chars[17] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
-	if(h >= 0 && h <= 15) {
-		return chars[h];
-	} else {
-		return 'X';
-	}
-}
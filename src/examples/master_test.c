@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include "zb_transport.h"
 #include "zb_packets.h"
 #include "requesthandlers.h"
@@ -17,6 +18,10 @@
  *
  * Reads commands from standard input to emulate asynchronously appearing HTTP requests.
  *
+ * Usage: master_test [device [baud [capture]]]
+ *
+ * With a capture file, all traffic to and from the radio is recorded for zb_replay.
+ *
  * Author: Kristian Hentschel
  * Team Project 3. University of Glasgow. 2013
  */
@@ -24,18 +29,49 @@
 
 static void *thread_parse(void *);
 
+/* received frames that can be in use at once */
+#define FRAME_POOL_SIZE 32
+
+static zb_transport_t *radio;
+static zb_framepool_t *frame_pool;
+static zb_addr_cache_t addresses;
+
 /* for testing only. will be replaced by webserver implementation. */
-int main(void) {
+int main(int argc, char *argv[]) {
 	char c;
 	pthread_t parser_thread;
 	char response_buffer[REQUEST_RESULT_BUFSIZE];
+	char cmd[3], value[41];
+	struct zb_transport_config cfg;
+
+	zb_transport_config_init(&cfg);
+	if (argc > 1) {
+		cfg.path = argv[1];
+	}
+	if (argc > 2) {
+		cfg.baud = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		cfg.capture_path = argv[3];
+	}
 
+	radio = zb_transport_open(&cfg);
+	frame_pool = zb_framepool_create(FRAME_POOL_SIZE);
+	if (radio == NULL || frame_pool == NULL) {
+		return 1;
+	}
+
+	zb_addr_cache_init(&addresses);
 	pthread_create(&parser_thread, NULL, thread_parse, NULL);
 
-	zb_packets_init();
+	zb_packets_init(radio);
+	sensors_init(radio, &addresses);
 	zb_set_broadcast_mode(1);
 	zb_set_device_id(0);
 
+	/* find the sensors, so that requests can go to them directly from the start */
+	REQUEST_discover(response_buffer);
+
 	while ((c = getchar()) != 'q') {
 		if (!isalpha((int) c)) {
 			continue;
@@ -55,48 +91,109 @@ int main(void) {
 				break;
 			case 'I':
 				printf("Sending ATNI node identity command\n");
-				zb_send_command("NI");
+				zb_send_command(radio, "NI");
 				break;
 			case 'D':
-				printf("Sending ATND node discover command\n");
-				zb_send_command("ND");
+				REQUEST_discover(response_buffer);
+				break;
+			case 'n':
+				REQUEST_nodes(response_buffer);
+				printf("%s\n", response_buffer);
+				break;
+			case 'A':
+				/* A, an AT command and its value in hex, e.g. AIR03E8 */
+				if (scanf("%2s%40[0-9a-fA-F]", cmd, value) == 2) {
+					REQUEST_configure(response_buffer, cmd, value);
+					printf("%s", response_buffer);
+				}
+				break;
+			case 'P':
+				/* P and a device id */
+				REQUEST_push(response_buffer, getchar() - '0');
+				printf("%s", response_buffer);
 				break;
 			default:
 				printf("unknown command %c\n", c);
 		}
 	}
 
-	zb_transport_stop();	
+	zb_transport_close(radio);
 	
 	printf("good-bye\n");
 	return 0;
 }
 	
-/* this could/should be a separate thread. */
+/* called by the parser with each valid frame, which is decoded straight into a pooled buffer.
+ * it could as well be queued to a worker thread, which would release it when done. */
+static void on_frame(void *arg, struct zb_frame *frame) {
+	(void) arg;
+	printf("\n(valid packet of %d characters with op code %x from device %x at %016llx: '%.*s')\n",
+			frame->len, frame->op, frame->from, (unsigned long long) frame->source64,
+			frame->len, (const char *) frame->data);
+	HANDLE_packet_received(frame);
+	zb_frame_release(frame);
+}
+
+/* called by the parser with the other API frames: responses to the AT commands sent
+ * from the command line, transmit status and modem status. node discovery responses
+ * go to the node registry. */
+static void on_api_frame(void *arg, const struct zb_api_frame *frame) {
+	const struct zb_at_response *at;
+
+	(void) arg;
+	if (HANDLE_api_frame(frame)) {
+		return;
+	}
+	switch (frame->api_id) {
+		case ZB_API_AT_RESPONSE:
+			at = &frame->u.at;
+			printf("\n(AT%c%c response, status %d", at->command[0], at->command[1], at->status);
+			if (at->len > 0) {
+				printf(": '%.*s'", at->len, (const char *) at->data);
+			}
+			printf(")\n");
+			break;
+		case ZB_API_TX_STATUS:
+			printf("\n(transmit status for frame %d: delivery %x after %d retries)\n", frame->u.tx_status.frame_id,
+					frame->u.tx_status.delivery, frame->u.tx_status.retries);
+			break;
+		case ZB_API_MODEM_STATUS:
+			printf("\n(modem status %x)\n", frame->u.modem.status);
+			break;
+		default:
+			printf("\n(API frame %02x)\n", frame->api_id);
+			break;
+	}
+}
+
+/* this could/should be a separate thread.
+ * drains everything available from the transport in one call, and parses it in one go. */
 static void *thread_parse(void *arg) {
-	char c;
+	unsigned char buf[64];
+	zb_parser_t parser;
+	unsigned long invalid = 0;
+	int i, n, timeout;
+
+	(void) arg;
+	zb_parser_init(&parser);
+	zb_parser_set_pool(&parser, frame_pool);
+	zb_parser_set_api_callback(&parser, on_api_frame, NULL);
+	zb_parser_set_address_cache(&parser, &addresses);
 
 	while(1){
-		c = zb_getc();
-		printf("%02x ", c);
+		/* wake up in time to expire requests that got no transmit status */
+		timeout = sensors_poll();
+		n = zb_read_timeout(radio, buf, sizeof(buf), timeout);
+
+		for (i = 0; i < n; i++) {
+			printf("%02x ", buf[i]);
+		}
 		fflush(stdout);
 
-		switch (zb_parse(c)) {
-			case ZB_START_PACKET:
-				printf("\n(start of packet)\n");
-				break;
-			case ZB_PLAIN_WORD:
-				printf("\n(plain word of %d characters)\n", zb_word_len);
-				break;
-			case ZB_VALID_PACKET:
-				printf("\n(valid packet of %d characters with op code %x from device %x: '%s')\n", zb_packet_len, zb_packet_op, zb_packet_from, strndup(zb_packet_data, zb_packet_len));
-				HANDLE_packet_received();
-				break;
-			case ZB_INVALID_PACKET:
-				printf("\n(invalid packet)\n");
-				break;
-			default:
-				break;
+		zb_parse_frames(&parser, buf, n, on_frame, NULL);
+		if (parser.invalid != invalid) {
+			printf("\n(%lu invalid packets)\n", parser.invalid - invalid);
+			invalid = parser.invalid;
 		}
 	}
 	return NULL;
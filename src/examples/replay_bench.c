@@ -0,0 +1,159 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "zb_packets.h"
+#include "zb_capture.h"
+
+/*
+ * replay_bench.c
+ *
+ * Feeds the received data from a capture file (see zb_capture.h) to the packet parser,
+ * as fast as possible or at the original timing, and reports how fast it was parsed.
+ *
+ * Usage: replay_bench capture [repeat [realtime|bytewise|verify|pooled]]
+ *
+ * repeat replays the file that many times, to get a measurable run time from a short capture.
+ * the data is parsed with zb_parse_buffer, or with zb_parser_feed a byte at a time with
+ * bytewise. verify does both and checks that they produce exactly the same packets.
+ * pooled parses with zb_parse_frames into a frame pool, releasing every frame straight away.
+ */
+
+enum mode {MODE_BUFFER, MODE_BYTEWISE, MODE_VERIFY, MODE_POOLED};
+
+#define POOL_SIZE 64
+
+static enum mode mode = MODE_BUFFER;
+static zb_parser_t parser, bytewise_parser;
+static zb_framepool_t *pool;
+
+/* packets from the bytewise parser, waiting to be compared */
+static struct zb_packet *expected;
+static int expected_count, expected_size, compared;
+static unsigned long long mismatches;
+
+static void on_packet(void *arg, const struct zb_packet *packet) {
+	const struct zb_packet *e;
+
+	(void) arg;
+	if (mode != MODE_VERIFY) {
+		return;
+	}
+	if (compared == expected_count) {
+		mismatches++;
+		return;
+	}
+	e = &expected[compared++];
+	if (e->op != packet->op || e->from != packet->from || e->len != packet->len
+			|| memcmp(e->data, packet->data, e->len) != 0) {
+		mismatches++;
+	}
+}
+
+static void on_frame(void *arg, struct zb_frame *frame) {
+	(void) arg;
+	zb_frame_release(frame);
+}
+
+static void parse_bytewise(unsigned char *buf, int len) {
+	struct zb_packet packet;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (zb_parser_feed(&bytewise_parser, buf[i], &packet) != ZB_VALID_PACKET || mode != MODE_VERIFY) {
+			continue;
+		}
+		if (expected_count == expected_size) {
+			expected_size = expected_size ? expected_size * 2 : 256;
+			expected = realloc(expected, expected_size * sizeof(*expected));
+		}
+		expected[expected_count++] = packet;
+	}
+}
+
+static void on_receive(void *arg, unsigned char *buf, int len) {
+	(void) arg;
+	if (mode == MODE_POOLED) {
+		zb_parse_frames(&parser, buf, len, on_frame, NULL);
+		return;
+	}
+	if (mode != MODE_BUFFER) {
+		parse_bytewise(buf, len);
+	}
+	if (mode != MODE_BYTEWISE) {
+		zb_parse_buffer(&parser, buf, len, on_packet, NULL);
+	}
+	if (mode == MODE_VERIFY) {
+		mismatches += expected_count - compared;
+		expected_count = compared = 0;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	zb_replay_t *replay;
+	struct timespec start, end;
+	unsigned long long bytes = 0, valid = 0, invalid = 0, api_frames = 0;
+	zb_parser_t *counted;
+	double elapsed;
+	int repeat = 1, flags = 0, i;
+
+	if (argc < 2) {
+		printf("Usage: %s capture [repeat [realtime|bytewise|verify|pooled]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		repeat = atoi(argv[2]);
+	}
+	if (argc > 3 && strcmp(argv[3], "realtime") == 0) {
+		flags |= ZB_REPLAY_REALTIME;
+	} else if (argc > 3 && strcmp(argv[3], "bytewise") == 0) {
+		mode = MODE_BYTEWISE;
+	} else if (argc > 3 && strcmp(argv[3], "verify") == 0) {
+		mode = MODE_VERIFY;
+	} else if (argc > 3 && strcmp(argv[3], "pooled") == 0) {
+		mode = MODE_POOLED;
+		pool = zb_framepool_create(POOL_SIZE);
+		if (pool == NULL) {
+			return 1;
+		}
+	}
+
+	replay = zb_replay_open(argv[1]);
+	if (replay == NULL) {
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < repeat; i++) {
+		zb_replay_rewind(replay);
+		zb_parser_init(&parser);
+		zb_parser_init(&bytewise_parser);
+		zb_parser_set_pool(&parser, pool);
+		bytes += zb_replay_run(replay, flags, on_receive, NULL);
+
+		counted = mode == MODE_BYTEWISE ? &bytewise_parser : &parser;
+		valid += counted->valid;
+		invalid += counted->invalid;
+		api_frames += counted->api_frames;
+		zb_parser_set_pool(&parser, NULL);
+		if (mode == MODE_VERIFY && (parser.valid != bytewise_parser.valid || parser.invalid != bytewise_parser.invalid
+					|| parser.api_frames != bytewise_parser.api_frames)) {
+			mismatches++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%llu bytes, %llu valid and %llu invalid packets, %llu other API frames in %.3f s: %.1f MB/s, %.0f packets/s\n",
+			bytes, valid, invalid, api_frames, elapsed, bytes / elapsed / 1e6, valid / elapsed);
+	if (mode == MODE_VERIFY) {
+		printf("%s: %llu mismatches between zb_parse_buffer and zb_parser_feed\n",
+				mismatches ? "FAILED" : "ok", mismatches);
+	}
+
+	zb_replay_close(replay);
+	if (pool != NULL) {
+		zb_framepool_destroy(pool);
+	}
+	return mismatches ? 1 : 0;
+}
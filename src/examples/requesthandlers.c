@@ -1,13 +1,40 @@
 #include "requesthandlers.h"
 #include "zb_transport.h"
 #include "zb_packets.h"
+#include "zb_pending.h"
+#include "zb_fragment.h"
+#include "zb_samples.h"
+#include "zb_schedule.h"
+#include "zb_nodes.h"
+#include "zb_routes.h"
+#include "zb_io.h"
+#include "zb_remote.h"
 #include "diagnostics.h"
 #include <pthread.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
-#define TIMEOUT 1
+/* how long to wait for responses to a calibration before accepting the next one */
+#define TIMEOUT_MS 1000
+
+/* how long to wait for the radio to report the delivery of a request */
+#define TX_STATUS_TIMEOUT_MS 5000
+
+/* sensors reply to a measure request one after the other, this far apart (zb_schedule.h).
+ * enough for a full batch through the coordinator's UART at 9600 baud */
+#define REPLY_SLOT_MS 100
+
+/* how long after the last slot a round waits for late replies */
+#define ROUND_SLACK_MS 1000
+
+/* sensors without a microcontroller push the samples of this analog input (AD0) this often */
+#define PUSH_CHANNEL 0
+#define PUSH_INTERVAL_MS 1000
+
+/* the coordinator sends a many-to-one route request this often, in tens of seconds (ATAR) */
+#define MANY_TO_ONE_INTERVAL 6
 
 /* this implementation of the REQUEST functions is not thread-safe. only one thread should be calling them. */
 
@@ -29,28 +56,228 @@ struct sensor_config {
 static struct sensor_config sensor_configs[SENSOR_COUNT];
 static struct sensor_result sensor_results[SENSOR_COUNT];
 
-enum comms_state {STATE_IDLE, STATE_PENDING_MEASURE, STATE_PENDING_CALIBRATE};
+enum comms_state {STATE_IDLE, STATE_PENDING_CALIBRATE};
 
 /* private variables */
 static enum comms_state state;
-time_t last_request_time = 0;
+static zb_transport_t *radio;
+static zb_pending_t requests;		/* requests waiting for their transmit status */
+static zb_addr_cache_t *addresses;	/* of the sensors, learned by the parser */
+static zb_frag_t messages;			/* larger messages from and to the sensors */
+static struct zb_round current_round;	/* replies to the last measure request */
+static pthread_mutex_t round_lock;
+static zb_nodes_t nodes;			/* the radios on the network */
+static zb_routes_t routes;			/* source routes to them, from their route records */
+static uint32_t pushing;			/* bit d: sensor d pushes IO samples, and is not polled */
+static zb_remote_t fleet;			/* the last change of settings on every node */
+static pthread_mutex_t jobs_lock;	/* held to poll the jobs, and to start new ones in their place */
+static zb_remote_t push_job;		/* the last sensor set up to push samples */
+static int push_sensor;
+unsigned long last_request_ms = 0;
 
 /* static methods */
-static unsigned int hexToInt(char *buf, unsigned char len);
+static unsigned int hexToInt(const char *buf, unsigned char len);
+static void update_sensor(int d, sensor_data_t value);
+static void round_reply(int d);
 static double convert_sensor_value(double value);
 
-/* check if the system is still waiting on previous responses to occur within TIMEOUT of last transmission. */
+/* check if a calibration is still waiting on responses to occur within TIMEOUT_MS of last transmission.
+ * measurements and pings are matched to their transmit status by frame id, and need not wait. */
 static int busy() {
-	if (time(NULL) - last_request_time > TIMEOUT) {
+	if (zb_transport_millis() - last_request_ms > TIMEOUT_MS) {
 		state = STATE_IDLE;
 	}
 	return state != STATE_IDLE;
 }
 
-void sensors_init() {
+/* called with the transmit status of a measure request or ping, or NULL if none arrived in time */
+static void on_delivery(void *arg, int frame_id, const struct zb_api_frame *response) {
+	const char *what = arg;
+
+	if (response == NULL) {
+		DIAGNOSTICS("%s (frame %d): no transmit status from the radio.\n", what, frame_id);
+	} else if (response->u.tx_status.delivery != ZB_DELIVERY_SUCCESS) {
+		DIAGNOSTICS("%s (frame %d): delivery failed with status %x.\n", what, frame_id, response->u.tx_status.delivery);
+	}
+}
+
+/* forgets the addresses of sensor d, and the route to it, until it is heard from again */
+static void forget_sensor(int d) {
+	uint64_t addr64;
+	uint16_t addr16;
+
+	if (zb_addr_cache_lookup(addresses, d, &addr64, &addr16) == 0) {
+		zb_routes_forget(&routes, addr64);
+	}
+	zb_addr_cache_forget(addresses, d);
+}
+
+/* called with the transmit status of a request to one sensor. if it did not arrive, the sensor
+ * may have a new network address: forget it, and broadcast until it is heard from again. */
+static void on_unicast_delivery(void *arg, int frame_id, const struct zb_api_frame *response) {
+	const struct sensor_config *sensor = arg;
+
+	if (response == NULL || response->u.tx_status.delivery != ZB_DELIVERY_SUCCESS) {
+		DIAGNOSTICS("delivery to sensor %d (frame %d) failed. forgetting its address.\n", sensor->device_id, frame_id);
+		forget_sensor(sensor->device_id);
+	}
+}
+
+/* starts a new round of measurements for the sensors that are polled, and writes its
+ * schedule into payload: slots by device id, so sensor d replies (d - 1) * REPLY_SLOT_MS
+ * after the request reaches it. returns the payload length, and the sensors asked in *asked. */
+static int begin_round(unsigned char *payload, uint32_t *asked) {
+	uint8_t id;
+	int len;
+
+	pthread_mutex_lock(&round_lock);
+	id = current_round.id + 1;
+	len = zb_schedule_encode(payload, id, REPLY_SLOT_MS, NULL, 0);
+	*asked = (((uint32_t) 1 << SENSOR_COUNT) - 2) & ~pushing;
+	zb_round_begin(&current_round, id, *asked,
+			(SENSOR_COUNT - 1) * REPLY_SLOT_MS + ROUND_SLACK_MS, zb_transport_millis());
+	pthread_mutex_unlock(&round_lock);
+	return len;
+}
+
+/* asks every sensor that is polled to measure: one unicast each if all their addresses are
+ * known, as this keeps routers from repeating a broadcast across the whole network, or a
+ * broadcast otherwise. either way the sensors reply in turn, in the slots of one schedule.
+ * sensors that push their samples are not asked. returns the number of requests sent, or
+ * 1 if every sensor pushes. */
+static int request_measurements(const char *what) {
+	unsigned char schedule[ZB_SCHEDULE_HEADER_LEN];
+	uint64_t addr64;
+	uint16_t addr16;
+	uint32_t asked;
+	int i, sent, len;
+
+	len = begin_round(schedule, &asked);
+	if (asked == 0) {
+		DIAGNOSTICS("%s: every sensor pushes its samples. nothing to request.\n", what);
+		return 1;
+	}
+	for (i = 1; i < SENSOR_COUNT; i++) {
+		if ((asked & (1 << i)) && zb_addr_cache_lookup(addresses, i, &addr64, &addr16) != 0) {
+			DIAGNOSTICS("%s: sending broadcast message to get measurements\n", what);
+			return zb_request_packet(&requests, radio, OP_MEASURE_REQUEST, schedule, len,
+					TX_STATUS_TIMEOUT_MS, on_delivery, (void *) what) != 0;
+		}
+	}
+
+	DIAGNOSTICS("%s: sending a message to each sensor to get measurements\n", what);
+	sent = 0;
+	for (i = 1; i < SENSOR_COUNT; i++) {
+		if (!(asked & (1 << i))) {
+			continue;
+		}
+		sent += zb_request_packet_unicast(&requests, radio, addresses, i, OP_MEASURE_REQUEST, schedule, len,
+				TX_STATUS_TIMEOUT_MS, on_unicast_delivery, &sensor_configs[i]) != 0;
+	}
+	return sent;
+}
+
+/* counts a reply from sensor d towards the current round */
+static void round_reply(int d) {
+	unsigned long now = zb_transport_millis();
+
+	pthread_mutex_lock(&round_lock);
+	if (zb_round_reply(&current_round, d, now)) {
+		DIAGNOSTICS("round %d: all sensors replied within %lu ms.\n", current_round.id,
+				current_round.finished - current_round.started);
+	}
+	pthread_mutex_unlock(&round_lock);
+}
+
+/* the device id of the sensor a node belongs to, by its node identifier, or -1 */
+static int sensor_of(const struct zb_node *node) {
+	int prefix = strlen(SENSOR_NI_PREFIX);
+	char *end;
+	long id;
+
+	if (node->ni_len <= prefix || strncmp(node->ni, SENSOR_NI_PREFIX, prefix) != 0) {
+		return -1;
+	}
+	id = strtol(node->ni + prefix, &end, 10);
+	if (*end != '\0' || id < 1 || id >= SENSOR_COUNT) {
+		return -1;
+	}
+	return id;
+}
+
+/* called with each node that was discovered, announced itself, changed or went away.
+ * sensors go into the address cache, so requests go to them directly. */
+static void on_node(void *arg, const struct zb_node *node, int event) {
+	int id = sensor_of(node);
+
+	(void) arg;
+	DIAGNOSTICS("node '%s' at %016llx/%04x %s.\n", node->ni, (unsigned long long) node->addr64, node->addr16,
+			event == ZB_NODES_NEW ? "found" : event == ZB_NODES_CHANGED ? "changed" : "gone");
+	if (id < 0) {
+		return;
+	}
+	if (event == ZB_NODES_GONE) {
+		forget_sensor(id);
+	} else {
+		zb_addr_cache_learn(addresses, id, node->addr64, node->addr16);
+	}
+}
+
+/* called with each message a sensor sent in fragments: the measurement batches it kept
+ * since the last request, oldest first */
+static void on_message(void *arg, char from, const unsigned char *data, int len) {
+	const unsigned char *batch;
+	uint16_t values[ZB_SAMPLES_MAX];
+	uint16_t interval;
+	uint32_t sampled;
+	int pos = 0, batches = 0, readings = 0, last = -1, size, n;
+
+	(void) arg;
+	if (from >= SENSOR_COUNT || from <= 0) {
+		DIAGNOSTICS("message from unknown sensor. ignoring.\n");
+		return;
+	}
+	while ((size = zb_samples_history_next(data, len, &pos, &batch)) > 0) {
+		n = zb_samples_decode(batch, size, &sampled, &interval, values, ZB_SAMPLES_MAX);
+		if (n < 0) {
+			break;
+		}
+		if (n > 0) {
+			last = values[n - 1];
+		}
+		batches++;
+		readings += n;
+	}
+	if (size != 0 || last < 0) {
+		DIAGNOSTICS("malformed measurement history from %d. ignoring.\n", from);
+		return;
+	}
+	DIAGNOSTICS("Received %d readings in %d batches from %d. Updating sensor result.\n",
+			readings, batches, from);
+	/* the latest reading is the current one */
+	update_sensor(from, last);
+	round_reply(from);
+}
+
+void sensors_init(zb_transport_t *t, zb_addr_cache_t *cache) {
+	char interval = MANY_TO_ONE_INTERVAL;
 	int i;
 	
+	radio = t;
+	addresses = cache;
+	zb_frag_init(&messages, t, cache, 0, on_message, NULL);
 	state = STATE_IDLE;
+	zb_pending_init(&requests);
+	pthread_mutex_init(&round_lock, NULL);
+	pthread_mutex_init(&jobs_lock, NULL);
+	zb_nodes_init(&nodes, on_node, NULL);
+
+	/* have the sensors record their routes, and send to them along those */
+	zb_routes_init(&routes);
+	zb_set_route_cache(&routes);
+	zb_send_command_with_argument(t, "AR", &interval, 1);
+	current_round.active = 0;
+	current_round.id = 0;
 
 	for (i = 0; i < SENSOR_COUNT; i++) {
 		pthread_mutex_init(&sensor_results[i].lock, NULL);
@@ -69,15 +296,14 @@ void sensors_init() {
 
 
 void REQUEST_measure(char *buf) {
-	if (!busy()) {
-		DIAGNOSTICS("MEASURE: sending broadcast message to get measurements\n");
-		state = STATE_PENDING_MEASURE;
-		last_request_time = time(NULL);
-		zb_send_packet(OP_MEASURE_REQUEST, NULL, 0);
+	if (busy()) {
+		DIAGNOSTICS("MEASURE:  request not honoured as a calibration is pending.\n");
+		sprintf(buf, "300 BUSY Measurement not requested as a calibration is still pending.\n");
+	} else if (request_measurements("MEASURE") != 0) {
 		sprintf(buf, "200 OK Measurement requested.\n");
 	} else {
-		DIAGNOSTICS("MEASURE:  request not honoured as the system is currently busy.\n");
-		sprintf(buf, "300 BUSY Measurement not requested as previous requests are still pending.\n");
+		DIAGNOSTICS("MEASURE:  request not honoured as too many requests are in flight.\n");
+		sprintf(buf, "300 BUSY Measurement not requested as too many requests are still pending.\n");
 	}
 }
 
@@ -89,13 +315,12 @@ void REQUEST_calibrate(char *buf) {
 	int i;
 
 	if (!busy()) {
-		DIAGNOSTICS("CALIBRATE: sending broadcast message to get raw measurements\n");
 		for (i = 1; i < SENSOR_COUNT; i++) {
 			sensor_configs[i].calibrated = 0;
 		}
 		state = STATE_PENDING_CALIBRATE;
-		last_request_time = time(NULL);
-		zb_send_packet(OP_MEASURE_REQUEST, NULL, 0);
+		last_request_ms = zb_transport_millis();
+		request_measurements("CALIBRATE");
 		sprintf(buf, "200 OK Calibration requested.\n");
 	} else {
 		DIAGNOSTICS("CALIBRATE: request not honoured as the system is currently busy.\n");
@@ -104,19 +329,207 @@ void REQUEST_calibrate(char *buf) {
 }
 
 void REQUEST_ping(char *buf) {
-	if (!busy()) {
+	if (zb_request_packet(&requests, radio, OP_PING, NULL, 0, TX_STATUS_TIMEOUT_MS, on_delivery, "PING") != 0) {
 		DIAGNOSTICS("PING sent.\n");
-		state = STATE_PENDING_CALIBRATE;
-		zb_send_packet(OP_PING, NULL, 0);
-		last_request_time = time(NULL);
 		sprintf(buf, "200 OK Ping request sent.\n");
 	} else {
-		DIAGNOSTICS("PING request not honoured as the system is currently busy.\n");
-		sprintf(buf, "300 BUSY ping: previous requests still pending.\n");
+		DIAGNOSTICS("PING request not honoured as too many requests are in flight.\n");
+		sprintf(buf, "300 BUSY ping: too many requests still pending.\n");
 	}
 	buf[0] = '\0';
 }
 
+void REQUEST_discover(char *buf) {
+	DIAGNOSTICS("DISCOVER: sending ATND node discover command.\n");
+	zb_nodes_begin_discovery(&nodes, zb_transport_millis());
+	zb_send_command(radio, "ND");
+	sprintf(buf, "200 OK Node discovery started.\n");
+}
+
+void REQUEST_nodes(char *buf) {
+	struct zb_node list[ZB_NODES_MAX];
+	char internalbuf[REQUEST_RESULT_BUFSIZE];
+	int i, n;
+
+	n = zb_nodes_list(&nodes, list, ZB_NODES_MAX);
+	DIAGNOSTICS("NODES: Returning %d nodes.\n", n);
+
+	strcpy(buf, "{\"nodes\": [");
+	for (i = 0; i < n; i++) {
+		snprintf(internalbuf, REQUEST_RESULT_BUFSIZE,
+				"{\"ni\": \"%s\", \"addr64\": \"%016llx\", \"addr16\": %d, \"type\": %d, \"sensor\": %d}",
+				list[i].ni, (unsigned long long) list[i].addr64, list[i].addr16, list[i].device_type, sensor_of(&list[i]));
+		strcat(buf, internalbuf);
+		if (i < n - 1) {
+			strcat(buf, ",\n");
+		}
+	}
+	strcat(buf, "]}");
+}
+
+/* called once the sensor's radio has taken the sampling settings, or failed to */
+static void on_pushing(void *arg, zb_remote_t *job) {
+	(void) arg;
+	if (job->failed) {
+		DIAGNOSTICS("PUSH: sensor %d failed with status %d, and is still polled.\n", push_sensor,
+				job->targets[0].status);
+	} else {
+		DIAGNOSTICS("PUSH: sensor %d configured, %lu commands sent, %lu of them again.\n", push_sensor,
+				job->sent, job->retried);
+	}
+}
+
+void REQUEST_push(char *buf, int d) {
+	struct zb_io_config io = {1 << PUSH_CHANNEL, 0, 0, PUSH_INTERVAL_MS};
+	char ni[ZB_NODES_NI_MAX + 1];
+	struct zb_node node;
+
+	snprintf(ni, sizeof(ni), "%s%d", SENSOR_NI_PREFIX, d);
+	if (d < 1 || d >= SENSOR_COUNT || zb_nodes_find_ni(&nodes, ni, strlen(ni), &node) != 0) {
+		DIAGNOSTICS("PUSH: sensor %d has not been discovered.\n", d);
+		sprintf(buf, "404 NOT FOUND Sensor %d has not been discovered.\n", d);
+		return;
+	}
+	/* as for fleet, the parser thread must not poll the job while it is set up */
+	pthread_mutex_lock(&jobs_lock);
+	if (zb_remote_poll(&push_job)) {
+		pthread_mutex_unlock(&jobs_lock);
+		DIAGNOSTICS("PUSH: request not honoured as the last sensor is still being configured.\n");
+		sprintf(buf, "300 BUSY Sensor %d not configured as the last one is still going on.\n", d);
+		return;
+	}
+
+	/* the job resends lost commands, and on_pushing reports if the radio did not take them */
+	push_sensor = d;
+	zb_remote_init(&push_job, &requests, radio, on_pushing, NULL);
+	zb_io_configure_remote(&push_job, &io);
+	zb_remote_add_target(&push_job, node.addr64, node.addr16);
+	zb_remote_start(&push_job, ZB_REMOTE_APPLY);
+	pthread_mutex_unlock(&jobs_lock);
+	DIAGNOSTICS("PUSH: sensor %d will send a sample every %d ms.\n", d, PUSH_INTERVAL_MS);
+	sprintf(buf, "200 OK Sensor %d is being configured to push samples.\n", d);
+}
+
+/* takes a sample pushed by the radio of a sensor, which is known by its node identifier.
+ * from then on, the sensor is no longer polled. */
+static void io_sample_received(const struct zb_io_sample *sample) {
+	struct zb_node node;
+	int d, value;
+
+	if (zb_nodes_find(&nodes, sample->source64, &node) != 0 || (d = sensor_of(&node)) < 0) {
+		DIAGNOSTICS("IO sample from unknown node %016llx. ignoring.\n", (unsigned long long) sample->source64);
+		return;
+	}
+	value = zb_io_analog(sample, PUSH_CHANNEL);
+	if (value < 0) {
+		DIAGNOSTICS("IO sample from %d without AD%d. ignoring.\n", d, PUSH_CHANNEL);
+		return;
+	}
+
+	pthread_mutex_lock(&round_lock);
+	pushing |= 1 << d;
+	pthread_mutex_unlock(&round_lock);
+
+	/* 10 bits, scaled to the 12 the sensor boards read */
+	DIAGNOSTICS("Received IO sample %d from %d. Updating sensor result.\n", value, d);
+	update_sensor(d, value << 2);
+}
+
+/* called once every node has taken the new setting, or failed to */
+static void on_configured(void *arg, zb_remote_t *job) {
+	int i;
+
+	(void) arg;
+	DIAGNOSTICS("CONFIGURE: %d of %d nodes changed, %lu commands sent, %lu of them again.\n",
+			job->target_count - job->failed, job->target_count, job->sent, job->retried);
+	for (i = 0; i < job->target_count; i++) {
+		if (job->targets[i].state == ZB_REMOTE_FAILED) {
+			DIAGNOSTICS("CONFIGURE: node %016llx failed with status %d.\n",
+					(unsigned long long) job->targets[i].addr64, job->targets[i].status);
+		}
+	}
+}
+
+void REQUEST_configure(char *buf, const char *cmd, const char *hex) {
+	struct zb_node list[ZB_NODES_MAX];
+	char value[ZB_REMOTE_PARAM_MAX];
+	int i, n, len;
+
+	len = strlen(hex) / 2;
+	if (strlen(cmd) != 2 || len > ZB_REMOTE_PARAM_MAX) {
+		sprintf(buf, "400 BAD REQUEST Give a two letter command and at most %d bytes in hex.\n", ZB_REMOTE_PARAM_MAX);
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		value[i] = hexToInt(hex + 2 * i, 2);
+	}
+
+	/* the parser thread polls the job, so it must not see it half set up */
+	pthread_mutex_lock(&jobs_lock);
+	if (zb_remote_poll(&fleet)) {
+		pthread_mutex_unlock(&jobs_lock);
+		DIAGNOSTICS("CONFIGURE: request not honoured as the last change is still going on.\n");
+		sprintf(buf, "300 BUSY Settings not changed as the last change is still going on.\n");
+		return;
+	}
+
+	/* the nodes change over together, once every one has the setting */
+	zb_remote_init(&fleet, &requests, radio, on_configured, NULL);
+	zb_remote_add_command(&fleet, (char *) cmd, value, len);
+	n = zb_nodes_list(&nodes, list, ZB_NODES_MAX);
+	for (i = 0; i < n; i++) {
+		zb_remote_add_target(&fleet, list[i].addr64, list[i].addr16);
+	}
+	DIAGNOSTICS("CONFIGURE: setting AT%s on %d nodes.\n", cmd, n);
+	zb_remote_start(&fleet, ZB_REMOTE_APPLY | ZB_REMOTE_WRITE);
+	pthread_mutex_unlock(&jobs_lock);
+	sprintf(buf, "200 OK Changing AT%s on %d nodes.\n", cmd, n);
+}
+
+int HANDLE_api_frame(const struct zb_api_frame *frame) {
+	if (frame->api_id == ZB_API_IO_SAMPLE) {
+		io_sample_received(&frame->u.io);
+		return 1;
+	}
+	if (zb_nodes_handle(&nodes, frame, zb_transport_millis())) {
+		return 1;
+	}
+	if (zb_routes_handle(&routes, frame, zb_transport_millis())) {
+		return 1;
+	}
+	return zb_pending_complete(&requests, frame);
+}
+
+/* the earlier of two timeouts, where -1 is none */
+static int earliest(int a, int b) {
+	if (a < 0 || (b >= 0 && b < a)) {
+		return b;
+	}
+	return a;
+}
+
+int sensors_poll(void) {
+	unsigned long now = zb_transport_millis();
+	int due;
+
+	zb_pending_expire(&requests, now);
+	pthread_mutex_lock(&jobs_lock);
+	zb_remote_poll(&fleet);
+	zb_remote_poll(&push_job);
+	pthread_mutex_unlock(&jobs_lock);
+	due = earliest(zb_pending_next_deadline(&requests, now), zb_frag_poll(&messages, now));
+
+	pthread_mutex_lock(&round_lock);
+	if (zb_round_expire(&current_round, now)) {
+		DIAGNOSTICS("round %d: no reply from sensors %lx within %lu ms.\n", current_round.id,
+				(unsigned long) (current_round.expected & ~current_round.replied),
+				current_round.finished - current_round.started);
+	}
+	due = earliest(due, zb_round_next_deadline(&current_round, now));
+	pthread_mutex_unlock(&round_lock);
+	return due;
+}
+
 void REQUEST_data(char *buf) {
 	int i;
 	char internalbuf[REQUEST_RESULT_BUFSIZE];
@@ -156,54 +569,86 @@ void REQUEST_data(char *buf) {
 
 
 
-void HANDLE_packet_received() {
-	int d, i;
-	switch (zb_packet_op) {
+void HANDLE_packet_received(const struct zb_frame *packet) {
+	uint16_t values[ZB_SAMPLES_MAX];
+	uint16_t interval;
+	uint32_t sampled;
+	int n;
+
+	if (zb_frag_handle(&messages, packet->op, packet->from, packet->data, packet->len)) {
+		return;
+	}
+	switch (packet->op) {
 		case OP_PING:
-			DIAGNOSTICS("Received PING request from %d.\n", zb_packet_from);
-			zb_send_packet(OP_PONG, NULL, 0);
+			DIAGNOSTICS("Received PING request from %d.\n", packet->from);
+			/* answer only the sender, if the parser has learned where it is */
+			if (zb_send_packet_unicast(radio, addresses, packet->from, 0, OP_PONG, NULL, 0) != 0) {
+				zb_send_packet(radio, OP_PONG, NULL, 0);
+			}
 			break;
 		case OP_PONG:
-			DIAGNOSTICS("Received PONG from %d.\n", zb_packet_from);
+			DIAGNOSTICS("Received PONG from %d.\n", packet->from);
 			break;
 		case OP_MEASURE_REQUEST:
 			DIAGNOSTICS("Received measure request. Ignoring on master unit.\n");
 			break;
 		case OP_MEASURE_RESPONSE:
-			DIAGNOSTICS("Received measure response from %d. Updating sensor result.\n", zb_packet_from);
-			if (zb_packet_from >= SENSOR_COUNT || zb_packet_from == 0) {
+			DIAGNOSTICS("Received measure response from %d. Updating sensor result.\n", packet->from);
+			if (packet->from >= SENSOR_COUNT || packet->from == 0) {
 				DIAGNOSTICS("response from unknown sensor. ignoring.\n");
 				break;
 			}
 
-			d = zb_packet_from;
+			update_sensor(packet->from, hexToInt((const char *) packet->data, packet->len));
+			round_reply(packet->from);
+			break;
+		case OP_MEASURE_BATCH:
+			if (packet->from >= SENSOR_COUNT || packet->from == 0) {
+				DIAGNOSTICS("batch from unknown sensor. ignoring.\n");
+				break;
+			}
+			n = zb_samples_decode(packet->data, packet->len, &sampled, &interval, values, ZB_SAMPLES_MAX);
+			if (n <= 0) {
+				DIAGNOSTICS("malformed measurement batch from %d. ignoring.\n", packet->from);
+				break;
+			}
+			DIAGNOSTICS("Received %d readings taken every %d ms from %d. Updating sensor result.\n",
+					n, interval, packet->from);
+			/* the latest reading is the current one */
+			update_sensor(packet->from, values[n - 1]);
+			round_reply(packet->from);
+			break;
+		default:
+			DIAGNOSTICS("Received packet with unsupported OP-code. ignoring.\n");
+	}
+}
 
-			pthread_mutex_lock(&sensor_results[d].lock);
-			sensor_results[d].data = hexToInt(zb_packet_data, zb_packet_len);
-			sensor_results[d].time = time(NULL); /* TODO gettimeofday for more resolution? */
+/* stores the current reading of sensor d, and uses it as the zero point if a calibration is pending */
+static void update_sensor(int d, sensor_data_t value) {
+	int i;
 
-			if (state == STATE_PENDING_CALIBRATE) {
-				sensor_configs[d].offset = sensor_results[d].data;
-				sensor_configs[d].calibrated = 1;
+	pthread_mutex_lock(&sensor_results[d].lock);
+	sensor_results[d].data = value;
+	sensor_results[d].time = time(NULL); /* TODO gettimeofday for more resolution? */
 
-				state = STATE_IDLE;
+	if (state == STATE_PENDING_CALIBRATE) {
+		sensor_configs[d].offset = sensor_results[d].data;
+		sensor_configs[d].calibrated = 1;
 
-				for (i = 1; i < SENSOR_COUNT; i++) {
-					if (sensor_configs[i].calibrated == 0) {
-						state = STATE_PENDING_CALIBRATE;
-					}
-				}
-			}
+		state = STATE_IDLE;
 
-			pthread_mutex_unlock(&sensor_results[d].lock);
-			break;
-		default:
-			DIAGNOSTICS("Received packet with unsupported OP-code. ignoring.\n");
+		for (i = 1; i < SENSOR_COUNT; i++) {
+			if (sensor_configs[i].calibrated == 0) {
+				state = STATE_PENDING_CALIBRATE;
+			}
+		}
 	}
+
+	pthread_mutex_unlock(&sensor_results[d].lock);
 }
 
 /* convert a string of hexadecimal numbers to an integer */
-static unsigned int hexToInt(char *buf, unsigned char len) {
+static unsigned int hexToInt(const char *buf, unsigned char len) {
 	int i;
 	char c;
 	unsigned int result, v;
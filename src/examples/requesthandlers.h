@@ -16,6 +16,8 @@
  * Team Project 3. University of Glasgow
  */
 
+#include "zb_transport.h"
+#include "zb_packets.h"
 
 /* all request methods will store the result to be sent to the client in a buffer
  * that must be of this size or bigger. */
@@ -24,11 +26,46 @@
 #define SENSOR_COUNT 5
 typedef unsigned long sensor_data_t;
 
+/* sensors set their radio's node identifier to this and their device id, e.g. SENSOR2, so
+ * that node discovery tells the master where each one is */
+#define SENSOR_NI_PREFIX "SENSOR"
+
+/* sets up sensor state. all requests are sent through the given radio. requests go to the
+ * sensors directly once their addresses are in the cache, which the parser fills in, and
+ * along the routes the sensors recorded once the radio's many-to-one routing has run. */
+void sensors_init(zb_transport_t *radio, zb_addr_cache_t *addresses);
+
 void REQUEST_measure(char *buf);
 void REQUEST_calibrate(char *buf);
 void REQUEST_data(char *buf);
 void REQUEST_ping(char *buf);
 
-void HANDLE_packet_received();
+/* starts a node discovery round. sensors found are sent to directly from then on. */
+void REQUEST_discover(char *buf);
+
+/* lists the nodes found by discovery or announced since. */
+void REQUEST_nodes(char *buf);
+
+/* has the radio of sensor d, as found by discovery, sample its analog input and push the
+ * samples, for sensors without a microcontroller. once they arrive, d is no longer polled. */
+void REQUEST_push(char *buf, int d);
+
+/* sets AT command cmd to the value given in hex on the radio of every node found by
+ * discovery, many at once, and applies and writes it once all have it. */
+void REQUEST_configure(char *buf, const char *cmd, const char *hex);
+
+/* acts on a packet received from the network. the frame is only read, and stays with the
+ * caller, so handlers for different packets may run while the parser carries on. */
+void HANDLE_packet_received(const struct zb_frame *packet);
+
+/* takes IO samples pushed by sensors, and passes any other decoded API frame to the node
+ * registry, the route cache and the requests waiting on responses. returns 1 if one of them
+ * took it. */
+int HANDLE_api_frame(const struct zb_api_frame *frame);
+
+/* times out requests that got no response, carries on a change of settings, and rounds of measurements some sensors did not
+ * reply to. returns the milliseconds until the next may time out, or -1 if none are waiting;
+ * call again by then. */
+int sensors_poll(void);
 #endif /*__MASTER_REQUESTHANDLERS_H__*/
 
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "zb_ring.h"
+
+/*
+ * ring_bench.c
+ *
+ * Stress test for zb_ring.h. A producer thread pushes a byte stream through one ring
+ * while the consumer takes it out and checks every byte. Both sides use chunk sizes
+ * that do not divide the ring size, so the copies wrap at every possible offset. One
+ * pass uses zb_ring_write/zb_ring_read, one the in-place zb_ring_write_space/_commit
+ * and zb_ring_read_space/_consume, and one zb_ring_put/zb_ring_take byte by byte.
+ *
+ * Usage: ring_bench [megabytes [ring size]]
+ *
+ * megabytes is how much data each pass moves (default 256). The ring size must be a
+ * power of two (default 256, the tty transport's smallest buffer).
+ */
+
+#define PASS_COPY 0
+#define PASS_IN_PLACE 1
+#define PASS_BYTES 2
+
+static const char *passes[] = {"copy", "in place", "bytes"};
+
+static zb_ring_t ring;
+static unsigned long long total;
+static int pass;
+
+/* the byte at offset i of the stream. it depends on the high bits of i too, so a byte left
+ * over from an earlier lap of the ring does not match. */
+static unsigned char stream(unsigned long long i) {
+	return (unsigned char) ((i * 31) ^ (i >> 11) ^ (i >> 23));
+}
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg) {
+	unsigned char buf[97], *p;
+	unsigned long long i = 0;
+	unsigned int n, k, done, run;
+
+	(void) arg;
+	while (i < total) {
+		n = total - i < sizeof(buf) ? total - i : sizeof(buf);
+		for (k = 0; k < n; k++) {
+			buf[k] = stream(i + k);
+		}
+		for (done = 0; done < n; done += run) {
+			switch (pass) {
+				case PASS_COPY:
+					run = zb_ring_write(&ring, buf + done, n - done);
+					break;
+				case PASS_IN_PLACE:
+					run = zb_ring_write_space(&ring, &p);
+					if (run > n - done) {
+						run = n - done;
+					}
+					for (k = 0; k < run; k++) {
+						p[k] = buf[done + k];
+					}
+					zb_ring_commit(&ring, run);
+					break;
+				default:
+					run = zb_ring_put(&ring, buf[done]);
+					break;
+			}
+			if (run == 0) {
+				sched_yield();
+			}
+		}
+		i += n;
+	}
+	return NULL;
+}
+
+/* takes total bytes out of the ring, and returns the offset of the first wrong one, or total. */
+static unsigned long long consume() {
+	unsigned char buf[61], *p;
+	unsigned long long i = 0;
+	unsigned int n, k;
+
+	while (i < total) {
+		switch (pass) {
+			case PASS_COPY:
+				n = zb_ring_read(&ring, buf, sizeof(buf));
+				p = buf;
+				break;
+			case PASS_IN_PLACE:
+				n = zb_ring_read_space(&ring, &p);
+				break;
+			default:
+				n = zb_ring_take(&ring, buf);
+				p = buf;
+				break;
+		}
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+		for (k = 0; k < n; k++) {
+			if (p[k] != stream(i + k)) {
+				return i + k;
+			}
+		}
+		if (pass == PASS_IN_PLACE) {
+			zb_ring_consume(&ring, n);
+		}
+		i += n;
+	}
+	return total;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned char *storage;
+	unsigned int size = 256;
+	unsigned long long bad;
+	int megabytes = 256, failed = 0;
+	pthread_t thread;
+	double t;
+
+	if (argc > 1) {
+		megabytes = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		size = atoi(argv[2]);
+	}
+	if (megabytes < 1 || !ZB_RING_SIZE_VALID(size)) {
+		printf("Usage: %s [megabytes [ring size]]\n", argv[0]);
+		return 1;
+	}
+	total = (unsigned long long) megabytes * 1000000;
+	storage = malloc(size);
+
+	printf("%d MB per pass through a %u byte ring\n", megabytes, size);
+	for (pass = PASS_COPY; pass <= PASS_BYTES; pass++) {
+		zb_ring_init(&ring, storage, size);
+		t = now();
+		pthread_create(&thread, NULL, producer, NULL);
+		bad = consume();
+		if (bad != total) {
+			/* the producer may be blocked on a full ring; leave it */
+			printf("%-8s FAILED: wrong byte at offset %llu\n", passes[pass], bad);
+			failed = 1;
+			break;
+		}
+		pthread_join(thread, NULL);
+		t = now() - t;
+		printf("%-8s %8.1f MB/s, all bytes correct\n", passes[pass], megabytes / t);
+	}
+
+	free(storage);
+	return failed;
+}
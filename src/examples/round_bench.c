@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "zb_transport.h"
+#include "zb_packets.h"
+#include "zb_samples.h"
+#include "zb_schedule.h"
+#include "zb_loopback.h"
+
+/*
+ * round_bench.c
+ *
+ * Measures how long it takes to poll every sensor of a network once, with the replies sent
+ * all at once or in the slots of a schedule (zb_schedule.h). A master and up to 15 sensors
+ * are connected through a simulated XBee network (zb_loopback.h) whose air is shared, so
+ * that transmissions contend for the channel and can collide. For 1 up to the given number
+ * of sensors, the master broadcasts measure requests to that many, and each replies with a
+ * full batch of readings.
+ *
+ * A round ends when the last reply arrives, or at its timeout if a reply was lost, which is
+ * when a master would give up waiting. Both count towards the mean.
+ *
+ * Usage: round_bench [sensors [rounds [baud [slot ms]]]]
+ *
+ * The slot width defaults to the time a reply takes through the coordinator's UART, plus
+ * a little.
+ */
+
+#define AIR_BPS 250000
+#define REPLY_FRAME_BYTES 100		/* a full batch as a receive packet, escaped */
+#define SLOT_MARGIN_MS 2
+#define ROUND_SLACK_MS 500			/* a round waits this long after its last slot */
+#define ROUND_GAP_MS 20				/* pause between rounds, for late retries to finish */
+#define SAMPLE_INTERVAL_MS 50
+
+struct sensor {
+	int id;
+	zb_transport_t *t;
+	zb_parser_t parser;
+	unsigned long reply_at;
+	int replying;
+	unsigned int seed;
+	uint16_t value;
+};
+
+static zb_transport_t *radio;
+static zb_addr_cache_t coordinator;	/* where the sensors send their replies */
+static struct sensor sensors[ZB_LOOPBACK_MAX_NODES];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zb_round round_state;
+
+/*
+ * every sensor in this process shares the packet layer's device id, so replies are told
+ * apart by the network address of the node they came from, which the loopback network
+ * hands out in the order the nodes were opened: sensor n is node n.
+ */
+static void on_frame(void *arg, struct zb_frame *frame) {
+	(void) arg;
+	if (frame->op == OP_MEASURE_BATCH) {
+		pthread_mutex_lock(&lock);
+		zb_round_reply(&round_state, frame->source16, zb_transport_millis());
+		pthread_mutex_unlock(&lock);
+	}
+	zb_frame_release(frame);
+}
+
+static void *thread_master(void *arg) {
+	unsigned char buf[256];
+	zb_parser_t parser;
+	int n;
+
+	(void) arg;
+	zb_parser_init(&parser);
+	zb_parser_set_pool(&parser, zb_framepool_create(64));
+	while (1) {
+		n = zb_read(radio, buf, sizeof(buf));
+		zb_parse_frames(&parser, buf, n, on_frame, NULL);
+	}
+
+	return NULL;
+}
+
+/* take a measure request, and note when our slot starts */
+static void on_request(void *arg, const struct zb_packet *packet) {
+	struct sensor *s = arg;
+	long delay;
+
+	if (packet->op != OP_MEASURE_REQUEST) {
+		return;
+	}
+	delay = zb_schedule_delay((const unsigned char *) packet->data, packet->len, s->id, NULL);
+	if (delay >= 0) {
+		s->reply_at = zb_transport_millis() + delay;
+		s->replying = 1;
+	}
+}
+
+/* reply with as many readings as fit in a packet */
+static void reply(struct sensor *s) {
+	struct zb_sample_writer batch;
+
+	zb_samples_begin(&batch, zb_transport_millis(), SAMPLE_INTERVAL_MS);
+	do {
+		s->value += rand_r(&s->seed) % 5 - 2;
+	} while (zb_samples_add(&batch, s->value) == 0);
+
+	zb_send_packet_unicast(s->t, &coordinator, 0, 0, OP_MEASURE_BATCH, batch.buf, batch.len);
+	s->replying = 0;
+}
+
+static void *thread_sensor(void *arg) {
+	struct sensor *s = arg;
+	unsigned char buf[256];
+	long wait;
+	int n;
+
+	zb_parser_init(&s->parser);
+	while (1) {
+		wait = -1;
+		if (s->replying) {
+			wait = (long) (s->reply_at - zb_transport_millis());
+			if (wait <= 0) {
+				reply(s);
+				continue;
+			}
+		}
+		n = zb_read_timeout(s->t, buf, sizeof(buf), wait);
+		zb_parse_buffer(&s->parser, buf, n, on_request, s);
+	}
+
+	return NULL;
+}
+
+/* polls sensors 1 to n rounds times with replies slot_ms apart, and reports the round times. */
+static void run(int n, int rounds, int slot_ms, zb_loopback_t *net) {
+	unsigned char schedule[ZB_SCHEDULE_HEADER_LEN + ZB_LOOPBACK_MAX_NODES];
+	char order[ZB_LOOPBACK_MAX_NODES];
+	unsigned long collisions, lost, collisions0, lost0, elapsed, sum = 0, max = 0;
+	int complete = 0, done, len, i, r;
+
+	for (i = 0; i < n; i++) {
+		order[i] = i + 1;
+	}
+	zb_loopback_air_stats(net, &collisions0, &lost0);
+
+	for (r = 0; r < rounds; r++) {
+		len = zb_schedule_encode(schedule, r, slot_ms, order, n);
+
+		pthread_mutex_lock(&lock);
+		zb_round_begin(&round_state, r, ((uint32_t) 1 << (n + 1)) - 2, n * slot_ms + ROUND_SLACK_MS,
+				zb_transport_millis());
+		pthread_mutex_unlock(&lock);
+		zb_send_packet(radio, OP_MEASURE_REQUEST, schedule, len);
+
+		do {
+			usleep(1000);
+			pthread_mutex_lock(&lock);
+			if (!zb_round_expire(&round_state, zb_transport_millis()) && !round_state.active) {
+				complete++;
+			}
+			done = !round_state.active;
+			elapsed = round_state.finished - round_state.started;
+			pthread_mutex_unlock(&lock);
+		} while (!done);
+
+		sum += elapsed;
+		if (elapsed > max) {
+			max = elapsed;
+		}
+		usleep(ROUND_GAP_MS * 1000);
+	}
+
+	zb_loopback_air_stats(net, &collisions, &lost);
+	printf("%2d sensors, %-12s: %3d of %d rounds complete, mean %6.1f ms, max %5lu ms, %4lu collisions, %3lu replies lost\n",
+			n, slot_ms ? "in slots" : "all at once", complete, rounds, (double) sum / rounds, max,
+			collisions - collisions0, lost - lost0);
+}
+
+int main(int argc, char *argv[]) {
+	int count = ZB_LOOPBACK_MAX_NODES - 1, rounds = 20, slot_ms, n, i;
+	unsigned long baud = 115200;
+	struct zb_transport_config cfg;
+	pthread_t thread;
+	zb_loopback_t *net;
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rounds = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		baud = strtoul(argv[3], NULL, 10);
+	}
+	if (count < 1 || count >= ZB_LOOPBACK_MAX_NODES || rounds < 1 || baud == 0) {
+		printf("between 1 and %d sensors are supported, at a baud rate other than 0\n", ZB_LOOPBACK_MAX_NODES - 1);
+		return 1;
+	}
+	slot_ms = (REPLY_FRAME_BYTES * 10 * 1000 + baud - 1) / baud + SLOT_MARGIN_MS;
+	if (argc > 4) {
+		slot_ms = atoi(argv[4]);
+	}
+
+	net = zb_loopback_create(ZB_LOOPBACK_SOCKETPAIR, baud);
+	if (net == NULL) {
+		return 1;
+	}
+	zb_loopback_air(net, AIR_BPS, 1);
+
+	zb_transport_config_init(&cfg);
+	cfg.baud = baud;
+
+	/* the first node opened is the coordinator, at addresses 0 */
+	radio = zb_loopback_open(net, &cfg);
+	if (radio == NULL) {
+		return 1;
+	}
+	zb_addr_cache_init(&coordinator);
+	zb_addr_cache_learn(&coordinator, 0, 0, 0);
+	for (i = 1; i <= count; i++) {
+		sensors[i].id = i;
+		sensors[i].seed = i;
+		sensors[i].value = 2048;
+		sensors[i].t = zb_loopback_open(net, &cfg);
+		if (sensors[i].t == NULL) {
+			return 1;
+		}
+	}
+
+	pthread_create(&thread, NULL, thread_master, NULL);
+	for (i = 1; i <= count; i++) {
+		pthread_create(&thread, NULL, thread_sensor, &sensors[i]);
+	}
+	zb_packets_init(radio);
+	zb_set_broadcast_mode(1);
+
+	printf("%d rounds each, %lu baud, slots of %d ms\n", rounds, baud, slot_ms);
+	for (n = 1; n <= count; n++) {
+		run(n, rounds, 0, net);
+		run(n, rounds, slot_ms, net);
+	}
+
+	return 0;
+}
@@ -1,37 +1,130 @@
 #include "zb_transport.h"
 #include "zb_packets.h"
+#include "zb_samples.h"
+#include "zb_schedule.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 /*
  * scale_test.c
  *
  * A simple test program to act as a scale unit in the system. This part of the system will later be run on the embedded microcontroller boards.
  *
+ * Usage: scale_test [device [baud]]
+ *
+ * Takes a reading every SAMPLE_INTERVAL_MS, and answers measurement requests with a batch
+ * of all readings since the last one (zb_samples.h), in the reply slot the request gives
+ * it (zb_schedule.h).
  */
 
+#define SAMPLE_INTERVAL_MS 50
+#define DEVICE_ID 4
+#define DEVICE_NI "SENSOR4"		/* the master finds us by this name in node discovery */
+
 /* in the real implementation, this will be updated through DMA by the ADC peripheral continously. */
 static unsigned int DMA_ADC_VALUE;
 
-int main(void) {
-	char c;
+static zb_transport_t *radio;
+static struct zb_sample_writer batch;
+static unsigned long next_sample;
+static unsigned long reply_at;		/* start of our slot, if replying */
+static int replying;
+
+/* sends the readings taken so far, and starts a new batch with the next one */
+static void send_batch() {
+	if (batch.count > 0) {
+		zb_send_packet(radio, OP_MEASURE_BATCH, batch.buf, batch.len);
+	}
+	zb_samples_begin(&batch, next_sample, SAMPLE_INTERVAL_MS);
+}
+
+/* takes a reading. a full batch is sent without waiting for the next request */
+static void sample() {
+	/* the load wobbles a little around its value */
+	DMA_ADC_VALUE += rand() % 5 - 2;
+	if (zb_samples_add(&batch, DMA_ADC_VALUE) != 0) {
+		send_batch();
+		zb_samples_add(&batch, DMA_ADC_VALUE);
+	}
+	next_sample += SAMPLE_INTERVAL_MS;
+}
+
+/* answers a measure request now, or once its slot for us has come */
+static void schedule_reply() {
+	long delay;
+
+	delay = zb_schedule_delay((unsigned char *) zb_packet_data, zb_packet_len, DEVICE_ID, NULL);
+	if (delay < 0) {
+		printf("received measurement request without a slot for us\n");
+		return;
+	}
+	printf("received measurement request, replying in %ld ms\n", delay);
+	reply_at = zb_transport_millis() + delay;
+	replying = 1;
+}
+
+/* sends the readings taken so far, at least the current one */
+static void reply() {
+	printf("sending %d readings\n", batch.count);
+	if (batch.count == 0) {
+		zb_samples_add(&batch, DMA_ADC_VALUE);
+	}
+	send_batch();
+	replying = 0;
+}
+
+int main(int argc, char *argv[]) {
+	int c;
+	long wait;
+	unsigned long now;
+	struct zb_transport_config cfg;
+
+	zb_transport_config_init(&cfg);
+	if (argc > 1) {
+		cfg.path = argv[1];
+	}
+	if (argc > 2) {
+		cfg.baud = strtoul(argv[2], NULL, 10);
+	}
+
+	radio = zb_transport_open(&cfg);
+	if (radio == NULL) {
+		return 1;
+	}
 
-	zb_packets_init();
+	zb_packets_init(radio);
 	zb_set_broadcast_mode(0);
-	zb_set_device_id(4);
+	zb_set_device_id(DEVICE_ID);
+	zb_send_command_with_argument(radio, "NI", DEVICE_NI, sizeof(DEVICE_NI) - 1);
 
 	DMA_ADC_VALUE = 128;
+	next_sample = zb_transport_millis();
+	zb_samples_begin(&batch, next_sample, SAMPLE_INTERVAL_MS);
 
 	while (1) {
-		c = zb_getc();
+		/* take the readings that are due and reply if our slot has come, then wait for the
+		 * radio until the next of those */
+		now = zb_transport_millis();
+		while ((wait = (long) (next_sample - now)) <= 0) {
+			sample();
+		}
+		if (replying && (long) (reply_at - now) <= 0) {
+			reply();
+		} else if (replying && (long) (reply_at - now) < wait) {
+			wait = reply_at - now;
+		}
+		c = zb_getc_timeout(radio, wait);
+		if (c < 0) {
+			continue;
+		}
 
 		switch(zb_parse(c)) {
 			case ZB_VALID_PACKET:
 				if (zb_packet_op == OP_MEASURE_REQUEST) {
-					printf("received measurement request packet");
-					zb_send_packet(OP_MEASURE_RESPONSE, "0080", 4);
+					schedule_reply();
 				} else if (zb_packet_op == OP_PING) {
 					printf("received PING\n");
-					zb_send_packet(OP_PONG, NULL, 0);
+					zb_send_packet(radio, OP_PONG, NULL, 0);
 				}
 				break;
 			default:
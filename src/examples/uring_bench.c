@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include "zb_transport.h"
+#include "zb_transport_linux.h"
+
+/*
+ * uring_bench.c
+ *
+ * Compares the io_uring backend of the tty transport with the read() and writer threads,
+ * on a pty pair. The transport is opened on the pty's slave side, like a serial device;
+ * the bench plays the radio on the master side.
+ *
+ *   rx	a feeder thread writes frames into the pty, and zb_read takes them out and checks
+ *		every byte.
+ *   tx	zb_send queues frames, flushing after every half queue, and a drain thread reads
+ *		them from the pty.
+ *
+ * For each, it reports the frame rate and, per frame, the CPU time and the context
+ * switches of the whole process. Those include the bench's own feeder or drain thread,
+ * which does the same work for both backends, so the difference is the transport's.
+ * At full speed both backends batch many frames per wakeup; a rate shows the cost of
+ * frames arriving one at a time, as from a radio. Work the kernel does in its own io_uring
+ * worker threads is not counted.
+ *
+ * Usage: uring_bench [frames [rate]]
+ *
+ * frames is the number of frames in each direction (default 200000). rate is in frames
+ * per second, 0 (the default) for as fast as possible.
+ */
+
+/* a receive packet (0x90) with a 6 byte payload */
+#define FRAME_LEN 24
+
+/* tx flushes after this many frames, so that zb_send never finds the queue full and the
+ * bench does not spin on it */
+#define TX_QUEUE_SIZE 256
+#define TX_BATCH (TX_QUEUE_SIZE / 2)
+
+static int frames = 200000, rate;
+static int pty_fd;
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long cpu_us(const struct rusage *ru) {
+	return (unsigned long long) (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000
+		+ ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+/* frame i of the stream. each one differs, so a lost or repeated frame is noticed. */
+static void make_frame(unsigned char *buf, int i) {
+	int k;
+
+	buf[0] = 0x7E;
+	for (k = 1; k < FRAME_LEN; k++) {
+		buf[k] = (unsigned char) (i * 7 + k + (i >> 8));
+	}
+}
+
+/* waits until frame i is due at the given rate. */
+static void pace(unsigned long long start, int i) {
+	struct timespec ts;
+	unsigned long long due;
+
+	if (rate == 0) {
+		return;
+	}
+	due = start + (unsigned long long) i * 1000000000ULL / rate;
+	ts.tv_sec = due / 1000000000ULL;
+	ts.tv_nsec = due % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* opens a raw pty pair. returns the slave side, and leaves the master side in pty_fd. */
+static int open_pty() {
+	struct termios tc;
+	int fd;
+
+	pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty_fd < 0) {
+		return -1;
+	}
+	if (grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0
+			|| (fd = open(ptsname(pty_fd), O_RDWR | O_NOCTTY)) < 0) {
+		close(pty_fd);
+		return -1;
+	}
+	tcgetattr(pty_fd, &tc);
+	cfmakeraw(&tc);
+	tcsetattr(pty_fd, TCSANOW, &tc);
+	return fd;
+}
+
+/* plays the radio sending frames to the transport. */
+static void *thread_feeder(void *arg) {
+	unsigned char buf[FRAME_LEN];
+	unsigned long long start = now_ns();
+	int i, n, done;
+
+	(void) arg;
+	for (i = 0; i < frames; i++) {
+		pace(start, i);
+		make_frame(buf, i);
+		for (done = 0; done < FRAME_LEN; done += n) {
+			n = write(pty_fd, buf + done, FRAME_LEN - done);
+			if (n <= 0) {
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* plays the radio taking the frames the transport sends. */
+static void *thread_drain(void *arg) {
+	unsigned char buf[4096];
+	long long left = (long long) frames * FRAME_LEN;
+	int n;
+
+	(void) arg;
+	while (left > 0) {
+		n = read(pty_fd, buf, sizeof(buf));
+		if (n <= 0) {
+			break;
+		}
+		left -= n;
+	}
+	return NULL;
+}
+
+/* returns 0, or -1 if a byte came out wrong. */
+static int run_rx(zb_transport_t *t) {
+	unsigned char buf[512], frame[FRAME_LEN];
+	long long pos = 0, total = (long long) frames * FRAME_LEN;
+	pthread_t feeder;
+	int n, k, bad = 0;
+
+	pthread_create(&feeder, NULL, thread_feeder, NULL);
+	make_frame(frame, 0);
+	while (pos < total && !bad) {
+		n = zb_read(t, buf, sizeof(buf));
+		for (k = 0; k < n; k++, pos++) {
+			if (pos % FRAME_LEN == 0) {
+				make_frame(frame, pos / FRAME_LEN);
+			}
+			if (buf[k] != frame[pos % FRAME_LEN]) {
+				printf("wrong byte at offset %lld\n", pos);
+				bad = 1;
+				break;
+			}
+		}
+	}
+	if (!bad) {
+		pthread_join(feeder, NULL);
+	}
+	return bad ? -1 : 0;
+}
+
+/* returns 0, or -1 if a frame could not be sent. */
+static int run_tx(zb_transport_t *t) {
+	unsigned char buf[FRAME_LEN];
+	unsigned long long start = now_ns();
+	pthread_t drain;
+	int i;
+
+	pthread_create(&drain, NULL, thread_drain, NULL);
+	for (i = 0; i < frames; i++) {
+		pace(start, i);
+		make_frame(buf, i);
+		if (zb_send(t, buf, FRAME_LEN) < 0) {
+			printf("frame %d not sent\n", i);
+			return -1;
+		}
+		if (i % TX_BATCH == TX_BATCH - 1 && zb_transport_flush(t) < 0) {
+			return -1;
+		}
+	}
+	zb_transport_flush(t);
+	pthread_join(drain, NULL);
+	return 0;
+}
+
+static void report(const char *backend, const char *direction, unsigned long long ns,
+		const struct rusage *before, const struct rusage *after) {
+	long switches = (after->ru_nvcsw - before->ru_nvcsw) + (after->ru_nivcsw - before->ru_nivcsw);
+
+	printf("%-8s %-4s %12.0f %12.2f %14.3f\n", backend, direction, frames / (ns / 1e9),
+			(double) (cpu_us(after) - cpu_us(before)) / frames, (double) switches / frames);
+}
+
+int main(int argc, char *argv[]) {
+	static const char *names[] = {"read()", "io_uring"};
+	static const int flags[] = {0, ZB_TRANSPORT_IO_URING};
+	struct zb_transport_config cfg;
+	struct rusage before, after;
+	unsigned long long start;
+	zb_transport_t *t;
+	int b;
+
+	if (argc > 1) {
+		frames = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rate = atoi(argv[2]);
+	}
+	if (frames < 1 || rate < 0) {
+		printf("Usage: %s [frames [rate]]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d frames of %d bytes each way, ", frames, FRAME_LEN);
+	if (rate) {
+		printf("%d frames/s\n", rate);
+	} else {
+		printf("as fast as possible\n");
+	}
+	printf("%-8s %-4s %12s %12s %14s\n", "backend", "dir", "frames/s", "CPU us/frame", "switches/frame");
+
+	for (b = 0; b < 2; b++) {
+		zb_transport_config_init(&cfg);
+		cfg.fd = open_pty();
+		cfg.flags = flags[b];
+		cfg.buffer_size = 4096;
+		cfg.tx_queue_size = TX_QUEUE_SIZE;
+		if (cfg.fd < 0 || (t = zb_transport_open(&cfg)) == NULL) {
+			printf("could not open a transport on a pty\n");
+			return 1;
+		}
+		/* the transport falls back to the read() thread without io_uring */
+		if ((flags[b] & ZB_TRANSPORT_IO_URING) && t->uring == NULL) {
+			printf("%-8s not available\n", names[b]);
+			zb_transport_close(t);
+			close(pty_fd);
+			continue;
+		}
+
+		getrusage(RUSAGE_SELF, &before);
+		start = now_ns();
+		if (run_rx(t) < 0) {
+			return 1;
+		}
+		getrusage(RUSAGE_SELF, &after);
+		report(names[b], "rx", now_ns() - start, &before, &after);
+
+		getrusage(RUSAGE_SELF, &before);
+		start = now_ns();
+		if (run_tx(t) < 0) {
+			return 1;
+		}
+		getrusage(RUSAGE_SELF, &after);
+		report(names[b], "tx", now_ns() - start, &before, &after);
+
+		zb_transport_close(t);
+		close(pty_fd);
+	}
+	return 0;
+}
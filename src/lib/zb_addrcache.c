@@ -0,0 +1,104 @@
+#include "zb_addrcache.h"
+#include <string.h>
+
+/*
+ * zb_addrcache.c
+ *
+ * Linear probing from the slot the device id hashes to. Device ids are small numbers
+ * handed out in order, so the hash only needs to spread neighbours across the table.
+ * Forgetting an entry moves the entries after it in the same run back, so that a lookup
+ * can stop at the first empty slot.
+ */
+
+#define MASK (ZB_ADDR_CACHE_SIZE - 1)
+
+static unsigned int home(char device_id) {
+	return ((uint8_t) device_id * 0x9Du) & MASK;
+}
+
+/* the slot holding device_id, or the empty slot where it would go, or -1 if the table is full.
+ * called with the lock held. */
+static int find(zb_addr_cache_t *c, char device_id) {
+	unsigned int i, slot;
+
+	slot = home(device_id);
+	for (i = 0; i < ZB_ADDR_CACHE_SIZE; i++) {
+		if (!c->entries[slot].used || c->entries[slot].device_id == device_id) {
+			return slot;
+		}
+		slot = (slot + 1) & MASK;
+	}
+	return -1;
+}
+
+void zb_addr_cache_init(zb_addr_cache_t *c) {
+	memset(c, 0, sizeof(*c));
+	ZB_LOCK_INIT(&c->lock);
+}
+
+void zb_addr_cache_learn(zb_addr_cache_t *c, char device_id, uint64_t addr64, uint16_t addr16) {
+	struct zb_addr_entry *e;
+	int slot;
+
+	ZB_LOCK(&c->lock);
+	slot = find(c, device_id);
+	if (slot < 0) {
+		/* full: the home slot is taken over, and the other entries stay where they are */
+		slot = home(device_id);
+	}
+	e = &c->entries[slot];
+	if (!e->used || e->device_id != device_id || e->addr64 != addr64 || e->addr16 != addr16) {
+		e->addr64 = addr64;
+		e->addr16 = addr16;
+		e->device_id = device_id;
+		e->used = 1;
+		c->learned++;
+	}
+	ZB_UNLOCK(&c->lock);
+}
+
+int zb_addr_cache_lookup(zb_addr_cache_t *c, char device_id, uint64_t *addr64, uint16_t *addr16) {
+	struct zb_addr_entry *e;
+	int slot;
+
+	ZB_LOCK(&c->lock);
+	slot = find(c, device_id);
+	if (slot < 0 || !c->entries[slot].used) {
+		ZB_UNLOCK(&c->lock);
+		return -1;
+	}
+	e = &c->entries[slot];
+	*addr64 = e->addr64;
+	*addr16 = e->addr16;
+	ZB_UNLOCK(&c->lock);
+	return 0;
+}
+
+void zb_addr_cache_forget(zb_addr_cache_t *c, char device_id) {
+	unsigned int hole, slot, h;
+	int found;
+
+	ZB_LOCK(&c->lock);
+	found = find(c, device_id);
+	if (found < 0 || !c->entries[found].used) {
+		ZB_UNLOCK(&c->lock);
+		return;
+	}
+	c->entries[found].used = 0;
+	c->forgotten++;
+
+	/* move back every later entry of the run that may no longer be reached from its home slot */
+	hole = found;
+	slot = (hole + 1) & MASK;
+	while (c->entries[slot].used) {
+		h = home(c->entries[slot].device_id);
+		/* the entry stays unless the hole lies between its home slot and where it is */
+		if (((slot - h) & MASK) >= ((slot - hole) & MASK)) {
+			c->entries[hole] = c->entries[slot];
+			c->entries[slot].used = 0;
+			hole = slot;
+		}
+		slot = (slot + 1) & MASK;
+	}
+	ZB_UNLOCK(&c->lock);
+}
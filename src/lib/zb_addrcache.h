@@ -0,0 +1,56 @@
+#ifndef __ZB_ADDRCACHE_H__
+#define __ZB_ADDRCACHE_H__
+/*
+ * zb_addrcache.h
+ *
+ * The network addresses of the devices heard from, by application device id.
+ *
+ * A parser with a cache attached (zb_parser_set_address_cache) records the 64 and 16 bit
+ * source addresses of every valid packet under the device id in its payload.
+ * zb_send_packet_unicast then addresses a device directly. As the 16 bit address is
+ * known, the radio sends at once, without first discovering it. A device that moved or
+ * rejoined the network gets a new 16 bit address: forget its entry when a delivery to
+ * it fails, and the next packet it sends fills it in again.
+ *
+ * The cache is an open addressed hash table with room for ZB_ADDR_CACHE_SIZE devices.
+ * When it is full, a new device replaces the entry in its home slot.
+ *
+ * Parsing and sending may happen on different threads; a zb_lock.h lock guards the
+ * entries.
+ */
+
+#include "zb_lock.h"
+#include <stdint.h>
+
+/* a power of two */
+#define ZB_ADDR_CACHE_SIZE 32
+
+/* private */
+struct zb_addr_entry {
+	uint64_t addr64;
+	uint16_t addr16;
+	char device_id;
+	uint8_t used;
+};
+
+/* the members are private, except for the counters. initialise with zb_addr_cache_init. */
+typedef struct zb_addr_cache {
+	zb_lock_t lock;
+	struct zb_addr_entry entries[ZB_ADDR_CACHE_SIZE];
+	unsigned long learned;			/* new devices, and devices whose address changed */
+	unsigned long forgotten;
+} zb_addr_cache_t;
+
+/* sets up an empty cache. */
+void zb_addr_cache_init(zb_addr_cache_t *c);
+
+/* records the addresses device_id sent from. */
+void zb_addr_cache_learn(zb_addr_cache_t *c, char device_id, uint64_t addr64, uint16_t addr16);
+
+/* looks up device_id. returns 0 and fills in the addresses, or -1 if it is not known. */
+int zb_addr_cache_lookup(zb_addr_cache_t *c, char device_id, uint64_t *addr64, uint16_t *addr16);
+
+/* drops the entry for device_id, e.g. after a failed delivery. */
+void zb_addr_cache_forget(zb_addr_cache_t *c, char device_id);
+
+#endif /* __ZB_ADDRCACHE_H__ */
@@ -0,0 +1,221 @@
+#include "zb_api.h"
+#include <string.h>
+
+/*
+ * zb_api.c
+ *
+ * One decoder per API frame type, found by indexing a table with the API ID, so the
+ * parser needs no states of its own for the fields of these frames. It collects the
+ * whole frame, checks the checksum, and calls zb_api_decode. A decoder only runs on a
+ * frame at least min_len bytes long, so it can read every fixed field without checks.
+ * Adding a frame type means adding a struct to zb_api.h, a decoder, and a table entry.
+ */
+
+struct api_decoder {
+	uint8_t min_len;			/* including the API ID. 0 for frames that are not decoded */
+	int (*decode)(const uint8_t *frame, int len, struct zb_api_frame *out);
+};
+
+static uint16_t get16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint64_t get64(const uint8_t *p) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/* id, frame id, command, status, data */
+static int decode_at_response(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_at_response *r = &out->u.at;
+
+	r->frame_id = f[1];
+	r->command[0] = f[2];
+	r->command[1] = f[3];
+	r->status = f[4];
+	r->data = f + 5;
+	r->len = len - 5;
+	return 0;
+}
+
+/* id, status. fixed length, so min_len is the only check needed */
+static int decode_modem_status(const uint8_t *f, int len, struct zb_api_frame *out) {
+	(void) len;
+	out->u.modem.status = f[1];
+	return 0;
+}
+
+/* id, frame id, 16 bit destination, retries, delivery status, discovery status. fixed length */
+static int decode_tx_status(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_tx_status *s = &out->u.tx_status;
+
+	(void) len;
+
+	s->frame_id = f[1];
+	s->dest16 = get16(f + 2);
+	s->retries = f[4];
+	s->delivery = f[5];
+	s->discovery = f[6];
+	return 0;
+}
+
+/* id, 64 and 16 bit source, source and destination endpoint, cluster, profile, options, data */
+static int decode_explicit_rx(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_explicit_rx *r = &out->u.explicit_rx;
+
+	r->source64 = get64(f + 1);
+	r->source16 = get16(f + 9);
+	r->source_endpoint = f[11];
+	r->dest_endpoint = f[12];
+	r->cluster = get16(f + 13);
+	r->profile = get16(f + 15);
+	r->options = f[17];
+	r->data = f + 18;
+	r->len = len - 18;
+	return 0;
+}
+
+/*
+ * id, 64 and 16 bit source, options, number of sample sets (always 1), digital and analog
+ * channel masks, then the digital samples if any channel is digital, and one analog sample
+ * per bit of the analog mask.
+ */
+static int decode_io_sample(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_io_sample *s = &out->u.io;
+	const uint8_t *p;
+	int i;
+
+	s->source64 = get64(f + 1);
+	s->source16 = get16(f + 9);
+	s->options = f[11];
+	s->digital_mask = get16(f + 13);
+	s->analog_mask = f[15];
+
+	p = f + 16;
+	s->digital = 0;
+	if (s->digital_mask != 0) {
+		if (p + 2 > f + len) {
+			return -1;
+		}
+		s->digital = get16(p) & s->digital_mask;
+		p += 2;
+	}
+	for (i = 0; i < 8; i++) {
+		s->analog[i] = 0;
+		if (s->analog_mask & (1 << i)) {
+			if (p + 2 > f + len) {
+				return -1;
+			}
+			s->analog[i] = get16(p);
+			p += 2;
+		}
+	}
+	return f[12] == 1 ? 0 : -1;
+}
+
+/* id, 64 and 16 bit sender, options, then the remote node as in an ND response */
+static int decode_node_id(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_node_id *n = &out->u.node_id;
+
+	n->sender64 = get64(f + 1);
+	n->sender16 = get16(f + 9);
+	n->options = f[11];
+	return zb_api_decode_node(f + 12, len - 12, &n->node);
+}
+
+/* id, frame id, 64 and 16 bit source, command, status, data */
+static int decode_remote_at_response(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_remote_at_response *r = &out->u.remote_at;
+
+	r->frame_id = f[1];
+	r->source64 = get64(f + 2);
+	r->source16 = get16(f + 10);
+	r->command[0] = f[12];
+	r->command[1] = f[13];
+	r->status = f[14];
+	r->data = f + 15;
+	r->len = len - 15;
+	return 0;
+}
+
+/* id, 64 and 16 bit source, options, number of addresses, addresses */
+static int decode_route_record(const uint8_t *f, int len, struct zb_api_frame *out) {
+	struct zb_route_record *r = &out->u.route;
+
+	r->source64 = get64(f + 1);
+	r->source16 = get16(f + 9);
+	r->options = f[11];
+	r->hops = f[12];
+	r->addresses = f + 13;
+	return len == 13 + 2 * r->hops ? 0 : -1;
+}
+
+static const struct api_decoder decoders[256] = {
+	[ZB_API_AT_RESPONSE]		= {5, decode_at_response},
+	[ZB_API_MODEM_STATUS]		= {2, decode_modem_status},
+	[ZB_API_TX_STATUS]			= {7, decode_tx_status},
+	[ZB_API_EXPLICIT_RX]		= {18, decode_explicit_rx},
+	[ZB_API_IO_SAMPLE]			= {16, decode_io_sample},
+	[ZB_API_NODE_ID]			= {12 + 19, decode_node_id},
+	[ZB_API_REMOTE_AT_RESPONSE]	= {15, decode_remote_at_response},
+	[ZB_API_ROUTE_RECORD]		= {13, decode_route_record},
+};
+
+int zb_api_decodable(uint8_t api_id) {
+	return decoders[api_id].decode != NULL;
+}
+
+int zb_api_decode(const uint8_t *frame, int len, struct zb_api_frame *out) {
+	const struct api_decoder *d;
+
+	if (len < 1) {
+		return -1;
+	}
+	d = &decoders[frame[0]];
+	if (d->decode == NULL || len < d->min_len) {
+		return -1;
+	}
+	out->api_id = frame[0];
+	out->frame = frame;
+	out->len = len;
+	return d->decode(frame, len, out);
+}
+
+/*
+ * 16 bit address, 64 bit address, node identifier and its terminating 0, parent's 16 bit
+ * address, device type, status, profile, manufacturer. at least 19 bytes. some firmware
+ * versions append more (device type identifier, RSSI), which is ignored.
+ */
+int zb_api_decode_node(const uint8_t *data, int len, struct zb_node_info *node) {
+	const uint8_t *end, *p;
+
+	if (len < 19) {
+		return -1;
+	}
+	node->addr16 = get16(data);
+	node->addr64 = get64(data + 2);
+	node->ni = (const char *) data + 10;
+
+	end = memchr(data + 10, 0, len - 10);
+	if (end == NULL || end + 1 + 8 > data + len) {
+		return -1;
+	}
+	node->ni_len = end - (data + 10);
+
+	p = end + 1;
+	node->parent16 = get16(p);
+	node->device_type = p[2];
+	node->status = p[3];
+	node->profile = get16(p + 4);
+	node->manufacturer = get16(p + 6);
+	return 0;
+}
+
+uint16_t zb_route_record_hop(const struct zb_route_record *route, int hop) {
+	return get16(route->addresses + 2 * hop);
+}
@@ -0,0 +1,167 @@
+#ifndef __ZB_API_H__
+#define __ZB_API_H__
+/*
+ * zb_api.h
+ *
+ * Decoding of the XBee ZB API frames other than 0x90 Receive Packet, which the
+ * packet parser (zb_packets.h) handles itself.
+ *
+ * Each frame type has one entry in a table indexed by its API ID: the shortest
+ * valid frame, and a function that fills in a typed view of the frame. The views
+ * point into the frame for anything of variable length (AT command data, node
+ * identifier strings), so they are only valid as long as the frame is.
+ *
+ * All offsets and lengths are for the unescaped frame data, starting with the API ID
+ * and without the checksum. Multi-byte fields are big-endian on the wire.
+ */
+
+#include <stdint.h>
+
+#define ZB_API_AT_RESPONSE			0x88
+#define ZB_API_MODEM_STATUS			0x8A
+#define ZB_API_TX_STATUS			0x8B
+#define ZB_API_EXPLICIT_RX			0x91
+#define ZB_API_IO_SAMPLE			0x92
+#define ZB_API_NODE_ID				0x95
+#define ZB_API_REMOTE_AT_RESPONSE	0x97
+#define ZB_API_ROUTE_RECORD			0xA1
+
+/* longest frame the parser decodes, API ID included. longer ones are counted as invalid. */
+#define ZB_API_FRAME_MAX 128
+
+/* AT and remote AT command status */
+#define ZB_AT_OK				0
+#define ZB_AT_ERROR				1
+#define ZB_AT_INVALID_COMMAND	2
+#define ZB_AT_INVALID_PARAMETER	3
+#define ZB_AT_TX_FAILURE		4
+
+/* the frame id of AT commands sent by zb_send_command, whose responses nothing waits for
+ * (e.g. those to ND, which the node registry reads). zb_pending_submit never hands it out. */
+#define ZB_FRAME_ID_UNTRACKED	1
+
+/* transmit status delivery status */
+#define ZB_DELIVERY_SUCCESS		0x00
+
+/* a node as described by an ND response or a node identification indicator */
+struct zb_node_info {
+	uint16_t addr16;
+	uint64_t addr64;
+	const char *ni;				/* node identifier, not terminated */
+	int ni_len;
+	uint16_t parent16;
+	uint8_t device_type;		/* 0 coordinator, 1 router, 2 end device */
+	uint8_t status;
+	uint16_t profile;
+	uint16_t manufacturer;
+};
+
+/* 0x88 */
+struct zb_at_response {
+	uint8_t frame_id;
+	char command[2];
+	uint8_t status;				/* ZB_AT_* */
+	const uint8_t *data;
+	int len;
+};
+
+/* 0x8A */
+struct zb_modem_status {
+	uint8_t status;				/* 0 hardware reset, 2 joined network, 3 disassociated, 6 coordinator started, ... */
+};
+
+/* 0x8B */
+struct zb_tx_status {
+	uint8_t frame_id;
+	uint16_t dest16;
+	uint8_t retries;
+	uint8_t delivery;			/* ZB_DELIVERY_SUCCESS, or the reason it failed */
+	uint8_t discovery;
+};
+
+/* 0x91 */
+struct zb_explicit_rx {
+	uint64_t source64;
+	uint16_t source16;
+	uint8_t source_endpoint;
+	uint8_t dest_endpoint;
+	uint16_t cluster;
+	uint16_t profile;
+	uint8_t options;
+	const uint8_t *data;
+	int len;
+};
+
+/* 0x92 */
+struct zb_io_sample {
+	uint64_t source64;
+	uint16_t source16;
+	uint8_t options;
+	uint16_t digital_mask;		/* bit n: DIOn was sampled */
+	uint8_t analog_mask;		/* bit n: ADn was sampled, n < 4. bit 7: the supply voltage */
+	uint16_t digital;			/* bit n: the level on DIOn */
+	uint16_t analog[8];			/* by the bits of analog_mask, 0 if not sampled. 10 bits, 1023 = 1.2 V */
+};
+
+/* 0x95 */
+struct zb_node_id {
+	uint64_t sender64;
+	uint16_t sender16;
+	uint8_t options;
+	struct zb_node_info node;
+};
+
+/* 0x97 */
+struct zb_remote_at_response {
+	uint8_t frame_id;
+	uint64_t source64;
+	uint16_t source16;
+	char command[2];
+	uint8_t status;				/* ZB_AT_* */
+	const uint8_t *data;
+	int len;
+};
+
+/* 0xA1 */
+struct zb_route_record {
+	uint64_t source64;
+	uint16_t source16;
+	uint8_t options;
+	uint8_t hops;
+	const uint8_t *addresses;	/* hops 16 bit addresses, big-endian, from the one next to the source */
+};
+
+/* a decoded frame. api_id says which member of u is filled in. */
+struct zb_api_frame {
+	uint8_t api_id;
+	const uint8_t *frame;		/* the whole frame, from the API ID */
+	int len;
+	union {
+		struct zb_at_response at;
+		struct zb_modem_status modem;
+		struct zb_tx_status tx_status;
+		struct zb_explicit_rx explicit_rx;
+		struct zb_io_sample io;
+		struct zb_node_id node_id;
+		struct zb_remote_at_response remote_at;
+		struct zb_route_record route;
+	} u;
+};
+
+/* called by the parser for every decoded frame. the frame is only valid during the call. */
+typedef void (*zb_api_callback)(void *arg, const struct zb_api_frame *frame);
+
+/* 1 if frames with this API ID can be decoded. */
+int zb_api_decodable(uint8_t api_id);
+
+/* decodes the len bytes of frame, starting with the API ID, into out.
+ * returns 0, or -1 if the frame type is unknown or the frame is malformed. */
+int zb_api_decode(const uint8_t *frame, int len, struct zb_api_frame *out);
+
+/* decodes a node description, as in an ND response's data. returns 0 or -1. */
+int zb_api_decode_node(const uint8_t *data, int len, struct zb_node_info *node);
+
+/* the hop-th address of a route record. */
+uint16_t zb_route_record_hop(const struct zb_route_record *route, int hop);
+
+#endif /* __ZB_API_H__ */
@@ -0,0 +1,208 @@
+#include "zb_transport_linux.h"
+#include "zb_capture.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "diagnostics.h"
+
+/*
+ * zb_capture.c
+ *
+ * Recording side: the receive backends call zb_capture for every chunk read from the
+ * device, and zb_tx_advance for every chunk written. Each record goes to the file with
+ * a single writev on a descriptor opened with O_APPEND, so records from the receive
+ * and transmit threads (or from several transports) never interleave, and no lock
+ * is needed.
+ *
+ * Replay side: the file is mapped read-only and chunks are handed out in place.
+ */
+
+struct zb_replay {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	uint64_t first_ns;			/* timestamp of the first record */
+	struct timespec start;		/* when realtime replay of the first record started */
+	int started;
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int zb_capture_open(struct zb_transport *t, const char *path) {
+	struct stat st;
+
+	t->capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (t->capture_fd < 0) {
+		return -1;
+	}
+
+	/* a new file starts with the magic. an existing one is appended to. */
+	if (fstat(t->capture_fd, &st) == 0 && st.st_size == 0) {
+		if (write(t->capture_fd, ZB_CAPTURE_MAGIC, ZB_CAPTURE_MAGIC_LEN) != ZB_CAPTURE_MAGIC_LEN) {
+			close(t->capture_fd);
+			t->capture_fd = -1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void zb_capture_close(struct zb_transport *t) {
+	if (t->capture_fd >= 0) {
+		close(t->capture_fd);
+		t->capture_fd = -1;
+	}
+}
+
+void zb_capture(struct zb_transport *t, int dir, const unsigned char *buf, size_t len) {
+	struct zb_capture_record rec;
+	struct iovec iov[2];
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ts_ns = now_ns();
+	rec.len = len;
+	rec.dir = dir;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = len;
+
+	/* the other thread may be capturing at the same time, so the file stays open on errors */
+	if (writev(t->capture_fd, iov, 2) < 0) {
+		DIAGNOSTICS("capture write failed, record of %u bytes lost: %s\n", (unsigned int) len, strerror(errno));
+	}
+}
+
+zb_replay_t *zb_replay_open(const char *path) {
+	zb_replay_t *r;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("[CRITICAL] could not open capture file %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < ZB_CAPTURE_MAGIC_LEN) {
+		printf("[CRITICAL] %s is not a capture file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("[CRITICAL] could not map capture file %s\n", path);
+		return NULL;
+	}
+	if (memcmp(p, ZB_CAPTURE_MAGIC, ZB_CAPTURE_MAGIC_LEN) != 0) {
+		printf("[CRITICAL] %s is not a capture file\n", path);
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	r->data = p;
+	r->size = st.st_size;
+	zb_replay_rewind(r);
+	return r;
+}
+
+void zb_replay_close(zb_replay_t *r) {
+	munmap((void *) r->data, r->size);
+	free(r);
+}
+
+void zb_replay_rewind(zb_replay_t *r) {
+	r->pos = ZB_CAPTURE_MAGIC_LEN;
+	r->started = 0;
+}
+
+/* sleep until the record captured at ts_ns is due, relative to the first one. */
+static void replay_wait(zb_replay_t *r, uint64_t ts_ns) {
+	struct timespec due;
+	uint64_t offset;
+
+	if (!r->started) {
+		r->first_ns = ts_ns;
+		clock_gettime(CLOCK_MONOTONIC, &r->start);
+		r->started = 1;
+		return;
+	}
+
+	offset = ts_ns > r->first_ns ? ts_ns - r->first_ns : 0;
+	due.tv_sec = r->start.tv_sec + offset / 1000000000ULL;
+	due.tv_nsec = r->start.tv_nsec + offset % 1000000000ULL;
+	if (due.tv_nsec >= 1000000000L) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+		;
+}
+
+int zb_replay_next(zb_replay_t *r, int flags, const unsigned char **buf, int *dir) {
+	struct zb_capture_record rec;
+
+	while (r->pos < r->size) {
+		if (r->size - r->pos < sizeof(rec)) {
+			return -1;
+		}
+		memcpy(&rec, r->data + r->pos, sizeof(rec));
+		if (r->size - r->pos - sizeof(rec) < rec.len) {
+			return -1;
+		}
+
+		*buf = r->data + r->pos + sizeof(rec);
+		r->pos += sizeof(rec) + rec.len;
+
+		if (rec.len == 0 || (rec.dir == ZB_CAPTURE_TX && !(flags & ZB_REPLAY_TX))) {
+			continue;
+		}
+		if (flags & ZB_REPLAY_REALTIME) {
+			replay_wait(r, rec.ts_ns);
+		}
+		if (dir != NULL) {
+			*dir = rec.dir;
+		}
+		return rec.len;
+	}
+
+	return 0;
+}
+
+unsigned long long zb_replay_run(zb_replay_t *r, int flags, zb_receive_callback cb, void *arg) {
+	unsigned long long total = 0;
+	const unsigned char *buf;
+	int n;
+
+	while ((n = zb_replay_next(r, flags, &buf, NULL)) > 0) {
+		/* the callback type takes a mutable buffer, but must not modify it: the mapping is read-only */
+		cb(arg, (unsigned char *) buf, n);
+		total += n;
+	}
+
+	if (n < 0) {
+		DIAGNOSTICS("capture file is truncated, replay stopped.\n");
+	}
+	return total;
+}
@@ -0,0 +1,63 @@
+#ifndef __ZB_CAPTURE_H__
+#define __ZB_CAPTURE_H__
+/*
+ * zb_capture.h
+ *
+ * Capture files and replay (Linux only).
+ *
+ * A transport opened with capture_path set appends every chunk it reads from or
+ * writes to the device to that file, so that traffic seen in the field can be
+ * replayed later, e.g. to reproduce a problem or to benchmark the packet parser.
+ *
+ * File format: the 8 byte magic ZB_CAPTURE_MAGIC, followed by records of a
+ * struct zb_capture_record header (host byte order) and len bytes of data.
+ * Record headers are not aligned in the file. Several transports may append to
+ * the same file; every record is written with a single write.
+ */
+
+#include "zb_transport.h"
+#include <stdint.h>
+
+#define ZB_CAPTURE_MAGIC "ZBCAP01\n"
+#define ZB_CAPTURE_MAGIC_LEN 8
+
+/* direction of a captured chunk */
+#define ZB_CAPTURE_RX 0
+#define ZB_CAPTURE_TX 1
+
+struct zb_capture_record {
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC when the chunk was read or written */
+	uint32_t len;		/* bytes of data following the header */
+	uint8_t dir;		/* ZB_CAPTURE_RX or ZB_CAPTURE_TX */
+	uint8_t reserved[3];
+};
+
+/*
+ * replay
+ */
+
+/* deliver chunks at the intervals they were captured at, rather than as fast as possible */
+#define ZB_REPLAY_REALTIME 0x01
+/* deliver transmitted chunks as well as received ones */
+#define ZB_REPLAY_TX 0x02
+
+typedef struct zb_replay zb_replay_t;
+
+/* map a capture file. NULL if it cannot be opened or is not a capture file. */
+zb_replay_t *zb_replay_open(const char *path);
+void zb_replay_close(zb_replay_t *r);
+
+/* start again from the first record. */
+void zb_replay_rewind(zb_replay_t *r);
+
+/* get the next received chunk (or any chunk, with ZB_REPLAY_TX), without copying.
+ * with ZB_REPLAY_REALTIME, sleeps until it is due. *buf points into the mapped file
+ * and stays valid until zb_replay_close. returns the length, 0 at the end of the
+ * file, or -1 if the file is truncated. dir may be NULL. */
+int zb_replay_next(zb_replay_t *r, int flags, const unsigned char **buf, int *dir);
+
+/* pass every remaining chunk to cb, as zb_transport_process_ready would.
+ * returns the number of bytes delivered. */
+unsigned long long zb_replay_run(zb_replay_t *r, int flags, zb_receive_callback cb, void *arg);
+
+#endif /* __ZB_CAPTURE_H__ */
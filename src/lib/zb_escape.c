@@ -0,0 +1,623 @@
+#include "zb_escape.h"
+#include <string.h>
+
+/*
+ * zb_escape.c
+ *
+ * Every implementation works the same way: load a vector, compare it against the
+ * bytes of interest, and store it to the output whole. If nothing matched, the whole
+ * vector was copied; if there was one match, the output position only advances up
+ * to it, it is handled on its own, and the next vector starts after it. Vectors with
+ * several matches are done a byte at a time, so that dense input (in the worst case,
+ * every byte escaped) costs about as much as the scalar version, give or take 15%, in
+ * an optimised (-O2) build. Unoptimised, the vector versions take twice as long on it.
+ * Stores may run past the end of the output, into the room that the callers are
+ * required to leave. Whatever is left at the end of the input is done a byte at a
+ * time as well.
+ *
+ * Escaping also sums the bytes it takes, for the frame checksum, so that a frame is
+ * encoded in a single pass over its payload.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZB_ESCAPE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define ZB_ESCAPE_ARM_NEON
+#include <arm_neon.h>
+#endif
+
+struct escape_impl {
+	int id;
+	const char *name;
+	int (*escape_run)(const unsigned char *buf, int len);
+	int (*clean_run)(const unsigned char *buf, int len);
+	int (*escape)(unsigned char *out, const unsigned char *in, int len, unsigned int *sum);
+	int (*unescape)(unsigned char *out, int want, const unsigned char *in, int len, int *used);
+};
+
+/* 1 if the escape character at in[i] is followed by an ordinary byte within len */
+static int escape_pair(const unsigned char *in, int i, int len) {
+	return i + 1 < len && in[i + 1] != ZB_FRAME_ESCAPE && in[i + 1] != ZB_FRAME_DELIMITER;
+}
+
+/*
+ * scalar implementation, also used for the tails of the vector ones
+ */
+
+static int escape_run_scalar(const unsigned char *buf, int len) {
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (ZB_NEEDS_ESCAPE(buf[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+static int clean_run_scalar(const unsigned char *buf, int len) {
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == ZB_FRAME_DELIMITER || buf[i] == ZB_FRAME_ESCAPE) {
+			break;
+		}
+	}
+	return i;
+}
+
+/* escapes in[i] up to in[len] to out[o], adding the bytes to *sum. returns the new o. */
+static inline int escape_tail(unsigned char *out, const unsigned char *in, int i, int o, int len, unsigned int *sum) {
+	unsigned int s = 0;
+	unsigned char c;
+
+	for (; i < len; i++) {
+		c = in[i];
+		s += c;
+		if (ZB_NEEDS_ESCAPE(c)) {
+			out[o++] = ZB_FRAME_ESCAPE;
+			out[o++] = c ^ 0x20;
+		} else {
+			out[o++] = c;
+		}
+	}
+	*sum += s;
+	return o;
+}
+
+static int escape_scalar(unsigned char *out, const unsigned char *in, int len, unsigned int *sum) {
+	return escape_tail(out, in, 0, 0, len, sum);
+}
+
+/* unescapes a byte at a time until out holds want bytes or in[stop] is reached.
+ * returns 0 if it stopped at a delimiter or an escape that cannot be taken. */
+static inline int unescape_bytes(unsigned char *out, int *op, int want, const unsigned char *in, int *ip, int stop, int len) {
+	int i = *ip, o = *op, ok = 1;
+	unsigned char c;
+
+	while (o < want && i < stop) {
+		c = in[i];
+		if (c == ZB_FRAME_DELIMITER) {
+			ok = 0;
+			break;
+		}
+		if (c == ZB_FRAME_ESCAPE) {
+			if (!escape_pair(in, i, len)) {
+				ok = 0;
+				break;
+			}
+			out[o++] = in[i + 1] ^ 0x20;
+			i += 2;
+		} else {
+			out[o++] = c;
+			i++;
+		}
+	}
+	*ip = i;
+	*op = o;
+	return ok;
+}
+
+static int unescape_tail(unsigned char *out, int o, int want, const unsigned char *in, int i, int len, int *used) {
+	unescape_bytes(out, &o, want, in, &i, len, len);
+	*used = i;
+	return o;
+}
+
+static int unescape_scalar(unsigned char *out, int want, const unsigned char *in, int len, int *used) {
+	return unescape_tail(out, 0, want, in, 0, len, used);
+}
+
+static const struct escape_impl impl_scalar = {
+	ZB_ESCAPE_SCALAR, "scalar",
+	escape_run_scalar, clean_run_scalar, escape_scalar, unescape_scalar
+};
+
+#if defined(ZB_ESCAPE_X86) || defined(ZB_ESCAPE_ARM_NEON)
+/* loaded from prefix_ones + 32 - n, a vector has its first n bytes set, to sum only those. */
+static const unsigned char prefix_ones[64] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+#endif
+
+#ifdef ZB_ESCAPE_X86
+
+/*
+ * SSE2, 16 bytes at a time
+ */
+
+/* bit n set if byte n needs escaping. 0x11 and 0x13 differ only in bit 1. */
+__attribute__((target("sse2")))
+static inline int sse2_escape_mask(__m128i v) {
+	__m128i m;
+
+	m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(ZB_FRAME_DELIMITER)), _mm_cmpeq_epi8(v, _mm_set1_epi8(ZB_FRAME_ESCAPE)));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char) 0xFD)), _mm_set1_epi8(ZB_FRAME_XON)));
+	return _mm_movemask_epi8(m);
+}
+
+/* bit n set if byte n is a delimiter or an escape */
+__attribute__((target("sse2")))
+static inline int sse2_clean_mask(__m128i v) {
+	return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(ZB_FRAME_DELIMITER)),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(ZB_FRAME_ESCAPE))));
+}
+
+__attribute__((target("sse2")))
+static int escape_run_sse2(const unsigned char *buf, int len) {
+	int i, mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = sse2_escape_mask(_mm_loadu_si128((const __m128i *) (buf + i)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + escape_run_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static int clean_run_sse2(const unsigned char *buf, int len) {
+	int i, mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = sse2_clean_mask(_mm_loadu_si128((const __m128i *) (buf + i)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + clean_run_scalar(buf + i, len - i);
+}
+
+/* out has room for 2 * len, and o <= 2 * i, so a 16 byte store never reaches past it.
+ * the bytes taken are summed with psadbw, into two 64 bit halves of acc. */
+__attribute__((target("sse2")))
+static int escape_sse2(unsigned char *out, const unsigned char *in, int len, unsigned int *sum) {
+	__m128i v, acc = _mm_setzero_si128();
+	int i = 0, o = 0, mask, k;
+
+	while (i + 16 <= len) {
+		v = _mm_loadu_si128((const __m128i *) (in + i));
+		_mm_storeu_si128((__m128i *) (out + o), v);
+		mask = sse2_escape_mask(v);
+		if (mask == 0) {
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+			i += 16;
+			o += 16;
+			continue;
+		}
+		if (mask & (mask - 1)) {
+			o = escape_tail(out, in, i, o, i + 16, sum);
+			i += 16;
+			continue;
+		}
+		k = __builtin_ctz(mask);
+		v = _mm_and_si128(v, _mm_loadu_si128((const __m128i *) (prefix_ones + 32 - (k + 1))));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+		i += k;
+		o += k;
+		out[o++] = ZB_FRAME_ESCAPE;
+		out[o++] = in[i++] ^ 0x20;
+	}
+	*sum += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+	return escape_tail(out, in, i, o, len, sum);
+}
+
+__attribute__((target("sse2")))
+static int unescape_sse2(unsigned char *out, int want, const unsigned char *in, int len, int *used) {
+	__m128i v;
+	int i = 0, o = 0, mask, k;
+
+	while (o < want && i + 16 <= len) {
+		v = _mm_loadu_si128((const __m128i *) (in + i));
+		_mm_storeu_si128((__m128i *) (out + o), v);
+		mask = sse2_clean_mask(v);
+		if (mask == 0 && want - o >= 16) {
+			i += 16;
+			o += 16;
+			continue;
+		}
+		if (mask & (mask - 1)) {
+			if (!unescape_bytes(out, &o, want, in, &i, i + 16, len)) {
+				*used = i;
+				return o;
+			}
+			continue;
+		}
+		k = mask ? __builtin_ctz(mask) : 16;
+		if (k > want - o) {
+			k = want - o;
+		}
+		i += k;
+		o += k;
+		if (k == 16 || o == want) {
+			continue;
+		}
+		if (in[i] == ZB_FRAME_DELIMITER || !escape_pair(in, i, len)) {
+			*used = i;
+			return o;
+		}
+		out[o++] = in[i + 1] ^ 0x20;
+		i += 2;
+	}
+	return unescape_tail(out, o, want, in, i, len, used);
+}
+
+static const struct escape_impl impl_sse2 = {
+	ZB_ESCAPE_SSE2, "sse2",
+	escape_run_sse2, clean_run_sse2, escape_sse2, unescape_sse2
+};
+
+/*
+ * AVX2, 32 bytes at a time. the same as SSE2 otherwise.
+ */
+
+__attribute__((target("avx2")))
+static inline unsigned int avx2_escape_mask(__m256i v) {
+	__m256i m;
+
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZB_FRAME_DELIMITER)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZB_FRAME_ESCAPE)));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_and_si256(v, _mm256_set1_epi8((char) 0xFD)), _mm256_set1_epi8(ZB_FRAME_XON)));
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int avx2_clean_mask(__m256i v) {
+	return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZB_FRAME_DELIMITER)),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZB_FRAME_ESCAPE))));
+}
+
+__attribute__((target("avx2")))
+static int escape_run_avx2(const unsigned char *buf, int len) {
+	unsigned int mask;
+	int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = avx2_escape_mask(_mm256_loadu_si256((const __m256i *) (buf + i)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + escape_run_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int clean_run_avx2(const unsigned char *buf, int len) {
+	unsigned int mask;
+	int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = avx2_clean_mask(_mm256_loadu_si256((const __m256i *) (buf + i)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + clean_run_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int escape_avx2(unsigned char *out, const unsigned char *in, int len, unsigned int *sum) {
+	__m256i v, acc = _mm256_setzero_si256();
+	__m128i half;
+	unsigned int mask;
+	int i = 0, o = 0, k;
+
+	while (i + 32 <= len) {
+		v = _mm256_loadu_si256((const __m256i *) (in + i));
+		_mm256_storeu_si256((__m256i *) (out + o), v);
+		mask = avx2_escape_mask(v);
+		if (mask == 0) {
+			acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+			i += 32;
+			o += 32;
+			continue;
+		}
+		if (mask & (mask - 1)) {
+			o = escape_tail(out, in, i, o, i + 32, sum);
+			i += 32;
+			continue;
+		}
+		k = __builtin_ctz(mask);
+		v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *) (prefix_ones + 32 - (k + 1))));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+		i += k;
+		o += k;
+		out[o++] = ZB_FRAME_ESCAPE;
+		out[o++] = in[i++] ^ 0x20;
+	}
+	half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	*sum += _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+	return escape_tail(out, in, i, o, len, sum);
+}
+
+__attribute__((target("avx2")))
+static int unescape_avx2(unsigned char *out, int want, const unsigned char *in, int len, int *used) {
+	__m256i v;
+	unsigned int mask;
+	int i = 0, o = 0, k;
+
+	while (o < want && i + 32 <= len) {
+		v = _mm256_loadu_si256((const __m256i *) (in + i));
+		_mm256_storeu_si256((__m256i *) (out + o), v);
+		mask = avx2_clean_mask(v);
+		if (mask == 0 && want - o >= 32) {
+			i += 32;
+			o += 32;
+			continue;
+		}
+		if (mask & (mask - 1)) {
+			if (!unescape_bytes(out, &o, want, in, &i, i + 32, len)) {
+				*used = i;
+				return o;
+			}
+			continue;
+		}
+		k = mask ? __builtin_ctz(mask) : 32;
+		if (k > want - o) {
+			k = want - o;
+		}
+		i += k;
+		o += k;
+		if (k == 32 || o == want) {
+			continue;
+		}
+		if (in[i] == ZB_FRAME_DELIMITER || !escape_pair(in, i, len)) {
+			*used = i;
+			return o;
+		}
+		out[o++] = in[i + 1] ^ 0x20;
+		i += 2;
+	}
+	return unescape_tail(out, o, want, in, i, len, used);
+}
+
+static const struct escape_impl impl_avx2 = {
+	ZB_ESCAPE_AVX2, "avx2",
+	escape_run_avx2, clean_run_avx2, escape_avx2, unescape_avx2
+};
+
+#endif /* ZB_ESCAPE_X86 */
+
+#ifdef ZB_ESCAPE_ARM_NEON
+
+/*
+ * NEON, 16 bytes at a time. there is no movemask, so the comparison result is narrowed
+ * to 4 bits per byte, and the position of a match is the trailing zero count / 4.
+ *
+ * not yet built or checked against plain C on ARM hardware, so it is only used when
+ * asked for with zb_escape_select.
+ */
+
+static inline uint64_t neon_mask(uint8x16_t match) {
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+}
+
+static inline uint64_t neon_escape_mask(uint8x16_t v) {
+	uint8x16_t m;
+
+	m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(ZB_FRAME_DELIMITER)), vceqq_u8(v, vdupq_n_u8(ZB_FRAME_ESCAPE)));
+	m = vorrq_u8(m, vceqq_u8(vandq_u8(v, vdupq_n_u8(0xFD)), vdupq_n_u8(ZB_FRAME_XON)));
+	return neon_mask(m);
+}
+
+static inline uint64_t neon_clean_mask(uint8x16_t v) {
+	return neon_mask(vorrq_u8(vceqq_u8(v, vdupq_n_u8(ZB_FRAME_DELIMITER)), vceqq_u8(v, vdupq_n_u8(ZB_FRAME_ESCAPE))));
+}
+
+static int escape_run_neon(const unsigned char *buf, int len) {
+	uint64_t mask;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = neon_escape_mask(vld1q_u8(buf + i));
+		if (mask) {
+			return i + (__builtin_ctzll(mask) >> 2);
+		}
+	}
+	return i + escape_run_scalar(buf + i, len - i);
+}
+
+static int clean_run_neon(const unsigned char *buf, int len) {
+	uint64_t mask;
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = neon_clean_mask(vld1q_u8(buf + i));
+		if (mask) {
+			return i + (__builtin_ctzll(mask) >> 2);
+		}
+	}
+	return i + clean_run_scalar(buf + i, len - i);
+}
+
+/* the bytes taken are widened and summed into four 32 bit lanes of acc. */
+static int escape_neon(unsigned char *out, const unsigned char *in, int len, unsigned int *sum) {
+	uint8x16_t v;
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint64_t mask;
+	int i = 0, o = 0, k;
+
+	while (i + 16 <= len) {
+		v = vld1q_u8(in + i);
+		vst1q_u8(out + o, v);
+		mask = neon_escape_mask(v);
+		if (mask == 0) {
+			acc = vpadalq_u16(acc, vpaddlq_u8(v));
+			i += 16;
+			o += 16;
+			continue;
+		}
+		k = __builtin_ctzll(mask) >> 2;
+		if (mask & ~(0xFULL << (k * 4))) {
+			o = escape_tail(out, in, i, o, i + 16, sum);
+			i += 16;
+			continue;
+		}
+		v = vandq_u8(v, vld1q_u8(prefix_ones + 32 - (k + 1)));
+		acc = vpadalq_u16(acc, vpaddlq_u8(v));
+		i += k;
+		o += k;
+		out[o++] = ZB_FRAME_ESCAPE;
+		out[o++] = in[i++] ^ 0x20;
+	}
+	*sum += vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+	return escape_tail(out, in, i, o, len, sum);
+}
+
+static int unescape_neon(unsigned char *out, int want, const unsigned char *in, int len, int *used) {
+	uint8x16_t v;
+	uint64_t mask;
+	int i = 0, o = 0, k;
+
+	while (o < want && i + 16 <= len) {
+		v = vld1q_u8(in + i);
+		vst1q_u8(out + o, v);
+		mask = neon_clean_mask(v);
+		if (mask == 0 && want - o >= 16) {
+			i += 16;
+			o += 16;
+			continue;
+		}
+		k = mask ? (__builtin_ctzll(mask) >> 2) : 16;
+		/* k is 16 for a clean vector, which must not be shifted by */
+		if (mask != 0 && (mask & ~(0xFULL << (k * 4)))) {
+			if (!unescape_bytes(out, &o, want, in, &i, i + 16, len)) {
+				*used = i;
+				return o;
+			}
+			continue;
+		}
+		if (k > want - o) {
+			k = want - o;
+		}
+		i += k;
+		o += k;
+		if (k == 16 || o == want) {
+			continue;
+		}
+		if (in[i] == ZB_FRAME_DELIMITER || !escape_pair(in, i, len)) {
+			*used = i;
+			return o;
+		}
+		out[o++] = in[i + 1] ^ 0x20;
+		i += 2;
+	}
+	return unescape_tail(out, o, want, in, i, len, used);
+}
+
+static const struct escape_impl impl_neon = {
+	ZB_ESCAPE_NEON, "neon",
+	escape_run_neon, clean_run_neon, escape_neon, unescape_neon
+};
+
+#endif /* ZB_ESCAPE_ARM_NEON */
+
+/*
+ * selection
+ */
+
+/* set on first use. several threads may race to set it, but they all set the same value. */
+static const struct escape_impl *impl;
+
+static const struct escape_impl *find_impl(int id) {
+	switch (id) {
+		case ZB_ESCAPE_SCALAR:
+			return &impl_scalar;
+#ifdef ZB_ESCAPE_X86
+		case ZB_ESCAPE_SSE2:
+			return __builtin_cpu_supports("sse2") ? &impl_sse2 : NULL;
+		case ZB_ESCAPE_AVX2:
+			return __builtin_cpu_supports("avx2") ? &impl_avx2 : NULL;
+#endif
+#ifdef ZB_ESCAPE_ARM_NEON
+		case ZB_ESCAPE_NEON:
+			return &impl_neon;
+#endif
+		default:
+			return NULL;
+	}
+}
+
+static const struct escape_impl *best_impl() {
+	static const int preferred[] = {ZB_ESCAPE_AVX2, ZB_ESCAPE_SSE2};
+	const struct escape_impl *found;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+		found = find_impl(preferred[i]);
+		if (found != NULL) {
+			return found;
+		}
+	}
+	return &impl_scalar;
+}
+
+static const struct escape_impl *get_impl() {
+	if (impl == NULL) {
+		impl = best_impl();
+	}
+	return impl;
+}
+
+int zb_escape_select(int id) {
+	const struct escape_impl *found;
+
+	found = id == ZB_ESCAPE_AUTO ? best_impl() : find_impl(id);
+	if (found == NULL) {
+		return -1;
+	}
+	impl = found;
+	return 0;
+}
+
+const char *zb_escape_name() {
+	return get_impl()->name;
+}
+
+int zb_escape_run(const unsigned char *buf, int len) {
+	return get_impl()->escape_run(buf, len);
+}
+
+int zb_clean_run(const unsigned char *buf, int len) {
+	return get_impl()->clean_run(buf, len);
+}
+
+int zb_escape(unsigned char *out, const unsigned char *in, int len) {
+	unsigned int sum = 0;
+
+	return get_impl()->escape(out, in, len, &sum);
+}
+
+int zb_escape_sum(unsigned char *out, const unsigned char *in, int len, unsigned char *sum) {
+	unsigned int s = 0;
+
+	len = get_impl()->escape(out, in, len, &s);
+	*sum += s;
+	return len;
+}
+
+int zb_unescape(unsigned char *out, int want, const unsigned char *in, int len, int *used) {
+	return get_impl()->unescape(out, want, in, len, used);
+}
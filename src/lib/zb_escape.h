@@ -0,0 +1,65 @@
+#ifndef __ZB_ESCAPE_H__
+#define __ZB_ESCAPE_H__
+/*
+ * zb_escape.h
+ *
+ * Escaping for API mode 2 (AP=2) framing, over whole buffers.
+ *
+ * In API mode 2 every byte of a frame after the delimiter that is 0x7E (delimiter),
+ * 0x7D (escape), 0x11 (XON) or 0x13 (XOFF) is sent as 0x7D followed by the byte
+ * XOR 0x20. A receiver therefore only has to look out for 0x7E and 0x7D.
+ *
+ * Runs of bytes that need no attention are scanned and copied a vector at a time.
+ * The implementation is chosen on first use: AVX2 or SSE2 where the CPU has them,
+ * plain C otherwise (e.g. on ARM and the STM32). NEON, on ARM targets built with it,
+ * is untested and must be asked for with zb_escape_select.
+ */
+
+#define ZB_FRAME_DELIMITER	0x7E
+#define ZB_FRAME_ESCAPE		0x7D
+#define ZB_FRAME_XON		0x11
+#define ZB_FRAME_XOFF		0x13
+
+#define ZB_NEEDS_ESCAPE(x) ((x) == ZB_FRAME_DELIMITER || (x) == ZB_FRAME_ESCAPE || (x) == ZB_FRAME_XON || (x) == ZB_FRAME_XOFF)
+
+/* zb_unescape may write this many bytes past what it returns. */
+#define ZB_UNESCAPE_SLACK 32
+
+/* implementations, for zb_escape_select */
+#define ZB_ESCAPE_AUTO		0
+#define ZB_ESCAPE_SCALAR	1
+#define ZB_ESCAPE_SSE2		2
+#define ZB_ESCAPE_AVX2		3
+#define ZB_ESCAPE_NEON		4
+
+/* length of the run at the start of buf (at most len) in which no byte needs escaping. */
+int zb_escape_run(const unsigned char *buf, int len);
+
+/* length of the run at the start of buf (at most len) with neither a delimiter nor an
+ * escape character, i.e. received data that can be taken as it is. */
+int zb_clean_run(const unsigned char *buf, int len);
+
+/* escapes len bytes from in into out, which must have room for 2 * len bytes.
+ * returns the number of bytes written. */
+int zb_escape(unsigned char *out, const unsigned char *in, int len);
+
+/* as zb_escape, and adds the len bytes of in to *sum on the way, for frame checksums. */
+int zb_escape_sum(unsigned char *out, const unsigned char *in, int len, unsigned char *sum);
+
+/*
+ * unescapes received bytes from in (len bytes) into out until it holds want bytes.
+ * stops early where in runs out, at a delimiter, or at an escape character that is not
+ * followed by an ordinary byte (the last byte of in, or a doubled escape). *used is set
+ * to the number of bytes taken from in. returns the number of bytes written to out,
+ * which must have room for want + ZB_UNESCAPE_SLACK bytes.
+ */
+int zb_unescape(unsigned char *out, int want, const unsigned char *in, int len, int *used);
+
+/* use a particular implementation from now on, e.g. to compare them.
+ * returns 0, or -1 if this CPU or build does not have it. */
+int zb_escape_select(int impl);
+
+/* name of the implementation in use */
+const char *zb_escape_name();
+
+#endif /* __ZB_ESCAPE_H__ */
@@ -0,0 +1,350 @@
+#include "zb_fragment.h"
+#include "diagnostics.h"
+#include <string.h>
+
+/*
+ * zb_fragment.c
+ *
+ * OP_FRAGMENT payload: to, message id, fragment number, fragment count, data. Every
+ * fragment but the last carries ZB_FRAG_DATA_MAX bytes, so the receiver knows where each
+ * one goes, and the last one gives the length of the message.
+ *
+ * OP_FRAGMENT_ACK payload: to, message id, and the mask of fragments held, big-endian.
+ *
+ * The receiver acknowledges a finished message, every half window of new fragments, and
+ * straight away when a fragment shows a gap or is a repeat, as then the sender is missing
+ * something. A finished message keeps its slot, so that repeats of its fragments are still
+ * acknowledged, until the slot is needed or it times out.
+ */
+
+#define RX_FREE		0
+#define RX_PARTIAL	1
+#define RX_DONE		2
+
+#define ACK_LEN 6
+
+#define BEFORE(a, b) ((long) ((a) - (b)) < 0)
+
+static uint32_t all_of(int count) {
+	return count == 32 ? 0xFFFFFFFFu : (1u << count) - 1;
+}
+
+/* to the device directly if its address is known, otherwise as zb_send_packet would. */
+static int send_to(zb_frag_t *f, char to, char op, unsigned char *data, unsigned char len) {
+	if (f->cache != NULL && zb_send_packet_unicast(f->t, f->cache, to, 0, op, data, len) == 0) {
+		return 0;
+	}
+	return zb_send_packet_with_id(f->t, 0, op, data, len);
+}
+
+static void send_ack(zb_frag_t *f, struct zb_frag_rx *r) {
+	unsigned char ack[ACK_LEN];
+
+	ack[0] = r->from;
+	ack[1] = r->msg_id;
+	ack[2] = r->have >> 24;
+	ack[3] = r->have >> 16;
+	ack[4] = r->have >> 8;
+	ack[5] = r->have;
+	send_to(f, r->from, OP_FRAGMENT_ACK, ack, ACK_LEN);
+	r->unacked = 0;
+}
+
+/* sends fragments of a message until the window is full. called with the lock held. */
+static void tx_pump(zb_frag_t *f, struct zb_frag_tx *s, unsigned long now) {
+	unsigned char buf[MAX_PACKET_SIZE];
+	uint32_t waiting;
+	int i, n, in_flight;
+
+	in_flight = 0;
+	for (waiting = s->sent; waiting != 0; waiting &= waiting - 1) {
+		in_flight++;
+	}
+
+	for (i = 0; i < s->count && in_flight < ZB_FRAG_WINDOW; i++) {
+		if ((s->sent | s->acked) & (1u << i)) {
+			continue;
+		}
+		n = i == s->count - 1 ? s->len - i * ZB_FRAG_DATA_MAX : ZB_FRAG_DATA_MAX;
+		buf[0] = s->to;
+		buf[1] = s->msg_id;
+		buf[2] = i;
+		buf[3] = s->count;
+		memcpy(buf + ZB_FRAG_HEADER_LEN, s->data + i * ZB_FRAG_DATA_MAX, n);
+		if (send_to(f, s->to, OP_FRAGMENT, buf, ZB_FRAG_HEADER_LEN + n) != 0) {
+			/* the transmit queue is full. try again on the next poll */
+			return;
+		}
+		if (s->tries[i]++ > 0) {
+			f->fragments_resent++;
+		}
+		f->fragments_sent++;
+		s->sent |= 1u << i;
+		s->sent_at[i] = now;
+		in_flight++;
+	}
+}
+
+void zb_frag_init(zb_frag_t *f, zb_transport_t *t, zb_addr_cache_t *cache, char device_id,
+		zb_frag_message_callback cb, void *arg) {
+	memset(f, 0, sizeof(*f));
+	ZB_LOCK_INIT(&f->lock);
+	f->t = t;
+	f->cache = cache;
+	f->device_id = device_id;
+	f->rto_ms = ZB_FRAG_RTO_MS;
+	f->message_cb = cb;
+	f->message_arg = arg;
+}
+
+int zb_frag_send(zb_frag_t *f, char to, const unsigned char *data, int len, zb_frag_done_callback cb, void *arg) {
+	struct zb_frag_tx *s;
+	int i;
+
+	if (len < 0 || len > ZB_FRAG_MESSAGE_MAX) {
+		DIAGNOSTICS("message of %d bytes is too large to send.\n", len);
+		return -1;
+	}
+
+	ZB_LOCK(&f->lock);
+	for (i = 0; i < ZB_FRAG_TX_SLOTS && f->tx[i].active; i++);
+	if (i == ZB_FRAG_TX_SLOTS) {
+		ZB_UNLOCK(&f->lock);
+		return -1;
+	}
+	s = &f->tx[i];
+	memset(s, 0, sizeof(*s));
+	s->active = 1;
+	s->to = to;
+	s->msg_id = f->next_msg_id++;
+	s->count = len == 0 ? 1 : (len + ZB_FRAG_DATA_MAX - 1) / ZB_FRAG_DATA_MAX;
+	s->data = data;
+	s->len = len;
+	s->cb = cb;
+	s->arg = arg;
+	tx_pump(f, s, zb_transport_millis());
+	ZB_UNLOCK(&f->lock);
+	return 0;
+}
+
+/* an acknowledgement for a message this endpoint is sending */
+static void handle_ack(zb_frag_t *f, char from, const unsigned char *data) {
+	struct zb_frag_tx *s;
+	zb_frag_done_callback cb;
+	unsigned long now;
+	uint32_t mask, lost;
+	void *arg;
+	int i, last;
+
+	mask = ((uint32_t) data[2] << 24) | ((uint32_t) data[3] << 16) | ((uint32_t) data[4] << 8) | data[5];
+	now = zb_transport_millis();
+
+	ZB_LOCK(&f->lock);
+	for (i = 0; i < ZB_FRAG_TX_SLOTS; i++) {
+		s = &f->tx[i];
+		if (s->active && s->to == from && s->msg_id == data[1]) {
+			break;
+		}
+	}
+	if (i == ZB_FRAG_TX_SLOTS) {
+		ZB_UNLOCK(&f->lock);
+		return;
+	}
+
+	s->acked |= mask & all_of(s->count);
+	s->sent &= ~s->acked;
+	if (s->acked == all_of(s->count)) {
+		cb = s->cb;
+		arg = s->arg;
+		s->active = 0;
+		ZB_UNLOCK(&f->lock);
+		if (cb != NULL) {
+			cb(arg, 0);
+		}
+		return;
+	}
+
+	/* fragments sent before the last one that got through are lost: resend them now */
+	for (last = s->count - 1; last >= 0 && !(mask & (1u << last)); last--);
+	if (last > 0) {
+		for (lost = s->sent & ((1u << last) - 1), i = 0; lost != 0; lost >>= 1, i++) {
+			if ((lost & 1) && !BEFORE(s->sent_at[last], s->sent_at[i])) {
+				s->sent &= ~(1u << i);
+			}
+		}
+	}
+	tx_pump(f, s, now);
+	ZB_UNLOCK(&f->lock);
+}
+
+/* a fragment of a message sent to this endpoint */
+static void handle_fragment(zb_frag_t *f, char from, const unsigned char *data, int len) {
+	struct zb_frag_rx *r, *slot;
+	uint8_t seq, count;
+	unsigned long now;
+	int i, n, complete;
+
+	seq = data[2];
+	count = data[3];
+	n = len - ZB_FRAG_HEADER_LEN;
+	if (count == 0 || count > ZB_FRAG_COUNT_MAX || seq >= count
+			|| (seq < count - 1 ? n != ZB_FRAG_DATA_MAX : n > ZB_FRAG_DATA_MAX)) {
+		DIAGNOSTICS("malformed fragment from %d.\n", from);
+		return;
+	}
+	now = zb_transport_millis();
+
+	ZB_LOCK(&f->lock);
+	slot = NULL;
+	for (i = 0; i < ZB_FRAG_RX_SLOTS; i++) {
+		r = &f->rx[i];
+		if (r->state != RX_FREE && r->from == from && r->msg_id == data[1]) {
+			break;
+		}
+		/* a free slot, or else the finished message heard from longest ago */
+		if (r->state == RX_FREE || (r->state == RX_DONE && (slot == NULL
+				|| (slot->state == RX_DONE && BEFORE(r->last, slot->last))))) {
+			slot = r;
+		}
+	}
+
+	if (i == ZB_FRAG_RX_SLOTS) {
+		if (slot == NULL) {
+			f->fragments_dropped++;
+			ZB_UNLOCK(&f->lock);
+			return;
+		}
+		r = slot;
+		r->state = RX_PARTIAL;
+		r->from = from;
+		r->msg_id = data[1];
+		r->count = count;
+		r->have = 0;
+		r->unacked = 0;
+		r->len = -1;
+	}
+
+	if (r->state == RX_DONE || (r->have & (1u << seq)) || r->count != count) {
+		/* a repeat: the sender has not heard the acknowledgement */
+		send_ack(f, r);
+		ZB_UNLOCK(&f->lock);
+		return;
+	}
+
+	memcpy(r->data + seq * ZB_FRAG_DATA_MAX, data + ZB_FRAG_HEADER_LEN, n);
+	if (seq == count - 1) {
+		r->len = seq * ZB_FRAG_DATA_MAX + n;
+	}
+	r->have |= 1u << seq;
+	r->unacked++;
+	r->last = now;
+
+	complete = r->have == all_of(count);
+	if (complete || r->unacked >= ZB_FRAG_WINDOW / 2 || (r->have & ((1u << seq) - 1)) != ((1u << seq) - 1)) {
+		send_ack(f, r);
+	}
+	if (!complete) {
+		ZB_UNLOCK(&f->lock);
+		return;
+	}
+	r->state = RX_DONE;
+	f->messages_received++;
+	ZB_UNLOCK(&f->lock);
+
+	/* only zb_frag_handle reuses a finished slot, so the data stays put during the call */
+	if (f->message_cb != NULL) {
+		f->message_cb(f->message_arg, from, r->data, r->len);
+	}
+}
+
+int zb_frag_handle(zb_frag_t *f, char op, char from, const unsigned char *data, int len) {
+	if (op == OP_FRAGMENT) {
+		if (len >= ZB_FRAG_HEADER_LEN && data[0] == f->device_id) {
+			handle_fragment(f, from, data, len);
+		}
+		return 1;
+	}
+	if (op == OP_FRAGMENT_ACK) {
+		if (len == ACK_LEN && data[0] == f->device_id) {
+			handle_ack(f, from, data);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+int zb_frag_poll(zb_frag_t *f, unsigned long now) {
+	zb_frag_done_callback failed_cb[ZB_FRAG_TX_SLOTS];
+	void *failed_arg[ZB_FRAG_TX_SLOTS];
+	struct zb_frag_tx *s;
+	struct zb_frag_rx *r;
+	unsigned long next, due;
+	int i, j, failed, pending;
+
+	failed = 0;
+	pending = 0;
+	next = now;
+
+	ZB_LOCK(&f->lock);
+	for (i = 0; i < ZB_FRAG_TX_SLOTS; i++) {
+		s = &f->tx[i];
+		if (!s->active) {
+			continue;
+		}
+		/* fragments that have waited too long are sent again, unless they have been too often */
+		for (j = 0; j < s->count; j++) {
+			if ((s->sent & (1u << j)) && !BEFORE(now, s->sent_at[j] + f->rto_ms)) {
+				s->sent &= ~(1u << j);
+				if (s->tries[j] > ZB_FRAG_RETRIES) {
+					break;
+				}
+			}
+		}
+		if (j < s->count) {
+			DIAGNOSTICS("giving up on message %d to %d.\n", s->msg_id, s->to);
+			failed_cb[failed] = s->cb;
+			failed_arg[failed++] = s->arg;
+			s->active = 0;
+			continue;
+		}
+		tx_pump(f, s, now);
+
+		for (j = 0; j < s->count; j++) {
+			due = s->sent_at[j] + f->rto_ms;
+			if ((s->sent & (1u << j)) && (pending++ == 0 || BEFORE(due, next))) {
+				next = due;
+			}
+		}
+		if (s->sent == 0 && (pending++ == 0 || BEFORE(now + 10, next))) {
+			/* nothing could be queued: try again shortly */
+			next = now + 10;
+		}
+	}
+
+	for (i = 0; i < ZB_FRAG_RX_SLOTS; i++) {
+		r = &f->rx[i];
+		if (r->state == RX_FREE) {
+			continue;
+		}
+		due = r->last + ZB_FRAG_RX_TIMEOUT_MS;
+		if (!BEFORE(now, due)) {
+			if (r->state == RX_PARTIAL) {
+				DIAGNOSTICS("dropping incomplete message %d from %d.\n", r->msg_id, r->from);
+			}
+			r->state = RX_FREE;
+		} else if (pending++ == 0 || BEFORE(due, next)) {
+			next = due;
+		}
+	}
+	ZB_UNLOCK(&f->lock);
+
+	for (i = 0; i < failed; i++) {
+		if (failed_cb[i] != NULL) {
+			failed_cb[i](failed_arg[i], -1);
+		}
+	}
+	if (pending == 0) {
+		return -1;
+	}
+	return BEFORE(next, now) ? 0 : (int) (next - now);
+}
@@ -0,0 +1,125 @@
+#ifndef __ZB_FRAGMENT_H__
+#define __ZB_FRAGMENT_H__
+/*
+ * zb_fragment.h
+ *
+ * Messages of up to ZB_FRAG_MESSAGE_MAX bytes, carried as a series of packets.
+ *
+ * zb_frag_send splits a message into fragments of up to ZB_FRAG_DATA_MAX bytes, each sent
+ * as an OP_FRAGMENT packet with its number, so that several can be in flight at once
+ * (ZB_FRAG_WINDOW). The receiver puts them back together in a fixed buffer, whatever order
+ * they arrive in, and answers with OP_FRAGMENT_ACK packets that list every fragment it
+ * holds. The sender resends only the fragments missing from that list: at once if a later
+ * one got through, otherwise when rto_ms has passed without them being acknowledged.
+ *
+ * A message has at most 32 fragments, so the list is a 32 bit mask and every acknowledgement
+ * is complete on its own. A lost one costs nothing but the wait for the next.
+ *
+ * Both ends use a zb_frag_t endpoint. Pass it every received packet with zb_frag_handle,
+ * which takes the OP_FRAGMENT and OP_FRAGMENT_ACK ones, and call zb_frag_poll regularly
+ * to resend and to drop messages that stopped arriving. Packets go to the device directly
+ * if its address is in the address cache (zb_addrcache.h), and are broadcast otherwise.
+ *
+ * Memory is fixed: ZB_FRAG_TX_SLOTS messages being sent, whose data stays with the caller
+ * until they complete, and ZB_FRAG_RX_SLOTS being received, each with a buffer of
+ * ZB_FRAG_MESSAGE_MAX bytes. Fragments of a further message are dropped until a slot frees
+ * up, and its sender then tries again.
+ *
+ * Sending and polling may happen on other threads than zb_frag_handle, but zb_frag_handle
+ * itself must only be called from one thread at a time. Completion and message callbacks
+ * may send again.
+ */
+
+#include "zb_packets.h"
+#include "zb_addrcache.h"
+#include "zb_lock.h"
+#include <stdint.h>
+
+/* to, message id, fragment number and fragment count come before the data */
+#define ZB_FRAG_HEADER_LEN 4
+#define ZB_FRAG_DATA_MAX (MAX_PACKET_SIZE - ZB_FRAG_HEADER_LEN)
+#define ZB_FRAG_COUNT_MAX 32
+#define ZB_FRAG_MESSAGE_MAX (ZB_FRAG_COUNT_MAX * ZB_FRAG_DATA_MAX)
+
+#define ZB_FRAG_WINDOW 8			/* fragments sent but not acknowledged, per message */
+#define ZB_FRAG_RETRIES 6			/* times a fragment is resent before the message fails */
+#define ZB_FRAG_RTO_MS 1000			/* default wait for an acknowledgement */
+#define ZB_FRAG_RX_TIMEOUT_MS 10000	/* a message with no new fragment for this long is dropped */
+
+#define ZB_FRAG_TX_SLOTS 2
+#define ZB_FRAG_RX_SLOTS 2
+
+/* called when a message sent has been acknowledged completely (status 0), or given up on (-1). */
+typedef void (*zb_frag_done_callback)(void *arg, int status);
+
+/* called with each message received. data is only valid during the call. */
+typedef void (*zb_frag_message_callback)(void *arg, char from, const unsigned char *data, int len);
+
+/* private */
+struct zb_frag_tx {
+	uint8_t active;
+	char to;
+	uint8_t msg_id;
+	uint8_t count;
+	const unsigned char *data;
+	int len;
+	uint32_t sent;					/* sent and waiting for an acknowledgement */
+	uint32_t acked;
+	unsigned long sent_at[ZB_FRAG_COUNT_MAX];
+	uint8_t tries[ZB_FRAG_COUNT_MAX];
+	zb_frag_done_callback cb;
+	void *arg;
+};
+
+/* private */
+struct zb_frag_rx {
+	uint8_t state;
+	char from;
+	uint8_t msg_id;
+	uint8_t count;
+	uint32_t have;
+	uint8_t unacked;				/* fragments received since the last acknowledgement */
+	int len;
+	unsigned long last;				/* when the last new fragment arrived */
+	unsigned char data[ZB_FRAG_MESSAGE_MAX];
+};
+
+/* the members are private, except for rto_ms and the counters. initialise with zb_frag_init. */
+typedef struct zb_frag {
+	zb_lock_t lock;
+	zb_transport_t *t;
+	zb_addr_cache_t *cache;
+	char device_id;
+	uint8_t next_msg_id;
+	int rto_ms;
+	zb_frag_message_callback message_cb;
+	void *message_arg;
+	struct zb_frag_tx tx[ZB_FRAG_TX_SLOTS];
+	struct zb_frag_rx rx[ZB_FRAG_RX_SLOTS];
+	unsigned long fragments_sent;
+	unsigned long fragments_resent;
+	unsigned long fragments_dropped;	/* received with no slot free */
+	unsigned long messages_received;
+} zb_frag_t;
+
+/*
+ * sets up an endpoint sending through t as application device device_id (see zb_set_device_id).
+ * cache may be NULL, then everything is broadcast. cb gets the messages received.
+ */
+void zb_frag_init(zb_frag_t *f, zb_transport_t *t, zb_addr_cache_t *cache, char device_id,
+		zb_frag_message_callback cb, void *arg);
+
+/*
+ * starts sending len bytes to device to. data must stay untouched until cb is called.
+ * returns 0, or -1 if the message is too large or every send slot is in use.
+ */
+int zb_frag_send(zb_frag_t *f, char to, const unsigned char *data, int len, zb_frag_done_callback cb, void *arg);
+
+/* takes a received packet if it belongs to this layer. returns 1 if it did, 0 otherwise. */
+int zb_frag_handle(zb_frag_t *f, char op, char from, const unsigned char *data, int len);
+
+/* sends and resends what is due by now (zb_transport_millis), and drops stalled messages.
+ * returns the milliseconds until it needs calling again, or -1 if nothing is going on. */
+int zb_frag_poll(zb_frag_t *f, unsigned long now);
+
+#endif /* __ZB_FRAGMENT_H__ */
@@ -0,0 +1,127 @@
+#include "zb_framepool.h"
+#include <stdlib.h>
+
+/*
+ * zb_framepool.c
+ *
+ * The free stack is a Treiber stack of frame indices. free_top holds the index of the
+ * first free frame in its low 16 bits (FREE_NONE if there is none), and a tag in the
+ * high 16 bits that is incremented by every push and pop. Each free frame holds the
+ * index of the next one in next_free.
+ *
+ * A pop reads next_free of a frame that another thread may have taken in the meantime.
+ * The compare-and-swap then fails, because the tag has moved on, and the value read is
+ * never used.
+ */
+
+#define FREE_NONE 0xFFFF
+#define TAG_STEP 0x10000
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#define LOAD_RELAXED(p)		atomic_load_explicit((p), memory_order_relaxed)
+#define LOAD_ACQUIRE(p)		atomic_load_explicit((p), memory_order_acquire)
+#define STORE_RELAXED(p, v)	atomic_store_explicit((p), (v), memory_order_relaxed)
+#define ADD_RELAXED(p, v)	atomic_fetch_add_explicit((p), (v), memory_order_relaxed)
+/* pop and push. the release on push publishes the frame's contents to the next owner */
+#define CAS_ACQUIRE(p, e, v)	atomic_compare_exchange_weak_explicit((p), (e), (v), memory_order_acquire, memory_order_acquire)
+#define CAS_RELEASE(p, e, v)	atomic_compare_exchange_weak_explicit((p), (e), (v), memory_order_release, memory_order_relaxed)
+
+/* drops a reference. returns 1 if it was the last one. */
+static inline int unref(struct zb_frame *f) {
+	/* a sole owner can skip the read-modify-write: nobody else can take a reference */
+	if (atomic_load_explicit(&f->refs, memory_order_acquire) == 1) {
+		return 1;
+	}
+	if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_release) != 1) {
+		return 0;
+	}
+	/* see every write other owners made before they let go */
+	atomic_thread_fence(memory_order_acquire);
+	return 1;
+}
+#else
+/* one core, and no frames are handled in interrupts: nothing can come in between */
+#define LOAD_RELAXED(p)		(*(p))
+#define LOAD_ACQUIRE(p)		(*(p))
+#define STORE_RELAXED(p, v)	(*(p) = (v))
+#define ADD_RELAXED(p, v)	(*(p) += (v))
+#define CAS_ACQUIRE(p, e, v)	(*(p) = (v), 1)
+#define CAS_RELEASE(p, e, v)	(*(p) = (v), 1)
+
+static inline int unref(struct zb_frame *f) {
+	return --f->refs == 0;
+}
+#endif
+
+static void push_free(zb_framepool_t *pool, struct zb_frame *f) {
+	unsigned int top, index = f - pool->frames;
+
+	top = LOAD_RELAXED(&pool->free_top);
+	do {
+		STORE_RELAXED(&f->next_free, top & FREE_NONE);
+	} while (!CAS_RELEASE(&pool->free_top, &top, ((top + TAG_STEP) & ~FREE_NONE) | index));
+}
+
+zb_framepool_t *zb_framepool_create(unsigned int count) {
+	zb_framepool_t *pool;
+	unsigned int i;
+
+	if (count == 0 || count > ZB_FRAMEPOOL_MAX) {
+		return NULL;
+	}
+
+	pool = malloc(sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->frames = malloc(count * sizeof(struct zb_frame));
+	if (pool->frames == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->count = count;
+	STORE_RELAXED(&pool->free_top, FREE_NONE);
+	STORE_RELAXED(&pool->exhausted, 0);
+
+	/* pushed in reverse, so that the first frames are handed out first */
+	for (i = count; i-- > 0; ) {
+		pool->frames[i].pool = pool;
+		STORE_RELAXED(&pool->frames[i].refs, 0);
+		push_free(pool, &pool->frames[i]);
+	}
+	return pool;
+}
+
+void zb_framepool_destroy(zb_framepool_t *pool) {
+	free(pool->frames);
+	free(pool);
+}
+
+struct zb_frame *zb_frame_alloc(zb_framepool_t *pool) {
+	struct zb_frame *f;
+	unsigned int top, index;
+
+	top = LOAD_ACQUIRE(&pool->free_top);
+	do {
+		index = top & FREE_NONE;
+		if (index == FREE_NONE) {
+			ADD_RELAXED(&pool->exhausted, 1);
+			return NULL;
+		}
+		f = &pool->frames[index];
+	} while (!CAS_ACQUIRE(&pool->free_top, &top, ((top + TAG_STEP) & ~FREE_NONE) | LOAD_RELAXED(&f->next_free)));
+
+	STORE_RELAXED(&f->refs, 1);
+	return f;
+}
+
+void zb_frame_ref(struct zb_frame *f) {
+	/* the caller already holds a reference, so the count cannot drop to 0 meanwhile */
+	ADD_RELAXED(&f->refs, 1);
+}
+
+void zb_frame_release(struct zb_frame *f) {
+	if (unref(f)) {
+		push_free(f->pool, f);
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef __ZB_FRAMEPOOL_H__
+#define __ZB_FRAMEPOOL_H__
+/*
+ * zb_framepool.h
+ *
+ * Fixed-size pool of reference counted receive frame buffers.
+ *
+ * A parser with a pool attached (zb_parser_set_pool) decodes each frame straight into a
+ * buffer from the pool, and zb_parse_frames hands it over as a struct zb_frame: the op
+ * code, the sender, the source address, and a pointer to the payload inside the buffer.
+ * The receiver owns one reference. It can queue the frame to other threads, take more
+ * references with zb_frame_ref, and gives each one back with zb_frame_release. The last
+ * release returns the buffer to the pool.
+ *
+ * All buffers are allocated when the pool is created, so receiving never calls malloc.
+ * The free buffers form a lock-free stack. Its top index carries a tag that changes on
+ * every push and pop, so that a compare-and-swap notices a buffer that was taken and given
+ * back in between (the ABA problem). Frames can be released from any thread.
+ *
+ * As in zb_ring.h, compilers without C11 atomics (Keil MDK for the Cortex-M targets) get
+ * plain variables. There, frames must only be taken and released outside of interrupts.
+ */
+
+#include <stdint.h>
+
+#if defined(__CC_ARM) && !defined(inline)
+#define inline __inline
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_uint zb_framepool_word_t;
+#else
+typedef volatile unsigned int zb_framepool_word_t;
+#endif
+
+/* room for an unescaped receive frame, from the api id to the checksum, plus the slack
+ * zb_unescape needs: 14 + MAX_PACKET_SIZE + 1 + ZB_UNESCAPE_SLACK. checked in zb_packets_api.c */
+#define ZB_FRAME_RAW_SIZE 120
+
+/* at most this many buffers per pool, as indices are 16 bit */
+#define ZB_FRAMEPOOL_MAX 65535
+
+struct zb_framepool;
+
+/* a received frame. the first part is the view filled in by the parser, read only. */
+struct zb_frame {
+	char op;
+	char from;
+	unsigned char len;
+	const unsigned char *data;		/* len bytes of payload, inside raw */
+	uint64_t source64;				/* 64 bit address of the sending radio */
+	uint16_t source16;				/* and its 16 bit network address */
+
+	/* private */
+	struct zb_framepool *pool;
+	zb_framepool_word_t refs;
+	zb_framepool_word_t next_free;
+	unsigned char raw[ZB_FRAME_RAW_SIZE];
+};
+
+typedef struct zb_framepool {
+	struct zb_frame *frames;
+	unsigned int count;
+	zb_framepool_word_t free_top;	/* tag << 16 | index of the first free frame */
+	zb_framepool_word_t exhausted;	/* zb_frame_alloc calls that found no free frame */
+} zb_framepool_t;
+
+/* allocates a pool of count frames. returns NULL on failure. */
+zb_framepool_t *zb_framepool_create(unsigned int count);
+
+/* frees the pool. every frame must have been released. */
+void zb_framepool_destroy(zb_framepool_t *pool);
+
+/* takes a free frame with one reference, or returns NULL if all are in use. */
+struct zb_frame *zb_frame_alloc(zb_framepool_t *pool);
+
+/* takes another reference, e.g. to hand the frame to a second consumer. */
+void zb_frame_ref(struct zb_frame *f);
+
+/* gives back one reference. the last one returns the frame to its pool. */
+void zb_frame_release(struct zb_frame *f);
+
+#endif /* __ZB_FRAMEPOOL_H__ */
@@ -0,0 +1,76 @@
+#include "zb_io.h"
+#include "zb_packets.h"
+#include <stddef.h>
+
+/*
+ * zb_io.c
+ *
+ * The pins are set before IR and IC, so that the first sample already holds every input.
+ * Commands to the local radio go out with frame id 0, so the radio sends no responses to
+ * them; nothing is lost between it and the UART. Those to a remote radio go through a
+ * zb_remote_t job, which matches each response and resends what was lost on the way.
+ */
+
+/* pin settings for ATD0 to ATD3 */
+#define PIN_ADC 2
+#define PIN_DIGITAL_IN 3
+
+/* takes one command of a configuration. returns 0, or -1 if it could not. */
+typedef int (*io_command)(void *arg, char cmd[2], char *data, int len);
+
+/* hands the commands of configuration c to command, in order. returns 0, or -1 if the
+ * configuration is invalid or a command failed. */
+static int io_commands(const struct zb_io_config *c, io_command command, void *arg) {
+	char cmd[2], pin, value[2];
+	int i, failed = 0;
+
+	if ((c->analog_mask | c->digital_mask) >> ZB_IO_ANALOG_CHANNELS || (c->analog_mask & c->digital_mask)
+			|| (c->interval_ms != 0 && c->interval_ms < ZB_IO_INTERVAL_MIN_MS)) {
+		return -1;
+	}
+
+	for (i = 0; i < ZB_IO_ANALOG_CHANNELS; i++) {
+		if (!((c->analog_mask | c->digital_mask) & (1 << i))) {
+			continue;
+		}
+		cmd[0] = 'D';
+		cmd[1] = '0' + i;
+		pin = c->analog_mask & (1 << i) ? PIN_ADC : PIN_DIGITAL_IN;
+		failed |= command(arg, cmd, &pin, 1);
+	}
+
+	/* 16 bit values, big-endian */
+	value[0] = c->change_mask >> 8;
+	value[1] = c->change_mask & 0xff;
+	failed |= command(arg, "IC", value, 2);
+	value[0] = c->interval_ms >> 8;
+	value[1] = c->interval_ms & 0xff;
+	failed |= command(arg, "IR", value, 2);
+	return failed ? -1 : 0;
+}
+
+static int local_command(void *arg, char cmd[2], char *data, int len) {
+	return zb_send_command_with_id(arg, 0, cmd, data, len);
+}
+
+static int remote_command(void *arg, char cmd[2], char *data, int len) {
+	return zb_remote_add_command(arg, cmd, data, len);
+}
+
+int zb_io_configure(zb_transport_t *t, const struct zb_io_config *c) {
+	if (io_commands(c, local_command, t) != 0) {
+		return -1;
+	}
+	return zb_send_command_with_id(t, 0, "AC", NULL, 0);
+}
+
+int zb_io_configure_remote(zb_remote_t *r, const struct zb_io_config *c) {
+	return io_commands(c, remote_command, r);
+}
+
+int zb_io_analog(const struct zb_io_sample *s, int channel) {
+	if (channel < 0 || channel > 7 || !(s->analog_mask & (1 << channel))) {
+		return -1;
+	}
+	return s->analog[channel];
+}
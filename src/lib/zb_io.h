@@ -0,0 +1,63 @@
+#ifndef __ZB_IO_H__
+#define __ZB_IO_H__
+/*
+ * zb_io.h
+ *
+ * Samples taken by the radio itself, for sensors that need no microcontroller.
+ *
+ * A sensor with a microcontroller is polled: the master asks, the sensor reads its ADC,
+ * and sends the reading back. An XBee can instead sample up to four analog inputs
+ * (D0 to D3, 10 bits, 1023 = 1.2 V) and digital inputs on its own, and push each set of
+ * samples to the coordinator in an IO data sample frame (0x92):
+ *
+ *   - every IR milliseconds, and
+ *   - whenever one of the digital inputs in the IC mask changes.
+ *
+ * This needs no request and no round trip, and a radio samples at up to 20 Hz.
+ *
+ * zb_io_configure sets up the pins, IR and IC of the local radio. zb_io_configure_remote adds
+ * the same commands to a zb_remote_t job, which sends them as remote AT commands (0x17) to the
+ * radios of other nodes, even those with nothing else attached; its callback reports the
+ * nodes that did not take them. Pins in neither mask are left as they are. The settings are
+ * applied with ATAC, by zb_io_configure or by the job's final pass with ZB_REMOTE_APPLY, but
+ * not written to the radio's flash; send ATWR, or add ZB_REMOTE_WRITE, for that.
+ *
+ * The parser decodes the samples into a struct zb_io_sample (zb_api.h).
+ */
+
+#include "zb_transport.h"
+#include "zb_api.h"
+#include "zb_remote.h"
+#include <stdint.h>
+
+/* D0 to D3 can sample analog inputs */
+#define ZB_IO_ANALOG_CHANNELS 4
+
+/* the shortest sample interval the radios accept */
+#define ZB_IO_INTERVAL_MIN_MS 50
+
+/* what a radio samples, and when */
+struct zb_io_config {
+	uint8_t analog_mask;		/* bit n: Dn is an analog input, n < ZB_IO_ANALOG_CHANNELS */
+	uint8_t digital_mask;		/* bit n: Dn is a digital input, n < ZB_IO_ANALOG_CHANNELS */
+	uint16_t change_mask;		/* IC: bit n: a change on DIOn sends a sample at once */
+	uint16_t interval_ms;		/* IR: 0 for no periodic samples */
+};
+
+/*
+ * configures the local radio to sample as given. returns 0 if every command was queued, or
+ * -1 if the configuration is invalid or the transmit queue is full.
+ */
+int zb_io_configure(zb_transport_t *t, const struct zb_io_config *c);
+
+/*
+ * adds the commands for sampling as given to job r. add the nodes, and start it with
+ * ZB_REMOTE_APPLY. returns 0, or -1 if the configuration is invalid or the job cannot take
+ * the commands (see zb_remote_add_command).
+ */
+int zb_io_configure_remote(zb_remote_t *r, const struct zb_io_config *c);
+
+/* the sample of analog input channel, or -1 if it was not sampled. */
+int zb_io_analog(const struct zb_io_sample *s, int channel);
+
+#endif /* __ZB_IO_H__ */
@@ -0,0 +1,38 @@
+#ifndef __ZB_LOCK_H__
+#define __ZB_LOCK_H__
+/*
+ * zb_lock.h
+ *
+ * The lock of the library's shared tables: pending requests, the address and route caches,
+ * the node registry, fragment endpoints and remote configuration jobs. Each is held only
+ * to copy or update a few entries, never across a callback, a send or anything else that
+ * may block, so a spin lock on an atomic_flag is cheaper than a mutex.
+ *
+ * Only Keil MDK, which builds for the single-core Cortex-M targets, gets no locking. There
+ * is only one core, so it is enough that the tables are not used from interrupts. Every
+ * other build locks: with C11 atomics where the language has them, otherwise with the
+ * GCC and Clang __atomic builtins, e.g. for -std=gnu99. A compiler with neither is an error
+ * rather than a build that silently shares the tables between threads unlocked.
+ */
+
+#if defined(__CC_ARM) || defined(__ARMCC_VERSION)
+typedef volatile int zb_lock_t;
+#define ZB_LOCK(l)
+#define ZB_UNLOCK(l)
+#define ZB_LOCK_INIT(l)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_flag zb_lock_t;
+#define ZB_LOCK(l)		while (atomic_flag_test_and_set_explicit((l), memory_order_acquire)) {}
+#define ZB_UNLOCK(l)	atomic_flag_clear_explicit((l), memory_order_release)
+#define ZB_LOCK_INIT(l)	atomic_flag_clear(l)
+#elif defined(__GNUC__)
+typedef volatile unsigned char zb_lock_t;
+#define ZB_LOCK(l)		while (__atomic_test_and_set((l), __ATOMIC_ACQUIRE)) {}
+#define ZB_UNLOCK(l)	__atomic_clear((l), __ATOMIC_RELEASE)
+#define ZB_LOCK_INIT(l)	__atomic_clear((l), __ATOMIC_RELAXED)
+#else
+#error "zb_lock.h: no atomic test-and-set for this compiler"
+#endif
+
+#endif /* __ZB_LOCK_H__ */
@@ -0,0 +1,1033 @@
+#define _GNU_SOURCE
+#include "zb_loopback.h"
+#include "zb_ring.h"
+#include "zb_escape.h"
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "diagnostics.h"
+
+/*
+ * zb_loopback.c
+ *
+ * Hub thread for a simulated XBee network, see zb_loopback.h.
+ *
+ * The hub polls its end of every node's connection. Bytes from a node go through a
+ * small API frame decoder; complete frames are answered or forwarded by encoding the
+ * resulting frames, escaped as with AP=2, into the destination nodes' output rings.
+ * Output rings are written out whenever a node's connection is writable. Any frame the
+ * hub sends in response is at most four times as long as the frame that caused it, so
+ * the hub never reads more than a quarter of the space left in the fullest output ring,
+ * less what frames it has partly decoded may still produce, and less room for one answer
+ * to ND, which is many frames long: a node that does not read fast enough holds
+ * up everybody's transmissions rather than losing frames, and benchmarks can rely on
+ * every frame arriving.
+ *
+ * With the air simulated (zb_loopback_air), transmit requests are not forwarded at once
+ * but queued on the channel, where the hub runs each one through backoffs, clear channel
+ * assessments and its time on the air as events of a simulated clock. Queued
+ * transmissions count towards the frames partly decoded, and reading stops while the
+ * queue is nearly full.
+ *
+ * Only the hub thread touches node state after a node has been added.
+ */
+
+#define LB_OUT_SIZE		8192	/* per node output ring. must be a power of two */
+#define LB_FRAME_MAX	512		/* largest frame body accepted from a node */
+#define LB_CHUNK		16		/* bytes moved per poll when emulating a baud rate */
+#define LB_READ_MIN		64		/* smallest read worth waking up for */
+#define LB_ND_RESERVE	(ZB_LOOPBACK_MAX_NODES * 2 * 48)	/* escaped ND responses for every node */
+#define LB_RR_RESERVE	(ZB_LOOPBACK_MAX_NODES * 2 * 18)	/* escaped route records from every node */
+
+#define LB_AIR_QUEUE		64			/* transmissions waiting for the channel or on the air */
+#define LB_AIR_OVERHEAD		31			/* PHY, MAC, network and APS framing around the RF data, in bytes */
+#define LB_TX_FRAME_MIN		18			/* shortest transmit request on the wire */
+#define LB_BACKOFF_NS		320000ULL	/* one backoff period of 20 symbols */
+#define LB_CCA_NS			320000ULL	/* a transmission is sensed by others this long after it starts */
+#define LB_ACK_WAIT_NS		864000ULL	/* a unicast sender waits this long for the MAC acknowledgement */
+#define LB_MIN_BE			3			/* backoff exponents: a backoff is up to 2^BE - 1 periods */
+#define LB_MAX_BE			5
+#define LB_MAX_BACKOFFS		4			/* busy channel assessments before giving up, less one */
+#define LB_MAX_RETRIES		3			/* MAC retries of a unicast */
+
+#define API_DELIMITER	0x7E
+#define API_ESCAPE		0x7D
+
+#define API_ATCOMMAND		0x08
+#define API_TRANSMITREQUEST	0x10
+#define API_REMOTEATCOMMAND	0x17
+#define API_CREATESOURCEROUTE	0x21
+#define API_ATRESPONSE		0x88
+#define API_TRANSMITSTATUS	0x8B
+#define API_RECEIVEPACKET	0x90
+#define API_IOSAMPLE		0x92
+#define API_REMOTEATRESPONSE	0x97
+#define API_ROUTERECORD		0xA1
+
+#define ADDR64_BROADCAST	0xFFFFULL
+#define ADDR16_UNKNOWN		0xFFFE
+#define DELIVERY_OK					0x00
+#define DELIVERY_MAC_ACK_FAILURE	0x01
+#define DELIVERY_CCA_FAILURE		0x02
+#define DELIVERY_ADDRESS_NOT_FOUND	0x24
+#define AT_OK				0x00
+#define AT_TX_FAILURE		0x04
+
+#define PIN_ADC				2
+
+enum lb_decode_state {LB_WAITING, LB_LENGTH_MSB, LB_LENGTH_LSB, LB_BODY, LB_CHECKSUM};
+
+struct lb_node {
+	int fd;						/* hub end, -1 once the node has gone away */
+	int index;
+	unsigned long long addr64;
+	unsigned short addr16;
+	char name[32];
+	char ni[21];				/* node identifier, set with ATNI */
+	int many_to_one;			/* ATAR set to other than 0xFF: others send it route records */
+	int recorded;				/* sent a route record since the last many-to-one request */
+
+	/* IO sampling: D0 to D3, IR and IC, and when the next periodic sample is due */
+	unsigned char pins[4];
+	unsigned short ir_ms, ic_mask;
+	unsigned long long sample_ns;
+	unsigned short adc;			/* the simulated analog inputs, a slow sawtooth */
+
+	zb_ring_t out;
+	unsigned char out_elements[LB_OUT_SIZE];
+
+	/* frame decoder */
+	enum lb_decode_state state;
+	int escaped;
+	unsigned int len, have;
+	unsigned char checksum;
+	unsigned char frame[LB_FRAME_MAX];
+
+	/* baud emulation: when the line in each direction is next free */
+	unsigned long long rx_free_ns, tx_free_ns;
+};
+
+/* a transmission on the simulated channel */
+struct lb_air {
+	int used;
+	int on_air;					/* 0: assesses the channel at due, 1: on the air until due */
+	int collided;
+	struct lb_node *from;
+	unsigned long long start, due;
+	int be, backoffs, retries;
+	unsigned int len;
+	unsigned char frame[LB_FRAME_MAX];
+};
+
+struct zb_loopback {
+	int kind;
+	unsigned long long byte_ns;	/* 0 = no rate emulation */
+
+	pthread_mutex_t lock;		/* protects count while nodes are added, and the air settings and counters */
+	struct lb_node *nodes[ZB_LOOPBACK_MAX_NODES];
+	int count;
+
+	/* simulated channel. air_byte_ns is the hub's copy of air_setting */
+	unsigned long long air_setting, air_byte_ns;	/* 0 = transmissions arrive at once */
+	unsigned int seed;
+	unsigned long collisions, failures;
+	struct lb_air air[LB_AIR_QUEUE];
+
+	pthread_t hub;
+	int wake_fd;
+	volatile int stopping;
+};
+
+static void *lb_hub(void *arg);
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+zb_loopback_t *zb_loopback_create(int kind, unsigned long baud) {
+	zb_loopback_t *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		return NULL;
+	}
+	l->kind = kind;
+	l->byte_ns = baud ? 10000000000ULL / baud : 0;
+	pthread_mutex_init(&l->lock, NULL);
+
+	l->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (l->wake_fd < 0) {
+		printf("[CRITICAL] could not create loopback network\n");
+		free(l);
+		return NULL;
+	}
+
+	if (pthread_create(&l->hub, NULL, lb_hub, l) != 0) {
+		printf("[CRITICAL] could not start loopback hub\n");
+		close(l->wake_fd);
+		free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+/* create a connected pair of descriptors. fds[0] is the hub end, fds[1] the node end. */
+static int lb_connect(int kind, int fds[2]) {
+	struct termios tc;
+
+	if (kind == ZB_LOOPBACK_SOCKETPAIR) {
+		return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	}
+
+	fds[0] = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fds[0] < 0) {
+		return -1;
+	}
+	if (grantpt(fds[0]) < 0 || unlockpt(fds[0]) < 0
+			|| (fds[1] = open(ptsname(fds[0]), O_RDWR | O_NOCTTY)) < 0) {
+		close(fds[0]);
+		return -1;
+	}
+
+	/* no line discipline processing, as on a UART talking to a radio */
+	tcgetattr(fds[1], &tc);
+	cfmakeraw(&tc);
+	tcsetattr(fds[1], TCSANOW, &tc);
+	return 0;
+}
+
+zb_transport_t *zb_loopback_open(zb_loopback_t *l, const struct zb_transport_config *cfg) {
+	struct zb_transport_config c = *cfg;
+	struct lb_node *node;
+	int fds[2];
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL) {
+		return NULL;
+	}
+
+	if (lb_connect(l->kind, fds) < 0) {
+		printf("[CRITICAL] could not connect loopback node\n");
+		free(node);
+		return NULL;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	node->fd = fds[0];
+	zb_ring_init(&node->out, node->out_elements, LB_OUT_SIZE);
+
+	pthread_mutex_lock(&l->lock);
+	if (l->count == ZB_LOOPBACK_MAX_NODES) {
+		pthread_mutex_unlock(&l->lock);
+		printf("[CRITICAL] loopback network is full\n");
+		close(fds[0]);
+		close(fds[1]);
+		free(node);
+		return NULL;
+	}
+	node->index = l->count;
+	node->addr64 = node->index ? ZB_LOOPBACK_ADDR64_BASE + node->index : 0;
+	node->addr16 = node->index;
+	snprintf(node->name, sizeof(node->name), "loopback node %d", node->index);
+	strcpy(node->ni, " ");
+	l->nodes[l->count++] = node;
+	pthread_mutex_unlock(&l->lock);
+
+	eventfd_write(l->wake_fd, 1);
+
+	c.path = node->name;
+	c.fd = fds[1];
+	return zb_transport_open(&c);
+}
+
+void zb_loopback_air(zb_loopback_t *l, unsigned long bps, unsigned int seed) {
+	pthread_mutex_lock(&l->lock);
+	l->air_setting = bps ? 8000000000ULL / bps : 0;
+	l->seed = seed;
+	l->collisions = 0;
+	l->failures = 0;
+	pthread_mutex_unlock(&l->lock);
+
+	eventfd_write(l->wake_fd, 1);
+}
+
+void zb_loopback_air_stats(zb_loopback_t *l, unsigned long *collisions, unsigned long *failures) {
+	pthread_mutex_lock(&l->lock);
+	*collisions = l->collisions;
+	*failures = l->failures;
+	pthread_mutex_unlock(&l->lock);
+}
+
+void zb_loopback_destroy(zb_loopback_t *l) {
+	int i;
+
+	l->stopping = 1;
+	eventfd_write(l->wake_fd, 1);
+	pthread_join(l->hub, NULL);
+
+	for (i = 0; i < l->count; i++) {
+		if (l->nodes[i]->fd >= 0) {
+			close(l->nodes[i]->fd);
+		}
+		free(l->nodes[i]);
+	}
+	close(l->wake_fd);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+}
+
+/* escape and queue an API frame for a node. lb_hub only reads as much as guarantees the space. */
+static void lb_emit(struct lb_node *node, const unsigned char *body, unsigned int len) {
+	unsigned char frame[2 * (LB_FRAME_MAX + 3) + 1];
+	unsigned char hdr[2], sum;
+	unsigned int n;
+
+	if (node->fd < 0) {
+		return;
+	}
+
+	hdr[0] = len >> 8;
+	hdr[1] = len & 0xff;
+
+	sum = 0;
+	n = 0;
+	frame[n++] = API_DELIMITER;
+	n += zb_escape(frame + n, hdr, 2);
+	n += zb_escape_sum(frame + n, body, len, &sum);
+	sum = 0xFF - sum;
+	n += zb_escape(frame + n, &sum, 1);
+
+	zb_ring_write(&node->out, frame, n);
+}
+
+static void lb_put64(unsigned char *p, unsigned long long v) {
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static unsigned long long lb_get64(const unsigned char *p) {
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/* answer ND with a description of every other node, then an empty response to end it. */
+static void lb_discover(zb_loopback_t *l, int count, struct lb_node *node, unsigned char frame_id) {
+	unsigned char r[64];
+	unsigned int n, k;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct lb_node *other = l->nodes[i];
+		if (other == node || other->fd < 0) {
+			continue;
+		}
+		n = 0;
+		r[n++] = API_ATRESPONSE;
+		r[n++] = frame_id;
+		r[n++] = 'N';
+		r[n++] = 'D';
+		r[n++] = 0x00;
+		r[n++] = other->addr16 >> 8;
+		r[n++] = other->addr16 & 0xff;
+		lb_put64(r + n, other->addr64);
+		n += 8;
+		k = strlen(other->ni) + 1;
+		memcpy(r + n, other->ni, k);
+		n += k;
+		r[n++] = 0xFF;	/* parent: none */
+		r[n++] = 0xFE;
+		r[n++] = other->index ? 1 : 0;	/* router, or coordinator */
+		r[n++] = 0x00;	/* status */
+		r[n++] = 0xC1;	/* profile */
+		r[n++] = 0x05;
+		r[n++] = 0x10;	/* manufacturer */
+		r[n++] = 0x1E;
+		lb_emit(node, r, n);
+	}
+
+	r[0] = API_ATRESPONSE;
+	r[1] = frame_id;
+	r[2] = 'N';
+	r[3] = 'D';
+	r[4] = 0x00;
+	lb_emit(node, r, 5);
+}
+
+static unsigned int lb_put16(unsigned char *p, unsigned short v) {
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+	return 2;
+}
+
+/*
+ * apply AT command cmd with the plen bytes of param to node, or read it if plen is 0, and
+ * write what is read back to out. returns its length. SH, SL, MY, NI, D0 to D3, IR and IC
+ * are read back; NI, AR, D0 to D3, IR and IC can be set. everything else is acknowledged.
+ */
+static unsigned int lb_parameter(zb_loopback_t *l, int count, struct lb_node *node,
+		const unsigned char *cmd, const unsigned char *param, unsigned int plen, unsigned char *out) {
+	unsigned long v;
+	unsigned int n = 0;
+	int i;
+
+	if (cmd[0] == 'N' && cmd[1] == 'I') {
+		if (plen > 0) {
+			n = plen < sizeof(node->ni) - 1 ? plen : sizeof(node->ni) - 1;
+			memcpy(node->ni, param, n);
+			node->ni[n] = '\0';
+			return 0;
+		}
+		memcpy(out, node->ni, strlen(node->ni));
+		return strlen(node->ni);
+	}
+	if (cmd[0] == 'A' && cmd[1] == 'R' && plen == 1) {
+		/* a many-to-one route request goes out now, and every other node records its route again */
+		node->many_to_one = param[0] != 0xFF;
+		for (i = 0; i < count; i++) {
+			l->nodes[i]->recorded = 0;
+		}
+		return 0;
+	}
+	if (cmd[0] == 'D' && cmd[1] >= '0' && cmd[1] <= '3') {
+		if (plen == 1) {
+			node->pins[cmd[1] - '0'] = param[0];
+			return 0;
+		}
+		out[0] = node->pins[cmd[1] - '0'];
+		return 1;
+	}
+	if (cmd[0] == 'I' && (cmd[1] == 'R' || cmd[1] == 'C')) {
+		v = plen >= 2 ? (param[0] << 8) | param[1] : plen == 1 ? param[0] : 0;
+		if (plen > 0 && cmd[1] == 'R') {
+			node->ir_ms = v;
+			node->sample_ns = now_ns() + v * 1000000ULL;
+		} else if (plen > 0) {
+			node->ic_mask = v;
+		}
+		return plen > 0 ? 0 : lb_put16(out, cmd[1] == 'R' ? node->ir_ms : node->ic_mask);
+	}
+	if (plen == 0 && cmd[0] == 'S' && (cmd[1] == 'H' || cmd[1] == 'L')) {
+		v = cmd[1] == 'H' ? node->addr64 >> 32 : node->addr64 & 0xffffffffUL;
+		out[0] = v >> 24;
+		out[1] = v >> 16;
+		out[2] = v >> 8;
+		out[3] = v;
+		return 4;
+	}
+	if (plen == 0 && cmd[0] == 'M' && cmd[1] == 'Y') {
+		return lb_put16(out, node->addr16);
+	}
+	return 0;
+}
+
+/* answer an AT command, as lb_parameter does. ND lists the other nodes. */
+static void lb_at_command(zb_loopback_t *l, int count, struct lb_node *node,
+		const unsigned char *f, unsigned int len) {
+	unsigned char r[32];
+	unsigned int n;
+
+	if (len < 4) {
+		return;
+	}
+	if (f[2] == 'N' && f[3] == 'D') {
+		if (f[1] != 0) {
+			lb_discover(l, count, node, f[1]);
+		}
+		return;
+	}
+
+	n = lb_parameter(l, count, node, f + 2, f + 4, len - 4, r + 5);
+	if (f[1] == 0) {
+		return;
+	}
+	r[0] = API_ATRESPONSE;
+	r[1] = f[1];
+	r[2] = f[2];
+	r[3] = f[3];
+	r[4] = AT_OK;
+	lb_emit(node, r, 5 + n);
+}
+
+/* answer a remote AT command on the node it is addressed to, which every node can reach.
+ * it reaches none if no node has its 64 bit address. */
+static void lb_remote_at_command(zb_loopback_t *l, int count, struct lb_node *node,
+		const unsigned char *f, unsigned int len) {
+	unsigned char r[48];
+	unsigned long long dest;
+	struct lb_node *to = NULL;
+	unsigned int n;
+	int i;
+
+	if (len < 15) {
+		return;
+	}
+	dest = lb_get64(f + 2);
+	for (i = 0; i < count; i++) {
+		if (l->nodes[i] != node && l->nodes[i]->fd >= 0 && l->nodes[i]->addr64 == dest) {
+			to = l->nodes[i];
+		}
+	}
+
+	n = 0;
+	r[n++] = API_REMOTEATRESPONSE;
+	r[n++] = f[1];
+	lb_put64(r + n, dest);
+	n += 8;
+	n += lb_put16(r + n, to != NULL ? to->addr16 : ADDR16_UNKNOWN);
+	r[n++] = f[13];
+	r[n++] = f[14];
+	r[n++] = to != NULL ? AT_OK : AT_TX_FAILURE;
+	if (to != NULL) {
+		n += lb_parameter(l, count, to, f + 13, f + 15, len - 15, r + n);
+	}
+	if (f[1] != 0) {
+		lb_emit(node, r, n);
+	}
+}
+
+/* report the outcome of transmit request f to its sender, if it asked for it. */
+static void lb_status(struct lb_node *from, const unsigned char *f, unsigned short dest16,
+		int retries, unsigned char status) {
+	unsigned char r[7];
+
+	if (f[1] == 0) {
+		return;
+	}
+	r[0] = API_TRANSMITSTATUS;
+	r[1] = f[1];
+	r[2] = dest16 >> 8;
+	r[3] = dest16 & 0xff;
+	r[4] = retries;
+	r[5] = status;
+	r[6] = 0;	/* discovery status */
+	lb_emit(from, r, 7);
+}
+
+/* every node hears every other, so a route record lists no hops. it is sent once after
+ * each many-to-one route request, with the first packet to the node that sent the request. */
+static void lb_route_record(struct lb_node *to, struct lb_node *from) {
+	unsigned char r[13];
+
+	r[0] = API_ROUTERECORD;
+	lb_put64(r + 1, from->addr64);
+	r[9] = from->addr16 >> 8;
+	r[10] = from->addr16 & 0xff;
+	r[11] = 0x01;	/* acknowledged */
+	r[12] = 0;		/* hops */
+	lb_emit(to, r, 13);
+	from->recorded = 1;
+}
+
+/* deliver a transmit request as a receive packet, and report the outcome to the sender. */
+static void lb_transmit(zb_loopback_t *l, int count, struct lb_node *from,
+		const unsigned char *f, unsigned int len, int retries) {
+	unsigned char r[LB_FRAME_MAX];
+	unsigned long long dest;
+	unsigned short dest16 = ADDR16_UNKNOWN;
+	unsigned char status = DELIVERY_ADDRESS_NOT_FOUND;
+	unsigned int n;
+	int i;
+
+	if (len < 14 || len - 14 + 12 > LB_FRAME_MAX) {
+		return;
+	}
+	dest = lb_get64(f + 2);
+
+	r[0] = API_RECEIVEPACKET;
+	lb_put64(r + 1, from->addr64);
+	r[9] = from->addr16 >> 8;
+	r[10] = from->addr16 & 0xff;
+	r[11] = dest == ADDR64_BROADCAST ? 0x02 : 0x01;
+	memcpy(r + 12, f + 14, len - 14);
+	n = 12 + len - 14;
+
+	for (i = 0; i < count; i++) {
+		struct lb_node *to = l->nodes[i];
+		if (to == from || to->fd < 0) {
+			continue;
+		}
+		if (dest == ADDR64_BROADCAST || to->addr64 == dest) {
+			if (to->many_to_one && !from->recorded && dest != ADDR64_BROADCAST) {
+				lb_route_record(to, from);
+			}
+			lb_emit(to, r, n);
+			status = DELIVERY_OK;
+			if (dest != ADDR64_BROADCAST) {
+				dest16 = to->addr16;
+				break;
+			}
+		}
+	}
+	if (dest == ADDR64_BROADCAST) {
+		status = DELIVERY_OK;
+	}
+
+	lb_status(from, f, dest16, retries, status);
+}
+
+/* a random backoff of up to 2^be - 1 periods */
+static unsigned long long lb_backoff(zb_loopback_t *l, int be) {
+	return (unsigned long long) (rand_r(&l->seed) % (1u << be)) * LB_BACKOFF_NS;
+}
+
+/* put a transmit request on the channel, after an initial backoff. */
+static void lb_air_queue(zb_loopback_t *l, struct lb_node *node, const unsigned char *f, unsigned int len) {
+	struct lb_air *e = NULL;
+	int i;
+
+	if (len < 14) {
+		return;
+	}
+	for (i = 0; i < LB_AIR_QUEUE && e == NULL; i++) {
+		if (!l->air[i].used) {
+			e = &l->air[i];
+		}
+	}
+	if (e == NULL) {
+		DIAGNOSTICS("%s: channel queue full, dropping transmission.\n", node->name);
+		lb_status(node, f, ADDR16_UNKNOWN, 0, DELIVERY_CCA_FAILURE);
+		return;
+	}
+
+	e->used = 1;
+	e->on_air = 0;
+	e->collided = 0;
+	e->from = node;
+	e->be = LB_MIN_BE;
+	e->backoffs = 0;
+	e->retries = 0;
+	e->len = len;
+	memcpy(e->frame, f, len);
+	e->due = now_ns() + lb_backoff(l, e->be);
+}
+
+/* a transmission failed for good. */
+static void lb_air_fail(zb_loopback_t *l, struct lb_air *e, unsigned char status) {
+	pthread_mutex_lock(&l->lock);
+	l->failures++;
+	pthread_mutex_unlock(&l->lock);
+
+	lb_status(e->from, e->frame, ADDR16_UNKNOWN, e->retries, status);
+	e->used = 0;
+}
+
+/* clear channel assessment at the end of a backoff: start sending, or back off again. */
+static void lb_air_assess(zb_loopback_t *l, struct lb_air *e) {
+	unsigned long long t = e->due;
+	int busy = 0, overlap = 0, i;
+	struct lb_air *o;
+
+	for (i = 0; i < LB_AIR_QUEUE; i++) {
+		o = &l->air[i];
+		if (o == e || !o->used || !o->on_air || o->due <= t) {
+			continue;
+		}
+		if (o->start + LB_CCA_NS <= t) {
+			busy = 1;
+		} else {
+			overlap = 1;
+		}
+	}
+
+	if (busy) {
+		if (++e->backoffs > LB_MAX_BACKOFFS) {
+			lb_air_fail(l, e, DELIVERY_CCA_FAILURE);
+			return;
+		}
+		if (e->be < LB_MAX_BE) {
+			e->be++;
+		}
+		e->due = t + lb_backoff(l, e->be);
+		return;
+	}
+
+	e->on_air = 1;
+	e->start = t;
+	e->due = t + (e->len - 14 + LB_AIR_OVERHEAD) * l->air_byte_ns;
+	if (!overlap) {
+		return;
+	}
+
+	/* too late to notice the others, which did not notice this one either */
+	for (i = 0; i < LB_AIR_QUEUE; i++) {
+		o = &l->air[i];
+		if (o->used && o->on_air && o->due > t) {
+			o->collided = 1;
+		}
+	}
+	pthread_mutex_lock(&l->lock);
+	l->collisions++;
+	pthread_mutex_unlock(&l->lock);
+}
+
+/* a transmission has left the air: deliver it, or retry it if it collided. */
+static void lb_air_end(zb_loopback_t *l, int count, struct lb_air *e) {
+	if (!e->collided) {
+		lb_transmit(l, count, e->from, e->frame, e->len, e->retries);
+		e->used = 0;
+		return;
+	}
+
+	/* broadcasts are not acknowledged, so the sender never learns of the loss */
+	if (lb_get64(e->frame + 2) == ADDR64_BROADCAST) {
+		pthread_mutex_lock(&l->lock);
+		l->failures++;
+		pthread_mutex_unlock(&l->lock);
+		lb_status(e->from, e->frame, ADDR16_UNKNOWN, 0, DELIVERY_OK);
+		e->used = 0;
+		return;
+	}
+
+	if (e->retries == LB_MAX_RETRIES) {
+		lb_air_fail(l, e, DELIVERY_MAC_ACK_FAILURE);
+		return;
+	}
+	e->retries++;
+	e->on_air = 0;
+	e->collided = 0;
+	e->be = LB_MIN_BE;
+	e->backoffs = 0;
+	e->due += LB_ACK_WAIT_NS + lb_backoff(l, e->be);
+}
+
+/* run the channel up to now: every assessment and transmission due by then, in order. */
+static void lb_air_run(zb_loopback_t *l, int count, unsigned long long now) {
+	struct lb_air *e;
+	int i;
+
+	while (1) {
+		e = NULL;
+		for (i = 0; i < LB_AIR_QUEUE; i++) {
+			if (l->air[i].used && l->air[i].due <= now && (e == NULL || l->air[i].due < e->due)) {
+				e = &l->air[i];
+			}
+		}
+		if (e == NULL) {
+			return;
+		}
+		if (e->on_air) {
+			lb_air_end(l, count, e);
+		} else {
+			lb_air_assess(l, e);
+		}
+	}
+}
+
+static void lb_frame(zb_loopback_t *l, int count, struct lb_node *node) {
+	switch (node->frame[0]) {
+		case API_ATCOMMAND:
+			lb_at_command(l, count, node, node->frame, node->len);
+			break;
+		case API_TRANSMITREQUEST:
+			if (l->air_byte_ns) {
+				lb_air_queue(l, node, node->frame, node->len);
+			} else {
+				lb_transmit(l, count, node, node->frame, node->len, 0);
+			}
+			break;
+		case API_REMOTEATCOMMAND:
+			lb_remote_at_command(l, count, node, node->frame, node->len);
+			break;
+		case API_CREATESOURCEROUTE:
+			/* the next transmission reaches its destination directly anyway */
+			break;
+		default:
+			DIAGNOSTICS("%s: ignoring API frame type %02x.\n", node->name, node->frame[0]);
+			break;
+	}
+}
+
+/* run received bytes through the node's frame decoder. */
+static void lb_decode(zb_loopback_t *l, int count, struct lb_node *node,
+		const unsigned char *buf, int len) {
+	unsigned char c;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c == API_DELIMITER) {
+			node->state = LB_LENGTH_MSB;
+			node->escaped = 0;
+			continue;
+		}
+		if (c == API_ESCAPE) {
+			node->escaped = 1;
+			continue;
+		}
+		if (node->escaped) {
+			c ^= 0x20;
+			node->escaped = 0;
+		}
+
+		switch (node->state) {
+			case LB_WAITING:
+				break;
+			case LB_LENGTH_MSB:
+				node->len = c << 8;
+				node->state = LB_LENGTH_LSB;
+				break;
+			case LB_LENGTH_LSB:
+				node->len |= c;
+				node->have = 0;
+				node->checksum = 0;
+				node->state = (node->len == 0 || node->len > LB_FRAME_MAX) ? LB_WAITING : LB_BODY;
+				break;
+			case LB_BODY:
+				node->frame[node->have++] = c;
+				node->checksum += c;
+				if (node->have == node->len) {
+					node->state = LB_CHECKSUM;
+				}
+				break;
+			case LB_CHECKSUM:
+				node->state = LB_WAITING;
+				if ((unsigned char) (node->checksum + c) == 0xFF) {
+					lb_frame(l, count, node);
+				} else {
+					DIAGNOSTICS("%s: dropping frame with bad checksum.\n", node->name);
+				}
+				break;
+		}
+	}
+}
+
+/* the node's end was closed. */
+static void lb_hangup(struct lb_node *node) {
+	close(node->fd);
+	node->fd = -1;
+}
+
+/* read and decode at most limit bytes from a node. returns the number read. */
+static unsigned int lb_receive(zb_loopback_t *l, int count, struct lb_node *node,
+		unsigned int limit, unsigned long long now) {
+	unsigned char buf[4096];
+	int n;
+
+	if (limit > sizeof(buf)) {
+		limit = sizeof(buf);
+	}
+	if (l->byte_ns && limit > LB_CHUNK) {
+		limit = LB_CHUNK;
+	}
+
+	n = read(node->fd, buf, limit);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	if (n <= 0) {
+		lb_hangup(node);
+		return 0;
+	}
+
+	if (l->byte_ns) {
+		node->rx_free_ns = (node->rx_free_ns > now ? node->rx_free_ns : now) + n * l->byte_ns;
+	}
+	lb_decode(l, count, node, buf, n);
+	return n;
+}
+
+static void lb_transmit_out(zb_loopback_t *l, struct lb_node *node, unsigned long long now) {
+	unsigned char *p;
+	unsigned int run;
+	int n;
+
+	run = zb_ring_read_space(&node->out, &p);
+	if (l->byte_ns && run > LB_CHUNK) {
+		run = LB_CHUNK;
+	}
+
+	n = write(node->fd, p, run);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			lb_hangup(node);
+		}
+		return;
+	}
+
+	zb_ring_consume(&node->out, n);
+	if (l->byte_ns) {
+		node->tx_free_ns = (node->tx_free_ns > now ? node->tx_free_ns : now) + n * l->byte_ns;
+	}
+}
+
+/* lower *timeout to the time until t, if that is in the future. returns 1 if t has passed. */
+static int lb_due(unsigned long long t, unsigned long long now, unsigned long long *timeout) {
+	if (t <= now) {
+		return 1;
+	}
+	if (t - now < *timeout) {
+		*timeout = t - now;
+	}
+	return 0;
+}
+
+/*
+ * send the IO samples that are due to the coordinator, as radios with IR set do, and lower
+ * *timeout to when the next is. the analog inputs of a node rise slowly and wrap around.
+ * a sample is dropped if the coordinator's output ring is half full, as the hub's limit on
+ * reading leaves no room for frames it did not read.
+ */
+static void lb_sample(zb_loopback_t *l, int count, unsigned long long now, unsigned long long *timeout) {
+	struct lb_node *node, *coordinator = l->nodes[0];
+	unsigned char r[16 + 2 * 4];
+	unsigned int n, mask;
+	int i, k;
+
+	for (i = 1; i < count; i++) {
+		node = l->nodes[i];
+		mask = 0;
+		for (k = 0; k < 4; k++) {
+			mask |= node->pins[k] == PIN_ADC ? 1 << k : 0;
+		}
+		if (node->fd < 0 || node->ir_ms == 0 || mask == 0 || !lb_due(node->sample_ns, now, timeout)) {
+			continue;
+		}
+		node->sample_ns += node->ir_ms * 1000000ULL;
+		if (node->sample_ns <= now) {
+			node->sample_ns = now + node->ir_ms * 1000000ULL;
+		}
+		lb_due(node->sample_ns, now, timeout);
+		node->adc = (node->adc + 8) & 0x3ff;
+		if (coordinator->fd < 0 || zb_ring_count(&coordinator->out) > LB_OUT_SIZE / 2) {
+			continue;
+		}
+
+		n = 0;
+		r[n++] = API_IOSAMPLE;
+		lb_put64(r + n, node->addr64);
+		n += 8;
+		n += lb_put16(r + n, node->addr16);
+		r[n++] = 0x01;	/* acknowledged */
+		r[n++] = 1;		/* sample sets */
+		n += lb_put16(r + n, 0);
+		r[n++] = mask;
+		for (k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				n += lb_put16(r + n, (node->adc + 64 * k) & 0x3ff);
+			}
+		}
+		lb_emit(coordinator, r, n);
+	}
+}
+
+static void *lb_hub(void *arg) {
+	zb_loopback_t *l = arg;
+	struct pollfd p[ZB_LOOPBACK_MAX_NODES + 1];
+	struct lb_node *node;
+	struct timespec ts;
+	unsigned long long now, timeout;
+	eventfd_t v;
+	unsigned int space, limit, pending, air_free;
+	int count, first = 0, i, k;
+
+	while (!l->stopping) {
+		pthread_mutex_lock(&l->lock);
+		count = l->count;
+		l->air_byte_ns = l->air_setting;
+		pthread_mutex_unlock(&l->lock);
+
+		now = now_ns();
+		timeout = ~0ULL;
+		lb_sample(l, count, now, &timeout);
+
+		/* every frame read may be forwarded to any node, so the fullest output ring limits reading */
+		limit = LB_OUT_SIZE;
+		pending = 0;
+		for (i = 0; i < count; i++) {
+			node = l->nodes[i];
+			space = zb_ring_size(&node->out) - zb_ring_count(&node->out);
+			if (node->fd >= 0 && space < limit) {
+				limit = space;
+			}
+			if (node->state != LB_WAITING) {
+				pending += 4 * (node->have + 4);
+			}
+		}
+		pending += LB_ND_RESERVE + LB_RR_RESERVE;
+		air_free = 0;
+		for (i = 0; i < LB_AIR_QUEUE; i++) {
+			if (l->air[i].used) {
+				pending += 4 * (l->air[i].len + 4);
+			} else {
+				air_free++;
+			}
+		}
+		limit = limit > pending ? (limit - pending) / 4 : 0;
+
+		/* a read finishes at most one frame more than it holds whole */
+		if (l->air_byte_ns && limit > (air_free > 0 ? air_free - 1 : 0) * LB_TX_FRAME_MIN) {
+			limit = (air_free > 0 ? air_free - 1 : 0) * LB_TX_FRAME_MIN;
+		}
+
+		now = now_ns();
+		for (i = 0; i < LB_AIR_QUEUE; i++) {
+			if (l->air[i].used && lb_due(l->air[i].due, now, &timeout)) {
+				timeout = 0;
+			}
+		}
+		for (i = 0; i < count; i++) {
+			node = l->nodes[i];
+			p[i].fd = node->fd;
+			p[i].events = 0;
+			p[i].revents = 0;
+			if (limit >= LB_READ_MIN && (!l->byte_ns || lb_due(node->rx_free_ns, now, &timeout))) {
+				p[i].events |= POLLIN;
+			}
+			if (!zb_ring_is_empty(&node->out)
+					&& (!l->byte_ns || lb_due(node->tx_free_ns, now, &timeout))) {
+				p[i].events |= POLLOUT;
+			}
+		}
+		p[count].fd = l->wake_fd;
+		p[count].events = POLLIN;
+
+		ts.tv_sec = timeout / 1000000000ULL;
+		ts.tv_nsec = timeout % 1000000000ULL;
+		if (ppoll(p, count + 1, timeout == ~0ULL ? NULL : &ts, NULL) < 0) {
+			continue;
+		}
+
+		if (p[count].revents & POLLIN) {
+			eventfd_read(l->wake_fd, &v);
+		}
+
+		/* start with a different node every time, so that all get a share of limit */
+		now = now_ns();
+		first++;
+		for (k = 0; k < count; k++) {
+			i = (first + k) % count;
+			node = l->nodes[i];
+			if (node->fd >= 0 && limit > 0 && (p[i].events & POLLIN) && (p[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				limit -= lb_receive(l, count, node, limit, now);
+			}
+			if (node->fd >= 0 && (p[i].revents & POLLOUT)) {
+				lb_transmit_out(l, node, now);
+			}
+		}
+		lb_air_run(l, count, now_ns());
+	}
+
+	return NULL;
+}
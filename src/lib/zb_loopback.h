@@ -0,0 +1,69 @@
+#ifndef __ZB_LOOPBACK_H__
+#define __ZB_LOOPBACK_H__
+/*
+ * zb_loopback.h
+ *
+ * Simulated XBee network for running the stack without radios (Linux only).
+ *
+ * Every transport opened on a loopback network is connected through a pty or a
+ * socketpair to a hub thread, which plays the part of that node's radio and of the
+ * air between them: it decodes the API frames each node writes, answers AT commands
+ * (0x08 -> 0x88), with ND listing the other nodes by the identifiers they set with ATNI,
+ * and turns transmit requests (0x10) into receive packets (0x90) at
+ * the destination node, or at all other nodes for a broadcast, followed by a
+ * transmit status (0x8B) if a frame id was given.
+ *
+ * Every node is in range of every other. After a node sets ATAR, each other node sends it
+ * one route record (0xA1), with no hops, ahead of its next packet to it; create source
+ * route frames (0x21) are accepted and have no effect.
+ *
+ * Remote AT commands (0x17) are answered at once by the node addressed (0x97), without
+ * going over the simulated air. A node whose D0 to D3 include analog inputs (2) and whose
+ * IR is set sends the coordinator an IO sample (0x92) every IR milliseconds. Its inputs
+ * read as a slow sawtooth. IC is kept, but no digital input ever changes.
+ *
+ * The first node opened is the coordinator (64 bit address 0, network address 0).
+ * Others get the 64 bit address ZB_LOOPBACK_ADDR64_BASE + n and network address n.
+ *
+ * With a non-zero baud rate, the hub only moves bytes between itself and each node
+ * as fast as a UART at that rate would (10 bits per byte), in both directions.
+ * Without, data moves as fast as the kernel copies it.
+ *
+ * Transmissions normally reach their destinations as soon as the hub has read them.
+ * zb_loopback_air adds a shared channel instead: each one waits a random backoff, checks
+ * that the channel is clear, and then occupies it for as long as its bytes take at the
+ * given bit rate, as 802.15.4 CSMA-CA does. A transmission started before another could be
+ * sensed collides with it; a collided unicast is retried up to three times before its
+ * transmit status reports a MAC ACK failure, and a collided broadcast is lost. A node that
+ * finds the channel busy five times gives up with a CCA failure. This makes the cost of
+ * many nodes transmitting at once visible in benchmarks.
+ */
+
+#include "zb_transport.h"
+
+#define ZB_LOOPBACK_PTY			0	/* nodes see a pty, so line settings and tcdrain work as on a tty */
+#define ZB_LOOPBACK_SOCKETPAIR	1	/* nodes see a unix stream socket */
+
+#define ZB_LOOPBACK_MAX_NODES 16
+#define ZB_LOOPBACK_ADDR64_BASE 0x0013A20040000000ULL
+
+typedef struct zb_loopback zb_loopback_t;
+
+/* start an empty network with the hub thread. baud = 0 disables rate emulation. NULL on failure. */
+zb_loopback_t *zb_loopback_create(int kind, unsigned long baud);
+
+/* add a node and open a transport on it. cfg->path and cfg->fd are replaced, everything
+ * else (flags, buffers, callbacks) is used as given. NULL on failure or if the network is full. */
+zb_transport_t *zb_loopback_open(zb_loopback_t *l, const struct zb_transport_config *cfg);
+
+/* simulate a shared channel of bps bits per second (250000 for 2.4 GHz radios), with
+ * random backoffs drawn from seed. 0 switches it off again. call before opening nodes. */
+void zb_loopback_air(zb_loopback_t *l, unsigned long bps, unsigned int seed);
+
+/* transmissions that collided, and those that failed for good, since zb_loopback_air. */
+void zb_loopback_air_stats(zb_loopback_t *l, unsigned long *collisions, unsigned long *failures);
+
+/* stop the hub thread and free the network. close the nodes' transports first. */
+void zb_loopback_destroy(zb_loopback_t *l);
+
+#endif /* __ZB_LOOPBACK_H__ */
@@ -0,0 +1,300 @@
+#include "zb_nodes.h"
+#include <string.h>
+
+/*
+ * zb_nodes.c
+ *
+ * The nodes sit in a plain array. Two hash tables of array indices, probed linearly as in
+ * zb_addrcache.c, find them by 64 bit address and by node identifier. The tables are twice
+ * the size of the array, so probing never runs far and never finds a table full.
+ *
+ * Node identifiers need not be unique. The identifier table points at the node that last
+ * claimed an identifier, or at another one holding it once that node goes or is renamed.
+ */
+
+#define MASK (ZB_NODES_INDEX_SIZE - 1)
+
+/* wrapping millisecond times, as returned by zb_transport_millis */
+#define BEFORE(a, b) ((long) ((a) - (b)) < 0)
+
+static unsigned int addr_home(uint64_t addr64) {
+	uint32_t x = (uint32_t) addr64 ^ (uint32_t) (addr64 >> 32);
+
+	return (x * 0x9E3779B1u) >> 26 & MASK;
+}
+
+/* FNV-1a */
+static unsigned int ni_home(const char *ni, int len) {
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (uint8_t) ni[i]) * 16777619u;
+	}
+	return h & MASK;
+}
+
+/* the table slot pointing at the node with this address, or -1. called with the lock held. */
+static int find_addr(zb_nodes_t *r, uint64_t addr64) {
+	unsigned int slot;
+
+	for (slot = addr_home(addr64); r->by_addr[slot]; slot = (slot + 1) & MASK) {
+		if (r->nodes[r->by_addr[slot] - 1].addr64 == addr64) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* the table slot pointing at a node with this identifier, or -1. */
+static int find_ni(zb_nodes_t *r, const char *ni, int len) {
+	struct zb_node *n;
+	unsigned int slot;
+
+	for (slot = ni_home(ni, len); r->by_ni[slot]; slot = (slot + 1) & MASK) {
+		n = &r->nodes[r->by_ni[slot] - 1];
+		if (n->ni_len == len && memcmp(n->ni, ni, len) == 0) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* the home slot of the node a table slot points at */
+static unsigned int home_of(zb_nodes_t *r, uint8_t *table, unsigned int slot) {
+	struct zb_node *n = &r->nodes[table[slot] - 1];
+
+	return table == r->by_addr ? addr_home(n->addr64) : ni_home(n->ni, n->ni_len);
+}
+
+/* empties a table slot, and moves back the later entries of its run that would otherwise
+ * no longer be reached from their home slot. */
+static void unlink_slot(zb_nodes_t *r, uint8_t *table, unsigned int hole) {
+	unsigned int slot, h;
+
+	table[hole] = 0;
+	for (slot = (hole + 1) & MASK; table[slot]; slot = (slot + 1) & MASK) {
+		h = home_of(r, table, slot);
+		if (((slot - h) & MASK) >= ((slot - hole) & MASK)) {
+			table[hole] = table[slot];
+			table[slot] = 0;
+			hole = slot;
+		}
+	}
+}
+
+/* points the identifier table at node i, unless another node holds its identifier; that
+ * entry is then taken over. */
+static void link_ni(zb_nodes_t *r, int i) {
+	struct zb_node *n = &r->nodes[i];
+	int slot;
+	unsigned int s;
+
+	slot = find_ni(r, n->ni, n->ni_len);
+	if (slot >= 0) {
+		r->by_ni[slot] = i + 1;
+		return;
+	}
+	for (s = ni_home(n->ni, n->ni_len); r->by_ni[s]; s = (s + 1) & MASK) {
+	}
+	r->by_ni[s] = i + 1;
+}
+
+/* drops node i from the identifier table, if it is the one the table points at, and points
+ * it at another node with the same identifier, if there is one. */
+static void unlink_ni(zb_nodes_t *r, int i) {
+	struct zb_node *n = &r->nodes[i];
+	int slot, j;
+
+	slot = find_ni(r, n->ni, n->ni_len);
+	if (slot < 0 || r->by_ni[slot] != i + 1) {
+		return;
+	}
+	for (j = 0; j < ZB_NODES_MAX; j++) {
+		if (j != i && r->nodes[j].used && r->nodes[j].ni_len == n->ni_len
+				&& memcmp(r->nodes[j].ni, n->ni, n->ni_len) == 0) {
+			r->by_ni[slot] = j + 1;
+			return;
+		}
+	}
+	unlink_slot(r, r->by_ni, slot);
+}
+
+void zb_nodes_init(zb_nodes_t *r, zb_nodes_callback cb, void *arg) {
+	memset(r, 0, sizeof(*r));
+	ZB_LOCK_INIT(&r->lock);
+	r->cb = cb;
+	r->arg = arg;
+}
+
+int zb_nodes_update(zb_nodes_t *r, const struct zb_node_info *info, unsigned long now) {
+	struct zb_node *n, copy;
+	int slot, i, ni_len, event;
+	unsigned int s;
+
+	ni_len = info->ni_len > ZB_NODES_NI_MAX ? ZB_NODES_NI_MAX : info->ni_len;
+
+	ZB_LOCK(&r->lock);
+	slot = find_addr(r, info->addr64);
+	if (slot >= 0) {
+		i = r->by_addr[slot] - 1;
+		n = &r->nodes[i];
+		event = ZB_NODES_SEEN;
+		if (n->ni_len != ni_len || memcmp(n->ni, info->ni, ni_len) != 0) {
+			unlink_ni(r, i);
+			event = ZB_NODES_CHANGED;
+		} else if (n->addr16 != info->addr16 || n->parent16 != info->parent16
+				|| n->device_type != info->device_type) {
+			event = ZB_NODES_CHANGED;
+		}
+	} else {
+		for (i = 0; i < ZB_NODES_MAX && r->nodes[i].used; i++) {
+		}
+		if (i == ZB_NODES_MAX) {
+			r->full++;
+			ZB_UNLOCK(&r->lock);
+			return -1;
+		}
+		n = &r->nodes[i];
+		n->used = 1;
+		n->addr64 = info->addr64;
+		for (s = addr_home(info->addr64); r->by_addr[s]; s = (s + 1) & MASK) {
+		}
+		r->by_addr[s] = i + 1;
+		r->count++;
+		event = ZB_NODES_NEW;
+	}
+
+	n->addr16 = info->addr16;
+	n->parent16 = info->parent16;
+	n->device_type = info->device_type;
+	n->seen = now;
+	if (event != ZB_NODES_SEEN) {
+		memcpy(n->ni, info->ni, ni_len);
+		n->ni[ni_len] = '\0';
+		n->ni_len = ni_len;
+		link_ni(r, i);
+	}
+	copy = *n;
+	ZB_UNLOCK(&r->lock);
+
+	if (event != ZB_NODES_SEEN && r->cb != NULL) {
+		r->cb(r->arg, &copy, event);
+	}
+	return event;
+}
+
+int zb_nodes_handle(zb_nodes_t *r, const struct zb_api_frame *frame, unsigned long now) {
+	const struct zb_at_response *at;
+	struct zb_node_info info;
+	unsigned long started;
+	int end_of_round;
+
+	switch (frame->api_id) {
+		case ZB_API_NODE_ID:
+			ZB_LOCK(&r->lock);
+			r->joined++;
+			ZB_UNLOCK(&r->lock);
+			zb_nodes_update(r, &frame->u.node_id.node, now);
+			return 1;
+		case ZB_API_AT_RESPONSE:
+			at = &frame->u.at;
+			if (at->command[0] != 'N' || at->command[1] != 'D') {
+				return 0;
+			}
+			if (at->status == ZB_AT_OK && at->len > 0) {
+				if (zb_api_decode_node(at->data, at->len, &info) == 0) {
+					ZB_LOCK(&r->lock);
+					r->discovered++;
+					ZB_UNLOCK(&r->lock);
+					zb_nodes_update(r, &info, now);
+				}
+				return 1;
+			}
+
+			/* the round is over */
+			ZB_LOCK(&r->lock);
+			end_of_round = r->discovering;
+			started = r->discovery_started;
+			r->discovering = 0;
+			ZB_UNLOCK(&r->lock);
+			if (end_of_round) {
+				zb_nodes_prune(r, started);
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void zb_nodes_begin_discovery(zb_nodes_t *r, unsigned long now) {
+	ZB_LOCK(&r->lock);
+	r->discovering = 1;
+	r->discovery_started = now;
+	ZB_UNLOCK(&r->lock);
+}
+
+int zb_nodes_prune(zb_nodes_t *r, unsigned long since) {
+	struct zb_node gone[ZB_NODES_MAX];
+	struct zb_node *n;
+	int i, count = 0;
+
+	ZB_LOCK(&r->lock);
+	for (i = 0; i < ZB_NODES_MAX; i++) {
+		n = &r->nodes[i];
+		if (!n->used || !BEFORE(n->seen, since)) {
+			continue;
+		}
+		unlink_ni(r, i);
+		unlink_slot(r, r->by_addr, find_addr(r, n->addr64));
+		n->used = 0;
+		r->count--;
+		r->removed++;
+		gone[count++] = *n;
+	}
+	ZB_UNLOCK(&r->lock);
+
+	if (r->cb != NULL) {
+		for (i = 0; i < count; i++) {
+			r->cb(r->arg, &gone[i], ZB_NODES_GONE);
+		}
+	}
+	return count;
+}
+
+int zb_nodes_find(zb_nodes_t *r, uint64_t addr64, struct zb_node *node) {
+	int slot;
+
+	ZB_LOCK(&r->lock);
+	slot = find_addr(r, addr64);
+	if (slot >= 0) {
+		*node = r->nodes[r->by_addr[slot] - 1];
+	}
+	ZB_UNLOCK(&r->lock);
+	return slot >= 0 ? 0 : -1;
+}
+
+int zb_nodes_find_ni(zb_nodes_t *r, const char *ni, int ni_len, struct zb_node *node) {
+	int slot;
+
+	ZB_LOCK(&r->lock);
+	slot = find_ni(r, ni, ni_len);
+	if (slot >= 0) {
+		*node = r->nodes[r->by_ni[slot] - 1];
+	}
+	ZB_UNLOCK(&r->lock);
+	return slot >= 0 ? 0 : -1;
+}
+
+int zb_nodes_list(zb_nodes_t *r, struct zb_node *out, int max) {
+	int i, n = 0;
+
+	ZB_LOCK(&r->lock);
+	for (i = 0; i < ZB_NODES_MAX && n < max; i++) {
+		if (r->nodes[i].used) {
+			out[n++] = r->nodes[i];
+		}
+	}
+	ZB_UNLOCK(&r->lock);
+	return n;
+}
@@ -0,0 +1,109 @@
+#ifndef __ZB_NODES_H__
+#define __ZB_NODES_H__
+/*
+ * zb_nodes.h
+ *
+ * A registry of the radios on the network, as found by node discovery.
+ *
+ * ATND makes the local radio ask the whole network to identify itself. Each node that
+ * answers comes back as one AT response (0x88) describing it: its 16 and 64 bit addresses,
+ * its node identifier (NI), its parent and its device type. After the discovery timeout
+ * (NT), a last ND response with no data ends the round. A node that joins later, or
+ * whose commissioning button is pressed, announces itself with a node identification
+ * indicator (0x95) carrying the same description.
+ *
+ * Pass every decoded API frame to zb_nodes_handle, which takes ND responses and node
+ * identification indicators and adds or updates the node they describe. Nodes can then
+ * be looked up by 64 bit address or by node identifier, and be sent to at once with the
+ * 16 bit address given, without the radio discovering it first. A callback hears of
+ * every node that is new, changed its addresses or identifier, or went away.
+ *
+ * Call zb_nodes_begin_discovery just before sending ATND. When the round ends, the nodes
+ * that neither answered it nor announced themselves since it started are removed. Nothing
+ * else removes nodes, so without discovery rounds the registry only grows.
+ *
+ * Memory is fixed: ZB_NODES_MAX nodes, each indexed in two open addressed hash tables.
+ * A further node is dropped and counted in full.
+ *
+ * Any thread may look nodes up while the parser's thread adds them. The callback may call
+ * back into the registry.
+ */
+
+#include "zb_api.h"
+#include "zb_lock.h"
+#include <stdint.h>
+
+#define ZB_NODES_MAX 32
+#define ZB_NODES_NI_MAX 20			/* the longest node identifier the radios accept */
+
+/* the index tables: a power of two, at least twice ZB_NODES_MAX */
+#define ZB_NODES_INDEX_SIZE 64
+
+/* events passed to the callback */
+#define ZB_NODES_NEW		0
+#define ZB_NODES_CHANGED	1		/* new addresses or identifier */
+#define ZB_NODES_GONE		2		/* did not answer a discovery round */
+#define ZB_NODES_SEEN		3		/* only returned by zb_nodes_update: nothing changed */
+
+/* a node in the registry */
+struct zb_node {
+	uint64_t addr64;
+	uint16_t addr16;
+	uint16_t parent16;				/* 0xFFFE if it has none */
+	uint8_t device_type;			/* 0 coordinator, 1 router, 2 end device */
+	uint8_t ni_len;
+	char ni[ZB_NODES_NI_MAX + 1];	/* terminated */
+	unsigned long seen;				/* when it last answered or announced itself */
+	uint8_t used;
+};
+
+/* called with a copy of a node that is new, changed or gone. */
+typedef void (*zb_nodes_callback)(void *arg, const struct zb_node *node, int event);
+
+/* the members are private, except for the counters. initialise with zb_nodes_init. */
+typedef struct zb_nodes {
+	zb_lock_t lock;
+	struct zb_node nodes[ZB_NODES_MAX];
+	uint8_t by_addr[ZB_NODES_INDEX_SIZE];	/* 1 + index into nodes, 0 if empty */
+	uint8_t by_ni[ZB_NODES_INDEX_SIZE];
+	int count;
+	uint8_t discovering;
+	unsigned long discovery_started;
+	zb_nodes_callback cb;
+	void *arg;
+	unsigned long discovered;		/* ND responses taken */
+	unsigned long joined;			/* node identification indicators taken */
+	unsigned long removed;
+	unsigned long full;				/* nodes dropped as the registry was full */
+} zb_nodes_t;
+
+/* sets up an empty registry. cb may be NULL. */
+void zb_nodes_init(zb_nodes_t *r, zb_nodes_callback cb, void *arg);
+
+/* adds or updates a node as described at time now (zb_transport_millis), and calls the
+ * callback if it is new or changed. returns ZB_NODES_NEW, ZB_NODES_CHANGED or ZB_NODES_SEEN,
+ * or -1 if the registry is full. */
+int zb_nodes_update(zb_nodes_t *r, const struct zb_node_info *info, unsigned long now);
+
+/*
+ * takes ND responses and node identification indicators: pass it every decoded API frame.
+ * returns 1 if the frame was one of those, 0 otherwise. the empty response that ends a
+ * discovery round removes the nodes that did not answer it.
+ */
+int zb_nodes_handle(zb_nodes_t *r, const struct zb_api_frame *frame, unsigned long now);
+
+/* marks the start of a discovery round. send ATND right after. */
+void zb_nodes_begin_discovery(zb_nodes_t *r, unsigned long now);
+
+/* removes the nodes not seen since the given time. returns the number removed. */
+int zb_nodes_prune(zb_nodes_t *r, unsigned long since);
+
+/* copy out the node with this 64 bit address, or node identifier (ni_len bytes).
+ * return 0, or -1 if there is none. */
+int zb_nodes_find(zb_nodes_t *r, uint64_t addr64, struct zb_node *node);
+int zb_nodes_find_ni(zb_nodes_t *r, const char *ni, int ni_len, struct zb_node *node);
+
+/* copies up to max nodes into out, in no particular order. returns the number copied. */
+int zb_nodes_list(zb_nodes_t *r, struct zb_node *out, int max);
+
+#endif /* __ZB_NODES_H__ */
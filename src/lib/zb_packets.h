@@ -15,13 +15,75 @@
  *
  */
 
+#include "zb_transport.h"
+#include "zb_framepool.h"
+#include "zb_api.h"
+#include "zb_escape.h"
+#include "zb_addrcache.h"
+#include "zb_routes.h"
+#include <stdint.h>
+
 #define MAX_PACKET_SIZE 72
 
 #define OP_PING 0x00
 #define OP_PONG 0x01
 #define OP_MEASURE_REQUEST 0x10
 #define OP_MEASURE_RESPONSE 0x20
-/* global variables to hold parser results */
+#define OP_MEASURE_BATCH 0x21		/* binary readings, see zb_samples.h */
+#define OP_FRAGMENT 0x30		/* part of a larger message, see zb_fragment.h */
+#define OP_FRAGMENT_ACK 0x31
+
+/* a received application packet */
+struct zb_packet {
+	char op;
+	char from;
+	unsigned char len;
+	char data[MAX_PACKET_SIZE];
+};
+
+/* lexer states, private to the parser */
+enum zb_parse_state {LEX_WAITING, LEX_IN_WORD,
+	LEX_FRAME_LENGTH_MSB, LEX_FRAME_LENGTH_LSB, LEX_API_ID, LEX_FRAME_ADDR64, LEX_FRAME_NETWORK_MSB, LEX_FRAME_NETWORK_LSB, LEX_FRAME_OPTIONS,
+	LEX_PACKET_OP, LEX_PACKET_FROM, LEX_PACKET_LENGTH, LEX_PACKET_DATA, LEX_PACKET_CHECKSUM,
+	LEX_API_BODY};
+
+/*
+ * parser context. holds everything needed to parse one stream, so each radio
+ * (or each thread) can have its own. initialise with zb_parser_init.
+ * the members are private.
+ */
+typedef struct zb_parser {
+	enum zb_parse_state state;
+	int seen_escape;
+	unsigned char checksum;
+	uint16_t frame_length;
+	uint16_t frame_bytes_seen;
+	uint16_t frame_address_bytes_seen;
+	struct zb_packet packet;		/* the packet being received */
+	unsigned char *data;			/* where its data goes: packet.data, or into frame */
+	uint64_t source64;
+	uint16_t source16;
+	zb_framepool_t *pool;			/* set with zb_parser_set_pool */
+	struct zb_frame *frame;			/* pooled buffer the current frame is decoded into */
+	unsigned char api_id;			/* of the current frame */
+	unsigned char api_frame[ZB_API_FRAME_MAX + 1 + ZB_UNESCAPE_SLACK];	/* other frames than receive packets */
+	zb_api_callback api_cb;			/* set with zb_parser_set_api_callback */
+	void *api_arg;
+	zb_addr_cache_t *addr_cache;	/* set with zb_parser_set_address_cache */
+	unsigned long valid;			/* frames seen since zb_parser_init */
+	unsigned long invalid;
+	unsigned long dropped;			/* valid frames zb_parse_frames dropped as the pool was empty */
+	unsigned long api_frames;		/* frames decoded by zb_api.h */
+} zb_parser_t;
+
+/* called by zb_parse_buffer for every valid packet. the packet is only valid during the call. */
+typedef void (*zb_packet_callback)(void *arg, const struct zb_packet *packet);
+
+/* called by zb_parse_frames for every valid packet. the callee owns the frame's reference
+ * and must give it back with zb_frame_release, from any thread, whenever it is done. */
+typedef void (*zb_frame_callback)(void *arg, struct zb_frame *frame);
+
+/* global variables to hold the results of zb_parse */
 extern char zb_word_data[MAX_PACKET_SIZE];
 extern int zb_word_len;
 
@@ -36,37 +98,127 @@ enum zb_parse_response {
 	ZB_PLAIN_WORD,
 	ZB_START_PACKET,
 	ZB_VALID_PACKET,
-	ZB_INVALID_PACKET
+	ZB_INVALID_PACKET,
+	ZB_API_FRAME
 };
 
 /*
- * Initialises the packet system state and lower level components.
- * Ensures that UART transfer with escape characters is enabled.
+ * Initialises the packet system state on a transport already opened with zb_transport_open.
+ * Ensures that UART transfer with escape characters is enabled on that radio.
  */
-void zb_packets_init();
+void zb_packets_init(zb_transport_t *t);
 
 /* 
- * sets the target address for transmissions sent by this device.
- * the packet layer currently only supports addressing all devices on the network (broadcast = 1)
- * or only the coordinator (unicast, broadcast = 0)
+ * sets the target address for transmissions sent by this device with zb_send_packet:
+ * all devices on the network (broadcast = 1) or only the coordinator (unicast, broadcast = 0).
+ * zb_send_packet_unicast addresses any other single device.
  */
 void zb_set_broadcast_mode(char broadcast);
 
+/*
+ * source routes every unicast to a node with a route in routes (see zb_routes.h), on any
+ * radio: a create source route frame goes to the radio first. NULL turns this off.
+ */
+void zb_set_route_cache(zb_routes_t *routes);
+
 /*
  * sets the application level device identifier for this device. This should be in the range of 1-4 for sensors, and 0 for the master unit.
  * This has no relation to the network or hardware (MAC) address of the radio unit.
  */
 void zb_set_device_id(char id);
 
-/* sends an AT command to the radio unit for reading or setting configuration parameters. */
-void zb_send_command_with_argument(char cmd[2], char *data, unsigned char len);
-void zb_send_command(char cmd[2]);
+/* sends an AT command to the radio unit for reading or setting configuration parameters.
+ * the responses carry frame id ZB_FRAME_ID_UNTRACKED, which no pending request uses. */
+void zb_send_command_with_argument(zb_transport_t *t, char cmd[2], char *data, unsigned char len);
+void zb_send_command(zb_transport_t *t, char cmd[2]);
 
 /* packetizes the data and sends it to the radio unit via the transport layer. */
-void zb_send_packet(char type, unsigned char *data, unsigned char len);
+void zb_send_packet(zb_transport_t *t, char type, unsigned char *data, unsigned char len);
+
+/*
+ * as zb_send_command_with_argument and zb_send_packet, with the given frame id. the radio
+ * answers a frame id other than 0 with an AT response or transmit status carrying the same
+ * id; zb_pending.h allocates ids and matches the responses. returns 0 if the frame was
+ * queued, -1 if it is too large or the transmit queue is full.
+ */
+int zb_send_command_with_id(zb_transport_t *t, unsigned char frame_id, char cmd[2], char *data, unsigned char len);
+int zb_send_packet_with_id(zb_transport_t *t, unsigned char frame_id, char type, unsigned char *data, unsigned char len);
+
+/*
+ * as zb_send_command_with_id, but for the radio of the node at addr64 and addr16 (0xFFFE
+ * if not known), which answers with a remote AT command response. options 0x02 applies a
+ * changed setting at once; without it, changes wait for ATAC.
+ */
+#define ZB_REMOTE_APPLY_CHANGES 0x02
+int zb_send_remote_command_with_id(zb_transport_t *t, unsigned char frame_id, uint64_t addr64, uint16_t addr16,
+		unsigned char options, char cmd[2], char *data, unsigned char len);
+
+/*
+ * as zb_send_packet_with_id, but to one device, at the addresses its last packet came from
+ * (see zb_addrcache.h), whatever the broadcast mode. returns -1 without sending if the
+ * device is not in the cache; send a broadcast instead then.
+ */
+int zb_send_packet_unicast(zb_transport_t *t, zb_addr_cache_t *cache, char device_id, unsigned char frame_id,
+		char type, unsigned char *data, unsigned char len);
+
+/*
+ * gives the radio the route for its next transmission to the node at addr64 and addr16:
+ * hops 16 bit addresses, big-endian, from the node's neighbour on, as in a route record.
+ * returns 0 if the frame was queued, -1 otherwise.
+ */
+int zb_send_source_route(zb_transport_t *t, uint64_t addr64, uint16_t addr16, const uint8_t *path, int hops);
+
+/* resets a parser context to wait for the start of a frame. */
+void zb_parser_init(zb_parser_t *p);
+
+/*
+ * parses the response, should be called in order on every character received on one stream.
+ * on ZB_VALID_PACKET, the packet is copied to *packet, which then belongs to the caller and
+ * stays valid however the parsing continues. *packet is not touched otherwise.
+ * return values as for zb_parse. contexts are independent, so different threads may parse
+ * different streams at the same time.
+ */
+enum zb_parse_response zb_parser_feed(zb_parser_t *p, unsigned char c, struct zb_packet *packet);
+
+/*
+ * parses len received bytes at once, passing each valid packet to cb.
+ * gives the same results as calling zb_parser_feed on every byte, and the two can be mixed
+ * on one context, but is much faster as unescaped runs are scanned, summed and copied
+ * as a whole. returns the number of valid packets.
+ */
+int zb_parse_buffer(zb_parser_t *p, const unsigned char *buf, int len, zb_packet_callback cb, void *arg);
+
+/*
+ * pass every other API frame that zb_api.h can decode (AT responses, transmit status,
+ * node identification, ...) to cb, whichever function is parsing. without a callback,
+ * they are decoded and counted in p->api_frames only.
+ */
+void zb_parser_set_api_callback(zb_parser_t *p, zb_api_callback cb, void *arg);
+
+/* record the source addresses of every valid packet in cache, under the sender's device id,
+ * whichever function is parsing. NULL stops recording. */
+void zb_parser_set_address_cache(zb_parser_t *p, zb_addr_cache_t *cache);
+
+/*
+ * decode frames straight into buffers from pool, for zb_parse_frames. the other parse
+ * functions still work, and copy out of the pooled buffer. the frame being received is
+ * abandoned. a pool of NULL gives back the buffer the parser holds; do this before
+ * destroying the pool.
+ */
+void zb_parser_set_pool(zb_parser_t *p, zb_framepool_t *pool);
+
+/*
+ * as zb_parse_buffer, but without copying: every valid packet is passed to cb as the pooled
+ * frame it was decoded into, together with the address of the sending radio. needs a pool
+ * (zb_parser_set_pool). packets that arrive while the pool is empty are counted in
+ * p->dropped and lost. returns the number of frames passed to cb.
+ */
+int zb_parse_frames(zb_parser_t *p, const unsigned char *buf, int len, zb_frame_callback cb, void *arg);
 
 /* 
  * parses the response, should be called in order on every character received.
+ * uses a single parser context shared by the whole program, so only one stream can be
+ * parsed this way, from one thread.
  * only guarantees that the data stored in global variables is valid between returning
  * ZB_VALID_PACKET and the next call to this method.
  *
@@ -76,7 +228,9 @@ void zb_send_packet(char type, unsigned char *data, unsigned char len);
  *  	Result will be valid in zb_word_data and zb_word_len global variables.
  *  - ZB_VALID_PACKET - A complete valid packet, matching the checksum and length fields, has been received.
  *  	Result will be valid in zb_packet_data, zb_packet_from, and zb_packet_len.
- *  - ZB_INVALID_PACKET - a packet with unknown API frame type or invalid checksum has been received.
+ *  - ZB_INVALID_PACKET - a packet with unknown API frame type, invalid checksum, or more than
+ *  	MAX_PACKET_SIZE bytes of data has been received.
+ *  - ZB_API_FRAME - another API frame has been decoded, and passed to the parser's api callback.
  */
 enum zb_parse_response zb_parse(unsigned char c);
 
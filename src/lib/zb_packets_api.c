@@ -1,20 +1,45 @@
 #include "zb_packets.h"
 #include "zb_transport.h"
+#include "zb_escape.h"
 #include "diagnostics.h"
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #define PACKET_DELIMETER 0x7E
 
 #define ZB_API_ESCAPE 0x7D
 #define ZB_ESCAPE(x) (x ^ 0x20)
-#define ZB_NEEDS_ESCAPE(x) ( x == 0x7E || x == 0x7D || x == 0x11 || x == 0x13 )
 #define ZB_API_TRANSMITREQUEST 0x10
 #define ZB_API_RECEIVEPACKET 0x90
 #define ZB_API_ATCOMMAND 0x08
-#define ZB_API_ATRESPONSE 0x88
+#define ZB_API_REMOTEATCOMMAND 0x17
+#define ZB_API_CREATESOURCEROUTE 0x21
+
+/* api id, 64 and 16 bit source address, options, then op and from in the payload */
+#define ZB_RX_HEADER_LEN 14
+
+/* api id, frame id, 64 and 16 bit destination address, radius, options, then op and from */
+#define ZB_TX_HEADER_LEN 16
+
+/* api id, frame id, 64 and 16 bit destination address, options, command */
+#define ZB_REMOTE_AT_HEADER_LEN 15
+
+/* api id, frame id, 64 and 16 bit destination address, options, number of addresses */
+#define ZB_SOURCE_ROUTE_HEADER_LEN 14
+
+/* largest frame body (between length and checksum) that fits into ZB_SEND_MAX even if every byte is escaped */
+#define ZB_FRAME_BODY_MAX ((ZB_SEND_MAX - 1) / 2 - 3)
+
+#if ZB_RX_HEADER_LEN + MAX_PACKET_SIZE + 1 + ZB_UNESCAPE_SLACK > ZB_FRAME_RAW_SIZE
+#error "pooled frames must hold a whole receive frame and the unescape slack"
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
  * zb_packets_api.c
@@ -38,26 +63,27 @@ char	zb_packet_len;
 /* private global variables */
 static char DEVICE_ID = 0x00;
 static char DEST_BROADCAST = 0;
+static zb_routes_t *ROUTES = NULL;
 
 /* private utility functions */
-static unsigned char zb_checksum(unsigned char *buf, unsigned char len);
-static void zb_send_frame(unsigned char *buf, unsigned char len);
+static int zb_send_frame(zb_transport_t *t, const unsigned char *head, unsigned char head_len,
+		const unsigned char *data, unsigned char len);
+static int zb_send_packet_to(zb_transport_t *t, uint64_t addr64, uint16_t addr16, unsigned char frame_id,
+		char op, unsigned char *data, unsigned char len);
 
 /*
- * initialise transport layer, set escape mode to on as required in parse function
- * TODO do escaping in send packet methods!
+ * set escape mode to on as required in parse function, on a transport opened by the caller.
  */
-void zb_packets_init() {
+void zb_packets_init(zb_transport_t *t) {
 	DIAGNOSTICS("Initialised Packets layer\n");
-	zb_transport_init();
-	zb_send_command_with_argument("AP", "\002", 1);
+	zb_send_command_with_argument(t, "AP", "\002", 1);
 }
 
 /*
  * device id is used inside the packet to identify individual sensors.
  */
 void zb_set_device_id(char id) {
-	DIAGNOSTICS("now operating as DEVICE_ID %d\n", id);
+	/* DIAGNOSTICS("now operating as DEVICE_ID %d\n", id); */
 	DEVICE_ID = id;
 }
 
@@ -68,38 +94,70 @@ void zb_set_broadcast_mode(char broadcast) {
 	DEST_BROADCAST = broadcast;
 }
 
+void zb_set_route_cache(zb_routes_t *routes) {
+	ROUTES = routes;
+}
+
 /*
  * Sends a request for an AT style command.
  * data can be NULL, in that case a command without parameter (read or action) is sent.
  *
  * This implements the AT Request API Frame.
  */
-void zb_send_command_with_argument(char cmd[2], char *data, unsigned char len) {
-	unsigned char buf[MAX_PACKET_SIZE];
-	unsigned char n, i;
+void zb_send_command_with_argument(zb_transport_t *t, char cmd[2], char *data, unsigned char len) {
+	zb_send_command_with_id(t, ZB_FRAME_ID_UNTRACKED, cmd, data, len);
+}
+
+int zb_send_command_with_id(zb_transport_t *t, unsigned char frame_id, char cmd[2], char *data, unsigned char len) {
+	unsigned char head[4];
+	unsigned char n;
 	
 	n = 0;
-	buf[n++] = ZB_API_ATCOMMAND;
+	head[n++] = ZB_API_ATCOMMAND;
 
 	/* frame id. 0 = no ack sent. */
-	buf[n++] = 0x01;
+	head[n++] = frame_id;
 
-	buf[n++] = cmd[0];
-	buf[n++] = cmd[1];
-	
-	for (i = 0; i < len; i++) {
-		buf[n] = data[i];
-		n++;
+	head[n++] = cmd[0];
+	head[n++] = cmd[1];
+
+	return zb_send_frame(t, head, n, (unsigned char *) data, len);
+}
+
+/*
+ * as zb_send_command_with_id, but to the radio of another node.
+ *
+ * This implements the Remote AT Command Request API Frame.
+ */
+int zb_send_remote_command_with_id(zb_transport_t *t, unsigned char frame_id, uint64_t addr64, uint16_t addr16,
+		unsigned char options, char cmd[2], char *data, unsigned char len) {
+	unsigned char head[ZB_REMOTE_AT_HEADER_LEN];
+	unsigned char n;
+	int i;
+
+	n = 0;
+	head[n++] = ZB_API_REMOTEATCOMMAND;
+	head[n++] = frame_id;
+	for (i = 56; i >= 0; i -= 8) {
+		head[n++] = addr64 >> i;
 	}
+	head[n++] = addr16 >> 8;
+	head[n++] = addr16 & 0xff;
 
-	zb_send_frame(buf, n);
+	/* 0x02 = apply changes at once, rather than on ATAC */
+	head[n++] = options;
+
+	head[n++] = cmd[0];
+	head[n++] = cmd[1];
+
+	return zb_send_frame(t, head, n, (unsigned char *) data, len);
 }
 
 /*
  * wrapper to send a simple command without an argument
  */
-void zb_send_command(char cmd[2]) {
-	zb_send_command_with_argument(cmd, NULL, 0);
+void zb_send_command(zb_transport_t *t, char cmd[2]) {
+	zb_send_command_with_argument(t, cmd, NULL, 0);
 }
 
 /*
@@ -107,236 +165,359 @@ void zb_send_command(char cmd[2]) {
  *
  * This implements the RF Transmission Request API Frame.
  *
- * broadcast or unicast needs to be defined - this is a hack and the packets API should be updated with
- * zb_send_packet_broadcast(op, data, len) and zb_send_packet_unicast(address, op, data, len). (TODO)
+ * sent to everyone or to the coordinator, as set by zb_set_broadcast_mode. zb_send_packet_unicast
+ * sends to a single device instead.
  */
-void zb_send_packet(char op, unsigned char *data, unsigned char len) {
-	unsigned char buf[MAX_PACKET_SIZE];
-	unsigned char n, i;
-	
+void zb_send_packet(zb_transport_t *t, char op, unsigned char *data, unsigned char len) {
+	zb_send_packet_with_id(t, 0x00, op, data, len);
+}
+
+int zb_send_packet_with_id(zb_transport_t *t, unsigned char frame_id, char op, unsigned char *data, unsigned char len) {
+	if (DEST_BROADCAST) {
+		/* 16 bit broadcast network address 0xfffe: not a typo - see spec! */
+		return zb_send_packet_to(t, 0xffff, 0xfffe, frame_id, op, data, len);
+	}
+	/* the coordinator's addresses are always 0 */
+	return zb_send_packet_to(t, 0, 0, frame_id, op, data, len);
+}
+
+int zb_send_packet_unicast(zb_transport_t *t, zb_addr_cache_t *cache, char device_id, unsigned char frame_id,
+		char op, unsigned char *data, unsigned char len) {
+	uint64_t addr64;
+	uint16_t addr16;
+
+	if (zb_addr_cache_lookup(cache, device_id, &addr64, &addr16) != 0) {
+		return -1;
+	}
+	return zb_send_packet_to(t, addr64, addr16, frame_id, op, data, len);
+}
+
+/*
+ * hands the radio the route for its next transmission to a node: the 16 bit addresses
+ * of the routers in between, from the node's neighbour on.
+ *
+ * This implements the Create Source Route API Frame.
+ */
+int zb_send_source_route(zb_transport_t *t, uint64_t addr64, uint16_t addr16, const uint8_t *path, int hops) {
+	unsigned char head[ZB_SOURCE_ROUTE_HEADER_LEN];
+	unsigned char n;
+	int i;
+
 	n = 0;
-	buf[n++] = ZB_API_TRANSMITREQUEST;
+	head[n++] = ZB_API_CREATESOURCEROUTE;
 
-	/* frame id. 0 = no ack sent. */
-	buf[n++] = 0x00;
+	/* frame id. the radio never responds to this frame. */
+	head[n++] = 0x00;
 
-	/* 64 bit destination address. for coord and broadcast, first 6 bytes are 0.
-	 * TODO store this as two uint32 variables for more flexibility */
-	for (i = 0; i < 6; i++) {
-		buf[n++] = 0x00;
+	for (i = 56; i >= 0; i -= 8) {
+		head[n++] = addr64 >> i;
 	}
+	head[n++] = addr16 >> 8;
+	head[n++] = addr16 & 0xff;
 
-	if (DEST_BROADCAST) {
-		buf[n++] = 0xff;
-		buf[n++] = 0xff;
+	/* route command options */
+	head[n++] = 0x00;
 
-		/* 16 bit broadcast network address */
-		buf[n++] = 0xff;
-		buf[n++] = 0xfe; /* not a typo - see spec! */
-	} else {
-		buf[n++] = 0x00;
-		buf[n++] = 0x00;
+	head[n++] = hops;
+
+	return zb_send_frame(t, head, n, path, 2 * hops);
+}
 
-		/* 16 bit coordinator network address */
-		buf[n++] = 0x00;
-		buf[n++] = 0x00;
+/* builds the transmit request head for the given destination. with the right 16 bit
+ * address, the radio needs no network address discovery before sending. */
+static int zb_send_packet_to(zb_transport_t *t, uint64_t addr64, uint16_t addr16, unsigned char frame_id,
+		char op, unsigned char *data, unsigned char len) {
+	unsigned char head[ZB_TX_HEADER_LEN];
+	struct zb_route route;
+	unsigned char n;
+	int i;
+
+	if (len > MAX_PACKET_SIZE) {
+		DIAGNOSTICS("packet of %d bytes is too large to send.\n", len);
+		return -1;
+	}
+	
+	/* a node with a recorded route gets it first. without it, the radio finds a route itself.
+	 * a neighbour (no hops) is reached directly, so it needs none. */
+	if (ROUTES != NULL && addr64 != 0 && addr64 != 0xffff && zb_routes_lookup(ROUTES, addr64, &route) == 0
+			&& route.hops > 0) {
+		zb_send_source_route(t, addr64, route.addr16, route.path, route.hops);
 	}
 
+
+	n = 0;
+	head[n++] = ZB_API_TRANSMITREQUEST;
+
+	/* frame id. 0 = no ack sent. */
+	head[n++] = frame_id;
+
+	/* 64 and 16 bit destination address, big-endian */
+	for (i = 56; i >= 0; i -= 8) {
+		head[n++] = addr64 >> i;
+	}
+	head[n++] = addr16 >> 8;
+	head[n++] = addr16 & 0xff;
+
 	/* broadcast hop radius (0 = max) */
-	buf[n++] = 0x00;
+	head[n++] = 0x00;
 
 	/* options (0x01 = disable ack, 0x02 = disable network address discovery */
-	buf[n++] = 0x00;
+	head[n++] = 0x00;
 
-	/* RF data: payload (op, from, data) */
-	buf[n++] = op;
-	buf[n++] = DEVICE_ID;
-	
-	for (i = 0; i < len; i++) {
-		buf[n] = data[i];
-		n++;
-	}
+	/* RF data: payload (op, from, data). the data is taken from the caller's buffer */
+	head[n++] = op;
+	head[n++] = DEVICE_ID;
 
-	zb_send_frame(buf, n);
+	return zb_send_frame(t, head, n, data, len);
 }
 
-/* packages the api-specific structure part in a serial frame with a checksum */
-void zb_send_frame(unsigned char *buf, unsigned char len){
-	unsigned char frame[MAX_PACKET_SIZE];
-	unsigned char n, i, chk;
+/* writes c to out, escaped. returns the number of bytes written. */
+static int zb_put_escaped(unsigned char *out, unsigned char c) {
+	if (ZB_NEEDS_ESCAPE(c)) {
+		out[0] = ZB_API_ESCAPE;
+		out[1] = ZB_ESCAPE(c);
+		return 2;
+	}
+	out[0] = c;
+	return 1;
+}
+
+/*
+ * encodes an api frame in one pass, straight into the transport's transmit queue:
+ * the delimiter, the length, the api specific head and the caller's data escaped
+ * and summed as they are copied, and the checksum. everything after the delimiter
+ * is escaped, as API mode 2 requires.
+ */
+static int zb_send_frame(zb_transport_t *t, const unsigned char *head, unsigned char head_len,
+		const unsigned char *data, unsigned char len) {
+	unsigned char *frame;
+	unsigned char sum;
+	int n;
+
+	if (head_len + len > ZB_FRAME_BODY_MAX) {
+		DIAGNOSTICS("frame of %d bytes is too large to send.\n", head_len + len);
+		return -1;
+	}
+	frame = zb_send_reserve(t);
+	if (frame == NULL) {
+		return -1;
+	}
 
+	sum = 0;
 	n = 0;
 	frame[n++] = PACKET_DELIMETER;
-	frame[n++] = 0x00;
-	frame[n++] = len;
+	n += zb_put_escaped(frame + n, 0x00);
+	n += zb_put_escaped(frame + n, head_len + len);
+	n += zb_escape_sum(frame + n, head, head_len, &sum);
+	n += zb_escape_sum(frame + n, data, len, &sum);
+	n += zb_put_escaped(frame + n, 0xFF - sum);
+
+	/* DIAGNOSTICS("Packaged %d bytes in a frame of %d bytes and sent it to the transport layer.\n", head_len + len, n); */
+	zb_send_commit(t, frame, n);
+	return 0;
+}
 
-	for (i = 0; i < len; i++) {
-		frame[n++] = buf[i];
-	}
+void zb_parser_init(zb_parser_t *p) {
+	memset(p, 0, sizeof(*p));
+	p->state = LEX_WAITING;
+	p->data = (unsigned char *) p->packet.data;
+}
 
-	chk = zb_checksum(buf, len);
-	if (ZB_NEEDS_ESCAPE(chk)) {
-		frame[n++] = ZB_API_ESCAPE;
-		frame[n++] = ZB_ESCAPE(chk);
-	} else {
-		frame[n++] = chk;
+void zb_parser_set_pool(zb_parser_t *p, zb_framepool_t *pool) {
+	if (p->frame != NULL) {
+		zb_frame_release(p->frame);
+		p->frame = NULL;
 	}
+	p->pool = pool;
+	p->state = LEX_WAITING;
+	p->data = (unsigned char *) p->packet.data;
+}
 
-	frame[n++] = '\0';
-	
-	DIAGNOSTICS("Packaged %d bytes in a frame of %d bytes and sent it to the transport layer.\n", len, n);
-	zb_send(frame, n);
+void zb_parser_set_api_callback(zb_parser_t *p, zb_api_callback cb, void *arg) {
+	p->api_cb = cb;
+	p->api_arg = arg;
 }
 
-/*
- * checksum: sum of all bytes, keeping only lower 8 bits, subtract from 0xFF.
- */
-static unsigned char zb_checksum(unsigned char *buf, unsigned char len) {
-	unsigned char i, result;
+void zb_parser_set_address_cache(zb_parser_t *p, zb_addr_cache_t *cache) {
+	p->addr_cache = cache;
+}
+
+/* decodes the other api frame of len bytes collected in p->api_frame, and passes it on.
+ * returns ZB_API_FRAME, or ZB_INVALID_PACKET if it is malformed. */
+static enum zb_parse_response parser_api_frame(zb_parser_t *p, int len) {
+	struct zb_api_frame f;
 
-	result = 0;
-	for (i = 0; i < len; i++) {
-		result += buf[i];
+	if (zb_api_decode(p->api_frame, len, &f) < 0) {
+		p->invalid++;
+		return ZB_INVALID_PACKET;
+	}
+	p->api_frames++;
+	if (p->api_cb != NULL) {
+		p->api_cb(p->api_arg, &f);
 	}
+	return ZB_API_FRAME;
+}
 
-	return 0xFF - result;
+/* a delimiter has been seen. with a pool, the frame is decoded into a pooled buffer,
+ * the same one until a frame is handed out in it. */
+static void parser_start_frame(zb_parser_t *p) {
+	if (p->pool != NULL && p->frame == NULL) {
+		p->frame = zb_frame_alloc(p->pool);
+	}
+	p->data = p->frame != NULL ? p->frame->raw + ZB_RX_HEADER_LEN : (unsigned char *) p->packet.data;
+
+	p->seen_escape = 0;
+	p->state = LEX_FRAME_LENGTH_MSB;
+	p->checksum = 0;
+	p->frame_length = 0;
+	p->frame_bytes_seen = 0;
+	p->frame_address_bytes_seen = 0;
+
+	p->packet.op = 0;
+	p->packet.from = 0;
+	p->packet.len = 0;
 }
 
 /*
  * for return values see header file comment.
  *
- * keep a lot of state in static variables local to this function.
- *
- * store results in global variables defined in header file.
+ * all state is kept in the parser context. the packet is assembled in p->packet, with its
+ * data at p->data, and is complete when this returns ZB_VALID_PACKET.
  */
-enum zb_parse_state {LEX_WAITING, LEX_IN_WORD,
-	LEX_FRAME_LENGTH_MSB, LEX_FRAME_LENGTH_LSB, LEX_API_ID, LEX_FRAME_ADDR64, LEX_FRAME_NETWORK_MSB, LEX_FRAME_NETWORK_LSB, LEX_FRAME_OPTIONS, 
-	LEX_PACKET_OP, LEX_PACKET_FROM, LEX_PACKET_LENGTH, LEX_PACKET_DATA, LEX_PACKET_CHECKSUM};
-
-enum zb_parse_response zb_parse(unsigned char c) {
-	static unsigned char checksum, packet_data_count;
-	static uint16_t			frame_length;
-	static uint16_t			frame_bytes_seen;
-	static uint16_t			frame_address_bytes_seen;
-	static enum zb_parse_state state = LEX_WAITING;
-	static int seen_escape;
-
+static enum zb_parse_response parser_step(zb_parser_t *p, unsigned char c) {
 	if (c == ZB_API_ESCAPE) {
-		seen_escape = 1;
+		p->seen_escape = 1;
 		return ZB_PARSING;
 	}
 
-	if ( seen_escape ) {
-		c = ZB_ESCAPE(c);
-		seen_escape = 0;
-	}
-
-
+	/* a delimiter on the line always starts a frame. it must be checked before unescaping,
+	 * as an escaped 0x7E (7D 5E) is data, e.g. a checksum. */
 	if (c == PACKET_DELIMETER) {
-		state = LEX_FRAME_LENGTH_MSB;
-		checksum = 0;
-		frame_length = 0;
-		frame_bytes_seen = 0;
-		frame_address_bytes_seen = 0;
-		packet_data_count = 0;
-
-		zb_packet_op = 0;
-		zb_packet_from = 0;
-		zb_packet_len = 0;
-
+		parser_start_frame(p);
 		return ZB_START_PACKET;
 	}
 
-	switch (state) {
+	if ( p->seen_escape ) {
+		c = ZB_ESCAPE(c);
+		p->seen_escape = 0;
+	}
+
+	switch (p->state) {
 		case LEX_WAITING:
 			break;
 		case LEX_FRAME_LENGTH_MSB:
-			frame_length = (c << 8) & 0xff00;
-			state = LEX_FRAME_LENGTH_LSB;
+			p->frame_length = (c << 8) & 0xff00;
+			p->state = LEX_FRAME_LENGTH_LSB;
 			break;
 		case LEX_FRAME_LENGTH_LSB:
-			frame_length |= (c & 0x00ff);
-			state = LEX_API_ID;
-			frame_bytes_seen = 0;
-			/* DIAGNOSTICS("\nexpecting (%x) %d bytes for this frame.\n", c, frame_length); */
+			p->frame_length |= (c & 0x00ff);
+			p->state = LEX_API_ID;
+			p->frame_bytes_seen = 0;
+			/* DIAGNOSTICS("\nexpecting (%x) %d bytes for this frame.\n", c, p->frame_length); */
 			break;
 		case LEX_API_ID:
-			checksum += c;
-			frame_bytes_seen++;
+			p->checksum += c;
+			p->frame_bytes_seen++;
+			p->api_id = c;
 			if (c == ZB_API_RECEIVEPACKET) {
 				/* DIAGNOSTICS("\nit's a receive packet frame.\n"); */
-				state = LEX_FRAME_ADDR64;
+				p->state = LEX_FRAME_ADDR64;
+			} else if (zb_api_decodable(c) && p->frame_length <= ZB_API_FRAME_MAX) {
+				/* collected whole, and decoded once the checksum is known to be right */
+				p->api_frame[0] = c;
+				p->state = p->frame_length > 1 ? LEX_API_BODY : LEX_PACKET_CHECKSUM;
 			} else {
 				/* ignore this packet */
-				state = LEX_WAITING;
+				p->state = LEX_WAITING;
+				p->invalid++;
 				/* DIAGNOSTICS("Parse: seen packet with unhandled api id %x, ignoring.\n", c); */
 				return ZB_INVALID_PACKET;
 			}
 			break;
 		case LEX_FRAME_ADDR64:
-			checksum += c;
-			frame_bytes_seen++;
-			frame_address_bytes_seen++;
-			if (frame_address_bytes_seen == 8) {
-				/* DIAGNOSTICS("\ngot 8 bytes of device address, have %d bytes total now.\n", frame_bytes_seen); */
-				state = LEX_FRAME_NETWORK_MSB;
+			p->source64 = (p->source64 << 8) | c;
+			p->checksum += c;
+			p->frame_bytes_seen++;
+			p->frame_address_bytes_seen++;
+			if (p->frame_address_bytes_seen == 8) {
+				/* DIAGNOSTICS("\ngot 8 bytes of device address, have %d bytes total now.\n", p->frame_bytes_seen); */
+				p->state = LEX_FRAME_NETWORK_MSB;
 			} else {
-				state = LEX_FRAME_ADDR64;
+				p->state = LEX_FRAME_ADDR64;
 			}
 			break;
 		case LEX_FRAME_NETWORK_MSB:
-			/* ignoring */
-			checksum += c;
-			frame_bytes_seen++;
-			state = LEX_FRAME_NETWORK_LSB;
+			p->source16 = c << 8;
+			p->checksum += c;
+			p->frame_bytes_seen++;
+			p->state = LEX_FRAME_NETWORK_LSB;
 			break;
 		case LEX_FRAME_NETWORK_LSB:
-			/* ignoring */
-			checksum += c;
-			frame_bytes_seen++;
-			state = LEX_FRAME_OPTIONS;
+			p->source16 |= c;
+			p->checksum += c;
+			p->frame_bytes_seen++;
+			p->state = LEX_FRAME_OPTIONS;
 			break;
 		case LEX_FRAME_OPTIONS:
 			/* ignoring */
-			checksum += c;
-			frame_bytes_seen++;
-			state = LEX_PACKET_OP;
+			p->checksum += c;
+			p->frame_bytes_seen++;
+			p->state = LEX_PACKET_OP;
 			break;
 		case LEX_PACKET_OP:
-			frame_bytes_seen++;
-			zb_packet_op = c;
-			checksum += c;
-			/* DIAGNOSTICS("\ngot op code %x, %d total bytes now.\n", c, frame_bytes_seen); */
-			state = LEX_PACKET_FROM;
+			p->frame_bytes_seen++;
+			p->packet.op = c;
+			p->checksum += c;
+			/* DIAGNOSTICS("\ngot op code %x, %d total bytes now.\n", c, p->frame_bytes_seen); */
+			p->state = LEX_PACKET_FROM;
 			break;
 		case LEX_PACKET_FROM:
-			frame_bytes_seen++;
-			zb_packet_from = c;
-			checksum += c;
-			if (frame_bytes_seen == frame_length) {
-				state = LEX_PACKET_CHECKSUM;
+			p->frame_bytes_seen++;
+			p->packet.from = c;
+			p->checksum += c;
+			if (p->frame_bytes_seen == p->frame_length) {
+				p->state = LEX_PACKET_CHECKSUM;
 			} else {
-				state = LEX_PACKET_DATA;
+				p->state = LEX_PACKET_DATA;
 			}
 			break;
 		case LEX_PACKET_DATA:
-			frame_bytes_seen++;
-			zb_packet_data[packet_data_count++] = c;
-			zb_packet_len++;
-			checksum += c;
-			if (frame_bytes_seen == frame_length) {
-				/* DIAGNOSTICS("\ngot all data bytes (%d), as well as all frame bytes (%d). wait for checksum.\n", packet_data_count, frame_bytes_seen); */
-				state = LEX_PACKET_CHECKSUM;
+			if (p->packet.len == MAX_PACKET_SIZE) {
+				/* the length field promised more than a packet can hold */
+				p->state = LEX_WAITING;
+				p->invalid++;
+				return ZB_INVALID_PACKET;
+			}
+			p->frame_bytes_seen++;
+			p->data[p->packet.len++] = c;
+			p->checksum += c;
+			if (p->frame_bytes_seen == p->frame_length) {
+				/* DIAGNOSTICS("\ngot all data bytes (%d), as well as all frame bytes (%d). wait for checksum.\n", p->packet.len, p->frame_bytes_seen); */
+				p->state = LEX_PACKET_CHECKSUM;
 			} else {
-				state = LEX_PACKET_DATA;
+				p->state = LEX_PACKET_DATA;
+			}
+			break;
+		case LEX_API_BODY:
+			p->api_frame[p->frame_bytes_seen++] = c;
+			p->checksum += c;
+			if (p->frame_bytes_seen == p->frame_length) {
+				p->state = LEX_PACKET_CHECKSUM;
 			}
 			break;
 		case LEX_PACKET_CHECKSUM:
-			state = LEX_WAITING;
-			/* DIAGNOSTICS("Sum character from packet: %0x, actual sum of received bytes: %0x\n", c, 0xff-checksum); */
-			if (0xFF - checksum == c) {
+			p->state = LEX_WAITING;
+			/* DIAGNOSTICS("Sum character from packet: %0x, actual sum of received bytes: %0x\n", c, 0xff-p->checksum); */
+			if (0xFF - p->checksum == c && p->api_id != ZB_API_RECEIVEPACKET) {
+				return parser_api_frame(p, p->frame_length);
+			} else if (0xFF - p->checksum == c) {
+				p->valid++;
+				if (p->addr_cache != NULL) {
+					zb_addr_cache_learn(p->addr_cache, p->packet.from, p->source64, p->source16);
+				}
 				return ZB_VALID_PACKET;
 			} else {
+				p->invalid++;
 				return ZB_INVALID_PACKET;
 			}
 		default:
@@ -345,3 +526,269 @@ enum zb_parse_response zb_parse(unsigned char c) {
 
 	return ZB_PARSING;
 }
+
+/* the packet is copied out, so the caller keeps it however parsing continues. */
+enum zb_parse_response zb_parser_feed(zb_parser_t *p, unsigned char c, struct zb_packet *packet) {
+	enum zb_parse_response r;
+
+	r = parser_step(p, c);
+	if (r == ZB_VALID_PACKET) {
+		memcpy(packet, &p->packet, offsetof(struct zb_packet, data));
+		memcpy(packet->data, p->data, p->packet.len);
+	}
+	return r;
+}
+
+/* where zb_parse_buffer and zb_parse_frames send packets. only one callback is set. */
+struct parse_sink {
+	zb_packet_callback packet_cb;
+	zb_frame_callback frame_cb;
+	void *arg;
+};
+
+/* hands the valid packet in p->packet and p->data to the callback. a frame callback gets
+ * the pooled buffer it was decoded into, and the parser takes a new one for the next frame. */
+static void parser_deliver(zb_parser_t *p, const struct parse_sink *sink) {
+	struct zb_frame *f = p->frame;
+
+	if (sink->frame_cb == NULL) {
+		if (p->data != (unsigned char *) p->packet.data) {
+			memcpy(p->packet.data, p->data, p->packet.len);
+		}
+		sink->packet_cb(sink->arg, &p->packet);
+		return;
+	}
+
+	if (f == NULL || p->data != f->raw + ZB_RX_HEADER_LEN) {
+		/* the pool was empty when the frame started */
+		p->dropped++;
+		return;
+	}
+	f->op = p->packet.op;
+	f->from = p->packet.from;
+	f->len = p->packet.len;
+	f->data = p->data;
+	f->source64 = p->source64;
+	f->source16 = p->source16;
+	p->frame = NULL;
+	p->data = (unsigned char *) p->packet.data;
+	sink->frame_cb(sink->arg, f);
+}
+
+/* the low byte of the sum of len bytes, as the frame checksum needs. */
+static unsigned char sum_bytes(const unsigned char *buf, int len) {
+	unsigned char sum = 0;
+	int i = 0;
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (buf + i)), _mm_setzero_si128()));
+	}
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#endif
+	for (; i < len; i++) {
+		sum += buf[i];
+	}
+	return sum;
+}
+
+/*
+ * unescapes want bytes from buf into out, which has room for want + ZB_UNESCAPE_SLACK.
+ * returns the number of bytes taken from buf, or 0 if buf ends first or anything
+ * unusual (a delimiter, a doubled escape) comes up, which is left to parser_step.
+ */
+static int unescape_run(const unsigned char *buf, int len, unsigned char *out, int want) {
+	int used;
+
+	if (zb_unescape(out, want, buf, len, &used) < want) {
+		return 0;
+	}
+	return used;
+}
+
+/*
+ * takes a whole receive packet frame straight from the buffer, if it is all there.
+ * buf starts after the delimiter. returns the number of bytes used, or 0 to leave
+ * the frame to parser_step, which handles everything else the same way.
+ */
+static int parse_whole_frame(zb_parser_t *p, const unsigned char *buf, int len,
+		const struct parse_sink *sink) {
+	unsigned char local[ZB_RX_HEADER_LEN + MAX_PACKET_SIZE + 1 + ZB_UNESCAPE_SLACK];
+	unsigned char *frame;
+	int frame_length, data_len, n, m, i;
+
+	/* with a pool, straight into the pooled buffer */
+	frame = p->frame != NULL ? p->frame->raw : local;
+
+	/* the length is rarely escaped, and too short to be worth a call */
+	if (len >= 2 && buf[0] != ZB_FRAME_ESCAPE && buf[1] != ZB_FRAME_ESCAPE
+			&& buf[0] != ZB_FRAME_DELIMITER && buf[1] != ZB_FRAME_DELIMITER) {
+		frame[0] = buf[0];
+		frame[1] = buf[1];
+		n = 2;
+	} else {
+		n = unescape_run(buf, len, frame, 2);
+		if (n == 0) {
+			return 0;
+		}
+	}
+	frame_length = (frame[0] << 8) | frame[1];
+
+	/* other api frames are unescaped whole into p->api_frame, and decoded from there */
+	if (n < len && buf[n] != ZB_API_RECEIVEPACKET && zb_api_decodable(buf[n])) {
+		if (frame_length < 1 || frame_length > ZB_API_FRAME_MAX) {
+			return 0;
+		}
+		m = unescape_run(buf + n, len - n, p->api_frame, frame_length + 1);
+		if (m == 0) {
+			return 0;
+		}
+		p->state = LEX_WAITING;
+		if (0xFF - sum_bytes(p->api_frame, frame_length) != p->api_frame[frame_length]) {
+			p->invalid++;
+		} else {
+			parser_api_frame(p, frame_length);
+		}
+		return n + m;
+	}
+
+	if (frame_length < ZB_RX_HEADER_LEN || frame_length > ZB_RX_HEADER_LEN + MAX_PACKET_SIZE) {
+		return 0;
+	}
+	/* frame and checksum */
+	m = unescape_run(buf + n, len - n, frame, frame_length + 1);
+	if (m == 0) {
+		return 0;
+	}
+
+	/* as with parser_step, a rejected frame leaves the parser waiting for the next delimiter.
+	 * nothing taken here is one, so it does not matter how far it got. */
+	p->state = LEX_WAITING;
+	if (frame[0] != ZB_API_RECEIVEPACKET || 0xFF - sum_bytes(frame, frame_length) != frame[frame_length]) {
+		p->invalid++;
+		return n + m;
+	}
+
+	data_len = frame_length - ZB_RX_HEADER_LEN;
+	p->packet.op = frame[ZB_RX_HEADER_LEN - 2];
+	p->packet.from = frame[ZB_RX_HEADER_LEN - 1];
+	p->packet.len = data_len;
+	if (frame == local) {
+		/* a fixed size copy is cheaper than an exact one; local has room for it */
+		memcpy(p->packet.data, frame + ZB_RX_HEADER_LEN, MAX_PACKET_SIZE);
+		p->data = (unsigned char *) p->packet.data;
+	} else {
+		p->data = frame + ZB_RX_HEADER_LEN;
+	}
+	/* copied packets carry no addresses, so only take them if someone wants them */
+	if (frame != local || p->addr_cache != NULL) {
+		p->source64 = 0;
+		for (i = 1; i <= 8; i++) {
+			p->source64 = (p->source64 << 8) | frame[i];
+		}
+		p->source16 = (frame[9] << 8) | frame[10];
+	}
+	if (p->addr_cache != NULL) {
+		zb_addr_cache_learn(p->addr_cache, p->packet.from, p->source64, p->source16);
+	}
+	p->valid++;
+	parser_deliver(p, sink);
+
+	return n + m;
+}
+
+/*
+ * the bulk version of zb_parser_feed. the common cases are handled a run at a time:
+ * skipping to the next delimiter, whole frames, and unescaped stretches of data
+ * in frames split across buffers. everything else goes through parser_step, one byte at a time.
+ * packets, counts and the state carried into the next call are the same as if every
+ * byte had been passed to zb_parser_feed.
+ */
+static void parse_buffer(zb_parser_t *p, const unsigned char *buf, int len, const struct parse_sink *sink) {
+	const unsigned char *next;
+	int i = 0, n;
+
+	while (i < len) {
+		if (p->state == LEX_WAITING) {
+			/* nothing but a delimiter matters here, escaped or not */
+			next = memchr(buf + i, PACKET_DELIMETER, len - i);
+			if (next == NULL) {
+				p->seen_escape = buf[len - 1] == ZB_API_ESCAPE;
+				break;
+			}
+			/* starting the frame here saves going through parser_step for the delimiter */
+			i = next - buf + 1;
+			parser_start_frame(p);
+			continue;
+		}
+
+		if (p->state == LEX_FRAME_LENGTH_MSB && !p->seen_escape) {
+			n = parse_whole_frame(p, buf + i, len - i, sink);
+			if (n > 0) {
+				i += n;
+				continue;
+			}
+		}
+
+		if (p->state == LEX_PACKET_DATA && !p->seen_escape) {
+			n = zb_clean_run(buf + i, len - i);
+			if (n > p->frame_length - p->frame_bytes_seen) {
+				n = p->frame_length - p->frame_bytes_seen;
+			}
+			if (n > MAX_PACKET_SIZE - p->packet.len) {
+				n = MAX_PACKET_SIZE - p->packet.len;
+			}
+			if (n > 0) {
+				memcpy(p->data + p->packet.len, buf + i, n);
+				p->checksum += sum_bytes(buf + i, n);
+				p->packet.len += n;
+				p->frame_bytes_seen += n;
+				if (p->frame_bytes_seen == p->frame_length) {
+					p->state = LEX_PACKET_CHECKSUM;
+				}
+				i += n;
+				continue;
+			}
+		}
+
+		if (parser_step(p, buf[i++]) == ZB_VALID_PACKET) {
+			parser_deliver(p, sink);
+		}
+	}
+}
+
+int zb_parse_buffer(zb_parser_t *p, const unsigned char *buf, int len, zb_packet_callback cb, void *arg) {
+	struct parse_sink sink = {cb, NULL, arg};
+	unsigned long valid = p->valid;
+
+	parse_buffer(p, buf, len, &sink);
+	return p->valid - valid;
+}
+
+int zb_parse_frames(zb_parser_t *p, const unsigned char *buf, int len, zb_frame_callback cb, void *arg) {
+	struct parse_sink sink = {NULL, cb, arg};
+	unsigned long delivered = p->valid - p->dropped;
+
+	parse_buffer(p, buf, len, &sink);
+	return p->valid - p->dropped - delivered;
+}
+
+/*
+ * the original interface: one parser for the whole program, with results published
+ * in the global variables defined in header file.
+ */
+enum zb_parse_response zb_parse(unsigned char c) {
+	static zb_parser_t parser = {LEX_WAITING};
+	static struct zb_packet packet;
+	enum zb_parse_response r;
+
+	r = zb_parser_feed(&parser, c, &packet);
+	if (r == ZB_VALID_PACKET) {
+		zb_packet_op = packet.op;
+		zb_packet_from = packet.from;
+		zb_packet_len = packet.len;
+		memcpy(zb_packet_data, packet.data, packet.len);
+	}
+	return r;
+}
@@ -0,0 +1,230 @@
+#include "zb_pending.h"
+#include "zb_packets.h"
+#include "diagnostics.h"
+#include <string.h>
+
+/*
+ * zb_pending.c
+ *
+ * The table is indexed by frame id, so a response finds its request in one step. A short
+ * spin lock guards it: every critical section is a few loads and stores, and callbacks
+ * always run after it is released.
+ *
+ * Expiring marks the overdue requests as EXPIRING in one pass under the lock, which also
+ * works out the next deadline, and then completes them one at a time. A marked request
+ * can neither be completed by a response nor have its id handed out again.
+ */
+
+/* expect of a request that has timed out, and whose callback is about to be called */
+#define EXPIRING 0xFF
+
+/* deadlines wrap with the clock, so compare differences */
+#define BEFORE(a, b) ((long) ((a) - (b)) < 0)
+
+void zb_pending_init(zb_pending_t *q) {
+	memset(q, 0, sizeof(*q));
+	ZB_LOCK_INIT(&q->lock);
+}
+
+int zb_pending_submit(zb_pending_t *q, uint8_t expect, int timeout_ms, zb_completion_callback cb, void *arg) {
+	struct zb_pending_request *r;
+	unsigned long deadline;
+	int id, i;
+
+	deadline = zb_transport_millis() + timeout_ms;
+
+	ZB_LOCK(&q->lock);
+	id = q->last_id;
+	for (i = ZB_PENDING_FIRST_ID; i <= ZB_PENDING_MAX; i++) {
+		id = id == ZB_PENDING_MAX || id < ZB_PENDING_FIRST_ID ? ZB_PENDING_FIRST_ID : id + 1;
+		if (q->requests[id].expect == 0) {
+			break;
+		}
+	}
+	if (i > ZB_PENDING_MAX) {
+		q->exhausted++;
+		ZB_UNLOCK(&q->lock);
+		return 0;
+	}
+
+	r = &q->requests[id];
+	r->expect = expect;
+	r->deadline = deadline;
+	r->cb = cb;
+	r->arg = arg;
+	if (q->in_flight == 0 || BEFORE(deadline, q->earliest)) {
+		q->earliest = deadline;
+	}
+	q->in_flight++;
+	q->last_id = id;
+	ZB_UNLOCK(&q->lock);
+	return id;
+}
+
+void zb_pending_cancel(zb_pending_t *q, int frame_id) {
+	if (frame_id < ZB_PENDING_FIRST_ID || frame_id > ZB_PENDING_MAX) {
+		return;
+	}
+	ZB_LOCK(&q->lock);
+	if (q->requests[frame_id].expect != 0 && q->requests[frame_id].expect != EXPIRING) {
+		q->requests[frame_id].expect = 0;
+		q->in_flight--;
+	}
+	ZB_UNLOCK(&q->lock);
+}
+
+int zb_pending_complete(zb_pending_t *q, const struct zb_api_frame *frame) {
+	struct zb_pending_request *r;
+	zb_completion_callback cb;
+	void *arg;
+	int id;
+
+	switch (frame->api_id) {
+		case ZB_API_AT_RESPONSE:
+			id = frame->u.at.frame_id;
+			break;
+		case ZB_API_TX_STATUS:
+			id = frame->u.tx_status.frame_id;
+			break;
+		case ZB_API_REMOTE_AT_RESPONSE:
+			id = frame->u.remote_at.frame_id;
+			break;
+		default:
+			return 0;
+	}
+	if (id < ZB_PENDING_FIRST_ID) {
+		return 0;
+	}
+
+	ZB_LOCK(&q->lock);
+	r = &q->requests[id];
+	if (r->expect != frame->api_id) {
+		q->unmatched++;
+		ZB_UNLOCK(&q->lock);
+		return 0;
+	}
+	cb = r->cb;
+	arg = r->arg;
+	r->expect = 0;
+	q->in_flight--;
+	q->completed++;
+	ZB_UNLOCK(&q->lock);
+
+	if (cb != NULL) {
+		cb(arg, id, frame);
+	}
+	return 1;
+}
+
+int zb_pending_expire(zb_pending_t *q, unsigned long now) {
+	struct zb_pending_request *r;
+	zb_completion_callback cb;
+	unsigned long next;
+	void *arg;
+	int id, expired, waiting, done;
+
+	ZB_LOCK(&q->lock);
+	if (q->in_flight == 0 || BEFORE(now, q->earliest)) {
+		ZB_UNLOCK(&q->lock);
+		return 0;
+	}
+	expired = 0;
+	waiting = 0;
+	next = now;
+	for (id = 1; id <= ZB_PENDING_MAX; id++) {
+		r = &q->requests[id];
+		if (r->expect == 0 || r->expect == EXPIRING) {
+			continue;
+		}
+		if (!BEFORE(now, r->deadline)) {
+			r->expect = EXPIRING;
+			expired++;
+		} else if (waiting++ == 0 || BEFORE(r->deadline, next)) {
+			next = r->deadline;
+		}
+	}
+	q->earliest = next;
+	ZB_UNLOCK(&q->lock);
+
+	done = 0;
+	for (id = 1; id <= ZB_PENDING_MAX && expired > 0; id++) {
+		r = &q->requests[id];
+		ZB_LOCK(&q->lock);
+		if (r->expect != EXPIRING) {
+			ZB_UNLOCK(&q->lock);
+			continue;
+		}
+		cb = r->cb;
+		arg = r->arg;
+		r->expect = 0;
+		q->in_flight--;
+		q->timed_out++;
+		ZB_UNLOCK(&q->lock);
+
+		DIAGNOSTICS("request with frame id %d timed out.\n", id);
+		if (cb != NULL) {
+			cb(arg, id, NULL);
+		}
+		expired--;
+		done++;
+	}
+	return done;
+}
+
+int zb_pending_next_deadline(zb_pending_t *q, unsigned long now) {
+	long left;
+
+	ZB_LOCK(&q->lock);
+	if (q->in_flight == 0) {
+		ZB_UNLOCK(&q->lock);
+		return -1;
+	}
+	left = (long) (q->earliest - now);
+	ZB_UNLOCK(&q->lock);
+	return left < 0 ? 0 : (int) left;
+}
+
+int zb_request_packet(zb_pending_t *q, zb_transport_t *t, char op, unsigned char *data, unsigned char len,
+		int timeout_ms, zb_completion_callback cb, void *arg) {
+	int id;
+
+	id = zb_pending_submit(q, ZB_API_TX_STATUS, timeout_ms, cb, arg);
+	if (id == 0) {
+		return 0;
+	}
+	if (zb_send_packet_with_id(t, id, op, data, len) != 0) {
+		zb_pending_cancel(q, id);
+		return 0;
+	}
+	return id;
+}
+
+int zb_request_command(zb_pending_t *q, zb_transport_t *t, char cmd[2], char *data, unsigned char len,
+		int timeout_ms, zb_completion_callback cb, void *arg) {
+	int id;
+
+	id = zb_pending_submit(q, ZB_API_AT_RESPONSE, timeout_ms, cb, arg);
+	if (id == 0) {
+		return 0;
+	}
+	if (zb_send_command_with_id(t, id, cmd, data, len) != 0) {
+		zb_pending_cancel(q, id);
+		return 0;
+	}
+	return id;
+}
+
+int zb_request_packet_unicast(zb_pending_t *q, zb_transport_t *t, zb_addr_cache_t *cache, char device_id,
+		char op, unsigned char *data, unsigned char len, int timeout_ms, zb_completion_callback cb, void *arg) {
+	int id;
+
+	id = zb_pending_submit(q, ZB_API_TX_STATUS, timeout_ms, cb, arg);
+	if (id == 0) {
+		return 0;
+	}
+	if (zb_send_packet_unicast(t, cache, device_id, id, op, data, len) != 0) {
+		zb_pending_cancel(q, id);
+		return 0;
+	}
+	return id;
+}
@@ -0,0 +1,108 @@
+#ifndef __ZB_PENDING_H__
+#define __ZB_PENDING_H__
+/*
+ * zb_pending.h
+ *
+ * Matches requests to the responses the radio sends for them, so that many requests can
+ * be in flight at once.
+ *
+ * Every API frame that asks for a response carries a frame id, 2 to 255, which the radio
+ * copies into its AT command response (0x88), transmit status (0x8B) or remote AT command
+ * response (0x97). zb_pending_submit allocates a free id and records the response type
+ * expected, a deadline and a completion callback. The caller sends its frame with that id,
+ * and passes every API frame the parser decodes to zb_pending_complete, which finds the
+ * request and calls its callback with the response. Requests still waiting at their
+ * deadline are completed by zb_pending_expire, with a response of NULL.
+ *
+ * zb_request_packet and zb_request_command do the submitting and sending in one call.
+ *
+ * Ids are handed out in turn rather than lowest first. An id is reused only after the
+ * others have been, which keeps a late response to a request that timed out from being
+ * taken for the response to a new one.
+ *
+ * Submitting, completing and expiring may happen on different threads. Callbacks are called
+ * without the table locked, so they may submit new requests.
+ */
+
+#include "zb_transport.h"
+#include "zb_api.h"
+#include "zb_addrcache.h"
+#include "zb_lock.h"
+#include <stdint.h>
+
+/* frame ids are one byte, and 0 asks for no response. ids from ZB_PENDING_FIRST_ID up are
+ * handed out; those below are left to ZB_FRAME_ID_UNTRACKED. */
+#define ZB_PENDING_MAX 255
+#define ZB_PENDING_FIRST_ID (ZB_FRAME_ID_UNTRACKED + 1)
+
+/*
+ * called once per request, when its response arrives, or with a response of NULL when it
+ * has timed out. the response is only valid during the call.
+ */
+typedef void (*zb_completion_callback)(void *arg, int frame_id, const struct zb_api_frame *response);
+
+/* private */
+struct zb_pending_request {
+	uint8_t expect;					/* API ID of the response, 0 if the id is free */
+	unsigned long deadline;
+	zb_completion_callback cb;
+	void *arg;
+};
+
+/* the members are private, except for the counters. initialise with zb_pending_init. */
+typedef struct zb_pending {
+	zb_lock_t lock;
+	struct zb_pending_request requests[ZB_PENDING_MAX + 1];	/* indexed by frame id */
+	uint8_t last_id;				/* the id handed out last */
+	unsigned int in_flight;
+	unsigned long earliest;			/* no deadline is before this */
+	unsigned long completed;		/* requests that got their response */
+	unsigned long timed_out;
+	unsigned long exhausted;		/* zb_pending_submit calls that found every id in use */
+	unsigned long unmatched;		/* responses with an id no request was waiting on */
+} zb_pending_t;
+
+/* sets up an empty table. */
+void zb_pending_init(zb_pending_t *q);
+
+/*
+ * allocates a frame id for a request that expects a response of type expect (ZB_API_TX_STATUS,
+ * ZB_API_AT_RESPONSE or ZB_API_REMOTE_AT_RESPONSE) within timeout_ms. returns the id, or 0 if
+ * all are in use.
+ */
+int zb_pending_submit(zb_pending_t *q, uint8_t expect, int timeout_ms, zb_completion_callback cb, void *arg);
+
+/* forgets a request without calling its callback, e.g. if sending it failed. */
+void zb_pending_cancel(zb_pending_t *q, int frame_id);
+
+/*
+ * completes the request a response belongs to, if any: pass it every decoded API frame.
+ * returns 1 if the frame was a response to a request in the table, 0 otherwise.
+ */
+int zb_pending_complete(zb_pending_t *q, const struct zb_api_frame *frame);
+
+/* completes every request whose deadline has passed by now (zb_transport_millis).
+ * returns the number of requests that timed out. */
+int zb_pending_expire(zb_pending_t *q, unsigned long now);
+
+/* milliseconds from now until the next deadline, or -1 if nothing is in flight.
+ * suitable as the timeout of zb_read_timeout. */
+int zb_pending_next_deadline(zb_pending_t *q, unsigned long now);
+
+/*
+ * send a packet (as zb_send_packet) or an AT command (as zb_send_command_with_argument)
+ * with a newly allocated frame id, and call cb with its transmit status or AT response.
+ * returns the frame id, or 0 if no id was free or the frame could not be queued; cb is
+ * not called then.
+ */
+int zb_request_packet(zb_pending_t *q, zb_transport_t *t, char op, unsigned char *data, unsigned char len,
+		int timeout_ms, zb_completion_callback cb, void *arg);
+int zb_request_command(zb_pending_t *q, zb_transport_t *t, char cmd[2], char *data, unsigned char len,
+		int timeout_ms, zb_completion_callback cb, void *arg);
+
+/* as zb_request_packet, sent with zb_send_packet_unicast. also returns 0 if the device's
+ * address is not in the cache. */
+int zb_request_packet_unicast(zb_pending_t *q, zb_transport_t *t, zb_addr_cache_t *cache, char device_id,
+		char op, unsigned char *data, unsigned char len, int timeout_ms, zb_completion_callback cb, void *arg);
+
+#endif /* __ZB_PENDING_H__ */
@@ -0,0 +1,277 @@
+#include "zb_remote.h"
+#include "zb_packets.h"
+#include <string.h>
+
+/*
+ * zb_remote.c
+ *
+ * Every node is a small state machine, stepping through the commands and then the final
+ * pass. Picking the next node to send to and marking it SENT happens under the lock;
+ * allocating a frame id and sending happen after it is released, as zb_pending.h has its
+ * own lock and the transport may block. The frame id is mapped to the node before the
+ * command is sent, so its response always finds it.
+ *
+ * The search for a node to send to starts after the one sent to last, so all nodes move
+ * forward together and no node waits behind the retries of another.
+ */
+
+static void on_response(void *arg, int frame_id, const struct zb_api_frame *response);
+
+void zb_remote_init(zb_remote_t *r, zb_pending_t *q, zb_transport_t *t, zb_remote_callback cb, void *arg) {
+	memset(r, 0, sizeof(*r));
+	ZB_LOCK_INIT(&r->lock);
+	r->pending = q;
+	r->t = t;
+	r->cb = cb;
+	r->arg = arg;
+	r->window = ZB_REMOTE_WINDOW;
+	r->tries = ZB_REMOTE_TRIES;
+	r->timeout_ms = ZB_REMOTE_TIMEOUT_MS;
+}
+
+int zb_remote_add_command(zb_remote_t *r, char cmd[2], const void *data, int len) {
+	struct zb_remote_command *c;
+
+	if (r->started || r->command_count == ZB_REMOTE_COMMANDS_MAX || len < 0 || len > ZB_REMOTE_PARAM_MAX) {
+		return -1;
+	}
+	c = &r->commands[r->command_count++];
+	c->cmd[0] = cmd[0];
+	c->cmd[1] = cmd[1];
+	c->len = len;
+	memcpy(c->data, data, len);
+	return 0;
+}
+
+int zb_remote_add_target(zb_remote_t *r, uint64_t addr64, uint16_t addr16) {
+	struct zb_remote_target *target;
+
+	if (r->started || r->target_count == ZB_REMOTE_TARGETS_MAX) {
+		return -1;
+	}
+	target = &r->targets[r->target_count++];
+	target->addr64 = addr64;
+	target->addr16 = addr16;
+	target->state = ZB_REMOTE_WAITING;
+	return 0;
+}
+
+/* the command of the final pass, or 0 if there is none: WR, which also applies the commands
+ * if asked to, or AC. called with the lock held. */
+static int final_command(zb_remote_t *r, char cmd[2], uint8_t *options) {
+	*options = 0;
+	if (r->finish & ZB_REMOTE_WRITE) {
+		cmd[0] = 'W';
+		cmd[1] = 'R';
+		*options = r->finish & ZB_REMOTE_APPLY ? ZB_REMOTE_APPLY_CHANGES : 0;
+		return 1;
+	}
+	if (r->finish & ZB_REMOTE_APPLY) {
+		cmd[0] = 'A';
+		cmd[1] = 'C';
+		return 1;
+	}
+	return 0;
+}
+
+/* moves a node on after its command succeeded. called with the lock held. */
+static void step_done(zb_remote_t *r, struct zb_remote_target *target) {
+	char cmd[2];
+	uint8_t options;
+
+	target->tries = 0;
+	target->step++;
+	if (target->step < r->command_count) {
+		target->state = ZB_REMOTE_WAITING;
+	} else if (target->step == r->command_count && final_command(r, cmd, &options)) {
+		target->state = r->final_pass ? ZB_REMOTE_WAITING : ZB_REMOTE_READY;
+	} else {
+		target->state = ZB_REMOTE_DONE;
+		r->done++;
+	}
+}
+
+/* starts the final pass once no node is still at its commands, and ends the job once every
+ * node is done or failed. returns 1 if the job just ended. called with the lock held. */
+static int check_progress(zb_remote_t *r) {
+	int i, at_commands = 0;
+
+	if (!r->running) {
+		return 0;
+	}
+	if (!r->final_pass) {
+		for (i = 0; i < r->target_count; i++) {
+			if (r->targets[i].state == ZB_REMOTE_WAITING || r->targets[i].state == ZB_REMOTE_SENT) {
+				at_commands = 1;
+				break;
+			}
+		}
+		if (!at_commands) {
+			r->final_pass = 1;
+			for (i = 0; i < r->target_count; i++) {
+				if (r->targets[i].state == ZB_REMOTE_READY) {
+					r->targets[i].state = ZB_REMOTE_WAITING;
+				}
+			}
+		}
+	}
+	if (r->done == r->target_count) {
+		r->running = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* sends commands to waiting nodes while the window allows, until one cannot be sent. */
+static void pump(zb_remote_t *r) {
+	struct zb_remote_target *target;
+	struct zb_remote_command c;
+	uint64_t addr64;
+	uint16_t addr16;
+	uint8_t options;
+	int i, k, id, sent;
+
+	while (1) {
+		ZB_LOCK(&r->lock);
+		if (!r->running || r->in_flight >= r->window) {
+			ZB_UNLOCK(&r->lock);
+			return;
+		}
+		target = NULL;
+		for (k = 0; k < r->target_count; k++) {
+			i = (r->cursor + k) % r->target_count;
+			if (r->targets[i].state == ZB_REMOTE_WAITING) {
+				target = &r->targets[i];
+				break;
+			}
+		}
+		if (target == NULL) {
+			ZB_UNLOCK(&r->lock);
+			return;
+		}
+		r->cursor = i + 1;
+		target->state = ZB_REMOTE_SENT;
+		r->in_flight++;
+		addr64 = target->addr64;
+		addr16 = target->addr16;
+		if (target->step < r->command_count) {
+			c = r->commands[target->step];
+			options = r->finish & ZB_REMOTE_APPLY ? 0 : ZB_REMOTE_APPLY_CHANGES;
+		} else {
+			final_command(r, c.cmd, &options);
+			c.len = 0;
+		}
+		ZB_UNLOCK(&r->lock);
+
+		sent = 0;
+		id = zb_pending_submit(r->pending, ZB_API_REMOTE_AT_RESPONSE, r->timeout_ms, on_response, r);
+		if (id != 0) {
+			ZB_LOCK(&r->lock);
+			r->by_frame[id] = i + 1;
+			ZB_UNLOCK(&r->lock);
+			sent = zb_send_remote_command_with_id(r->t, id, addr64, addr16, options, c.cmd,
+					(char *) c.data, c.len) == 0;
+			if (!sent) {
+				zb_pending_cancel(r->pending, id);
+			}
+		}
+
+		ZB_LOCK(&r->lock);
+		if (sent) {
+			r->sent++;
+		} else {
+			/* wait for zb_remote_poll */
+			target->state = ZB_REMOTE_WAITING;
+			r->in_flight--;
+			if (id != 0) {
+				r->by_frame[id] = 0;
+			}
+			r->cursor = i;
+		}
+		ZB_UNLOCK(&r->lock);
+		if (!sent) {
+			return;
+		}
+	}
+}
+
+/* called with the response to a command, or NULL if none came in time */
+static void on_response(void *arg, int frame_id, const struct zb_api_frame *response) {
+	zb_remote_t *r = arg;
+	struct zb_remote_target *target;
+	int ended;
+
+	ZB_LOCK(&r->lock);
+	if (r->by_frame[frame_id] == 0) {
+		ZB_UNLOCK(&r->lock);
+		return;
+	}
+	target = &r->targets[r->by_frame[frame_id] - 1];
+	r->by_frame[frame_id] = 0;
+	r->in_flight--;
+
+	target->status = response != NULL ? response->u.remote_at.status : ZB_AT_TX_FAILURE;
+	if (target->status == ZB_AT_OK) {
+		target->addr16 = response->u.remote_at.source16;
+		step_done(r, target);
+	} else if (target->status == ZB_AT_TX_FAILURE && ++target->tries < r->tries) {
+		/* lost on the way, or the node was busy: try again */
+		target->state = ZB_REMOTE_WAITING;
+		r->retried++;
+	} else {
+		target->state = ZB_REMOTE_FAILED;
+		r->failed++;
+		r->done++;
+	}
+	ended = check_progress(r);
+	ZB_UNLOCK(&r->lock);
+
+	if (ended) {
+		if (r->cb != NULL) {
+			r->cb(r->arg, r);
+		}
+		return;
+	}
+	pump(r);
+}
+
+int zb_remote_start(zb_remote_t *r, int finish) {
+	char cmd[2];
+	uint8_t options;
+	int ended, i;
+
+	ZB_LOCK(&r->lock);
+	if (r->started) {
+		ZB_UNLOCK(&r->lock);
+		return -1;
+	}
+	r->started = 1;
+	r->running = 1;
+	r->finish = finish;
+	r->final_pass = r->command_count == 0;
+	if (r->command_count == 0 && !final_command(r, cmd, &options)) {
+		/* nothing to send */
+		for (i = 0; i < r->target_count; i++) {
+			r->targets[i].state = ZB_REMOTE_DONE;
+		}
+		r->done = r->target_count;
+	}
+	ended = check_progress(r);
+	ZB_UNLOCK(&r->lock);
+
+	if (ended && r->cb != NULL) {
+		r->cb(r->arg, r);
+	}
+	pump(r);
+	return 0;
+}
+
+int zb_remote_poll(zb_remote_t *r) {
+	int running;
+
+	pump(r);
+	ZB_LOCK(&r->lock);
+	running = r->running;
+	ZB_UNLOCK(&r->lock);
+	return running;
+}
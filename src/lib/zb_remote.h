@@ -0,0 +1,139 @@
+#ifndef __ZB_REMOTE_H__
+#define __ZB_REMOTE_H__
+/*
+ * zb_remote.h
+ *
+ * Changes the settings of many radios at once, through remote AT commands.
+ *
+ * A remote AT command (0x17) travels to the node's radio and back as a response (0x97),
+ * which takes tens to hundreds of milliseconds across a mesh. Sent one after the other,
+ * a few settings on hundreds of nodes take minutes. A zb_remote_t instead keeps up to
+ * window commands in flight, to different nodes, and matches the responses to them by
+ * frame id through a zb_pending_t.
+ *
+ * Add the commands, which every node gets in the order added, and the nodes, then start.
+ * Each node gets its commands one at a time, so they arrive in order. A command that
+ * times out, or could not be delivered, is sent again, up to ZB_REMOTE_TRIES times in
+ * all. A node that rejects a command, or does not answer, fails, and gets none of its
+ * remaining commands.
+ *
+ * A final pass, once every node has had its commands, can apply and write them:
+ *
+ *   ZB_REMOTE_APPLY	the commands are queued on each radio, and applied by ATAC (or
+ *						ATWR with the apply option) in the final pass. Nodes then switch
+ *						together, e.g. to a new PAN ID, and none is cut off from the
+ *						network while others still wait for their commands.
+ *						Without it, each command is applied as it arrives.
+ *   ZB_REMOTE_WRITE	ATWR in the final pass, so the settings survive a reset.
+ *
+ * Failed nodes are left out of the final pass. The callback runs once, when every node is
+ * done or has failed; the result of each is then in targets[i].
+ *
+ * Responses come in through zb_pending_complete, and timeouts through zb_pending_expire,
+ * on whatever threads call them; the next commands are sent from there. A command that
+ * could not be sent, as no frame id was free or the transmit queue was full, waits for
+ * zb_remote_poll. The callback may start a new job.
+ */
+
+#include "zb_transport.h"
+#include "zb_pending.h"
+#include "zb_lock.h"
+#include <stdint.h>
+
+#ifndef ZB_REMOTE_TARGETS_MAX
+#define ZB_REMOTE_TARGETS_MAX 256
+#endif
+#define ZB_REMOTE_COMMANDS_MAX 8
+#define ZB_REMOTE_PARAM_MAX 20			/* the longest parameter, as for ATNI */
+
+/* defaults for the settings in zb_remote_t */
+#define ZB_REMOTE_WINDOW 16
+#define ZB_REMOTE_TRIES 3
+#define ZB_REMOTE_TIMEOUT_MS 2000
+
+/* the final pass */
+#define ZB_REMOTE_APPLY 0x01
+#define ZB_REMOTE_WRITE 0x02
+
+/* state of a node */
+#define ZB_REMOTE_WAITING	0			/* for its next command to be sent */
+#define ZB_REMOTE_SENT		1			/* its command is in flight */
+#define ZB_REMOTE_READY		2			/* had every command, waits for the final pass */
+#define ZB_REMOTE_DONE		3
+#define ZB_REMOTE_FAILED	4
+
+/* private */
+struct zb_remote_command {
+	char cmd[2];
+	uint8_t len;
+	uint8_t data[ZB_REMOTE_PARAM_MAX];
+};
+
+/* a node. the members are read only. */
+struct zb_remote_target {
+	uint64_t addr64;
+	uint16_t addr16;				/* 0xFFFE until its first response */
+	uint8_t state;					/* ZB_REMOTE_* */
+	uint8_t step;					/* the command it is at. command_count for the final pass */
+	uint8_t tries;					/* of the current command */
+	uint8_t status;					/* ZB_AT_* of its last response, ZB_AT_TX_FAILURE if none came */
+};
+
+struct zb_remote;
+
+/* called once, when the job is over. */
+typedef void (*zb_remote_callback)(void *arg, struct zb_remote *job);
+
+/*
+ * the members are private, except for the settings, which may be changed before
+ * zb_remote_start, and the targets and counters, which are read only.
+ */
+typedef struct zb_remote {
+	zb_lock_t lock;
+	zb_pending_t *pending;
+	zb_transport_t *t;
+	zb_remote_callback cb;
+	void *arg;
+
+	int window;						/* settings: commands in flight at most */
+	int tries;						/* sends of one command to one node at most */
+	int timeout_ms;					/* for each response */
+
+	struct zb_remote_command commands[ZB_REMOTE_COMMANDS_MAX];
+	int command_count;
+	uint8_t finish;					/* ZB_REMOTE_APPLY | ZB_REMOTE_WRITE */
+	uint8_t started;
+	uint8_t running;
+	uint8_t final_pass;
+	int in_flight;
+	int cursor;						/* where the search for the next node to send to starts */
+	uint16_t by_frame[ZB_PENDING_MAX + 1];	/* 1 + the target a frame id was sent to */
+
+	struct zb_remote_target targets[ZB_REMOTE_TARGETS_MAX];
+	int target_count;
+	int done;						/* targets done or failed */
+	unsigned long sent;				/* commands sent, including retries */
+	unsigned long retried;
+	int failed;
+} zb_remote_t;
+
+/* sets up an empty job whose requests go through q and t. cb may be NULL. */
+void zb_remote_init(zb_remote_t *r, zb_pending_t *q, zb_transport_t *t, zb_remote_callback cb, void *arg);
+
+/* adds a command, with len bytes of parameter. returns 0, or -1 if there are too many,
+ * the parameter is too long, or the job has started. */
+int zb_remote_add_command(zb_remote_t *r, char cmd[2], const void *data, int len);
+
+/* adds the node at addr64, and addr16 if known, 0xFFFE otherwise. returns 0, or -1 if
+ * there are too many, or the job has started. */
+int zb_remote_add_target(zb_remote_t *r, uint64_t addr64, uint16_t addr16);
+
+/* starts sending, with the final pass given, ZB_REMOTE_APPLY | ZB_REMOTE_WRITE or 0.
+ * returns 0, or -1 if it has started before. */
+int zb_remote_start(zb_remote_t *r, int finish);
+
+/* sends the commands that could not be sent before. returns 1 while the job runs, 0 once
+ * it is over or if it never started. */
+int zb_remote_poll(zb_remote_t *r);
+
+#endif /* __ZB_REMOTE_H__ */
@@ -0,0 +1,196 @@
+#ifndef __ZB_RING_H__
+#define __ZB_RING_H__
+/*
+ * zb_ring.h
+ *
+ * Lock-free single-producer/single-consumer byte ring buffer, shared by the
+ * tty (producer: serial monitor thread) and embedded (producer: USART interrupt)
+ * transports.
+ *
+ * head is only ever written by the consumer, tail only by the producer.
+ * Both are free-running counters, so tail - head is the number of stored bytes
+ * and no separate count field has to be kept consistent between the two sides.
+ * The size must be a power of two so that indices can be masked instead of using %.
+ *
+ * The producer publishes data with a release store of tail, and the consumer
+ * frees space with a release store of head. With C11 atomics these map onto
+ * stdatomic.h, and without them (e.g. -std=gnu99) onto the GCC and Clang __atomic
+ * builtins. Only under Keil MDK, for the single-core Cortex-M targets, is a compiler
+ * barrier all there is, which is sufficient as the producer and consumer share a core.
+ */
+
+#include <string.h>
+
+#if defined(__CC_ARM) && !defined(inline)
+#define inline __inline
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_uint zb_ring_index_t;
+#define ZB_RING_LOAD_RELAXED(p)		atomic_load_explicit((p), memory_order_relaxed)
+#define ZB_RING_LOAD_ACQUIRE(p)		atomic_load_explicit((p), memory_order_acquire)
+#define ZB_RING_STORE_RELEASE(p, v)	atomic_store_explicit((p), (v), memory_order_release)
+#define ZB_RING_STORE_RELAXED(p, v)	atomic_store_explicit((p), (v), memory_order_relaxed)
+#elif defined(__GNUC__) && !defined(__CC_ARM)
+typedef unsigned int zb_ring_index_t;
+#define ZB_RING_LOAD_RELAXED(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ZB_RING_LOAD_ACQUIRE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ZB_RING_STORE_RELEASE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ZB_RING_STORE_RELAXED(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#elif defined(__CC_ARM)
+typedef volatile unsigned int zb_ring_index_t;
+#define ZB_RING_BARRIER() __schedule_barrier()
+#define ZB_RING_LOAD_RELAXED(p)		(*(p))
+#define ZB_RING_LOAD_ACQUIRE(p)		zb_ring_load_acquire(p)
+#define ZB_RING_STORE_RELEASE(p, v)	do { ZB_RING_BARRIER(); *(p) = (v); } while (0)
+#define ZB_RING_STORE_RELAXED(p, v)	(*(p) = (v))
+
+static inline unsigned int zb_ring_load_acquire(zb_ring_index_t *p) {
+	unsigned int v = *p;
+	ZB_RING_BARRIER();
+	return v;
+}
+#else
+#error "zb_ring.h: no atomic loads and stores for this compiler"
+#endif
+
+typedef struct zb_ring {
+	zb_ring_index_t head;	/* next element to take. written by consumer only. */
+	zb_ring_index_t tail;	/* next free element. written by producer only. */
+	unsigned int mask;		/* size - 1 */
+	unsigned char *elements;
+} zb_ring_t;
+
+/* returns 1 if n is a non-zero power of two. */
+#define ZB_RING_SIZE_VALID(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+/* initialise an empty ring using storage of size bytes, which must be a power of two. */
+static inline void zb_ring_init(zb_ring_t *r, unsigned char *storage, unsigned int size) {
+	ZB_RING_STORE_RELAXED(&r->head, 0);
+	ZB_RING_STORE_RELAXED(&r->tail, 0);
+	r->mask = size - 1;
+	r->elements = storage;
+}
+
+static inline unsigned int zb_ring_size(const zb_ring_t *r) {
+	return r->mask + 1;
+}
+
+/* number of bytes currently stored. exact when called by either side, a snapshot otherwise. */
+static inline unsigned int zb_ring_count(zb_ring_t *r) {
+	return ZB_RING_LOAD_ACQUIRE(&r->tail) - ZB_RING_LOAD_ACQUIRE(&r->head);
+}
+
+static inline int zb_ring_is_empty(zb_ring_t *r) {
+	return zb_ring_count(r) == 0;
+}
+
+/*
+ * producer side.
+ */
+
+/* append one byte. returns 1 on success, 0 if the ring was full. */
+static inline int zb_ring_put(zb_ring_t *r, unsigned char c) {
+	unsigned int tail = ZB_RING_LOAD_RELAXED(&r->tail);
+
+	if (tail - ZB_RING_LOAD_ACQUIRE(&r->head) > r->mask) {
+		return 0;
+	}
+
+	r->elements[tail & r->mask] = c;
+	ZB_RING_STORE_RELEASE(&r->tail, tail + 1);
+	return 1;
+}
+
+/* get the largest contiguous free region, so that it can be filled in place
+ * (e.g. by read()). returns its length, which is 0 if the ring is full. */
+static inline unsigned int zb_ring_write_space(zb_ring_t *r, unsigned char **p) {
+	unsigned int tail = ZB_RING_LOAD_RELAXED(&r->tail);
+	unsigned int space = zb_ring_size(r) - (tail - ZB_RING_LOAD_ACQUIRE(&r->head));
+	unsigned int run = zb_ring_size(r) - (tail & r->mask);
+
+	*p = &r->elements[tail & r->mask];
+	return space < run ? space : run;
+}
+
+/* publish n bytes previously filled in through zb_ring_write_space. */
+static inline void zb_ring_commit(zb_ring_t *r, unsigned int n) {
+	ZB_RING_STORE_RELEASE(&r->tail, ZB_RING_LOAD_RELAXED(&r->tail) + n);
+}
+
+/* append up to len bytes. returns the number of bytes actually stored. */
+static inline unsigned int zb_ring_write(zb_ring_t *r, const unsigned char *buf, unsigned int len) {
+	unsigned int n, run;
+	unsigned char *p;
+
+	for (n = 0; n < len; n += run) {
+		run = zb_ring_write_space(r, &p);
+		if (run == 0) {
+			break;
+		}
+		if (run > len - n) {
+			run = len - n;
+		}
+		memcpy(p, buf + n, run);
+		zb_ring_commit(r, run);
+	}
+
+	return n;
+}
+
+/*
+ * consumer side.
+ */
+
+/* take one byte. returns 1 on success, 0 if the ring was empty. */
+static inline int zb_ring_take(zb_ring_t *r, unsigned char *c) {
+	unsigned int head = ZB_RING_LOAD_RELAXED(&r->head);
+
+	if (ZB_RING_LOAD_ACQUIRE(&r->tail) == head) {
+		return 0;
+	}
+
+	*c = r->elements[head & r->mask];
+	ZB_RING_STORE_RELEASE(&r->head, head + 1);
+	return 1;
+}
+
+/* get the largest contiguous stored region, so that it can be used in place
+ * (e.g. by write()). returns its length, which is 0 if the ring is empty. */
+static inline unsigned int zb_ring_read_space(zb_ring_t *r, unsigned char **p) {
+	unsigned int head = ZB_RING_LOAD_RELAXED(&r->head);
+	unsigned int count = ZB_RING_LOAD_ACQUIRE(&r->tail) - head;
+	unsigned int run = zb_ring_size(r) - (head & r->mask);
+
+	*p = &r->elements[head & r->mask];
+	return count < run ? count : run;
+}
+
+/* free n bytes previously used through zb_ring_read_space. */
+static inline void zb_ring_consume(zb_ring_t *r, unsigned int n) {
+	ZB_RING_STORE_RELEASE(&r->head, ZB_RING_LOAD_RELAXED(&r->head) + n);
+}
+
+/* take up to len bytes, in at most two copies. returns the number of bytes taken. */
+static inline unsigned int zb_ring_read(zb_ring_t *r, unsigned char *buf, unsigned int len) {
+	unsigned int head = ZB_RING_LOAD_RELAXED(&r->head);
+	unsigned int count = ZB_RING_LOAD_ACQUIRE(&r->tail) - head;
+	unsigned int run;
+
+	if (len > count) {
+		len = count;
+	}
+
+	run = zb_ring_size(r) - (head & r->mask);
+	if (run > len) {
+		run = len;
+	}
+	memcpy(buf, &r->elements[head & r->mask], run);
+	memcpy(buf + run, r->elements, len - run);
+
+	ZB_RING_STORE_RELEASE(&r->head, head + len);
+	return len;
+}
+
+#endif /* __ZB_RING_H__ */
@@ -0,0 +1,157 @@
+#include "zb_routes.h"
+#include <string.h>
+
+/*
+ * zb_routes.c
+ *
+ * The routes sit in a plain array, found through a table of array indices probed linearly
+ * from the slot the 64 bit address hashes to, as in zb_nodes.c. The table is at least twice
+ * the size of the array, so probing never runs far and never finds it full.
+ *
+ * Route records arrive with every packet a node sends after a many-to-one route request,
+ * and mostly repeat the route kept, so that case only compares and stamps the entry.
+ */
+
+#define MASK (ZB_ROUTES_INDEX_SIZE - 1)
+
+#if ZB_ROUTES_INDEX_SIZE & MASK || ZB_ROUTES_INDEX_SIZE < 2 * ZB_ROUTES_MAX || ZB_ROUTES_INDEX_SIZE > 256
+#error "ZB_ROUTES_INDEX_SIZE must be a power of two, at least twice ZB_ROUTES_MAX, and at most 256"
+#endif
+
+/* wrapping millisecond times, as returned by zb_transport_millis */
+#define BEFORE(a, b) ((long) ((a) - (b)) < 0)
+
+static unsigned int home(uint64_t addr64) {
+	uint32_t x = (uint32_t) addr64 ^ (uint32_t) (addr64 >> 32);
+
+	return (x * 0x9E3779B1u) >> 24 & MASK;
+}
+
+/* the table slot pointing at the route to addr64, or -1. called with the lock held. */
+static int find(zb_routes_t *r, uint64_t addr64) {
+	unsigned int slot;
+
+	for (slot = home(addr64); r->index[slot]; slot = (slot + 1) & MASK) {
+		if (r->routes[r->index[slot] - 1].addr64 == addr64) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* empties a table slot, and moves back the later entries of its run that would otherwise
+ * no longer be reached from their home slot. */
+static void unlink_slot(zb_routes_t *r, unsigned int hole) {
+	unsigned int slot, h;
+
+	r->index[hole] = 0;
+	for (slot = (hole + 1) & MASK; r->index[slot]; slot = (slot + 1) & MASK) {
+		h = home(r->routes[r->index[slot] - 1].addr64);
+		if (((slot - h) & MASK) >= ((slot - hole) & MASK)) {
+			r->index[hole] = r->index[slot];
+			r->index[slot] = 0;
+			hole = slot;
+		}
+	}
+}
+
+/* a free entry for a new route, replacing the oldest one if there is none. */
+static int take_entry(zb_routes_t *r) {
+	int i, oldest = 0;
+
+	for (i = 0; i < ZB_ROUTES_MAX; i++) {
+		if (!r->routes[i].used) {
+			return i;
+		}
+		if (BEFORE(r->routes[i].recorded, r->routes[oldest].recorded)) {
+			oldest = i;
+		}
+	}
+	unlink_slot(r, find(r, r->routes[oldest].addr64));
+	r->routes[oldest].used = 0;
+	r->count--;
+	r->replaced++;
+	return oldest;
+}
+
+void zb_routes_init(zb_routes_t *r) {
+	memset(r, 0, sizeof(*r));
+	ZB_LOCK_INIT(&r->lock);
+}
+
+int zb_routes_record(zb_routes_t *r, uint64_t addr64, uint16_t addr16, int hops, const uint8_t *path,
+		unsigned long now) {
+	struct zb_route *e;
+	unsigned int s;
+	int slot, i;
+
+	ZB_LOCK(&r->lock);
+	r->recorded++;
+	if (hops < 0 || hops > ZB_ROUTES_HOPS_MAX) {
+		r->too_long++;
+		ZB_UNLOCK(&r->lock);
+		return -1;
+	}
+
+	slot = find(r, addr64);
+	if (slot >= 0) {
+		e = &r->routes[r->index[slot] - 1];
+	} else {
+		i = take_entry(r);
+		e = &r->routes[i];
+		e->addr64 = addr64;
+		e->hops = 0xFF;
+		e->used = 1;
+		for (s = home(addr64); r->index[s]; s = (s + 1) & MASK) {
+		}
+		r->index[s] = i + 1;
+		r->count++;
+	}
+
+	if (e->addr16 != addr16 || e->hops != hops || memcmp(e->path, path, 2 * hops) != 0) {
+		e->addr16 = addr16;
+		e->hops = hops;
+		memcpy(e->path, path, 2 * hops);
+		r->changed++;
+	}
+	e->recorded = now;
+	ZB_UNLOCK(&r->lock);
+	return 0;
+}
+
+int zb_routes_handle(zb_routes_t *r, const struct zb_api_frame *frame, unsigned long now) {
+	const struct zb_route_record *rec;
+
+	if (frame->api_id != ZB_API_ROUTE_RECORD) {
+		return 0;
+	}
+	rec = &frame->u.route;
+	zb_routes_record(r, rec->source64, rec->source16, rec->hops, rec->addresses, now);
+	return 1;
+}
+
+int zb_routes_lookup(zb_routes_t *r, uint64_t addr64, struct zb_route *route) {
+	int slot;
+
+	ZB_LOCK(&r->lock);
+	slot = find(r, addr64);
+	if (slot >= 0) {
+		*route = r->routes[r->index[slot] - 1];
+	}
+	ZB_UNLOCK(&r->lock);
+	return slot >= 0 ? 0 : -1;
+}
+
+void zb_routes_forget(zb_routes_t *r, uint64_t addr64) {
+	int slot;
+
+	ZB_LOCK(&r->lock);
+	slot = find(r, addr64);
+	if (slot >= 0) {
+		r->routes[r->index[slot] - 1].used = 0;
+		unlink_slot(r, slot);
+		r->count--;
+		r->forgotten++;
+	}
+	ZB_UNLOCK(&r->lock);
+}
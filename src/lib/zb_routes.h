@@ -0,0 +1,92 @@
+#ifndef __ZB_ROUTES_H__
+#define __ZB_ROUTES_H__
+/*
+ * zb_routes.h
+ *
+ * Source routes to the nodes of a large network, learned from route records.
+ *
+ * Left to itself, the coordinator's radio discovers a route to every destination it sends
+ * to: it broadcasts a route request across the whole network, and waits for the replies
+ * before sending. In a network of hundreds of routers, these requests flood the mesh, and
+ * each first packet to a node waits for its discovery.
+ *
+ * Many-to-one routing turns this around. With ATAR set, the coordinator broadcasts a single
+ * many-to-one route request every AR * 10 seconds, which leaves every router with a route
+ * back to it. A node sending to the coordinator then also sends a route record (0xA1),
+ * listing the 16 bit addresses of the routers the packet passed through. Pass every decoded
+ * API frame to zb_routes_handle, which keeps the latest record of each node.
+ *
+ * Packets to a node with a route are source routed: a create source route frame (0x21)
+ * with the recorded hops goes to the radio just before the transmit request, which is then
+ * sent along them without any route discovery. A neighbour, whose record has no hops, is
+ * sent to directly. zb_set_route_cache has zb_send_packet_unicast and the other unicasts do
+ * this. The cost is one short frame on the UART per packet, and the traffic on the air no
+ * longer grows with the network.
+ *
+ * A route goes stale when a router on it fails or a node moves: forget it when a delivery
+ * fails, and the next route record replaces it. Until then, the radio finds a route itself.
+ *
+ * Memory is fixed: ZB_ROUTES_MAX routes in an open addressed hash table by 64 bit address.
+ * When it is full, the oldest route is replaced. Routes longer than ZB_ROUTES_HOPS_MAX are
+ * not kept.
+ *
+ * Route records come from the parser's thread, and lookups from whichever thread sends.
+ */
+
+#include "zb_api.h"
+#include "zb_lock.h"
+#include <stdint.h>
+
+#ifndef ZB_ROUTES_MAX
+#define ZB_ROUTES_MAX 128
+#endif
+
+/* the index table: a power of two, at least twice ZB_ROUTES_MAX, and at most 256 */
+#ifndef ZB_ROUTES_INDEX_SIZE
+#define ZB_ROUTES_INDEX_SIZE 256
+#endif
+
+/* the longest route kept, in routers between the coordinator and the node */
+#define ZB_ROUTES_HOPS_MAX 16
+
+/* a route to one node */
+struct zb_route {
+	uint64_t addr64;
+	uint16_t addr16;
+	uint8_t hops;
+	uint8_t path[2 * ZB_ROUTES_HOPS_MAX];	/* 16 bit addresses, big-endian, from the node's neighbour on */
+	unsigned long recorded;			/* when its last route record arrived */
+	uint8_t used;
+};
+
+/* the members are private, except for the counters. initialise with zb_routes_init. */
+typedef struct zb_routes {
+	zb_lock_t lock;
+	struct zb_route routes[ZB_ROUTES_MAX];
+	uint8_t index[ZB_ROUTES_INDEX_SIZE];	/* 1 + index into routes, 0 if empty */
+	int count;
+	unsigned long recorded;			/* route records taken */
+	unsigned long changed;			/* of which were new or differed from the route kept */
+	unsigned long too_long;			/* route records with more than ZB_ROUTES_HOPS_MAX hops */
+	unsigned long replaced;			/* routes dropped for a new one as the cache was full */
+	unsigned long forgotten;
+} zb_routes_t;
+
+/* sets up an empty cache. */
+void zb_routes_init(zb_routes_t *r);
+
+/* records the route to the node at addr64 and addr16: hops 16 bit addresses, big-endian,
+ * as in a route record. returns 0, or -1 if it has too many hops. */
+int zb_routes_record(zb_routes_t *r, uint64_t addr64, uint16_t addr16, int hops, const uint8_t *path,
+		unsigned long now);
+
+/* takes route records: pass it every decoded API frame. returns 1 if the frame was one, 0 otherwise. */
+int zb_routes_handle(zb_routes_t *r, const struct zb_api_frame *frame, unsigned long now);
+
+/* copies out the route to the node at addr64. returns 0, or -1 if there is none. */
+int zb_routes_lookup(zb_routes_t *r, uint64_t addr64, struct zb_route *route);
+
+/* drops the route to the node at addr64, e.g. after a failed delivery. */
+void zb_routes_forget(zb_routes_t *r, uint64_t addr64);
+
+#endif /* __ZB_ROUTES_H__ */
@@ -0,0 +1,137 @@
+#include "zb_samples.h"
+
+/*
+ * zb_samples.c
+ *
+ * Written for the sensor boards as much as for the master: no allocation, no floating
+ * point, and a reading is appended in a handful of instructions.
+ */
+
+/* the longest varint of a 32 bit number */
+#define VARINT_MAX 5
+
+static int put_varint(unsigned char *out, uint32_t v) {
+	int n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	out[n++] = v;
+	return n;
+}
+
+/* reads a varint from data[*pos] onwards. returns 0, or -1 if it runs past len or 32 bits. */
+static int get_varint(const unsigned char *data, int len, int *pos, uint32_t *v) {
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if (*pos >= len) {
+			return -1;
+		}
+		*v |= (uint32_t) (data[*pos] & 0x7f) << shift;
+		if (!(data[(*pos)++] & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint32_t zigzag(int32_t v) {
+	return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+	return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+void zb_samples_begin(struct zb_sample_writer *w, uint32_t time, uint16_t interval) {
+	w->count = 0;
+	w->len = 1;
+	w->len += put_varint(w->buf + w->len, time);
+	w->len += put_varint(w->buf + w->len, interval);
+	w->buf[0] = 0;
+}
+
+int zb_samples_add(struct zb_sample_writer *w, uint16_t value) {
+	unsigned char tmp[VARINT_MAX];
+	uint32_t v;
+	int i, n;
+
+	if (w->count == 255) {
+		return -1;
+	}
+	v = w->count == 0 ? value : zigzag((int32_t) value - w->last);
+	n = put_varint(tmp, v);
+	if (w->len + n > MAX_PACKET_SIZE) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		w->buf[w->len++] = tmp[i];
+	}
+	w->last = value;
+	w->buf[0] = ++w->count;
+	return 0;
+}
+
+int zb_samples_decode(const unsigned char *data, int len, uint32_t *time, uint16_t *interval,
+		uint16_t *values, int max) {
+	uint32_t v;
+	int32_t value;
+	int count, pos, i;
+
+	if (len < 1) {
+		return -1;
+	}
+	count = data[0];
+	if (count > max) {
+		return -1;
+	}
+	pos = 1;
+	if (get_varint(data, len, &pos, time) != 0 || get_varint(data, len, &pos, &v) != 0 || v > 0xffff) {
+		return -1;
+	}
+	*interval = v;
+
+	value = 0;
+	for (i = 0; i < count; i++) {
+		if (get_varint(data, len, &pos, &v) != 0) {
+			return -1;
+		}
+		value = i == 0 ? (int32_t) v : value + unzigzag(v);
+		if (value < 0 || value > 0xffff) {
+			return -1;
+		}
+		values[i] = value;
+	}
+	return pos == len ? count : -1;
+}
+
+int zb_samples_history_add(unsigned char *buf, int len, int max, const struct zb_sample_writer *w) {
+	int i;
+
+	if (len + 1 + w->len > max) {
+		return -1;
+	}
+	buf[len++] = w->len;
+	for (i = 0; i < w->len; i++) {
+		buf[len++] = w->buf[i];
+	}
+	return len;
+}
+
+int zb_samples_history_next(const unsigned char *data, int len, int *pos, const unsigned char **batch) {
+	int n;
+
+	if (*pos >= len) {
+		return 0;
+	}
+	n = data[*pos];
+	if (n == 0 || *pos + 1 + n > len) {
+		return -1;
+	}
+	*batch = data + *pos + 1;
+	*pos += 1 + n;
+	return n;
+}
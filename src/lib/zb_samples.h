@@ -0,0 +1,62 @@
+#ifndef __ZB_SAMPLES_H__
+#define __ZB_SAMPLES_H__
+/*
+ * zb_samples.h
+ *
+ * Compact binary encoding of a batch of sensor readings, sent as one OP_MEASURE_BATCH packet.
+ *
+ * The payload holds the number of readings, the time of the first one and the interval
+ * between them in milliseconds, the first reading, and then the difference of every other
+ * reading to the one before it. Numbers are varints: seven bits per byte, least significant
+ * first, with the top bit set on all but the last byte. The differences are zig-zag encoded
+ * (0, -1, 1, -2, 2, ... become 0, 1, 2, 3, 4, ...) so that small ones of either sign take
+ * one byte. A slowly changing 12 bit reading thus costs one byte instead of four hex
+ * characters, and one packet carries up to about 60 of them.
+ *
+ *   count (1 byte), time, interval, first reading, difference, difference, ...
+ *
+ * Batches that pile up between two requests are sent together as one fragmented message
+ * (zb_fragment.h), a history: each batch payload, preceded by its length in one byte.
+ */
+
+#include "zb_packets.h"
+#include <stdint.h>
+
+/* upper bound on the readings in one packet: one byte each, after the shortest header */
+#define ZB_SAMPLES_MAX (MAX_PACKET_SIZE - 3)
+
+/* collects readings into a payload. the members are private, except for buf, len and count. */
+struct zb_sample_writer {
+	unsigned char buf[MAX_PACKET_SIZE];
+	int len;
+	int count;
+	uint16_t last;
+};
+
+/* starts an empty batch whose first reading is taken at time (ms), and the others every interval ms. */
+void zb_samples_begin(struct zb_sample_writer *w, uint32_t time, uint16_t interval);
+
+/* appends a reading. returns 0, or -1 if it does not fit; send the batch and begin a new one then. */
+int zb_samples_add(struct zb_sample_writer *w, uint16_t value);
+
+/*
+ * decodes a batch payload into up to max values. returns the number of readings, and sets
+ * *time and *interval, or returns -1 if the payload is malformed or holds more than max.
+ */
+int zb_samples_decode(const unsigned char *data, int len, uint32_t *time, uint16_t *interval,
+		uint16_t *values, int max);
+
+/*
+ * appends the batch in w to the history of len bytes in buf, which has room for max.
+ * returns the new length, or -1 if the batch does not fit.
+ */
+int zb_samples_history_add(unsigned char *buf, int len, int max, const struct zb_sample_writer *w);
+
+/*
+ * finds the batch at *pos in a history of len bytes, and moves *pos past it. returns the
+ * length of the batch and points *batch at it, 0 at the end of the history, or -1 if the
+ * history is malformed.
+ */
+int zb_samples_history_next(const unsigned char *data, int len, int *pos, const unsigned char **batch);
+
+#endif /* __ZB_SAMPLES_H__ */
@@ -0,0 +1,99 @@
+#include "zb_schedule.h"
+#include <stddef.h>
+
+/*
+ * zb_schedule.c
+ *
+ * Used by the sensor boards as well as the master, so nothing here allocates or blocks.
+ */
+
+/* wrapping millisecond times, as returned by zb_transport_millis */
+#define BEFORE(a, b) ((long) ((a) - (b)) < 0)
+
+int zb_schedule_encode(unsigned char *out, uint8_t round, uint16_t slot_ms, const char *order, int count) {
+	int i;
+
+	if (count < 0 || count > ZB_SCHEDULE_SLOTS_MAX || (order == NULL && count != 0)) {
+		return -1;
+	}
+	out[0] = round;
+	out[1] = slot_ms >> 8;
+	out[2] = slot_ms & 0xff;
+	for (i = 0; i < count; i++) {
+		out[ZB_SCHEDULE_HEADER_LEN + i] = order[i];
+	}
+	return ZB_SCHEDULE_HEADER_LEN + count;
+}
+
+long zb_schedule_delay(const unsigned char *data, int len, char device_id, uint8_t *round) {
+	unsigned int slot_ms;
+	int i;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (len < ZB_SCHEDULE_HEADER_LEN) {
+		return -1;
+	}
+	if (round != NULL) {
+		*round = data[0];
+	}
+	slot_ms = (data[1] << 8) | data[2];
+
+	/* slots by device id. the master (0) has none */
+	if (len == ZB_SCHEDULE_HEADER_LEN) {
+		return device_id > 0 ? (long) (device_id - 1) * slot_ms : -1;
+	}
+
+	for (i = ZB_SCHEDULE_HEADER_LEN; i < len; i++) {
+		if ((char) data[i] == device_id) {
+			return (long) (i - ZB_SCHEDULE_HEADER_LEN) * slot_ms;
+		}
+	}
+	return -1;
+}
+
+void zb_round_begin(struct zb_round *r, uint8_t id, uint32_t expected, int timeout_ms, unsigned long now) {
+	r->active = 1;
+	r->id = id;
+	r->expected = expected;
+	r->replied = 0;
+	r->started = now;
+	r->deadline = now + timeout_ms;
+	r->finished = now;
+}
+
+int zb_round_reply(struct zb_round *r, char from, unsigned long now) {
+	uint32_t bit;
+
+	if (!r->active || (unsigned char) from >= ZB_ROUND_DEVICES_MAX) {
+		return 0;
+	}
+	bit = (uint32_t) 1 << (unsigned char) from;
+	if (!(r->expected & bit) || (r->replied & bit)) {
+		return 0;
+	}
+	r->replied |= bit;
+	if (r->replied != r->expected) {
+		return 0;
+	}
+	r->active = 0;
+	r->finished = now;
+	return 1;
+}
+
+int zb_round_expire(struct zb_round *r, unsigned long now) {
+	if (!r->active || BEFORE(now, r->deadline)) {
+		return 0;
+	}
+	r->active = 0;
+	r->finished = now;
+	return 1;
+}
+
+int zb_round_next_deadline(const struct zb_round *r, unsigned long now) {
+	if (!r->active) {
+		return -1;
+	}
+	return BEFORE(now, r->deadline) ? (int) (r->deadline - now) : 0;
+}
@@ -0,0 +1,79 @@
+#ifndef __ZB_SCHEDULE_H__
+#define __ZB_SCHEDULE_H__
+/*
+ * zb_schedule.h
+ *
+ * Reply slots for measurement rounds, so that the sensors answering one request do not all
+ * transmit at the same moment.
+ *
+ * A broadcast measure request reaches every sensor at once. If they all answer straight
+ * away, their radios find the channel busy, back off for random times that are short next
+ * to a reply, and collide anyway: replies are retried or lost, and a round over the whole
+ * network takes far longer than its replies one after the other would.
+ *
+ * Instead, the request carries a schedule. Its time is split into slots of slot_ms, and
+ * each sensor waits for the start of its own slot, counted from when the request arrived,
+ * before replying. Slots go by device id (sensor d replies in slot d - 1), or follow an
+ * explicit list of device ids; a sensor left out of a list does not reply at all. An empty
+ * payload, as older masters send, is answered at once.
+ *
+ *   round (1 byte), slot width in ms (2 bytes, big-endian), device id, device id, ...
+ *
+ * A slot should hold one reply on the air and through the coordinator's UART, so a round
+ * over n sensors takes n slots. A batch of a full packet needs about 100 ms at 9600 baud.
+ *
+ * On the master, a zb_round tracks which of the sensors asked have replied, and when the
+ * round completed or ran out of time. It has no lock; callers share one between threads
+ * under their own.
+ */
+
+#include "zb_packets.h"
+#include <stdint.h>
+
+#define ZB_SCHEDULE_HEADER_LEN 3
+#define ZB_SCHEDULE_SLOTS_MAX (MAX_PACKET_SIZE - ZB_SCHEDULE_HEADER_LEN)
+
+/* zb_round keeps one bit per device id, so it tracks ids 0 to 31 */
+#define ZB_ROUND_DEVICES_MAX 32
+
+/*
+ * writes the schedule of a request into out, which needs ZB_SCHEDULE_HEADER_LEN + count
+ * bytes. order lists count device ids in slot order, or is NULL for slots by device id.
+ * returns the length of the payload, or -1 if count is too large.
+ */
+int zb_schedule_encode(unsigned char *out, uint8_t round, uint16_t slot_ms, const char *order, int count);
+
+/*
+ * the milliseconds device device_id waits after receiving a request with this payload
+ * before replying: 0 if it carries no schedule, or -1 if the device has no slot in it or
+ * the schedule is malformed. sets *round if the payload has a schedule and round is not NULL.
+ */
+long zb_schedule_delay(const unsigned char *data, int len, char device_id, uint8_t *round);
+
+/* the replies to one round. the members are read only, except through the functions below. */
+struct zb_round {
+	uint8_t active;
+	uint8_t id;
+	uint32_t expected;				/* bit d: device d was asked */
+	uint32_t replied;
+	unsigned long started;
+	unsigned long deadline;
+	unsigned long finished;			/* when the last reply arrived, or the deadline passed */
+};
+
+/* starts tracking round id at time now, asking the devices in the expected mask, which all
+ * should have replied within timeout_ms. a round still active is abandoned. */
+void zb_round_begin(struct zb_round *r, uint8_t id, uint32_t expected, int timeout_ms, unsigned long now);
+
+/* records a reply from device from. returns 1 if it completed the round, 0 otherwise,
+ * also if the device was not asked or had already replied. */
+int zb_round_reply(struct zb_round *r, char from, unsigned long now);
+
+/* ends the round if its deadline has passed by now. returns 1 if it did; the devices in
+ * expected & ~replied never replied. */
+int zb_round_expire(struct zb_round *r, unsigned long now);
+
+/* milliseconds from now until the round times out, or -1 if none is active. */
+int zb_round_next_deadline(const struct zb_round *r, unsigned long now);
+
+#endif /* __ZB_SCHEDULE_H__ */
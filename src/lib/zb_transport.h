@@ -9,24 +9,157 @@
  * Abstraction for accessing a serial connection to a Zigbee device.
  * There will be several implementations:
  * 	- zb_transport_tty.c	Target: Raspberry Pi. Buffer managed and populated using pthreads library.
+ * 		Optionally driven by io_uring instead (zb_transport_uring.c).
  * 	- zb_transport_embedded.c	Target: STM32F4/F0. Buffer managed and populated using interrupts and a USART peripheral.
  *
+ * Each open serial connection is represented by a zb_transport_t handle, so one process can
+ * drive several radios. All state belongs to the handle; there are no transport globals.
  */
 
-/* opens the serial device and initialises any receive buffer structures. */
-void zb_transport_init();
+#define ZB_TRANSPORT_DEFAULT_PATH "/dev/ttyAMA0"
+#define ZB_TRANSPORT_DEFAULT_BAUD 9600
+#define ZB_TRANSPORT_DEFAULT_BUFFER_SIZE 256
+#define ZB_TRANSPORT_DEFAULT_TX_QUEUE_SIZE 64
+
+/* largest frame that can be sent, escaped, delimiter included */
+#define ZB_SEND_MAX 256
+
+/* value for rx_cpu to leave the receive thread unpinned */
+#define ZB_TRANSPORT_ANY_CPU (-1)
+
+/* flags for zb_transport_config */
+#define ZB_TRANSPORT_POLLED 0x01	/* no receive thread. caller polls zb_transport_fd and calls zb_transport_process_ready */
+#define ZB_TRANSPORT_IO_URING 0x02	/* Linux: receive and transmit through io_uring, falling back to read() if unavailable. ignored when polled */
+#define ZB_TRANSPORT_RTSCTS 0x04	/* hardware flow control. the radio must be configured with D6=1 and D7=1 */
+
+/*
+ * transmit pacing model for an XBee ZB module: size of its serial receive buffer, and
+ * over-the-air time per frame (CSMA backoff, headers, MAC ack) and per byte at 250 kbit/s.
+ * set pace_buffer to ZB_TRANSPORT_XBEE_BUFFER_SIZE to enable pacing with these values.
+ */
+#define ZB_TRANSPORT_XBEE_BUFFER_SIZE 202
+#define ZB_TRANSPORT_XBEE_FRAME_US 2500
+#define ZB_TRANSPORT_XBEE_BYTE_US 32
+
+typedef struct zb_transport zb_transport_t;
+
+/* receives data read by zb_transport_process_ready. buf is only valid during the call. */
+typedef void (*zb_receive_callback)(void *arg, unsigned char *buf, int len);
+
+/* parameters for opening a transport. initialise with zb_transport_config_init. */
+struct zb_transport_config {
+	const char *path;			/* serial device. ignored on embedded targets. */
+	int fd;						/* Linux: already open descriptor (tty, pty or socket) to use instead of path, or -1. closed with the transport */
+	unsigned long baud;			/* line rate, e.g. 9600, 115200, 230400 */
+	unsigned int buffer_size;	/* receive buffer size in bytes, rounded up to a power of two */
+	unsigned int tx_queue_size;	/* frames that can be queued for transmission, rounded up to a power of two */
+	int rx_cpu;					/* CPU to pin the receive thread to, or ZB_TRANSPORT_ANY_CPU */
+	int flags;					/* ZB_TRANSPORT_* flags */
+	unsigned int pace_buffer;	/* modelled radio buffer in bytes. frames are held back so that it never overflows. 0 = no pacing */
+	unsigned int pace_frame_us;	/* modelled airtime per frame */
+	unsigned int pace_byte_us;	/* modelled airtime per byte */
+	const char *capture_path;	/* Linux: append everything read and written to this capture file (zb_capture.h), or NULL */
+	zb_receive_callback on_receive;	/* required in polled mode */
+	void *on_receive_arg;
+};
+
+/* counters describing the transmit path. */
+struct zb_transport_stats {
+	unsigned long long frames_sent;
+	unsigned long long bytes_sent;
+	unsigned int bytes_in_flight;		/* bytes the pacing model considers still in the radio's buffer */
+	unsigned long long pace_blocked_us;	/* time the writer held frames back for the pacing model */
+	unsigned long long cts_blocked_us;	/* time the writer waited for the radio to assert CTS */
+	unsigned long long frames_dropped;	/* frames zb_send could not queue, as the queue was full */
+};
+
+/* fills in the defaults: ZB_TRANSPORT_DEFAULT_PATH at ZB_TRANSPORT_DEFAULT_BAUD, unpinned, threaded,
+ * no flow control, no pacing (but with the XBee airtime model ready to use). */
+void zb_transport_config_init(struct zb_transport_config *cfg);
+
+/* opens the serial device and initialises any receive buffer structures.
+ * returns NULL if the device could not be opened or configured. */
+zb_transport_t *zb_transport_open(const struct zb_transport_config *cfg);
 
 /* closes the serial device connection and destroys the buffers if required. */
-void zb_transport_stop();
+void zb_transport_close(zb_transport_t *t);
+
+/* queues a complete data packet for sending over the serial line, and returns without
+ * waiting for it to be written. safe to call from several threads at once.
+ * returns 0, or -1 if the transmit queue is full and the packet was dropped. */
+int zb_send(zb_transport_t *t, unsigned char *buf, unsigned char len);
+
+/*
+ * zb_send without the copy: returns room for one frame of up to ZB_SEND_MAX bytes,
+ * to encode the frame into in place, or NULL if the transmit queue is full.
+ * every buffer returned must be passed to zb_send_commit with the length of the frame
+ * (at least 1), which sends it. on Linux, the buffer is a slot of the transmit queue,
+ * and frames queued after it by other threads wait for it, so commit promptly.
+ */
+unsigned char *zb_send_reserve(zb_transport_t *t);
+void zb_send_commit(zb_transport_t *t, unsigned char *frame, int len);
+
+/* blocks until every queued packet has been written and transmitted by the UART.
+ * returns 0, or -1 if writing to the device failed; zb_send then takes no more frames. */
+int zb_transport_flush(zb_transport_t *t);
+
+/* copies a snapshot of the transmit counters into stats. */
+void zb_transport_get_stats(zb_transport_t *t, struct zb_transport_stats *stats);
+
+/* blocks until at least one character is available in the serial buffer,
+ * then copies up to len of the available characters into buf.
+ * returns the number of characters copied.
+ * in polled mode this does not block, and returns 0 if nothing is available. */
+int zb_read(zb_transport_t *t, unsigned char *buf, int len);
 
-/* sends a complete data packet over the serial line */
-void zb_send(unsigned char *buf, unsigned char len);
+/* blocks until a character is available in the serial buffer.
+ * equivalent to zb_read with a length of one. returns the character as an unsigned char.
+ * in polled mode this does not block, and returns -1 if nothing is available. */
+int zb_getc(zb_transport_t *t);
 
-/* blocks until a character is available in the serial buffer */
-char zb_getc();
+/* as zb_read, but gives up after timeout_ms milliseconds and returns 0.
+ * a timeout of 0 never blocks, a negative one blocks like zb_read. */
+int zb_read_timeout(zb_transport_t *t, unsigned char *buf, int len, int timeout_ms);
+
+/* as zb_getc, but returns the character as an unsigned char, or -1 if none arrived
+ * within timeout_ms milliseconds. */
+int zb_getc_timeout(zb_transport_t *t, int timeout_ms);
+
+/* a millisecond clock that never goes backwards (CLOCK_MONOTONIC on Linux, the SysTick
+ * count on embedded targets), for timing out requests. it wraps, so only compare
+ * differences: (long) (zb_transport_millis() - start) > timeout. */
+unsigned long zb_transport_millis();
+
+/*
+ * Polled mode (ZB_TRANSPORT_POLLED): the transport starts no threads. The caller waits for
+ * zb_transport_fd to become readable (poll/epoll/select), then calls zb_transport_process_ready,
+ * which reads everything that is available and passes it to the on_receive callback from
+ * the configuration, typically to feed zb_parse. A polled transport must only be used
+ * from the thread running the event loop.
+ */
+
+/* file descriptor to wait on for readability. -1 where there is none (embedded targets). */
+int zb_transport_fd(zb_transport_t *t);
+
+/* reads all available data and passes it to the on_receive callback, without blocking,
+ * and writes as much queued data as the device accepts.
+ * returns the number of bytes processed, or -1 if the device has failed or been closed. */
+int zb_transport_process_ready(zb_transport_t *t);
+
+/* 1 if queued data is waiting for the device to become writable. poll for that as well then. */
+int zb_transport_wants_write(zb_transport_t *t);
+
+/* milliseconds until the pacing model releases the next queued frame, or -1 if it is not
+ * holding anything back. use as the poll timeout, then call zb_transport_process_ready. */
+int zb_transport_tx_delay_ms(zb_transport_t *t);
 
 /* blocks for (at least!) one second, used for guard timings on entering command mode */
 void zb_guard_delay();
 
+/* embedded targets: advances zb_transport_millis by one. the library's SysTick_Handler calls
+ * it, and is weak; an application with its own SysTick_Handler (e.g. in stm32f4xx_it.c) must
+ * call it from there instead. */
+void zb_transport_tick(void);
+
 
 #endif /* __ZB_TRANSPORT_H__ */
@@ -1,4 +1,5 @@
 #include "zb_transport.h"
+#include "zb_ring.h"
 #include "stm32f4_discovery.h"
 
 /*
@@ -8,27 +9,41 @@
  * and the STM32F4's USART peripherals.
  *
  * Currently hard-coded for USART3 peripheral - should be more flexible through #defines.
+ * There is therefore a single transport instance; opening it again re-initialises the
+ * peripheral with the new configuration and returns the same handle.
  *
- * implements an interrupt-safe queue for holding received bytes.
+ * received bytes are stored by the interrupt handler in a single-producer/single-consumer
+ * ring (zb_ring.h). The interrupt handler only writes the tail index and the application
+ * only writes the head index, so no interrupt masking is required on either side.
  *
  * Author: Kristian Hentschel
  * Team Project 3. University of Glasgow. 2013.
  */
 
-#define QUEUE_SIZE 72
+/* must be a power of two */
+#define QUEUE_SIZE 128
 
-typedef struct queue {
-	int head;
-	int tail;
-	int count;
-	char elements[QUEUE_SIZE];
-} *Queue;
+struct zb_transport {
+	zb_ring_t rx;
+	zb_receive_callback on_receive;
+	void *on_receive_arg;
+	unsigned long frames_sent;
+	unsigned long bytes_sent;
+	unsigned char frame[ZB_SEND_MAX];	/* for zb_send_reserve */
+};
 
-static int q_is_empty(Queue q);
-static void q_put(Queue q, char c);
-static char q_take(Queue q);
+static struct zb_transport USART3_transport;
+static unsigned char RX_elements[QUEUE_SIZE];
 
-struct queue RX;
+/* milliseconds since zb_transport_open, counted by the SysTick interrupt */
+static volatile unsigned long ticks;
+
+/* the application may define its own SysTick_Handler instead of ours */
+#if defined(__CC_ARM)
+#define ZB_WEAK __weak
+#else
+#define ZB_WEAK __attribute__((weak))
+#endif
 
 /* synchronously sends a single character, by busy-waiting until send buffer is empty. */
 static void zb_putc(unsigned char c) {
@@ -37,15 +52,37 @@ static void zb_putc(unsigned char c) {
 	USART_SendData(USART3, c);
 }
 
-/* initialise USART Peripheral and set up GPIO pins for its use. Enable interrupts. */
-void zb_transport_init() {
+void zb_transport_config_init(struct zb_transport_config *cfg) {
+	cfg->path = ZB_TRANSPORT_DEFAULT_PATH;
+	cfg->fd = -1;
+	cfg->baud = ZB_TRANSPORT_DEFAULT_BAUD;
+	cfg->buffer_size = QUEUE_SIZE;
+	cfg->tx_queue_size = 0;
+	cfg->rx_cpu = ZB_TRANSPORT_ANY_CPU;
+	cfg->flags = 0;
+	cfg->pace_buffer = 0;
+	cfg->pace_frame_us = ZB_TRANSPORT_XBEE_FRAME_US;
+	cfg->pace_byte_us = ZB_TRANSPORT_XBEE_BYTE_US;
+	cfg->capture_path = NULL;
+	cfg->on_receive = NULL;
+	cfg->on_receive_arg = NULL;
+}
+
+/* initialise USART Peripheral and set up GPIO pins for its use. Enable interrupts.
+ * the receive buffer is statically allocated, so buffer_size, path and rx_cpu are ignored.
+ * zb_send blocks until every byte is out, so there is no pacing either.
+ * with ZB_TRANSPORT_RTSCTS, PB13 (CTS) and PB14 (RTS) are used for hardware flow control.
+ * SysTick is set up to interrupt every millisecond, see zb_transport_tick below. */
+zb_transport_t *zb_transport_open(const struct zb_transport_config *cfg) {
 	GPIO_InitTypeDef	GPIO_InitStructure;
 	USART_InitTypeDef	USART_InitStructure;
 	NVIC_InitTypeDef	NVIC_InitStructure;
 	/* init data structures */
-	RX.head = 0;
-	RX.tail = 0;
-	RX.count = 0;
+	zb_ring_init(&USART3_transport.rx, RX_elements, QUEUE_SIZE);
+	USART3_transport.on_receive = cfg->on_receive;
+	USART3_transport.on_receive_arg = cfg->on_receive_arg;
+	USART3_transport.frames_sent = 0;
+	USART3_transport.bytes_sent = 0;
 	
 	/* init uart */
 	
@@ -67,19 +104,27 @@ void zb_transport_init() {
 	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_10 | GPIO_Pin_11;
 	GPIO_Init(GPIOB, &GPIO_InitStructure);
 
+	if (cfg->flags & ZB_TRANSPORT_RTSCTS) {
+		GPIO_PinAFConfig(GPIOB, GPIO_PinSource13, GPIO_AF_USART3);
+		GPIO_PinAFConfig(GPIOB, GPIO_PinSource14, GPIO_AF_USART3);
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_13 | GPIO_Pin_14;
+		GPIO_Init(GPIOB, &GPIO_InitStructure);
+	}
+
 	/* 4 baud rate, word length, stop bit, parity, flow control */
 	USART_StructInit(&USART_InitStructure);
-	USART_InitStructure.USART_BaudRate				= 9600;
+	USART_InitStructure.USART_BaudRate				= cfg->baud;
 	USART_InitStructure.USART_WordLength			= USART_WordLength_8b;
 	USART_InitStructure.USART_StopBits				= USART_StopBits_1;
 	USART_InitStructure.USART_Parity				= USART_Parity_No;
 	USART_InitStructure.USART_Mode	 				= USART_Mode_Rx | USART_Mode_Tx;
-	USART_InitStructure.USART_HardwareFlowControl	= USART_HardwareFlowControl_None;
+	USART_InitStructure.USART_HardwareFlowControl	= (cfg->flags & ZB_TRANSPORT_RTSCTS)
+		? USART_HardwareFlowControl_RTS_CTS : USART_HardwareFlowControl_None;
 
 	USART_Init(USART3, &USART_InitStructure);
 
 	/* 5 enable nvic and these interrupts if interrupts required */
-	//USART_ITConfig(USART3, USART_IT_RXNE, ENABLE);
+	USART_ITConfig(USART3, USART_IT_RXNE, ENABLE);
 
 	/* 6 enable DMA if using this? */
 
@@ -88,43 +133,158 @@ void zb_transport_init() {
 	
 	
 	/* init NVIC */
-	//NVIC_PriorityGroupConfig(NVIC_PriorityGroup_0); /* do not need preemption of interrupts as we are only using one. */
-	//NVIC_Init(&NVIC_InitStructure);
-	
+	NVIC_PriorityGroupConfig(NVIC_PriorityGroup_0); /* do not need preemption of interrupts as we are only using one. */
+	NVIC_InitStructure.NVIC_IRQChannel						= USART3_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority	= 0;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority			= 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd					= ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	/* 1 ms SysTick for timeouts and the guard delay */
+	SysTick_Config(SystemCoreClock / 1000);
+
+	return &USART3_transport;
+
 }
 
 /* disable interrupts for the usart peripheral (?) */
-void zb_transport_stop() {
+void zb_transport_close(zb_transport_t *t) {
 	/* this space intentionally left empty:
 	 * closing the connection does not really apply for embedded system. */
 }
 
-/* blocking write, sending character by character */
-void zb_send(unsigned char *buf, unsigned char len) {
+/* blocking write, sending character by character. there is no transmit queue. */
+int zb_send(zb_transport_t *t, unsigned char *buf, unsigned char len) {
 	int i;
 	for (i = 0; i < len; i++) {
 		zb_putc(buf[i]);
 	}
+	t->frames_sent++;
+	t->bytes_sent += len;
+	return 0;
 }
 
-/* disable interrupts, take character from buffer, re-enable interrupts */
-char zb_getc() {
-	/* TODO temporary hack - uses polling from usart peripheral rather than interrupts. */
-		while(! (USART3->SR & USART_FLAG_RXNE) )
+/* there is one transport and one thread, so a single frame buffer will do. */
+unsigned char *zb_send_reserve(zb_transport_t *t) {
+	return t->frame;
+}
+
+void zb_send_commit(zb_transport_t *t, unsigned char *frame, int len) {
+	zb_send(t, frame, len);
+}
+
+/* wait for the last character to leave the shift register. */
+int zb_transport_flush(zb_transport_t *t) {
+	while (!(USART3->SR & USART_FLAG_TC))
 		;
-	return USART_ReceiveData(USART3) & 0xff;
-	
-	/* wait until item has been added to queue */
-	while (q_is_empty(&RX))
+	return 0;
+}
+
+/* zb_send has always finished writing by the time it returns. */
+int zb_transport_wants_write(zb_transport_t *t) {
+	return 0;
+}
+
+/* nothing is ever held back, as zb_send does not return before the frame is out. */
+int zb_transport_tx_delay_ms(zb_transport_t *t) {
+	return -1;
+}
+
+/* the cycles spent waiting for CTS are not counted separately. */
+void zb_transport_get_stats(zb_transport_t *t, struct zb_transport_stats *stats) {
+	stats->frames_sent = t->frames_sent;
+	stats->bytes_sent = t->bytes_sent;
+	stats->bytes_in_flight = 0;
+	stats->pace_blocked_us = 0;
+	stats->cts_blocked_us = 0;
+	stats->frames_dropped = 0;		/* zb_send waits for the USART instead */
+}
+
+/* wait until the interrupt handler has put a character into the ring, then take it. */
+int zb_getc(zb_transport_t *t) {
+	unsigned char c;
+
+	while (!zb_ring_take(&t->rx, &c))
 		;
 
-	/* take item from queue */
-	return q_take(&RX);
+	return c;
+}
+
+/* block for the first character, then take any others already waiting without blocking again. */
+int zb_read(zb_transport_t *t, unsigned char *buf, int len) {
+	if (len <= 0) {
+		return 0;
+	}
+
+	buf[0] = zb_getc(t);
+
+	return 1 + zb_ring_read(&t->rx, buf + 1, len - 1);
+}
+
+/* spin on the ring until a character arrives or the tick count reaches the deadline. */
+int zb_getc_timeout(zb_transport_t *t, int timeout_ms) {
+	unsigned long start = ticks;
+	unsigned char c;
+
+	while (!zb_ring_take(&t->rx, &c)) {
+		if (timeout_ms >= 0 && (long) (ticks - start) >= timeout_ms) {
+			return -1;
+		}
+	}
+
+	return c;
 }
 
-/* delay for one second through SysTick or busy loop. */
+int zb_read_timeout(zb_transport_t *t, unsigned char *buf, int len, int timeout_ms) {
+	int c;
+
+	if (len <= 0 || (c = zb_getc_timeout(t, timeout_ms)) < 0) {
+		return 0;
+	}
+
+	buf[0] = c;
+
+	return 1 + zb_ring_read(&t->rx, buf + 1, len - 1);
+}
+
+unsigned long zb_transport_millis() {
+	return ticks;
+}
+
+/* there is no file descriptor; the main loop can simply call zb_transport_process_ready. */
+int zb_transport_fd(zb_transport_t *t) {
+	return -1;
+}
+
+/* pass everything the interrupt handler has stored so far to the callback. */
+int zb_transport_process_ready(zb_transport_t *t) {
+	unsigned char buf[QUEUE_SIZE];
+	int n;
+
+	n = zb_ring_read(&t->rx, buf, QUEUE_SIZE);
+	if (n > 0 && t->on_receive != NULL) {
+		t->on_receive(t->on_receive_arg, buf, n);
+	}
+
+	return n;
+}
+
+/* delay for (at least) one second on the SysTick count. */
 void zb_guard_delay() {
-	/* TODO */	
+	unsigned long start = ticks;
+
+	while (ticks - start <= 1000)
+		;
+}
+
+/* called from the SysTick interrupt, once per millisecond once zb_transport_open has configured it. */
+void zb_transport_tick(void) {
+	ticks++;
+}
+
+/* replaced by the application's own handler, if it has one, which then calls zb_transport_tick. */
+ZB_WEAK void SysTick_Handler(void) {
+	zb_transport_tick();
 }
 
 /* Interrupt handler for USART.
@@ -134,49 +294,13 @@ void zb_guard_delay() {
  * 	- clear interrupt flag
  */
 void USART3_IRQHandler(void) {
-	char c;
+	unsigned char c;
 
 	if (USART_GetITStatus(USART3, USART_IT_RXNE) == SET) {
 		c = USART_ReceiveData(USART3) & 0xff; /* also clears RXNE interrupt flag */
-		q_put(&RX, c);
+		zb_ring_put(&USART3_transport.rx, c); /* discards the character if the ring is full. tough. */
 	} else {
 		/* TODO may have to clear other interrupt flags, see peripheral driver source comments. */
 	}
 	
 }
-
-/* take an item from an interrupt-safe queue.
- * this is only called from non-interrupt code. */
-char q_take(Queue q) {
-	char c;
-
-	while (q_is_empty(q))
-		; /* do nothing */
-
-	/* TODO disable interrupts */
-
-	c = q->elements[q->head];
-	q->count -= 1;
-	q->head = (q->head + 1) % QUEUE_SIZE;
-
-	/* TODO enable interrupts */
-
-	return c;
-}
-
-/* put an item into the queue.
- * this is only called from the irq handler
- * and discards items if the queue is full. tough. */
-void q_put(Queue q, char c) {
-	if (q->count == QUEUE_SIZE) {
-		return;
-	}
-	q->elements[q->tail] = c;
-	q->count++;
-	q->tail = (q->tail + 1) % QUEUE_SIZE;
-}
-
-/* return 1 if queue is empty, 0 otherwise. */
-int q_is_empty(Queue q) {
-	return (q->count == 0);
-}
@@ -0,0 +1,164 @@
+#ifndef __ZB_TRANSPORT_LINUX_H__
+#define __ZB_TRANSPORT_LINUX_H__
+/*
+ * zb_transport_linux.h
+ *
+ * Internal definitions shared by the Linux transport implementation files.
+ * Not part of the library API - applications only see the opaque zb_transport_t.
+ *
+ * 	- zb_transport_tty.c	device setup, receive buffer, read() based monitor thread.
+ * 	- zb_transport_tx.c	transmit queue and writev() based writer thread.
+ * 	- zb_transport_uring.c	io_uring based receive/transmit loop, used instead of the monitor thread.
+ * 	- zb_capture.c	capture of received and transmitted chunks, and replay.
+ */
+
+#include "zb_transport.h"
+#include "zb_ring.h"
+#include "zb_txqueue.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* most frames written by a single writev() */
+#define ZB_TX_IOV_MAX 16
+
+/* most frames the pacing model tracks in the radio's buffer at once */
+#define ZB_PACE_MAX_FRAMES 32
+
+typedef struct buffer {
+	zb_ring_t ring;
+	int nonempty_fd;			/* eventfd the consumer sleeps on */
+	int nonfull_fd;				/* eventfd the producer sleeps on */
+	atomic_int consumer_sleeping;
+	atomic_int producer_sleeping;
+	unsigned char *elements;
+} Buffer;
+
+/* model of the radio's serial receive buffer, emptied at the rate frames go over the air.
+ * owned by the writer. */
+typedef struct tx_pacer {
+	unsigned int buffer;		/* 0 = pacing disabled */
+	unsigned long long frame_ns;
+	unsigned long long byte_ns;
+	unsigned long long air_free_ns;	/* when the radio will have sent everything admitted so far */
+	struct {
+		unsigned long long done_ns;
+		unsigned int len;
+	} frames[ZB_PACE_MAX_FRAMES];
+	unsigned int head, count;
+	unsigned int in_flight;
+} TxPacer;
+
+typedef struct tx_state {
+	zb_txqueue_t queue;
+	unsigned int offset;		/* bytes of the head frame already written. writer only */
+	unsigned int admitted;		/* frames at the head already admitted by the pacer. writer only */
+	TxPacer pacer;
+	int rtscts;
+	int wake_fd;				/* eventfd the writer sleeps on */
+	int drained_fd;				/* eventfd zb_transport_flush sleeps on */
+	atomic_int writer_sleeping;
+	atomic_int flush_waiting;
+	atomic_int dead;			/* the device failed; nothing will drain the queue again */
+
+	/* statistics, written by the writer only */
+	_Atomic unsigned long long frames_sent;
+	_Atomic unsigned long long bytes_sent;
+	atomic_uint bytes_in_flight;
+	_Atomic unsigned long long pace_blocked_ns;
+	_Atomic unsigned long long cts_blocked_ns;
+
+	/* written by the senders */
+	_Atomic unsigned long long frames_dropped;
+} TxState;
+
+struct zb_uring;
+
+struct zb_transport {
+	int serial_fd;
+	int flags;
+	pthread_t receiver;
+	pthread_t writer;
+	int writer_running;
+	Buffer rx;
+	TxState tx;
+	zb_receive_callback on_receive;
+	void *on_receive_arg;
+	struct zb_uring *uring;		/* NULL unless the io_uring backend is running */
+	int capture_fd;				/* capture file, or -1 */
+};
+
+/* zb_transport_tty.c: sleep/wake protocol shared by the buffers and queues. */
+
+/* block until the eventfd is signalled. */
+void zb_sleep_on(int fd);
+
+/* signal the eventfd, but only if *sleeping was set by a thread going to sleep on it. */
+void zb_wake_if_sleeping(atomic_int *sleeping, int fd);
+
+/* zb_transport_tty.c: producer side of the receive buffer, for use by the receive backends. */
+
+/* block until the receive buffer has free space, or until woken by zb_buffer_wake_producer. */
+void zb_buffer_wait_space(Buffer *b);
+
+/* wake the consumer if it is sleeping on an empty buffer. call after committing data. */
+void zb_buffer_wake_consumer(Buffer *b);
+
+/* unconditionally wake a producer sleeping in zb_buffer_wait_space, e.g. to make it stop. */
+void zb_buffer_wake_producer(Buffer *b);
+
+/* zb_transport_tx.c */
+
+/* set up the transmit queue (slots rounded up to a power of two) and pacing model. */
+int zb_tx_init(struct zb_transport *t, const struct zb_transport_config *cfg);
+void zb_tx_destroy(struct zb_transport *t);
+
+/* start/stop the writer thread used when neither polled nor driven by io_uring. */
+int zb_tx_start_writer(struct zb_transport *t);
+void zb_tx_stop_writer(struct zb_transport *t);
+
+/* fill iov with the published frames at the head of the queue that the pacer admits,
+ * the first one minus the part already written. returns the number of entries,
+ * at most ZB_TX_IOV_MAX. writer only. */
+int zb_tx_gather(struct zb_transport *t, struct iovec *iov);
+
+/* nanoseconds until the pacer admits the head frame, or 0 if it is not holding one back.
+ * writer only, after zb_tx_gather returned 0. */
+unsigned long long zb_tx_pace_delay(struct zb_transport *t);
+
+/* record time the writer spent held back by the pacer. */
+void zb_tx_pace_blocked(struct zb_transport *t, unsigned long long ns);
+
+/* account for n bytes written from the head of the queue. writer only. */
+void zb_tx_advance(struct zb_transport *t, size_t n);
+
+/* announce that the writer is about to sleep until woken through tx.wake_fd.
+ * returns 0 (and does not sleep) if a frame was published in the meantime. writer only. */
+int zb_tx_prepare_sleep(struct zb_transport *t);
+
+/* the device failed to write: stop taking frames, and wake zb_transport_flush. writer only. */
+void zb_tx_fail(struct zb_transport *t);
+
+/* polled mode: write as much as the device accepts without blocking. */
+void zb_tx_drain(struct zb_transport *t);
+
+/* zb_transport_uring.c */
+
+/* start the io_uring receive/transmit thread for t.
+ * returns -1 if io_uring is not available, in which case nothing has been started. */
+int zb_uring_start(struct zb_transport *t);
+
+/* stop the thread and release the ring. */
+void zb_uring_stop(struct zb_transport *t);
+
+/* zb_capture.c */
+
+/* create or append to the capture file at path. returns -1 on failure. */
+int zb_capture_open(struct zb_transport *t, const char *path);
+void zb_capture_close(struct zb_transport *t);
+
+/* append a record of a chunk read (ZB_CAPTURE_RX) or written (ZB_CAPTURE_TX).
+ * only call if t->capture_fd >= 0. safe to call from the receive and transmit threads at once. */
+void zb_capture(struct zb_transport *t, int dir, const unsigned char *buf, size_t len);
+
+#endif /* __ZB_TRANSPORT_LINUX_H__ */
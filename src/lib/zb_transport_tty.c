@@ -1,13 +1,18 @@
-#include "zb_transport.h"
+#define _GNU_SOURCE
+#include "zb_transport_linux.h"
+#include "zb_capture.h"
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "diagnostics.h"
-#define RX_BUFFER_SIZE 256
-#define SERIAL_DEVICE "/dev/ttyAMA0"
-#define SERIAL_BAUD_RATE 9600
 
 /*
  * zb_transport_tty.h
@@ -15,107 +20,457 @@
  * Seriel communication interface for tty device on the Raspberry Pi.
  *
  * Realised using pthreads for the receive buffer with a separate thread monitoring
- * the serial device.
+ * the serial device. Every open transport has its own device, buffer and thread.
  *
+ * The receive buffer is a lock-free single-producer/single-consumer ring (zb_ring.h).
+ * Each side only enters the kernel to sleep when it cannot make progress: it sets its
+ * sleeping flag, re-checks the ring, and then blocks on an eventfd. The other side
+ * only writes to that eventfd if the flag was set, so in the steady state neither
+ * thread makes any futex or eventfd calls.
+ *
+ * With ZB_TRANSPORT_IO_URING, zb_transport_uring.c replaces the monitor thread if the
+ * kernel supports it, and the monitor thread is used otherwise.
+ *
+ * Transmission goes through a queue and writer thread of its own, see zb_transport_tx.c.
+ *
+ * In polled mode there is no thread and no ring: the device is non-blocking and
+ * zb_transport_process_ready reads it straight into a scratch buffer for the callback.
  *
  * Author: Kristian Hentschel
  * Team Project 3. University of Glasgow. 2013
  */
 
-/* worker method. argument is a file descriptor for the serial interface */
+/* worker method. argument is the transport whose device should be monitored */
 static void *serial_monitor(void *arg);
 
-typedef struct buffer {
-	pthread_mutex_t lock;
-	pthread_cond_t	nonfull;
-	pthread_cond_t	nonempty;
-	int count;
-	int last;
-	int first;
-	char elements[RX_BUFFER_SIZE];
-} Buffer;
-
-/* global variables */
-static pthread_t pthread_receiver;
-static Buffer RX_buffer;
-static int serial_fd;
-
-/* open and setup the serial device.
- * initialise the buffer structure, locks, and condition variables.
- * start the monitoring thread
- */
-void zb_transport_init() {
+/* supported line rates */
+static const struct {
+	unsigned long baud;
+	speed_t speed;
+} baud_rates[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+};
+
+/* returns 0 and sets speed if baud is supported, -1 otherwise. */
+static int baud_to_speed(unsigned long baud, speed_t *speed) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++) {
+		if (baud_rates[i].baud == baud) {
+			*speed = baud_rates[i].speed;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* block until the other side signals the eventfd. */
+void zb_sleep_on(int fd) {
+	eventfd_t v;
+	eventfd_read(fd, &v);
+}
+
+/* wake the other side, but only if it has announced that it is (about to be) asleep. */
+void zb_wake_if_sleeping(atomic_int *sleeping, int fd) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(sleeping, memory_order_relaxed) && atomic_exchange(sleeping, 0)) {
+		eventfd_write(fd, 1);
+	}
+}
+
+void zb_buffer_wait_space(Buffer *b) {
+	atomic_store(&b->producer_sleeping, 1);
+	if (zb_ring_count(&b->ring) < zb_ring_size(&b->ring)) {
+		atomic_store(&b->producer_sleeping, 0);
+		return;
+	}
+	zb_sleep_on(b->nonfull_fd);
+}
+
+void zb_buffer_wake_consumer(Buffer *b) {
+	zb_wake_if_sleeping(&b->consumer_sleeping, b->nonempty_fd);
+}
+
+void zb_buffer_wake_producer(Buffer *b) {
+	eventfd_write(b->nonfull_fd, 1);
+}
+
+/* set up ring storage and, unless polled, wakeup eventfds. size is rounded up to a power of two. */
+static int buffer_init(Buffer *b, unsigned int size, int polled) {
+	unsigned int n;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+
+	b->elements = malloc(n);
+	if (b->elements == NULL) {
+		return -1;
+	}
+	if (!polled) {
+		b->nonempty_fd = eventfd(0, EFD_CLOEXEC);
+		b->nonfull_fd = eventfd(0, EFD_CLOEXEC);
+		if (b->nonempty_fd < 0 || b->nonfull_fd < 0) {
+			return -1;
+		}
+	}
+
+	zb_ring_init(&b->ring, b->elements, n);
+	atomic_init(&b->consumer_sleeping, 0);
+	atomic_init(&b->producer_sleeping, 0);
+	return 0;
+}
+
+static void buffer_destroy(Buffer *b) {
+	if (b->nonempty_fd >= 0) {
+		close(b->nonempty_fd);
+	}
+	if (b->nonfull_fd >= 0) {
+		close(b->nonfull_fd);
+	}
+	free(b->elements);
+}
+
+void zb_transport_config_init(struct zb_transport_config *cfg) {
+	cfg->path = ZB_TRANSPORT_DEFAULT_PATH;
+	cfg->fd = -1;
+	cfg->baud = ZB_TRANSPORT_DEFAULT_BAUD;
+	cfg->buffer_size = ZB_TRANSPORT_DEFAULT_BUFFER_SIZE;
+	cfg->tx_queue_size = ZB_TRANSPORT_DEFAULT_TX_QUEUE_SIZE;
+	cfg->rx_cpu = ZB_TRANSPORT_ANY_CPU;
+	cfg->flags = 0;
+	cfg->pace_buffer = 0;
+	cfg->pace_frame_us = ZB_TRANSPORT_XBEE_FRAME_US;
+	cfg->pace_byte_us = ZB_TRANSPORT_XBEE_BYTE_US;
+	cfg->capture_path = NULL;
+	cfg->on_receive = NULL;
+	cfg->on_receive_arg = NULL;
+}
+
+/* set tc options for serial port transfers.
+ * a descriptor adopted through cfg->fd may be a socket, which has no line settings. */
+static int configure_line(struct zb_transport *t, const struct zb_transport_config *cfg, speed_t speed) {
 	struct termios tc;
 
+	if (tcgetattr(t->serial_fd, &tc) < 0) {
+		return cfg->fd >= 0 && errno == ENOTTY ? 0 : -1;
+	}
+
+	cfsetospeed(&tc, speed);
+	cfsetispeed(&tc, speed);
+	tc.c_cflag |= (CLOCAL | CREAD);
+	if (t->flags & ZB_TRANSPORT_RTSCTS) {
+		tc.c_cflag |= CRTSCTS;
+	} else {
+		tc.c_cflag &= ~CRTSCTS;
+	}
+	tc.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+
+	/* read() returns as soon as at least one byte is available, with everything that is. */
+	tc.c_cc[VMIN] = 1;
+	tc.c_cc[VTIME] = 0;
+
+	return tcsetattr(t->serial_fd, TCSANOW, &tc);
+}
+
+/* open and setup the serial device, or adopt cfg->fd if set. line settings only apply to ttys.
+ * initialise the buffer structure and wakeup eventfds.
+ * start the monitoring thread, pinned to a CPU if requested, unless in polled mode.
+ */
+zb_transport_t *zb_transport_open(const struct zb_transport_config *cfg) {
+	struct zb_transport *t;
+	speed_t speed;
+	cpu_set_t cpus;
+	int started;
+
+	if (baud_to_speed(cfg->baud, &speed) < 0) {
+		printf("[CRITICAL] unsupported baud rate %lu\n", cfg->baud);
+		return NULL;
+	}
+
+	if ((cfg->flags & ZB_TRANSPORT_POLLED) && cfg->on_receive == NULL) {
+		printf("[CRITICAL] polled transport for %s needs a receive callback\n", cfg->path);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->rx.nonempty_fd = -1;
+	t->rx.nonfull_fd = -1;
+	t->tx.wake_fd = -1;
+	t->tx.drained_fd = -1;
+	t->capture_fd = -1;
+	t->flags = cfg->flags;
+	t->on_receive = cfg->on_receive;
+	t->on_receive_arg = cfg->on_receive_arg;
+
 	/* open serial port */
-	serial_fd = open(SERIAL_DEVICE, O_RDWR | O_NOCTTY | O_NDELAY);
-	if (serial_fd < 0) {
-		printf("[CRITICAL] could not open serial device %s\n", SERIAL_DEVICE);
+	t->serial_fd = cfg->fd >= 0 ? cfg->fd : open(cfg->path, O_RDWR | O_NOCTTY | O_NDELAY);
+	if (t->serial_fd < 0) {
+		printf("[CRITICAL] could not open serial device %s\n", cfg->path);
+		free(t);
+		return NULL;
 	}
 
-	fcntl(serial_fd, F_SETFL, 0);
+	/* blocking reads for the monitor thread, non-blocking for an event loop */
+	fcntl(t->serial_fd, F_SETFL, (t->flags & ZB_TRANSPORT_POLLED) ? O_NONBLOCK : 0);
 	
-	/* set tc options for serial port transfers */
-	tcgetattr(serial_fd, &tc);
+	if (configure_line(t, cfg, speed) < 0) {
+		printf("[CRITICAL] could not configure serial device %s\n", cfg->path);
+		close(t->serial_fd);
+		free(t);
+		return NULL;
+	}
 
-	cfsetospeed(&tc, 9600);
-	cfsetispeed(&tc, 9600);
-	tc.c_cflag |= (CLOCAL | CREAD);
-	tc.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	/* set up buffer structures and wakeup channels */
+	if (buffer_init(&t->rx, cfg->buffer_size ? cfg->buffer_size : ZB_TRANSPORT_DEFAULT_BUFFER_SIZE,
+				t->flags & ZB_TRANSPORT_POLLED) < 0
+			|| zb_tx_init(t, cfg) < 0) {
+		printf("[CRITICAL] could not set up buffers for %s\n", cfg->path);
+		buffer_destroy(&t->rx);
+		zb_tx_destroy(t);
+		close(t->serial_fd);
+		free(t);
+		return NULL;
+	}
 
-	tcsetattr(serial_fd, TCSANOW, &tc);
+	if (cfg->capture_path != NULL && zb_capture_open(t, cfg->capture_path) < 0) {
+		printf("[CRITICAL] could not open capture file %s\n", cfg->capture_path);
+		buffer_destroy(&t->rx);
+		zb_tx_destroy(t);
+		close(t->serial_fd);
+		free(t);
+		return NULL;
+	}
 
-	/* set up buffer structures and locks */
-	pthread_mutex_init(&RX_buffer.lock, NULL);
-	pthread_mutex_lock(&RX_buffer.lock);
+	if (t->flags & ZB_TRANSPORT_POLLED) {
+		return t;
+	}
 
-	pthread_cond_init(&RX_buffer.nonfull, NULL);
-	pthread_cond_init(&RX_buffer.nonempty, NULL);
+	/* start receiving thread to fill the buffer, and writer thread to empty the queue.
+	 * the io_uring thread does both. */	
+	if (!(t->flags & ZB_TRANSPORT_IO_URING) || zb_uring_start(t) < 0) {
+		if (t->flags & ZB_TRANSPORT_IO_URING) {
+			DIAGNOSTICS("io_uring not available for %s, using read() thread.\n", cfg->path);
+		}
+		started = pthread_create(&t->receiver, NULL, serial_monitor, t) == 0;
+		if (started && zb_tx_start_writer(t) < 0) {
+			pthread_cancel(t->receiver);
+			pthread_join(t->receiver, NULL);
+			started = 0;
+		}
+		if (!started) {
+			printf("[CRITICAL] could not start the threads for %s\n", cfg->path);
+			zb_capture_close(t);
+			buffer_destroy(&t->rx);
+			zb_tx_destroy(t);
+			close(t->serial_fd);
+			free(t);
+			return NULL;
+		}
+	}
 
-	RX_buffer.count = 0;
-	RX_buffer.last = 0;
-	RX_buffer.first = 0;
+	if (cfg->rx_cpu != ZB_TRANSPORT_ANY_CPU) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cfg->rx_cpu, &cpus);
+		if (pthread_setaffinity_np(t->receiver, sizeof(cpus), &cpus) != 0) {
+			DIAGNOSTICS("could not pin receive thread for %s to CPU %d\n", cfg->path, cfg->rx_cpu);
+		}
+	}
 
-	pthread_mutex_unlock(&RX_buffer.lock);
+	return t;
+}
 
-	/* start receiving thread to fill the buffer */	
-	pthread_create(&pthread_receiver, NULL, serial_monitor, NULL); 
+/* close serial device, destroy any threads and wakeup channels */
+void zb_transport_close(zb_transport_t *t) {
+	if (t->uring != NULL) {
+		zb_uring_stop(t);
+	} else if (!(t->flags & ZB_TRANSPORT_POLLED)) {
+		pthread_cancel(t->receiver);
+		pthread_join(t->receiver, NULL);
+		zb_tx_stop_writer(t);
+	}
+	close(t->serial_fd);
+	zb_capture_close(t);
+	buffer_destroy(&t->rx);
+	zb_tx_destroy(t);
+	free(t);
 }
 
-/* close serial device, destroy any threads and locks (TODO do it properly) */
-void zb_transport_stop() {
-	pthread_cancel(pthread_receiver);
-	pthread_join(pthread_receiver, NULL);
-	close(serial_fd);
+/* deadline timeout_ms from now on CLOCK_MONOTONIC. */
+static void deadline_after(struct timespec *deadline, int timeout_ms) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
 }
 
-void zb_send(unsigned char *buf, unsigned char len) {
-	write(serial_fd, buf, len);
-	fsync(serial_fd);
+/* block until fd is readable or the deadline (NULL for none) has passed.
+ * returns 1 if it is readable, 0 on timeout. */
+static int wait_readable(int fd, const struct timespec *deadline) {
+	struct pollfd pfd;
+	struct timespec now, left;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do {
+		if (deadline == NULL) {
+			r = ppoll(&pfd, 1, NULL, NULL);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline->tv_sec - now.tv_sec;
+		left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
+		}
+		if (left.tv_sec < 0) {
+			return 0;
+		}
+		r = ppoll(&pfd, 1, &left, NULL);
+	} while (r < 0 && errno == EINTR);
+
+	return r > 0;
+}
+
+/* take up to len characters from the buffer,
+ * blocking until at least one character is available or the timeout expires.
+ *
+ * the receiver thread wakes us through the eventfd, so instead of a condition variable
+ * the deadline is kept by polling that. if we time out, the receiver may still have seen
+ * consumer_sleeping and signalled the eventfd: that leaves one spurious wakeup for the
+ * next call, which just finds the ring empty and goes back to sleep.
+ */
+int zb_read_timeout(zb_transport_t *t, unsigned char *buf, int len, int timeout_ms) {
+	Buffer *b = &t->rx;
+	struct timespec deadline;
+	eventfd_t v;
+	int n;
+
+	if (timeout_ms > 0) {
+		deadline_after(&deadline, timeout_ms);
+	}
+
+	if (t->flags & ZB_TRANSPORT_POLLED) {
+		while ((n = read(t->serial_fd, buf, len)) < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (timeout_ms == 0 || !wait_readable(t->serial_fd, timeout_ms > 0 ? &deadline : NULL)) {
+				return 0;
+			}
+		}
+		if (n > 0 && t->capture_fd >= 0) {
+			zb_capture(t, ZB_CAPTURE_RX, buf, n);
+		}
+		return n > 0 ? n : 0;
+	}
+
+	while ((n = zb_ring_read(&b->ring, buf, len)) == 0) {
+		if (timeout_ms == 0) {
+			return 0;
+		}
+		atomic_store(&b->consumer_sleeping, 1);
+		if (!zb_ring_is_empty(&b->ring)) {
+			atomic_store(&b->consumer_sleeping, 0);
+			continue;
+		}
+		if (timeout_ms < 0) {
+			zb_sleep_on(b->nonempty_fd);
+		} else if (wait_readable(b->nonempty_fd, &deadline)) {
+			eventfd_read(b->nonempty_fd, &v);
+		} else {
+			atomic_store(&b->consumer_sleeping, 0);
+			/* the last byte may have arrived just as we gave up */
+			n = zb_ring_read(&b->ring, buf, len);
+			break;
+		}
+	}
+
+	/* DIAGNOSTICS("read: took %d bytes, %d in RX buffer\n", n, zb_ring_count(&b->ring)); */
+
+	if (n > 0) {
+		zb_wake_if_sleeping(&b->producer_sleeping, b->nonfull_fd);
+	}
+
+	return n;
+}
+
+/* take up to len characters from the buffer,
+ * blocking until at least one character is available.
+ * in polled mode, returns 0 at once if nothing is available.
+ */
+int zb_read(zb_transport_t *t, unsigned char *buf, int len) {
+	return zb_read_timeout(t, buf, len, (t->flags & ZB_TRANSPORT_POLLED) ? 0 : -1);
 }
 
 /* take a character from the buffer if it's not empty
  * or block until a character is available.
  */
-char zb_getc() {
-	char c;
+int zb_getc(zb_transport_t *t) {
+	unsigned char c;
+
+	if (zb_read(t, &c, 1) == 0) {
+		return -1;
+	}
+	return c;
+}
 
-	pthread_mutex_lock(&RX_buffer.lock);
+int zb_getc_timeout(zb_transport_t *t, int timeout_ms) {
+	unsigned char c;
 
-	while (RX_buffer.count == 0) {
-		pthread_cond_wait(&RX_buffer.nonempty, &RX_buffer.lock);
+	if (zb_read_timeout(t, &c, 1, timeout_ms) == 0) {
+		return -1;
 	}
+	return c;
+}
 
-	c = RX_buffer.elements[RX_buffer.first];
-	RX_buffer.count--;
-	RX_buffer.first = (RX_buffer.first + 1) % RX_BUFFER_SIZE;
-	
-	/* DIAGNOSTICS("getc: got %02x, %d in RX buffer\n", c, RX_buffer.count); */
+unsigned long zb_transport_millis() {
+	struct timespec ts;
 
-	pthread_cond_signal(&RX_buffer.nonfull);
-	pthread_mutex_unlock(&RX_buffer.lock);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L;
+}
 
-	return c;
+int zb_transport_fd(zb_transport_t *t) {
+	return t->serial_fd;
+}
+
+/* drain the non-blocking device into the callback, one scratch buffer's worth at a time,
+ * and write out whatever is still queued for transmission. */
+int zb_transport_process_ready(zb_transport_t *t) {
+	int n, total;
+
+	if (!(t->flags & ZB_TRANSPORT_POLLED)) {
+		return -1;
+	}
+
+	zb_tx_drain(t);
+
+	total = 0;
+	while ((n = read(t->serial_fd, t->rx.elements, zb_ring_size(&t->rx.ring))) > 0) {
+		if (t->capture_fd >= 0) {
+			zb_capture(t, ZB_CAPTURE_RX, t->rx.elements, n);
+		}
+		t->on_receive(t->on_receive_arg, t->rx.elements, n);
+		total += n;
+	}
+
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		return total > 0 ? total : -1;
+	}
+	return total;
 }
 
 /* pause current thread for 1 second */
@@ -124,26 +479,36 @@ void zb_guard_delay() {
 	usleep(1000 * 1000);
 }
 
-/* worker thread for monitoring serial device and putting stuff into buffer */
+/* worker thread for monitoring serial device and putting stuff into buffer.
+ *
+ * read() fills the free part of the ring in place, as many bytes as are available
+ * up to the contiguous free space, and the bytes are then published in one go.
+ */
 static void *serial_monitor(void *arg) {
-	char c;
+	struct zb_transport *t = arg;
+	Buffer *b = &t->rx;
+	unsigned char *p;
+	int n, space;
 
 	printf("starting to read\n");
-	while (read(serial_fd, &c, 1) > 0) {
-		pthread_mutex_lock(&RX_buffer.lock);
-		while (RX_buffer.count == RX_BUFFER_SIZE) {
-			pthread_cond_wait(&RX_buffer.nonfull, &RX_buffer.lock);
-		}
-		
-		RX_buffer.elements[RX_buffer.last] = c;
-		RX_buffer.last = (RX_buffer.last + 1) % RX_BUFFER_SIZE;
-		
-		RX_buffer.count++;
-		
-		/* DIAGNOSTICS("read: got %02x, %d in RX buffer now.\n", c, RX_buffer.count); */
-
-		pthread_cond_signal(&RX_buffer.nonempty);
-		pthread_mutex_unlock(&RX_buffer.lock);
+	while (1) {
+		while ((space = zb_ring_write_space(&b->ring, &p)) == 0) {
+			zb_buffer_wait_space(b);
+		}
+
+		n = read(t->serial_fd, p, space);
+		if (n <= 0) {
+			break;
+		}
+		if (t->capture_fd >= 0) {
+			zb_capture(t, ZB_CAPTURE_RX, p, n);
+		}
+
+		zb_ring_commit(&b->ring, n);
+
+		/* DIAGNOSTICS("read: got %d bytes, %d in RX buffer now.\n", n, zb_ring_count(&b->ring)); */
+
+		zb_buffer_wake_consumer(b);
 	}
 
 	printf("[CRITICAL] read from serial device failed.\n");
@@ -0,0 +1,445 @@
+#include "zb_transport_linux.h"
+#include "zb_capture.h"
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+
+/*
+ * zb_transport_tx.c
+ *
+ * Transmit path of the Linux transport.
+ *
+ * zb_send copies the frame into a slot of a lock-free multi-producer queue (zb_txqueue.h)
+ * and returns without touching the device, so it can be called from any number of
+ * threads, e.g. request handlers and the parser thread at the same time.
+ *
+ * The queue is drained by exactly one writer:
+ * 	- a writer thread per transport, normally,
+ * 	- the io_uring thread when that backend is running, or
+ * 	- the calling thread itself in polled mode, without blocking.
+ * The writer takes every frame published so far and writes them with a single writev(),
+ * continuing from the right byte after a partial write. Nothing is fsync()ed; use
+ * zb_transport_flush to wait until everything has actually left the UART. If the device
+ * fails, e.g. a USB adapter is unplugged, the writer gives up: zb_send refuses further
+ * frames, and zb_transport_flush returns -1 instead of waiting for a drain that never comes.
+ *
+ * Optionally, frames are paced: the writer models the radio's serial receive buffer,
+ * which fills with every frame written and empties at the rate the radio can put frames
+ * on the air. A frame is only handed to the device once it fits into the modelled buffer,
+ * so the radio is kept busy without being overrun. With RTS/CTS enabled, the writer
+ * thread additionally waits for CTS before writing rather than filling the kernel's
+ * output buffer while the radio has asked us to stop.
+ */
+
+static void *serial_writer(void *arg);
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* forget frames the radio has finished sending by now. */
+static void pacer_expire(TxPacer *p, unsigned long long now) {
+	while (p->count > 0 && p->frames[p->head].done_ns <= now) {
+		p->in_flight -= p->frames[p->head].len;
+		p->head = (p->head + 1) % ZB_PACE_MAX_FRAMES;
+		p->count--;
+	}
+}
+
+/* returns 1 and accounts for the frame if it fits into the modelled buffer now, 0 otherwise. */
+static int pacer_admit(TxPacer *p, unsigned int len) {
+	unsigned long long now, start;
+	unsigned int i;
+
+	if (p->buffer == 0) {
+		return 1;
+	}
+
+	now = now_ns();
+	pacer_expire(p, now);
+
+	/* a frame larger than the whole buffer is let through once the radio is idle */
+	if (p->count == ZB_PACE_MAX_FRAMES || (p->count > 0 && p->in_flight + len > p->buffer)) {
+		return 0;
+	}
+
+	start = p->air_free_ns > now ? p->air_free_ns : now;
+	p->air_free_ns = start + p->frame_ns + len * p->byte_ns;
+
+	i = (p->head + p->count) % ZB_PACE_MAX_FRAMES;
+	p->frames[i].done_ns = p->air_free_ns;
+	p->frames[i].len = len;
+	p->count++;
+	p->in_flight += len;
+	return 1;
+}
+
+int zb_tx_init(struct zb_transport *t, const struct zb_transport_config *cfg) {
+	unsigned int n, slots;
+	TxState *tx = &t->tx;
+
+	slots = cfg->tx_queue_size ? cfg->tx_queue_size : ZB_TRANSPORT_DEFAULT_TX_QUEUE_SIZE;
+	for (n = 1; n < slots; n <<= 1)
+		;
+
+	tx->offset = 0;
+	tx->admitted = 0;
+	tx->rtscts = (cfg->flags & ZB_TRANSPORT_RTSCTS) != 0;
+	memset(&tx->pacer, 0, sizeof(tx->pacer));
+	tx->pacer.buffer = cfg->pace_buffer;
+	tx->pacer.frame_ns = cfg->pace_frame_us * 1000ULL;
+	tx->pacer.byte_ns = cfg->pace_byte_us * 1000ULL;
+	atomic_init(&tx->writer_sleeping, 0);
+	atomic_init(&tx->flush_waiting, 0);
+	atomic_init(&tx->dead, 0);
+	atomic_init(&tx->frames_sent, 0);
+	atomic_init(&tx->bytes_sent, 0);
+	atomic_init(&tx->bytes_in_flight, 0);
+	atomic_init(&tx->pace_blocked_ns, 0);
+	atomic_init(&tx->cts_blocked_ns, 0);
+	atomic_init(&tx->frames_dropped, 0);
+	tx->wake_fd = eventfd(0, EFD_CLOEXEC);
+	tx->drained_fd = eventfd(0, EFD_CLOEXEC);
+	if (tx->wake_fd < 0 || tx->drained_fd < 0) {
+		return -1;
+	}
+
+	return zb_txqueue_init(&tx->queue, n);
+}
+
+void zb_tx_destroy(struct zb_transport *t) {
+	if (t->tx.wake_fd >= 0) {
+		close(t->tx.wake_fd);
+	}
+	if (t->tx.drained_fd >= 0) {
+		close(t->tx.drained_fd);
+	}
+	zb_txqueue_destroy(&t->tx.queue);
+}
+
+int zb_tx_start_writer(struct zb_transport *t) {
+	if (pthread_create(&t->writer, NULL, serial_writer, t) != 0) {
+		return -1;
+	}
+	t->writer_running = 1;
+	return 0;
+}
+
+void zb_tx_stop_writer(struct zb_transport *t) {
+	if (t->writer_running) {
+		pthread_cancel(t->writer);
+		pthread_join(t->writer, NULL);
+		t->writer_running = 0;
+	}
+}
+
+#if ZB_TX_SLOT_SIZE < ZB_SEND_MAX
+#error "transmit queue slots must hold ZB_SEND_MAX bytes"
+#endif
+
+/* frames are encoded straight into a queue slot; the caller gets its data array. */
+unsigned char *zb_send_reserve(zb_transport_t *t) {
+	struct zb_tx_slot *slot;
+
+	if (atomic_load_explicit(&t->tx.dead, memory_order_relaxed)) {
+		return NULL;
+	}
+	slot = zb_txqueue_reserve(&t->tx.queue);
+	if (slot == NULL && (t->flags & ZB_TRANSPORT_POLLED)) {
+		/* the caller is the writer; make room if the device has become writable since */
+		zb_tx_drain(t);
+		slot = zb_txqueue_reserve(&t->tx.queue);
+	}
+	if (slot == NULL) {
+		/* the caller retries or gives up; a full queue is no error worth a message */
+		atomic_fetch_add_explicit(&t->tx.frames_dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+	return slot->data;
+}
+
+/* publish the slot and make sure a writer will pick it up. */
+void zb_send_commit(zb_transport_t *t, unsigned char *frame, int len) {
+	struct zb_tx_slot *slot = (struct zb_tx_slot *) (frame - offsetof(struct zb_tx_slot, data));
+
+	slot->len = len;
+	zb_txqueue_commit(&t->tx.queue, slot);
+
+	if (t->flags & ZB_TRANSPORT_POLLED) {
+		zb_tx_drain(t);
+	} else {
+		zb_wake_if_sleeping(&t->tx.writer_sleeping, t->tx.wake_fd);
+	}
+}
+
+int zb_tx_gather(struct zb_transport *t, struct iovec *iov) {
+	TxState *tx = &t->tx;
+	struct zb_tx_slot *slot;
+	int n;
+
+	for (n = 0; n < ZB_TX_IOV_MAX; n++) {
+		slot = zb_txqueue_peek(&tx->queue, n);
+		if (slot == NULL) {
+			break;
+		}
+		if ((unsigned int) n >= tx->admitted) {
+			if (!pacer_admit(&tx->pacer, slot->len)) {
+				break;
+			}
+			tx->admitted++;
+		}
+		iov[n].iov_base = slot->data;
+		iov[n].iov_len = slot->len;
+	}
+
+	if (n > 0) {
+		iov[0].iov_base = (unsigned char *) iov[0].iov_base + tx->offset;
+		iov[0].iov_len -= tx->offset;
+	}
+	atomic_store_explicit(&tx->bytes_in_flight, tx->pacer.in_flight, memory_order_relaxed);
+	return n;
+}
+
+/* nanoseconds until the pacer will admit the next queued frame, or 0 if it would be
+ * admitted now (or nothing is waiting). does not modify the pacer. */
+unsigned long long zb_tx_pace_delay(struct zb_transport *t) {
+	TxPacer *p = &t->tx.pacer;
+	struct zb_tx_slot *slot;
+	unsigned long long now;
+	unsigned int i, k, in_flight;
+
+	if (p->buffer == 0 || t->tx.admitted >= ZB_TX_IOV_MAX
+			|| (slot = zb_txqueue_peek(&t->tx.queue, t->tx.admitted)) == NULL) {
+		return 0;
+	}
+
+	now = now_ns();
+	in_flight = p->in_flight;
+	for (k = 0; k < p->count; k++) {
+		i = (p->head + k) % ZB_PACE_MAX_FRAMES;
+		if (p->count - k < ZB_PACE_MAX_FRAMES && in_flight + slot->len <= p->buffer) {
+			break;
+		}
+		if (p->frames[i].done_ns > now) {
+			return p->frames[i].done_ns - now;
+		}
+		in_flight -= p->frames[i].len;
+	}
+	return 0;
+}
+
+void zb_tx_pace_blocked(struct zb_transport *t, unsigned long long ns) {
+	atomic_fetch_add_explicit(&t->tx.pace_blocked_ns, ns, memory_order_relaxed);
+}
+
+void zb_tx_advance(struct zb_transport *t, size_t n) {
+	TxState *tx = &t->tx;
+	struct zb_tx_slot *slot;
+	size_t rest;
+
+	atomic_fetch_add_explicit(&tx->bytes_sent, n, memory_order_relaxed);
+
+	while (n > 0 && (slot = zb_txqueue_peek(&tx->queue, 0)) != NULL) {
+		rest = slot->len - tx->offset;
+		if (t->capture_fd >= 0) {
+			zb_capture(t, ZB_CAPTURE_TX, slot->data + tx->offset, n < rest ? n : rest);
+		}
+		if (n < rest) {
+			tx->offset += n;
+			return;
+		}
+		n -= rest;
+		tx->offset = 0;
+		tx->admitted--;
+		zb_txqueue_release(&tx->queue);
+		atomic_fetch_add_explicit(&tx->frames_sent, 1, memory_order_relaxed);
+	}
+
+	if (zb_txqueue_is_empty(&tx->queue)) {
+		zb_wake_if_sleeping(&tx->flush_waiting, tx->drained_fd);
+	}
+}
+
+int zb_tx_prepare_sleep(struct zb_transport *t) {
+	atomic_store(&t->tx.writer_sleeping, 1);
+	if (zb_txqueue_peek(&t->tx.queue, 0) != NULL) {
+		atomic_store(&t->tx.writer_sleeping, 0);
+		return 0;
+	}
+	return 1;
+}
+
+void zb_tx_fail(struct zb_transport *t) {
+	atomic_store(&t->tx.dead, 1);
+	zb_wake_if_sleeping(&t->tx.flush_waiting, t->tx.drained_fd);
+}
+
+void zb_tx_drain(struct zb_transport *t) {
+	struct iovec iov[ZB_TX_IOV_MAX];
+	ssize_t r;
+	int n;
+
+	while ((n = zb_tx_gather(t, iov)) > 0) {
+		r = writev(t->serial_fd, iov, n);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				printf("[CRITICAL] write to serial device failed.\n");
+				zb_tx_fail(t);
+			}
+			if (errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+		zb_tx_advance(t, r);
+	}
+}
+
+int zb_send(zb_transport_t *t, unsigned char *buf, unsigned char len) {
+	unsigned char *frame;
+
+	frame = zb_send_reserve(t);
+	if (frame == NULL) {
+		return -1;
+	}
+	memcpy(frame, buf, len);
+	zb_send_commit(t, frame, len);
+	return 0;
+}
+
+/* queued frames the pacer is holding back do not need the device to be writable. */
+int zb_transport_wants_write(zb_transport_t *t) {
+	return !zb_txqueue_is_empty(&t->tx.queue) && zb_tx_pace_delay(t) == 0;
+}
+
+int zb_transport_tx_delay_ms(zb_transport_t *t) {
+	unsigned long long ns = zb_tx_pace_delay(t);
+
+	if (ns == 0) {
+		return -1;
+	}
+	return (int) ((ns + 999999) / 1000000);
+}
+
+void zb_transport_get_stats(zb_transport_t *t, struct zb_transport_stats *stats) {
+	TxState *tx = &t->tx;
+
+	stats->frames_sent = atomic_load_explicit(&tx->frames_sent, memory_order_relaxed);
+	stats->bytes_sent = atomic_load_explicit(&tx->bytes_sent, memory_order_relaxed);
+	stats->bytes_in_flight = atomic_load_explicit(&tx->bytes_in_flight, memory_order_relaxed);
+	stats->pace_blocked_us = atomic_load_explicit(&tx->pace_blocked_ns, memory_order_relaxed) / 1000;
+	stats->cts_blocked_us = atomic_load_explicit(&tx->cts_blocked_ns, memory_order_relaxed) / 1000;
+	stats->frames_dropped = atomic_load_explicit(&tx->frames_dropped, memory_order_relaxed);
+}
+
+/* wait until the queue is empty, then until the UART has sent the last byte. */
+int zb_transport_flush(zb_transport_t *t) {
+	TxState *tx = &t->tx;
+	struct pollfd p;
+
+	while (!zb_txqueue_is_empty(&tx->queue)) {
+		if (atomic_load(&tx->dead)) {
+			return -1;
+		}
+		if (t->flags & ZB_TRANSPORT_POLLED) {
+			zb_tx_drain(t);
+			if (!zb_txqueue_is_empty(&tx->queue)) {
+				p.fd = t->serial_fd;
+				p.events = zb_transport_wants_write(t) ? POLLOUT : 0;
+				poll(&p, 1, zb_transport_tx_delay_ms(t));
+			}
+			continue;
+		}
+
+		/* the writer wakes us when the queue drains, or when it gives up */
+		atomic_store(&tx->flush_waiting, 1);
+		if (zb_txqueue_is_empty(&tx->queue) || atomic_load(&tx->dead)) {
+			atomic_store(&tx->flush_waiting, 0);
+			continue;
+		}
+		zb_sleep_on(tx->drained_fd);
+	}
+
+	tcdrain(t->serial_fd);
+	return 0;
+}
+
+/* sleep for ns nanoseconds, accounting the time to the pacer. */
+static void writer_pace(struct zb_transport *t, unsigned long long ns) {
+	struct timespec ts;
+	unsigned long long start = now_ns();
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	nanosleep(&ts, NULL);
+
+	zb_tx_pace_blocked(t, now_ns() - start);
+}
+
+/* with hardware flow control, hold off while the radio has CTS deasserted.
+ * devices that cannot report modem lines (e.g. ptys) are treated as always clear. */
+static void writer_wait_cts(struct zb_transport *t) {
+	unsigned long long start;
+	int lines;
+
+	if (ioctl(t->serial_fd, TIOCMGET, &lines) < 0 || (lines & TIOCM_CTS)) {
+		return;
+	}
+
+	start = now_ns();
+	while (ioctl(t->serial_fd, TIOCMGET, &lines) == 0 && !(lines & TIOCM_CTS)) {
+		if (ioctl(t->serial_fd, TIOCMIWAIT, TIOCM_CTS) < 0) {
+			break;
+		}
+	}
+	atomic_fetch_add_explicit(&t->tx.cts_blocked_ns, now_ns() - start, memory_order_relaxed);
+}
+
+/* writer thread: sleep while there is nothing to send, or the pacer holds the next frame back.
+ * otherwise write everything published and admitted so far in one system call. */
+static void *serial_writer(void *arg) {
+	struct zb_transport *t = arg;
+	struct iovec iov[ZB_TX_IOV_MAX];
+	unsigned long long delay;
+	ssize_t r;
+	int n;
+
+	while (1) {
+		n = zb_tx_gather(t, iov);
+		if (n == 0) {
+			if ((delay = zb_tx_pace_delay(t)) > 0) {
+				writer_pace(t, delay);
+			} else if (zb_tx_prepare_sleep(t)) {
+				zb_sleep_on(t->tx.wake_fd);
+			}
+			continue;
+		}
+
+		if (t->tx.rtscts) {
+			writer_wait_cts(t);
+		}
+
+		r = writev(t->serial_fd, iov, n);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		zb_tx_advance(t, r);
+	}
+
+	printf("[CRITICAL] write to serial device failed.\n");
+	zb_tx_fail(t);
+	return NULL;
+}
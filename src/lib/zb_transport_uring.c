@@ -0,0 +1,471 @@
+#include "zb_transport_linux.h"
+#include "zb_capture.h"
+#include "diagnostics.h"
+#include <stdio.h>
+
+/*
+ * zb_transport_uring.c
+ *
+ * io_uring backend for the tty transport, used instead of the read() monitor thread
+ * when a transport is opened with ZB_TRANSPORT_IO_URING.
+ *
+ * One thread per transport owns the ring and is its only submitter. It keeps a single
+ * multishot read posted against the tty, with data landing in a ring of provided
+ * buffers, so a burst of received bytes costs one io_uring_enter() wakeup and no
+ * re-submission. Kernels without multishot reads get a single-shot read with buffer
+ * selection, re-armed after each completion.
+ *
+ * The thread is also the writer for the transmit queue (zb_transport_tx.c). It is only
+ * kicked, through a read of the queue's wakeup eventfd kept posted in the same ring, when
+ * it has announced that it is idle. Every frame queued while a write is in flight goes
+ * out in the next single writev.
+ *
+ * The ring is set up with raw system calls, so liburing is not required.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ZB_HAVE_IO_URING
+#endif
+#endif
+
+#ifndef ZB_HAVE_IO_URING
+
+int zb_uring_start(struct zb_transport *t) {
+	(void) t;
+	return -1;
+}
+
+void zb_uring_stop(struct zb_transport *t) {
+	(void) t;
+}
+
+#else
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* not in older kernel headers, but supported by newer kernels. */
+#define ZB_IORING_OP_READ_MULTISHOT 49
+
+#define URING_ENTRIES	8
+#define RX_BUF_COUNT	8		/* must be a power of two */
+#define RX_BUF_SIZE		256
+#define RX_BUF_GROUP	0
+
+/* user_data tags for completions */
+#define TAG_RX		1
+#define TAG_WAKE	2
+#define TAG_TX		3
+#define TAG_PACE	4
+
+struct zb_uring {
+	int ring_fd;
+
+	/* submission queue */
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned to_submit;
+
+	/* completion queue */
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* provided receive buffers */
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned char *rx_bufs;
+	unsigned short br_tail;
+	int multishot;
+
+	/* thread control. woken through the transmit queue's eventfd */
+	eventfd_t wake_val;
+	atomic_int stopping;
+
+	/* frames being written */
+	int tx_busy;
+	struct iovec tx_iov[ZB_TX_IOV_MAX];
+
+	/* pending timeout while the pacer holds the next frame back */
+	int tx_paced;
+	struct __kernel_timespec pace_ts;
+};
+
+static void *uring_loop(void *arg);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* map the submission and completion queues of a freshly set up ring. */
+static int uring_map(struct zb_uring *u, struct io_uring_params *p) {
+	u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) && u->cq_len > u->sq_len) {
+		u->sq_len = u->cq_len;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			return -1;
+		}
+	}
+
+	u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	u->sq_head = (unsigned *) ((char *) u->sq_ptr + p->sq_off.head);
+	u->sq_tail = (unsigned *) ((char *) u->sq_ptr + p->sq_off.tail);
+	u->sq_mask = (unsigned *) ((char *) u->sq_ptr + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *) ((char *) u->sq_ptr + p->sq_off.array);
+
+	u->cq_head = (unsigned *) ((char *) u->cq_ptr + p->cq_off.head);
+	u->cq_tail = (unsigned *) ((char *) u->cq_ptr + p->cq_off.tail);
+	u->cq_mask = (unsigned *) ((char *) u->cq_ptr + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ptr + p->cq_off.cqes);
+
+	return 0;
+}
+
+/* hand a receive buffer (back) to the kernel. */
+static void uring_provide(struct zb_uring *u, unsigned short bid) {
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (RX_BUF_COUNT - 1)];
+
+	buf->addr = (unsigned long) (u->rx_bufs + bid * RX_BUF_SIZE);
+	buf->len = RX_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	atomic_store_explicit((_Atomic unsigned short *) &u->br->tail, u->br_tail, memory_order_release);
+}
+
+/* register the provided buffer ring and fill it. */
+static int uring_setup_buffers(struct zb_uring *u) {
+	struct io_uring_buf_reg reg;
+	unsigned short i;
+
+	u->br_len = RX_BUF_COUNT * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+
+	u->rx_bufs = malloc(RX_BUF_COUNT * RX_BUF_SIZE);
+	if (u->rx_bufs == NULL) {
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) u->br;
+	reg.ring_entries = RX_BUF_COUNT;
+	reg.bgid = RX_BUF_GROUP;
+	if (sys_io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		return -1;
+	}
+
+	u->br_tail = 0;
+	for (i = 0; i < RX_BUF_COUNT; i++) {
+		uring_provide(u, i);
+	}
+
+	return 0;
+}
+
+/* get the next free submission queue entry. only the loop thread submits, and it
+ * never has more than four requests outstanding, so the queue cannot be full. */
+static struct io_uring_sqe *uring_get_sqe(struct zb_uring *u) {
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	atomic_store_explicit((_Atomic unsigned *) u->sq_tail, tail + 1, memory_order_release);
+	u->to_submit++;
+	return sqe;
+}
+
+static void uring_arm_read(struct zb_transport *t) {
+	struct zb_uring *u = t->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = u->multishot ? ZB_IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = t->serial_fd;
+	sqe->off = (unsigned long long) -1;
+	sqe->len = u->multishot ? 0 : RX_BUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RX_BUF_GROUP;
+	sqe->user_data = TAG_RX;
+}
+
+static void uring_arm_wake(struct zb_transport *t) {
+	struct zb_uring *u = t->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = t->tx.wake_fd;
+	sqe->addr = (unsigned long) &u->wake_val;
+	sqe->len = sizeof(u->wake_val);
+	sqe->off = (unsigned long long) -1;
+	sqe->user_data = TAG_WAKE;
+}
+
+/* retry writing once the pacer will admit the next frame. */
+static void uring_arm_pace(struct zb_transport *t, unsigned long long ns) {
+	struct zb_uring *u = t->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	u->pace_ts.tv_sec = ns / 1000000000ULL;
+	u->pace_ts.tv_nsec = ns % 1000000000ULL;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) &u->pace_ts;
+	sqe->len = 1;
+	sqe->user_data = TAG_PACE;
+	u->tx_paced = 1;
+	zb_tx_pace_blocked(t, ns);
+}
+
+/* if nothing is being written, write every published frame the pacer admits with one writev.
+ * if there are none, announce that the writer is idle so that zb_send kicks it. */
+static void uring_start_write(struct zb_transport *t) {
+	struct zb_uring *u = t->uring;
+	struct io_uring_sqe *sqe;
+	unsigned long long delay;
+	int n;
+
+	if (u->tx_busy || u->tx_paced) {
+		return;
+	}
+
+	while ((n = zb_tx_gather(t, u->tx_iov)) == 0) {
+		if ((delay = zb_tx_pace_delay(t)) > 0) {
+			uring_arm_pace(t, delay);
+			return;
+		}
+		if (zb_tx_prepare_sleep(t)) {
+			return;
+		}
+	}
+
+	sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = t->serial_fd;
+	sqe->addr = (unsigned long) u->tx_iov;
+	sqe->len = n;
+	sqe->off = (unsigned long long) -1;
+	sqe->user_data = TAG_TX;
+	u->tx_busy = 1;
+}
+
+/* copy received data into the receive buffer, waiting for the consumer if it is full. */
+static void uring_deliver(struct zb_transport *t, unsigned char *buf, int len) {
+	unsigned int n;
+
+	if (t->capture_fd >= 0) {
+		zb_capture(t, ZB_CAPTURE_RX, buf, len);
+	}
+
+	while (len > 0 && !atomic_load(&t->uring->stopping)) {
+		n = zb_ring_write(&t->rx.ring, buf, len);
+		if (n == 0) {
+			zb_buffer_wait_space(&t->rx);
+			continue;
+		}
+		buf += n;
+		len -= n;
+		zb_buffer_wake_consumer(&t->rx);
+	}
+}
+
+/* returns 0 to keep going, -1 if the device has failed. */
+static int uring_complete(struct zb_transport *t, struct io_uring_cqe *cqe) {
+	struct zb_uring *u = t->uring;
+	unsigned short bid;
+
+	switch (cqe->user_data) {
+		case TAG_RX:
+			if (cqe->res == -EINVAL && u->multishot) {
+				DIAGNOSTICS("multishot read not supported, re-arming single reads.\n");
+				u->multishot = 0;
+				uring_arm_read(t);
+				return 0;
+			}
+			if (cqe->res == -ENOBUFS || cqe->res == -EINTR) {
+				uring_arm_read(t);
+				return 0;
+			}
+			if (cqe->res <= 0) {
+				return -1;
+			}
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			uring_deliver(t, u->rx_bufs + bid * RX_BUF_SIZE, cqe->res);
+			uring_provide(u, bid);
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				uring_arm_read(t);
+			}
+			break;
+		case TAG_WAKE:
+			uring_start_write(t);
+			uring_arm_wake(t);
+			break;
+		case TAG_TX:
+			if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+				printf("[CRITICAL] write to serial device failed.\n");
+				zb_tx_fail(t);
+				return -1;
+			}
+			/* after a partial write, the next gather starts at the first unwritten byte */
+			if (cqe->res > 0) {
+				zb_tx_advance(t, cqe->res);
+			}
+			u->tx_busy = 0;
+			uring_start_write(t);
+			break;
+		case TAG_PACE:
+			/* -ETIME is the normal result of an expired timeout */
+			u->tx_paced = 0;
+			uring_start_write(t);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+static void uring_destroy(struct zb_uring *u) {
+	if (u->sqes != NULL) {
+		munmap(u->sqes, u->sqes_len);
+	}
+	if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr) {
+		munmap(u->cq_ptr, u->cq_len);
+	}
+	if (u->sq_ptr != NULL) {
+		munmap(u->sq_ptr, u->sq_len);
+	}
+	if (u->br != NULL) {
+		munmap(u->br, u->br_len);
+	}
+	if (u->ring_fd >= 0) {
+		close(u->ring_fd);
+	}
+	free(u->rx_bufs);
+	free(u);
+}
+
+int zb_uring_start(struct zb_transport *t) {
+	struct io_uring_params params;
+	struct zb_uring *u;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL) {
+		return -1;
+	}
+	u->multishot = 1;
+	atomic_init(&u->stopping, 0);
+
+	memset(&params, 0, sizeof(params));
+	u->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if (u->ring_fd < 0 || uring_map(u, &params) < 0 || uring_setup_buffers(u) < 0) {
+		uring_destroy(u);
+		return -1;
+	}
+
+	t->uring = u;
+	uring_arm_read(t);
+	uring_arm_wake(t);
+	uring_start_write(t);
+
+	if (pthread_create(&t->receiver, NULL, uring_loop, t) != 0) {
+		t->uring = NULL;
+		uring_destroy(u);
+		return -1;
+	}
+
+	return 0;
+}
+
+void zb_uring_stop(struct zb_transport *t) {
+	struct zb_uring *u = t->uring;
+
+	atomic_store(&u->stopping, 1);
+	eventfd_write(t->tx.wake_fd, 1);
+	zb_buffer_wake_producer(&t->rx);
+	pthread_join(t->receiver, NULL);
+
+	t->uring = NULL;
+	uring_destroy(u);
+}
+
+/* submit everything queued, wait for at least one completion, and handle all completions. */
+static void *uring_loop(void *arg) {
+	struct zb_transport *t = arg;
+	struct zb_uring *u = t->uring;
+	unsigned head, tail;
+	int failed = 0;
+
+	while (!failed && !atomic_load(&u->stopping)) {
+		if (sys_io_uring_enter(u->ring_fd, u->to_submit, 1, IORING_ENTER_GETEVENTS) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		u->to_submit = 0;
+
+		head = *u->cq_head;
+		tail = atomic_load_explicit((_Atomic unsigned *) u->cq_tail, memory_order_acquire);
+		while (head != tail && !failed) {
+			failed = uring_complete(t, &u->cqes[head & *u->cq_mask]) < 0;
+			head++;
+		}
+		atomic_store_explicit((_Atomic unsigned *) u->cq_head, head, memory_order_release);
+	}
+
+	/* this thread was the writer too */
+	if (!atomic_load(&u->stopping) && !atomic_load(&t->tx.dead)) {
+		printf("[CRITICAL] read from serial device failed.\n");
+		zb_tx_fail(t);
+	}
+	return NULL;
+}
+
+#endif /* ZB_HAVE_IO_URING */
@@ -0,0 +1,126 @@
+#ifndef __ZB_TXQUEUE_H__
+#define __ZB_TXQUEUE_H__
+/*
+ * zb_txqueue.h
+ *
+ * Lock-free bounded multi-producer/single-consumer queue of encoded frames, used by the
+ * Linux transport to decouple zb_send from the thread that writes to the device.
+ *
+ * Each slot holds one frame and a sequence number (after D. Vyukov's bounded queue).
+ * A producer claims a slot by advancing enqueue_pos with compare-and-swap, fills it in
+ * place, and publishes it by storing its sequence number. The consumer takes slots in
+ * order and hands them back by advancing the sequence number by one lap. Producers never
+ * wait for each other except for the compare-and-swap, and never wait for the consumer.
+ *
+ * The number of slots must be a power of two.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* largest encoded frame a slot can hold. zb_send lengths are 8 bit. */
+#define ZB_TX_SLOT_SIZE 256
+
+struct zb_tx_slot {
+	atomic_uint seq;
+	unsigned int len;
+	unsigned char data[ZB_TX_SLOT_SIZE];
+};
+
+typedef struct zb_txqueue {
+	struct zb_tx_slot *slots;
+	unsigned int mask;
+	atomic_uint enqueue_pos;	/* next slot to claim. shared by all producers */
+	atomic_uint dequeue_pos;	/* next slot to write out. only advanced by the consumer */
+} zb_txqueue_t;
+
+/* allocate a queue of count slots (a power of two). returns 0 on success. */
+static inline int zb_txqueue_init(zb_txqueue_t *q, unsigned int count) {
+	unsigned int i;
+
+	q->slots = malloc(count * sizeof(struct zb_tx_slot));
+	if (q->slots == NULL) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		atomic_init(&q->slots[i].seq, i);
+	}
+	q->mask = count - 1;
+	atomic_init(&q->enqueue_pos, 0);
+	atomic_init(&q->dequeue_pos, 0);
+	return 0;
+}
+
+static inline void zb_txqueue_destroy(zb_txqueue_t *q) {
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/*
+ * producer side.
+ */
+
+/* claim a slot to encode a frame into. returns NULL if the queue is full. */
+static inline struct zb_tx_slot *zb_txqueue_reserve(zb_txqueue_t *q) {
+	struct zb_tx_slot *slot;
+	unsigned int pos, seq;
+	int diff;
+
+	pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		slot = &q->slots[pos & q->mask];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (int) (seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed)) {
+				return slot;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+/* publish a reserved slot after setting its data and len. */
+static inline void zb_txqueue_commit(zb_txqueue_t *q, struct zb_tx_slot *slot) {
+	/* while claimed, the slot's sequence number is still the position it was claimed at. */
+	unsigned int pos = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	(void) q;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * consumer side.
+ */
+
+/* the i-th published frame after the head, or NULL if it has not been committed yet. */
+static inline struct zb_tx_slot *zb_txqueue_peek(zb_txqueue_t *q, unsigned int i) {
+	unsigned int pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed) + i;
+	struct zb_tx_slot *slot = &q->slots[pos & q->mask];
+
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+		return NULL;
+	}
+	return slot;
+}
+
+/* hand the head slot back to the producers once it has been written out. */
+static inline void zb_txqueue_release(zb_txqueue_t *q) {
+	unsigned int pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	struct zb_tx_slot *slot = &q->slots[pos & q->mask];
+
+	atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+	atomic_store_explicit(&q->dequeue_pos, pos + 1, memory_order_release);
+}
+
+/* 1 if every claimed slot has been written out. a snapshot when called by a producer. */
+static inline int zb_txqueue_is_empty(zb_txqueue_t *q) {
+	return atomic_load_explicit(&q->dequeue_pos, memory_order_acquire)
+		== atomic_load_explicit(&q->enqueue_pos, memory_order_acquire);
+}
+
+#endif /* __ZB_TXQUEUE_H__ */